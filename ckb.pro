@@ -8,4 +8,8 @@ SUBDIRS = \
     src/ckb-gradient \
     src/ckb-pinwheel \
     src/ckb-random \
-    src/ckb-rain
+    src/ckb-rain \
+    src/ckb-effects
+
+# Benchmarks (see BUILD.md)
+!isEmpty(CKB_BENCH): SUBDIRS += src/ckb-bench src/ckb-bench-gui
@@ -0,0 +1,58 @@
+QT       += core gui
+greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
+
+TARGET = ckb-bench-gui
+TEMPLATE = app
+
+# Development tool, not part of the default build. Build with:
+#   qmake src/ckb-bench-gui && make
+# or build both benchmarks with ckb itself:
+#   qmake CKB_BENCH=1 && make
+
+CONFIG   += console release
+CONFIG   -= app_bundle
+
+QMAKE_CFLAGS += -std=gnu99 -Wno-unused-parameter
+QMAKE_CXXFLAGS += -Wno-unused-parameter
+
+# Animations are loaded from next to the binary, the same as ckb
+macx {
+    DESTDIR = $$PWD/../../ckb.app/Contents/MacOS
+} else {
+    DESTDIR = $$PWD/../../bin
+}
+QMAKE_MACOSX_DEPLOYMENT_TARGET = 10.9
+
+CKB = $$PWD/../ckb
+BENCH = $$PWD/../ckb-bench
+INCLUDEPATH += $$CKB $$BENCH
+
+# Only the lighting classes from ckb
+SOURCES += \
+    main.cpp \
+    $$BENCH/counters.c \
+    $$CKB/animplugin.cpp \
+    $$CKB/animscript.cpp \
+    $$CKB/ckbsettings.cpp \
+    $$CKB/ckbsettingswriter.cpp \
+    $$CKB/colormap.cpp \
+    $$CKB/colorpipeline.cpp \
+    $$CKB/kbanim.cpp \
+    $$CKB/kbframe.cpp \
+    $$CKB/kblight.cpp \
+    $$CKB/keymap.cpp
+
+HEADERS += \
+    $$BENCH/counters.h \
+    $$CKB/animplugin.h \
+    $$CKB/animscript.h \
+    $$CKB/ckbsettings.h \
+    $$CKB/ckbsettingswriter.h \
+    $$CKB/colormap.h \
+    $$CKB/colorpipeline.h \
+    $$CKB/kbanim.h \
+    $$CKB/kbframe.h \
+    $$CKB/kblight.h \
+    $$CKB/keymap.h \
+    $$CKB/renderlock.h \
+    $$CKB/snapshot.h
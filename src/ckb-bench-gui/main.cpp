@@ -0,0 +1,199 @@
+// ckb-bench-gui: measures the GUI side of the lighting path, KbLight::frameUpdate() and KbAnim::blend(), and the cost of a
+// frame with 1, 4 and 16 animations layered on top of each other.
+// Animations are loaded from the ckb-animations directory next to the binary (the same place ckb looks for them),
+// so build ckb first. Animations that are also built as plugins (ckb-effects) are run in-process, as in ckb. Nothing is sent to the daemon; frames are written to a temporary file instead of a cmd node.
+//
+// Usage: ckb-bench-gui [-r <fps>] [-t <seconds>] [-n <blends>] [-j] [<animation> ...]
+//   -r: frame rate (default 60)
+//   -t: how long to run each animation for (default 5)
+//   -n: number of KbAnim::blend() calls to time after the frames, and of layered frames (default 10000)
+//   -j: print one JSON object per result instead of text
+// Animations are chosen by name (e.g. "Wave"). With no names, every installed animation is run, one at a time.
+
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QStringList>
+#include <QTemporaryFile>
+#include <QThread>
+#include <cstdio>
+#include <ctime>
+#include "animplugin.h"
+#include "animscript.h"
+#include "colorpipeline.h"
+#include "kbanim.h"
+#include "kblight.h"
+#include "counters.h"
+
+// The frames are timed in CPU time so that the animation processes running alongside don't skew the results
+static double cpu_ns(){
+    timespec time;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+    return time.tv_sec * 1e9 + time.tv_nsec;
+}
+
+static bool json = false;
+
+static void report(const char* bench, const QString& name, double ops, double ns, const benchcounters& start, const benchcounters& end, double bytes){
+    double allocs = (end.allocs - start.allocs) / ops;
+    double syscalls = (end.syscalls - start.syscalls) / ops;
+    bool counted = bench_counters_available();
+    if(json){
+        printf("{\"bench\":\"%s\",\"name\":\"%s\",\"ops\":%.0f,\"ns_per_op\":%.1f", bench, name.toUtf8().constData(), ops, ns / ops);
+        if(counted)
+            printf(",\"allocs_per_op\":%.3f,\"syscalls_per_op\":%.3f", allocs, syscalls);
+        if(bytes >= 0.)
+            printf(",\"bytes_per_op\":%.1f", bytes / ops);
+        printf("}\n");
+        return;
+    }
+    printf("  %s: %.1f ns/op", bench, ns / ops);
+    if(counted)
+        printf(", %.3f allocs/op, %.3f syscalls/op", allocs, syscalls);
+    if(bytes >= 0.)
+        printf(", %.1f bytes/op", bytes / ops);
+    printf("\n");
+}
+
+// Lets the animation processes run until the given time (ms since start)
+static void waitUntil(const QElapsedTimer& clock, qint64 due){
+    while(true){
+        QCoreApplication::processEvents();
+        qint64 remaining = due - clock.elapsed();
+        if(remaining <= 0)
+            break;
+        QThread::msleep(remaining > 1 ? 1 : remaining);
+    }
+}
+
+static void bench(const AnimScript* script, const KeyMap& map, int fps, int seconds, int blends){
+    // Same setup as a new animation added from the lighting tab
+    KbLight* light = new KbLight(0, map);
+    AnimScript::PresetValue preset;
+    if(!script->presets().isEmpty())
+        preset = script->preset(0);
+    KbAnim* anim = light->addAnim(script, map.keys(), script->name(), preset);
+    light->open();
+    QTemporaryFile cmd;
+    if(!cmd.open()){
+        printf("Couldn't create a temporary file\n");
+        delete light;
+        return;
+    }
+    if(!json)
+        printf("%s: %d frames at %d fps\n", script->name().toUtf8().constData(), fps * seconds, fps);
+
+    // Wait for the animation to start. Kb::frameUpdate() doesn't send anything before then either.
+    QElapsedTimer clock;
+    clock.start();
+    while(!light->isStarted() && clock.elapsed() < 5000)
+        waitUntil(clock, clock.elapsed() + 1);
+
+    // Frames are drawn and written the same way as Kb::frameUpdate(), minus the bindings
+    KbLight::Frame lightFrame;
+    int frames = fps * seconds;
+    double total = 0., bytes = 0.;
+    benchcounters before, after, frame0, frame1;
+    before.allocs = before.syscalls = after.allocs = after.syscalls = 0;
+    clock.restart();
+    for(int i = 0; i < frames; i++){
+        waitUntil(clock, (qint64)i * 1000 / fps);
+        cmd.seek(0);
+        bench_counters(&frame0);
+        double start = cpu_ns();
+        cmd.write("mode 1 ");
+        light->frameUpdate(lightFrame);
+        KbLight::writeFrame(cmd, lightFrame);
+        cmd.write("\n");
+        cmd.flush();
+        total += cpu_ns() - start;
+        bench_counters(&frame1);
+        bytes += cmd.pos();
+        after.allocs += frame1.allocs - frame0.allocs;
+        after.syscalls += frame1.syscalls - frame0.syscalls;
+    }
+    report("frame", script->name(), frames, total, before, after, bytes);
+
+    // Blend the animation's last frame over and over. The timestamp doesn't change, so the script isn't asked for anything new.
+    ColorMap colors;
+    colors.init(map);
+    quint64 timestamp = QDateTime::currentMSecsSinceEpoch();
+    anim->blend(colors, timestamp);
+    bench_counters(&before);
+    double start = cpu_ns();
+    for(int i = 0; i < blends; i++)
+        anim->blend(colors, timestamp);
+    total = cpu_ns() - start;
+    bench_counters(&after);
+    report("blend", script->name(), blends, total, before, after, -1.);
+
+    // Whole frames with 1, 4 and 16 layers of the same animation, cycling through the blend modes, plus the final pass
+    // with dimming turned on. This is the per-frame cost of KbLight::frameUpdate() minus the scripts and the output.
+    ColorMap base;
+    base.init(map);
+    KbAnim::Mode mode = anim->mode();
+    static const int layerCounts[] = { 1, 4, 16 };
+    for(uint l = 0; l < sizeof(layerCounts) / sizeof(layerCounts[0]); l++){
+        int layers = layerCounts[l];
+        bench_counters(&before);
+        start = cpu_ns();
+        for(int i = 0; i < blends; i++){
+            colors = base;
+            for(int layer = 0; layer < layers; layer++){
+                anim->mode((KbAnim::Mode)(layer % (KbAnim::Divide + 1)));
+                anim->blend(colors, timestamp);
+            }
+            finishColors(colors.colors(), 0, colors.count(), false, 2.f / 3.f, 0);
+        }
+        total = cpu_ns() - start;
+        bench_counters(&after);
+        report(QString("layers%1").arg(layers).toLatin1().constData(), script->name(), blends, total, before, after, -1.);
+    }
+    anim->mode(mode);
+
+    // Deleting the light stops the animation process or plugin
+    delete light;
+}
+
+int main(int argc, char* argv[]){
+    QCoreApplication app(argc, argv);
+    int fps = 60, seconds = 5, blends = 10000;
+    QStringList names;
+    QStringList args = app.arguments();
+    for(int i = 1; i < args.count(); i++){
+        const QString& arg = args[i];
+        if(arg == "-j")
+            json = true;
+        else if((arg == "-r" || arg == "-t" || arg == "-n") && i + 1 < args.count()){
+            int value = args[++i].toInt();
+            if(arg == "-r")
+                fps = value;
+            else if(arg == "-t")
+                seconds = value;
+            else
+                blends = value;
+        } else if(arg.startsWith("-")){
+            printf("Usage: %s [-r <fps>] [-t <seconds>] [-n <blends>] [-j] [<animation> ...]\n", argv[0]);
+            return 1;
+        } else
+            names.append(arg);
+    }
+    if(fps <= 0 || seconds <= 0 || blends <= 0){
+        printf("Usage: %s [-r <fps>] [-t <seconds>] [-n <blends>] [-j] [<animation> ...]\n", argv[0]);
+        return 1;
+    }
+
+    AnimScript::scan();
+    if(AnimScript::count() == 0){
+        printf("No animations found in %s\n", AnimScript::path().toUtf8().constData());
+        return 1;
+    }
+    KeyMap map(KeyMap::K95, KeyMap::US);
+    foreach(const AnimScript* script, AnimScript::list()){
+        if(!names.isEmpty() && !names.contains(script->name(), Qt::CaseInsensitive))
+            continue;
+        bench(script, map, fps, seconds, blends);
+    }
+    AnimPlugin::cleanUp();
+    return 0;
+}
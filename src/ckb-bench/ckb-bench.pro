@@ -0,0 +1,69 @@
+TEMPLATE = app
+TARGET = ckb-bench
+
+# Development tool, not part of the default build. Build with:
+#   qmake src/ckb-bench && make
+# or build both benchmarks with ckb itself:
+#   qmake CKB_BENCH=1 && make
+
+DESTDIR = $$PWD/../../bin
+
+macx {
+    LIBS = -framework CoreFoundation -framework CoreGraphics -framework IOKit -liconv
+} else {
+    # Use the simulated device backend so that lighting goes through the real packet code
+    LIBS = -lpthread -ldl
+    DEFINES += CKB_SIM
+}
+
+QMAKE_CFLAGS  = -std=gnu99 -Wno-unused-parameter -Werror=all
+QMAKE_MACOSX_DEPLOYMENT_TARGET = 10.9
+
+CONFIG   = release
+QT       =
+
+CKB_VERSION_STR = `cat $$PWD/../../VERSION`
+DEFINES += CKB_VERSION_STR="\\\"$$CKB_VERSION_STR\\\""
+
+DAEMON = $$PWD/../ckb-daemon
+INCLUDEPATH += $$DAEMON
+
+# Everything from the daemon except its main.c
+SOURCES += \
+    main.c \
+    counters.c \
+    $$DAEMON/device.c \
+    $$DAEMON/devnode.c \
+    $$DAEMON/input_linux.c \
+    $$DAEMON/input_mac.c \
+    $$DAEMON/input.c \
+    $$DAEMON/notify.c \
+    $$DAEMON/usb_linux.c \
+    $$DAEMON/usb_mac.c \
+    $$DAEMON/usb.c \
+    $$DAEMON/firmware.c \
+    $$DAEMON/frame.c \
+    $$DAEMON/profile.c \
+    $$DAEMON/extra_mac.c \
+    $$DAEMON/keymap.c \
+    $$DAEMON/command.c \
+    $$DAEMON/device_vtable.c \
+    $$DAEMON/device_keyboard.c \
+    $$DAEMON/device_mouse.c \
+    $$DAEMON/led_keyboard.c \
+    $$DAEMON/led.c \
+    $$DAEMON/led_mouse.c \
+    $$DAEMON/input_mac_mouse.c \
+    $$DAEMON/profile_keyboard.c \
+    $$DAEMON/dpi.c \
+    $$DAEMON/effect.c \
+    $$DAEMON/profile_mouse.c \
+    $$DAEMON/eventloop.c \
+    $$DAEMON/latency.c \
+    $$DAEMON/hwcache.c \
+    $$DAEMON/macro.c \
+    $$DAEMON/usb_sim.c \
+    $$DAEMON/input_sim.c
+
+HEADERS += \
+    counters.h
@@ -0,0 +1,84 @@
+#include "counters.h"
+#include <stdarg.h>
+#include <stddef.h>
+#include <unistd.h>
+
+#ifdef __GLIBC__
+
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+static unsigned long allocs, syscalls;
+
+#define COUNT(counter) __atomic_add_fetch(&(counter), 1, __ATOMIC_RELAXED)
+
+// glibc keeps its own entry points available, so the replacements don't need dlsym (which allocates)
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+extern void __libc_free(void* ptr);
+
+void* malloc(size_t size){
+    COUNT(allocs);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size){
+    COUNT(allocs);
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size){
+    COUNT(allocs);
+    return __libc_realloc(ptr, size);
+}
+
+void free(void* ptr){
+    __libc_free(ptr);
+}
+
+ssize_t read(int fd, void* buf, size_t count){
+    COUNT(syscalls);
+    return syscall(SYS_read, fd, buf, count);
+}
+
+ssize_t write(int fd, const void* buf, size_t count){
+    COUNT(syscalls);
+    return syscall(SYS_write, fd, buf, count);
+}
+
+ssize_t writev(int fd, const struct iovec* iov, int iovcnt){
+    COUNT(syscalls);
+    return syscall(SYS_writev, fd, iov, iovcnt);
+}
+
+int ioctl(int fd, unsigned long request, ...){
+    va_list args;
+    va_start(args, request);
+    void* arg = va_arg(args, void*);
+    va_end(args);
+    COUNT(syscalls);
+    return syscall(SYS_ioctl, fd, request, arg);
+}
+
+int bench_counters_available(void){
+    return 1;
+}
+
+void bench_counters(benchcounters* counters){
+    counters->allocs = __atomic_load_n(&allocs, __ATOMIC_RELAXED);
+    counters->syscalls = __atomic_load_n(&syscalls, __ATOMIC_RELAXED);
+}
+
+#else
+
+int bench_counters_available(void){
+    return 0;
+}
+
+void bench_counters(benchcounters* counters){
+    counters->allocs = counters->syscalls = 0;
+}
+
+#endif  // __GLIBC__
@@ -0,0 +1,25 @@
+#ifndef COUNTERS_H
+#define COUNTERS_H
+
+// Allocation and system call counters shared by ckb-bench and ckb-bench-gui.
+// malloc, calloc, realloc, read, write, writev, and ioctl are replaced with counting versions that forward to the C library.
+// Only available with glibc; elsewhere the counters stay at zero and bench_counters_available() returns 0.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    unsigned long allocs;
+    unsigned long syscalls;
+} benchcounters;
+
+int bench_counters_available(void);
+// Reads the totals since the program started
+void bench_counters(benchcounters* counters);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // COUNTERS_H
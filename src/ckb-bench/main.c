@@ -0,0 +1,448 @@
+// ckb-bench: measures the daemon's per-frame paths with no hardware attached.
+//
+// The default benchmark replays recorded command streams through the command parser and reports the time per line.
+// Streams are plain text, exactly as they would be written to a device's cmd node (see streams/).
+// With -i, the streams are run once to set the device up, and then synthetic input reports are fed through the
+// scancode translation and inputupdate() instead.
+//
+// On Linux the daemon is built against the simulated device backend (see ckb-daemon/usb_sim.c), so lighting updates
+// go through the real packet encoding and the packets are counted. Elsewhere, USB I/O is stubbed out and only parsing
+// and the cmd_ functions are measured. System calls aren't reported, since neither backend makes any for USB I/O.
+//
+// Usage: ckb-bench [-n <iterations>] [-i <reports>] [-m] [-h] [-k] [-j] <stream> [<stream> ...]
+//   -n: number of times to replay each stream (default 1000)
+//   -i: time <reports> input reports instead of the streams (Linux only)
+//   -m: emulate a mouse (M65) instead of a keyboard (K95)
+//   -h: with -i, send HID reports (as in hardware mode) instead of Corsair reports
+//   -k: with -i, send NKRO HID reports (as RGB keyboards do) instead of 6KRO. Implies -h.
+//   -j: print one JSON object per result instead of text
+
+#include "command.h"
+#include "device.h"
+#include "input.h"
+#include "profile.h"
+#include "sim.h"
+#include "usb.h"
+#include "counters.h"
+
+// main.c isn't linked, so provide what it normally would
+void timespec_add(struct timespec* timespec, long nanoseconds){
+    nanoseconds += timespec->tv_nsec;
+    timespec->tv_sec += nanoseconds / 1000000000;
+    timespec->tv_nsec = nanoseconds % 1000000000;
+}
+
+// Stubs for everything that would touch the hardware
+static int stub_io(usbdevice* kb, usbmode* mode, int notify, int keyindex, const char* param){
+    return 0;
+}
+#ifndef OS_SIM
+static unsigned rgb_updates;
+static int stub_update(usbdevice* kb, int force){
+    rgb_updates++;
+    return 0;
+}
+static void stub_indicators(usbdevice* kb, int force){
+}
+#endif
+
+// Report formats for the input benchmark
+#define REPORT_CORSAIR  0
+#define REPORT_6KRO     1
+#define REPORT_NKRO     2
+
+static double now_ns(){
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1e9 + time.tv_nsec;
+}
+
+// Everything that's counted during a benchmark
+typedef struct {
+    benchcounters counters;
+    unsigned long packets, frames, events, syncs;
+} benchstats;
+
+static void readstats(usbdevice* kb, benchstats* stats){
+    memset(stats, 0, sizeof(*stats));
+    bench_counters(&stats->counters);
+#ifdef OS_SIM
+    sim_usbstats(kb, &stats->packets, &stats->frames);
+    sim_inputstats(kb, &stats->events, &stats->syncs);
+#else
+    stats->frames = rgb_updates;
+#endif
+}
+
+static int json = 0;
+
+// Prints a result. ns is the total time taken by ops operations; start and end are the counters before and after.
+static void report(const char* bench, const char* name, double ops, double ns, const benchstats* start, const benchstats* end){
+    double allocs = (end->counters.allocs - start->counters.allocs) / ops;
+    unsigned long frames = end->frames - start->frames;
+    unsigned long packets = end->packets - start->packets;
+    double events = (end->events - start->events) / ops;
+    double syncs = (end->syncs - start->syncs) / ops;
+    int counted = bench_counters_available();
+#ifdef OS_SIM
+    int usb = 1;
+#else
+    int usb = 0;
+#endif
+    if(json){
+        printf("{\"bench\":\"%s\",\"name\":\"%s\",\"ops\":%.0f,\"ns_per_op\":%.1f", bench, name, ops, ns / ops);
+        if(counted)
+            printf(",\"allocs_per_op\":%.3f", allocs);
+        printf(",\"frames_per_op\":%.3f", frames / ops);
+        if(usb){
+            printf(",\"packets_per_op\":%.3f,\"packets_per_frame\":%.3f", packets / ops, frames ? (double)packets / frames : 0.);
+            printf(",\"events_per_op\":%.3f,\"syncs_per_op\":%.3f", events, syncs);
+        }
+        printf("}\n");
+        return;
+    }
+    printf("  %.1f ns/op", ns / ops);
+    if(counted)
+        printf(", %.3f allocs/op", allocs);
+    printf(", %.3f frames/op", frames / ops);
+    if(usb){
+        printf(", %.3f packets/frame", frames ? (double)packets / frames : 0.);
+        if(events || syncs)
+            printf(", %.3f events/op, %.3f syncs/op", events, syncs);
+    }
+    printf("\n");
+}
+
+// Reads a whole file. Returns null on failure.
+static char* readfile(const char* path, long* length){
+    FILE* file = fopen(path, "r");
+    if(!file)
+        return 0;
+    fseek(file, 0, SEEK_END);
+    *length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char* data = malloc(*length + 1);
+    if(fread(data, 1, *length, file) != (size_t)*length){
+        free(data);
+        fclose(file);
+        return 0;
+    }
+    data[*length] = 0;
+    fclose(file);
+    return data;
+}
+
+// A stream split into lines
+typedef struct {
+    char* data;
+    long length;
+    char** lines;
+    int* lengths;
+    int count;
+} stream;
+
+static int loadstream(const char* path, stream* out){
+    out->data = readfile(path, &out->length);
+    if(!out->data){
+        if(json)
+            printf("{\"bench\":\"cmd\",\"name\":\"%s\",\"error\":\"%s\"}\n", path, strerror(errno));
+        else
+            printf("%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    int linecount = 0;
+    for(long i = 0; i < out->length; i++){
+        if(out->data[i] == '\n')
+            linecount++;
+    }
+    out->lines = calloc(linecount + 1, sizeof(char*));
+    out->lengths = calloc(linecount + 1, sizeof(int));
+    linecount = 0;
+    for(char* line = out->data; *line; ){
+        char* end = strchr(line, '\n');
+        int len = end ? end + 1 - line : (int)strlen(line);
+        out->lines[linecount] = line;
+        out->lengths[linecount++] = len;
+        line += len;
+    }
+    out->count = linecount;
+    return 0;
+}
+
+static void freestream(stream* stream){
+    free(stream->lengths);
+    free(stream->lines);
+    free(stream->data);
+}
+
+static const char* basename_of(const char* path){
+    const char* slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+static void bench_cmd(usbdevice* kb, const char* path, int iterations){
+    stream s;
+    if(loadstream(path, &s))
+        return;
+    // readcmd modifies its input, so each line is copied to a scratch buffer before being replayed
+    char* scratch = malloc(s.length + 1);
+
+    // Measure the copy by itself so that it can be subtracted
+    double start = now_ns();
+    for(int n = 0; n < iterations; n++){
+        for(int i = 0; i < s.count; i++){
+            memcpy(scratch, s.lines[i], s.lengths[i]);
+            scratch[s.lengths[i]] = 0;
+        }
+    }
+    double copytime = now_ns() - start;
+
+    benchstats before, after;
+    readstats(kb, &before);
+    start = now_ns();
+    for(int n = 0; n < iterations; n++){
+        for(int i = 0; i < s.count; i++){
+            memcpy(scratch, s.lines[i], s.lengths[i]);
+            scratch[s.lengths[i]] = 0;
+            readcmd(kb, scratch);
+        }
+    }
+    double total = now_ns() - start - copytime;
+    readstats(kb, &after);
+    double lines_run = (double)s.count * iterations;
+    if(!json){
+        printf("%s: %d lines, %ld bytes, %d iterations\n", path, s.count, s.length, iterations);
+        printf("  %.3f us/line, %.2f ns/byte, %.1f MB/s\n",
+               total / lines_run / 1000., total / ((double)s.length * iterations), s.length * iterations / (total / 1e9) / 1e6);
+    }
+    report("cmd", basename_of(path), lines_run, total, &before, &after);
+
+    free(scratch);
+    freestream(&s);
+}
+
+#ifdef OS_SIM
+
+// Small deterministic generator, so that every run sends the same reports
+static unsigned lcg(unsigned* state){
+    *state = *state * 1103515245u + 12345u;
+    return *state >> 16;
+}
+
+#define REPORT_SIZE MSG_SIZE
+
+// Fills reports[count] with a sequence of key/button changes. Each report presses or releases one or two keys.
+static int makereports(usbdevice* kb, uchar (*reports)[REPORT_SIZE], int* lengths, int count, int hid){
+    unsigned seed = 1;
+    uchar keys[N_KEYBYTES_HW] = { 0 };
+    int mouse = IS_MOUSE_DEV(kb);
+    for(int i = 0; i < count; i++){
+        uchar* report = reports[i];
+        memset(report, 0, REPORT_SIZE);
+        int changes = 1 + (lcg(&seed) & 1);
+        for(int j = 0; j < changes; j++){
+            if(mouse){
+                // HID reports carry buttons 1 - 5, Corsair reports carry the rest
+                int bit = hid ? lcg(&seed) % 5 : 5 + lcg(&seed) % (N_BUTTONS_HW - 5);
+                keys[bit / 8] ^= 1 << (bit % 8);
+            } else {
+                // Any key on the main block (A - Z, 0 - 9, and friends)
+                int bit = 13 + lcg(&seed) % 60;
+                keys[bit / 8] ^= 1 << (bit % 8);
+            }
+        }
+        if(mouse){
+            if(hid){
+                // EP 2 HID report: buttons, then 16-bit X and Y at bytes 5 and 7
+                report[0] = 1;
+                report[1] = keys[0];
+                short x = (short)(lcg(&seed) % 7) - 3, y = (short)(lcg(&seed) % 7) - 3;
+                memcpy(report + 5, &x, 2);
+                memcpy(report + 7, &y, 2);
+                lengths[i] = 10;
+            } else {
+                // EP 3 Corsair report
+                memcpy(report, keys, (N_BUTTONS_HW + 7) / 8);
+                lengths[i] = MSG_SIZE;
+            }
+        } else {
+            if(hid){
+                // Keys are translated back to their HID codes (modifiers are never pressed)
+                static const uchar hid_of[N_KEYS_HW] = {
+                    [13] = 0x1e, [14] = 0x1f, [15] = 0x20, [16] = 0x21, [17] = 0x22, [18] = 0x23, [19] = 0x24, [20] = 0x25,
+                    [21] = 0x26, [22] = 0x27, [23] = 0x2d, [24] = 0x2b, [25] = 0x14, [26] = 0x1a, [27] = 0x08, [28] = 0x15,
+                    [29] = 0x17, [30] = 0x1c, [31] = 0x18, [32] = 0x0c, [33] = 0x12, [34] = 0x13, [35] = 0x2f, [36] = 0x39,
+                    [37] = 0x04, [38] = 0x16, [39] = 0x07, [40] = 0x09, [41] = 0x0a, [42] = 0x0b, [43] = 0x0d, [44] = 0x0e,
+                    [45] = 0x0f, [46] = 0x33, [47] = 0x34, [49] = 0x64, [50] = 0x1d, [51] = 0x1b, [52] = 0x06, [53] = 0x19,
+                    [54] = 0x05, [55] = 0x11, [56] = 0x10, [57] = 0x36, [58] = 0x37, [59] = 0x38, [64] = 0x2c, [69] = 0x65,
+                    [72] = 0x45,
+                };
+                if(hid == REPORT_NKRO){
+                    // EP 2 NKRO report: type 1, modifiers, then a bitmap of HID codes 0 - 151
+                    report[0] = 1;
+                    for(int bit = 13; bit < 73; bit++){
+                        if((keys[bit / 8] & (1 << (bit % 8))) && hid_of[bit])
+                            report[2 + hid_of[bit] / 8] |= 1 << (hid_of[bit] % 8);
+                    }
+                    lengths[i] = 21;
+                } else {
+                    // EP 1 6KRO report
+                    int pos = 2;
+                    for(int bit = 13; bit < 73 && pos < 8; bit++){
+                        if((keys[bit / 8] & (1 << (bit % 8))) && hid_of[bit])
+                            report[pos++] = hid_of[bit];
+                    }
+                    lengths[i] = 8;
+                }
+            } else {
+                memcpy(report, keys, N_KEYBYTES_HW);
+                lengths[i] = MSG_SIZE;
+            }
+        }
+    }
+    return 0;
+}
+
+static void bench_input(usbdevice* kb, const char* name, int count, int hid){
+    uchar (*reports)[REPORT_SIZE] = malloc(count * REPORT_SIZE);
+    int* lengths = malloc(count * sizeof(int));
+    makereports(kb, reports, lengths, count, hid);
+    int mouse = IS_MOUSE_DEV(kb);
+
+    // inputupdate needs uinput handles. The simulated ones don't send events anywhere.
+    os_inputopen(kb);
+    benchstats before, after;
+    readstats(kb, &before);
+    double start = now_ns();
+    for(int i = 0; i < count; i++){
+        // Same as the input thread in usb_linux.c
+        pthread_mutex_lock(imutex(kb));
+        if(mouse){
+            if(hid)
+                hid_mouse_translate(kb->input.keys, &kb->input.rel_x, &kb->input.rel_y, -2, lengths[i], reports[i]);
+            else
+                corsair_mousecopy(kb->input.keys, -3, reports[i]);
+        } else {
+            if(hid)
+                hid_kb_translate(kb->input.keys, hid == REPORT_NKRO ? -2 : -1, lengths[i], reports[i]);
+            else
+                corsair_kbcopy(kb->input.keys, -3, reports[i]);
+        }
+        inputupdate(kb);
+        pthread_mutex_unlock(imutex(kb));
+    }
+    double total = now_ns() - start;
+    readstats(kb, &after);
+    os_inputclose(kb);
+    static const char* const formats[] = { "Corsair", "HID", "NKRO HID" };
+    static const char* const benches[] = { "input", "input-hid", "input-nkro" };
+    if(!json)
+        printf("%s: %d %s reports\n", name, count, formats[hid]);
+    report(benches[hid], name, count, total, &before, &after);
+    // A device polled at 1000 Hz can send a report every millisecond
+    if(!json)
+        printf("  %.3f%% of a 1000 Hz polling interval\n", total / count / 1e4);
+
+    free(lengths);
+    free(reports);
+}
+
+#endif  // OS_SIM
+
+static void usage(const char* argv0){
+    printf("Usage: %s [-n <iterations>] [-i <reports>] [-m] [-h] [-k] [-j] <stream> [<stream> ...]\n", argv0);
+}
+
+int main(int argc, char** argv){
+    int iterations = 1000, reports = 0, mouse = 0, hid = REPORT_CORSAIR;
+    int opt;
+    while((opt = getopt(argc, argv, "n:i:mhkj")) != -1){
+        switch(opt){
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        case 'i':
+            reports = atoi(optarg);
+            break;
+        case 'm':
+            mouse = 1;
+            break;
+        case 'h':
+            if(hid == REPORT_CORSAIR)
+                hid = REPORT_6KRO;
+            break;
+        case 'k':
+            hid = REPORT_NKRO;
+            break;
+        case 'j':
+            json = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if((optind >= argc && !reports) || iterations <= 0 || reports < 0){
+        usage(argv[0]);
+        return 1;
+    }
+#ifndef OS_SIM
+    if(reports){
+        printf("The input benchmark needs the simulated device backend, which is only available on Linux.\n");
+        return 1;
+    }
+#endif
+
+    // Set up a fake device in the first device slot. Its dmutex stays locked while the benchmarks run.
+    usbdevice* kb = device_add(0);
+    kb->vendor = V_CORSAIR;
+    kb->product = mouse ? P_M65 : P_K95;
+    kb->features = FEAT_STD_RGB;
+    kb->fwversion = 0x0200;
+    strncpy(kb->name, mouse ? "Corsair M65 (benchmark)" : "Corsair K95 (benchmark)", KB_NAME_LEN);
+    strncpy(kb->serial, "BENCH", SERIAL_LEN - 1);
+    union devcmd vt = mouse ? vtable_mouse : vtable_keyboard;
+    vt.hwload = vt.hwsave = vt.fwupdate = vt.pollrate = vt.active = vt.idle = stub_io;
+#ifndef OS_SIM
+    vt.updatergb = vt.updatedpi = stub_update;
+    vt.updateindicators = stub_indicators;
+#endif
+    kb->vtable = &vt;
+    vt.allocprofile(kb);
+    kb->active = 1;
+    // Send lighting as fast as it's generated. Only changed keys are sent, the same as for a real device (see _setupusb).
+    kb->usbdelay = 0;
+    kb->delta = 1;
+
+    if(!reports){
+        for(int i = optind; i < argc; i++)
+            bench_cmd(kb, argv[i], iterations);
+    }
+#ifdef OS_SIM
+    else {
+        // Streams set the device up (bindings, macros) before the input is timed
+        char name[256] = "";
+        for(int i = optind; i < argc; i++){
+            stream s;
+            if(loadstream(argv[i], &s))
+                continue;
+            for(int j = 0; j < s.count; j++){
+                char* line = s.lines[j];
+                line[s.lengths[j] - (line[s.lengths[j] - 1] == '\n')] = 0;
+                readcmd(kb, line);
+            }
+            freestream(&s);
+            if(*name)
+                strncat(name, "+", sizeof(name) - strlen(name) - 1);
+            strncat(name, basename_of(argv[i]), sizeof(name) - strlen(name) - 1);
+        }
+        if(!*name)
+            strcpy(name, mouse ? "m65" : "k95");
+        pthread_mutex_unlock(dmutex(kb));
+        bench_input(kb, name, reports, hid);
+        return 0;
+    }
+#endif
+    pthread_mutex_unlock(dmutex(kb));
+    return 0;
+}
@@ -10,7 +10,7 @@ macx {
 macx {
     LIBS = -framework CoreFoundation -framework CoreGraphics -framework IOKit -liconv
 } else {
-    LIBS = -lpthread -ludev
+    LIBS = -lpthread -ludev -ldl
 }
 
 QMAKE_CFLAGS  = -std=gnu99 -Wno-unused-parameter -Werror=all
@@ -20,6 +20,14 @@ QMAKE_MACOSX_DEPLOYMENT_TARGET = 10.9
 CONFIG   = debug_and_release
 QT       =
 
+# Simulated devices for testing without hardware (Linux only). Build with:
+#   qmake CKB_SIM=1 src/ckb-daemon && make
+!isEmpty(CKB_SIM) {
+    TARGET = ckb-daemon-sim
+    LIBS = -lpthread -ldl
+    DEFINES += CKB_SIM
+}
+
 CKB_VERSION_STR = `cat $$PWD/../../VERSION`
 DEFINES += CKB_VERSION_STR="\\\"$$CKB_VERSION_STR\\\""
 
@@ -35,6 +43,7 @@ SOURCES += \
     usb_mac.c \
     usb.c \
     firmware.c \
+    frame.c \
     profile.c \
     extra_mac.c \
     keymap.c \
@@ -48,7 +57,14 @@ SOURCES += \
     input_mac_mouse.c \
     profile_keyboard.c \
     dpi.c \
-    profile_mouse.c
+    effect.c \
+    profile_mouse.c \
+    eventloop.c \
+    latency.c \
+    hwcache.c \
+    macro.c \
+    usb_sim.c \
+    input_sim.c
 
 HEADERS += \
     device.h \
@@ -60,9 +76,16 @@ HEADERS += \
     os.h \
     usb.h \
     firmware.h \
+    frame.h \
     profile.h \
     command.h \
     keymap.h \
     keymap_mac.h \
     structures.h \
-    dpi.h
+    dpi.h \
+    effect.h \
+    eventloop.h \
+    latency.h \
+    hwcache.h \
+    macro.h \
+    sim.h
@@ -1,6 +1,9 @@
 #include "command.h"
 #include "device.h"
 #include "devnode.h"
+#include "effect.h"
+#include "frame.h"
+#include "input.h"
 #include "led.h"
 #include "notify.h"
 #include "profile.h"
@@ -17,6 +20,9 @@ static const char* const cmd_strings[CMD_COUNT - 1] = {
     "notifyoff",
     "fps",
     "dither",
+    "delta",
+    "frame",
+    "effect",
 
     "hwload",
     "hwsave",
@@ -53,58 +59,130 @@ static const char* const cmd_strings[CMD_COUNT - 1] = {
     "get"
 };
 
+// Hash table of command words (open addressing). Entries are cmd_strings indices + 1; 0 = empty.
+#define CMDHASH_SIZE    128
+static char cmdhash[CMDHASH_SIZE];
+static pthread_once_t cmdhash_once = PTHREAD_ONCE_INIT;
+
+static void cmdhash_init(){
+    for(int i = 0; i < CMD_COUNT - 1; i++){
+        unsigned slot = strhash(cmd_strings[i]) & (CMDHASH_SIZE - 1);
+        while(cmdhash[slot])
+            slot = (slot + 1) & (CMDHASH_SIZE - 1);
+        cmdhash[slot] = i + 1;
+    }
+}
+
+// Finds a command by name. Returns NONE if the word isn't a command.
+static cmd findcmd(const char* word){
+    pthread_once(&cmdhash_once, cmdhash_init);
+    unsigned slot = strhash(word) & (CMDHASH_SIZE - 1);
+    int index;
+    while((index = cmdhash[slot])){
+        if(!strcmp(cmd_strings[index - 1], word))
+            return index - 1 + CMD_FIRST;
+        slot = (slot + 1) & (CMDHASH_SIZE - 1);
+    }
+    return NONE;
+}
+
 #define TRY_WITH_RESET(action)  \
     while(action){              \
-        if(usb_tryreset(kb)){   \
-            free(word);         \
+        if(usb_tryreset(kb))    \
             return 1;           \
-        }                       \
     }
 
+// Same characters as isspace() in the C locale
+#define IS_SPACE(c) ((c) == ' ' || ((c) >= '\t' && (c) <= '\r'))
+
+// In-place tokenizer. Each word is null-terminated by overwriting the whitespace after it.
+typedef struct {
+    char* next;
+    // Set when the current word is the first on its line
+    char newline;
+    // Set when the whitespace overwritten after the previous word was a newline
+    char pending;
+} tokenizer;
+
+// Returns the next word, or null at the end of the input.
+static inline char* nextword(tokenizer* tok){
+    char* c = tok->next;
+    tok->newline = tok->pending;
+    tok->pending = 0;
+    while(IS_SPACE(*c)){
+        if(*c == '\n')
+            tok->newline = 1;
+        c++;
+    }
+    if(!*c)
+        return 0;
+    char* word = c;
+    while(*c && !IS_SPACE(*c))
+        c++;
+    if(*c){
+        if(*c == '\n')
+            tok->pending = 1;
+        *c++ = 0;
+    }
+    tok->next = c;
+    return word;
+}
+
+// Applies a deferred frame load (see readcmd)
+static inline void flushframe(usbdevice* kb, usbmode** frameload){
+    if(*frameload){
+        loadframe(kb, *frameload);
+        *frameload = 0;
+    }
+}
 
-int readcmd(usbdevice* kb, const char* line){
-    char* word = malloc(strlen(line) + 1);
-    int wordlen;
-    const char* newline = 0;
+int readcmd(usbdevice* kb, char* line){
     const devcmd* vt = kb->vtable;
     usbprofile* profile = kb->profile;
     usbmode* mode = 0;
     int notifynumber = 0;
+    // Lighting and DPI changes only update the modes as they're read. The device gets the final state once the whole
+    // batch has been read (see "Finish up" below), so frames that were already out of date by the time they arrived are dropped.
+    // Frame loads are deferred as well, because every load in a batch would read the same frame.
+    int frames = 0;
+    char framelit = 0;
+    usbmode* frameload = 0;
     // Read words from the input
     cmd command = NONE;
-    while(sscanf(line, "%s%n", word, &wordlen) == 1){
-        line += wordlen;
+    tokenizer tok = { line, 0, 1 };
+    char* word;
+    while((word = nextword(&tok))){
         // If we passed a newline, reset the context
-        if(line > newline){
+        if(tok.newline){
             mode = profile->currentmode;
             command = NONE;
             notifynumber = 0;
-            newline = strchr(line, '\n');
-            if(!newline)
-                newline = line + strlen(line);
+            frames += framelit;
+            framelit = 0;
         }
         // Check for a command word
-        for(int i = 0; i < CMD_COUNT - 1; i++){
-            if(!strcmp(word, cmd_strings[i])){
-                command = i + CMD_FIRST;
+        cmd newcommand = findcmd(word);
+        if(newcommand != NONE){
+            command = newcommand;
+            // Commands which read or replace the lighting need to see the deferred frame first
+            if(command == RGB || command == GET || command == HWLOAD || command == HWSAVE || command == ERASE || command == ERASEPROFILE)
+                flushframe(kb, &frameload);
 #ifndef OS_MAC
-                // Layout and mouse acceleration aren't used on Linux; ignore
-                if(command == LAYOUT || command == ACCEL || command == SCROLLSPEED)
-                    command = NONE;
+            // Layout and mouse acceleration aren't used on Linux; ignore
+            if(command == LAYOUT || command == ACCEL || command == SCROLLSPEED)
+                command = NONE;
 #endif
-                // Most commands require parameters, but a few are actions in and of themselves
-                if(command != SWITCH
-                        && command != HWLOAD && command != HWSAVE
-                        && command != ACTIVE && command != IDLE
-                        && command != ERASE && command != ERASEPROFILE)
-                    goto next_loop;
-                break;
-            }
+            // Most commands require parameters, but a few are actions in and of themselves
+            if(command != SWITCH
+                    && command != HWLOAD && command != HWSAVE
+                    && command != ACTIVE && command != IDLE
+                    && command != ERASE && command != ERASEPROFILE)
+                goto next_loop;
         }
 
         // Set current notification node when given @number
-        int newnotify;
-        if(sscanf(word, "@%u", &newnotify) == 1 && newnotify < OUTFIFO_MAX){
+        uint newnotify;
+        if(word[0] == '@' && parse_uint(word + 1, &newnotify) && newnotify < OUTFIFO_MAX){
             notifynumber = newnotify;
             continue;
         }
@@ -167,24 +245,16 @@ int readcmd(usbdevice* kb, const char* line){
 #endif
         case MODE: {
             // Select a mode number (1 - 6)
-            int newmode;
-            if(sscanf(word, "%u", &newmode) == 1 && newmode > 0 && newmode <= MODE_COUNT)
+            uint newmode;
+            if(parse_uint(word, &newmode) && newmode > 0 && newmode <= MODE_COUNT)
                 mode = profile->mode + newmode - 1;
             continue;
         }
         case FPS: {
-            // USB command delay (2 - 10ms)
+            // Target frame rate. The USB delay adapts to it, based on how many packets the device actually needs per frame.
             uint framerate;
-            if(sscanf(word, "%u", &framerate) == 1 && framerate > 0){
-                // Not all devices require the same number of messages per frame; select delay appropriately
-                uint per_frame = IS_MOUSE_DEV(kb) ? 2 : IS_STRAFE(kb) ? 14 : 5;
-                uint delay = 1000 / framerate / per_frame;
-                if(delay < 2)
-                    delay = 2;
-                else if(delay > 10)
-                    delay = 10;
-                kb->usbdelay = delay;
-            }
+            if(sscanf(word, "%u", &framerate) == 1 && framerate > 0)
+                usb_pace_setfps(kb, framerate);
             continue;
         }
         case DITHER: {
@@ -197,6 +267,13 @@ int readcmd(usbdevice* kb, const char* line){
             }
             continue;
         }
+        case DELTA: {
+            // 0: Always send full lighting frames, 1: Send only the packets which changed.
+            uint delta;
+            if(sscanf(word, "%u", &delta) == 1 && delta <= 1)
+                kb->delta = delta;
+            continue;
+        }
         default:;
         }
 
@@ -219,6 +296,21 @@ int readcmd(usbdevice* kb, const char* line){
                 vt->setmodeindex(kb, index);
             }
             continue;
+        case FRAME:
+            // Shared-memory frames: open/close the node or load the current frame into the selected mode
+            if(!strcmp(word, "load")){
+                if(frameload != mode)
+                    flushframe(kb, &frameload);
+                frameload = mode;
+                framelit = 1;
+                continue;
+            }
+            flushframe(kb, &frameload);
+            cmd_frame(kb, mode, word);
+            continue;
+        case EFFECT:
+            cmd_effect(kb, mode, word);
+            continue;
         case HWLOAD: case HWSAVE:{
             char delay = kb->usbdelay;
             // Ensure delay of at least 10ms as the device can get overwhelmed otherwise
@@ -233,10 +325,8 @@ int readcmd(usbdevice* kb, const char* line){
         }
         case FWUPDATE:
             // FW update parses a whole word. Unlike hwload/hwsave, there's no try again on failure.
-            if(vt->fwupdate(kb, mode, notifynumber, 0, word)){
-                free(word);
+            if(vt->fwupdate(kb, mode, notifynumber, 0, word))
                 return 1;
-            }
             continue;
         case POLLRATE: {
             uint rate;
@@ -256,9 +346,10 @@ int readcmd(usbdevice* kb, const char* line){
             vt->do_cmd[command](kb, mode, notifynumber, 0, word);
             continue;
         case RGB: {
+            framelit = 1;
             // RGB command has a special response for a single hex constant
-            int r, g, b;
-            if(sscanf(word, "%02x%02x%02x", &r, &g, &b) == 3){
+            uchar r, g, b;
+            if(parse_rgb(word, &r, &g, &b)){
                 // Set all keys
                 for(int i = 0; i < N_KEYS_EXTENDED; i++)
                     vt->rgb(kb, mode, notifynumber, i, word);
@@ -275,51 +366,58 @@ int readcmd(usbdevice* kb, const char* line){
         default:;
         }
         // For anything else, split the parameter at the colon
-        int left = -1;
-        sscanf(word, "%*[^:]%n", &left);
+        char* colon = strchr(word, ':');
+        int left = colon ? colon - word : (int)strlen(word);
         if(left <= 0)
             continue;
         const char* right = word + left;
-        if(right[0] == ':')
+        if(colon){
+            *colon = 0;
             right++;
+        }
         // Macros and DPI have a separate left-side handler
         if(command == MACRO || command == DPI){
-            word[left] = 0;
             vt->do_macro[command](kb, mode, notifynumber, word, right);
             continue;
         }
         // Scan the left side for key names and run the requested command
-        int position = 0, field = 0;
-        char keyname[11];
-        while(position < left && sscanf(word + position, "%10[^:,]%n", keyname, &field) == 1){
-            int keycode;
+        char* keyname = word;
+        while(*keyname){
+            char* comma = strchr(keyname, ',');
+            if(comma)
+                *comma = 0;
+            uint keycode;
             if(!strcmp(keyname, "all")){
                 // Set all keys
                 for(int i = 0; i < N_KEYS_EXTENDED; i++)
                     vt->do_cmd[command](kb, mode, notifynumber, i, right);
-            } else if((sscanf(keyname, "#%d", &keycode) && keycode >= 0 && keycode < N_KEYS_EXTENDED)
-                      || (sscanf(keyname, "#x%x", &keycode) && keycode >= 0 && keycode < N_KEYS_EXTENDED)){
-                // Set a key numerically
-                vt->do_cmd[command](kb, mode, notifynumber, keycode, right);
+            } else if(keyname[0] == '#'){
+                // Set a key numerically (#n or #xn)
+                int valid = keyname[1] == 'x' ? parse_hex(keyname + 2, &keycode) : parse_uint(keyname + 1, &keycode);
+                if(valid && keycode < N_KEYS_EXTENDED)
+                    vt->do_cmd[command](kb, mode, notifynumber, keycode, right);
             } else {
                 // Find this key in the keymap
-                for(unsigned i = 0; i < N_KEYS_EXTENDED; i++){
-                    if(keymap[i].name && !strcmp(keyname, keymap[i].name)){
-                        vt->do_cmd[command](kb, mode, notifynumber, i, right);
-                        break;
-                    }
-                }
+                int i = keymap_find(keyname);
+                if(i >= 0)
+                    vt->do_cmd[command](kb, mode, notifynumber, i, right);
             }
-            if(word[position += field] == ',')
-                position++;
+            if(!comma)
+                break;
+            keyname = comma + 1;
         }
     }
 
     // Finish up
+    publishbind(kb);
+    flushframe(kb, &frameload);
+    frames += framelit;
+    kb->frames_received += frames;
+    if(frames > 1)
+        kb->frames_dropped += frames - 1;
     if(!NEEDS_FW_UPDATE(kb)){
         TRY_WITH_RESET(vt->updatergb(kb, 0));
         TRY_WITH_RESET(vt->updatedpi(kb, 0));
     }
-    free(word);
     return 0;
 }
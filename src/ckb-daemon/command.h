@@ -6,16 +6,19 @@
 // Command operations
 typedef enum {
     // Special - handled by readcmd, no device functions
-    NONE        = -10,
-    MODE        = -9,   CMD_FIRST = MODE,
-    SWITCH      = -8,
-    LAYOUT      = -7,
-    ACCEL       = -6,
-    SCROLLSPEED = -5,
-    NOTIFYON    = -4,
-    NOTIFYOFF   = -3,
-    FPS         = -2,
-    DITHER      = -1,
+    NONE        = -13,
+    MODE        = -12,  CMD_FIRST = MODE,
+    SWITCH      = -11,
+    LAYOUT      = -10,
+    ACCEL       = -9,
+    SCROLLSPEED = -8,
+    NOTIFYON    = -7,
+    NOTIFYOFF   = -6,
+    FPS         = -5,
+    DITHER      = -4,
+    DELTA       = -3,
+    FRAME       = -2,
+    EFFECT      = -1,
 
     // Hardware data
     HWLOAD      = 0,    CMD_VT_FIRST = 0,
@@ -136,7 +139,60 @@ typedef union devcmd {
 
 // Parse input from FIFO. Lock dmutex first (see device.h)
 // This function is also responsible for calling all of the cmd_ functions. They should not be invoked elsewhere.
-int readcmd(usbdevice* kb, const char* line);
+// The input is split into words in place, so it will be modified.
+int readcmd(usbdevice* kb, char* line);
+
+// Argument parsers. These are used instead of sscanf on the per-frame paths.
+
+// Parses a decimal number. Returns the number of digits read, or 0 if the string doesn't begin with one.
+static inline int parse_uint(const char* str, uint* value){
+    uint result = 0;
+    int digits = 0;
+    for(; str[digits] >= '0' && str[digits] <= '9'; digits++)
+        result = result * 10 + (str[digits] - '0');
+    if(digits)
+        *value = result;
+    return digits;
+}
+
+// Parses one hex digit. Returns -1 if invalid.
+static inline int parse_hexdigit(char c){
+    if(c >= '0' && c <= '9')
+        return c - '0';
+    if(c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+// Parses a hex number. Returns the number of digits read, or 0 if the string doesn't begin with one.
+static inline int parse_hex(const char* str, uint* value){
+    uint result = 0;
+    int digits = 0, d;
+    for(; (d = parse_hexdigit(str[digits])) >= 0; digits++)
+        result = result << 4 | d;
+    if(digits)
+        *value = result;
+    return digits;
+}
+
+// Parses a two-digit hex byte. Returns 1 on success.
+static inline int parse_hexbyte(const char* str, uchar* value){
+    int hi = parse_hexdigit(str[0]);
+    if(hi < 0)
+        return 0;
+    int lo = parse_hexdigit(str[1]);
+    if(lo < 0)
+        return 0;
+    *value = hi << 4 | lo;
+    return 1;
+}
+
+// Parses an rrggbb color. Returns 1 on success.
+static inline int parse_rgb(const char* str, uchar* r, uchar* g, uchar* b){
+    return parse_hexbyte(str, r) && parse_hexbyte(str + 2, g) && parse_hexbyte(str + 4, b);
+}
 
 #endif  // COMMAND_H
 
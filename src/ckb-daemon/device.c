@@ -6,11 +6,123 @@
 
 int hwload_mode = 1;
 
-// Device list
-usbdevice keyboard[DEV_MAX];
-pthread_mutex_t devlistmutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t devmutex[DEV_MAX] = { [0 ... DEV_MAX-1] = PTHREAD_MUTEX_INITIALIZER };
-pthread_mutex_t inputmutex[DEV_MAX] = { [0 ... DEV_MAX-1] = PTHREAD_MUTEX_INITIALIZER };
+// Device list. The root controller's slot is static; everything else is allocated by device_add.
+// devlistmutex protects the list along with the slots' keys and used flags. If you need a device's dmutex as well, lock that first.
+static pthread_mutex_t devlistmutex = PTHREAD_MUTEX_INITIALIZER;
+static devslot rootslot = { .devmutex = PTHREAD_MUTEX_INITIALIZER, .inputmutex = PTHREAD_MUTEX_INITIALIZER, .used = 1 };
+static devslot* slots[DEV_MAX] = { &rootslot };
+static int slotcount = 1;
+// Allocated slots that aren't in use, one bit per slot
+static uint64_t freeslots[DEV_MAX / 64];
+// Key -> slot, chained through devslot.hashnext
+#define DEV_HASH    64
+static devslot* keyhash[DEV_HASH];
+
+usbdevice* device_get(int index){
+    if(index < 0 || index >= DEV_MAX)
+        return 0;
+    devslot* slot = __atomic_load_n(slots + index, __ATOMIC_ACQUIRE);
+    return slot ? &slot->kb : 0;
+}
+
+int device_count(){
+    return __atomic_load_n(&slotcount, __ATOMIC_ACQUIRE);
+}
+
+static inline unsigned keybucket(const char* key){
+    return strhash(key) % DEV_HASH;
+}
+
+// Lock devlistmutex first
+static devslot* keylookup(const char* key){
+    for(devslot* slot = keyhash[keybucket(key)]; slot; slot = slot->hashnext){
+        if(!strcmp(slot->key, key))
+            return slot;
+    }
+    return 0;
+}
+
+usbdevice* device_add(const char* key){
+    pthread_mutex_lock(&devlistmutex);
+    if(key && keylookup(key)){
+        pthread_mutex_unlock(&devlistmutex);
+        errno = EEXIST;
+        return 0;
+    }
+    // Reuse the lowest free slot. A slot whose mutex is still held is being closed, so skip it for now.
+    devslot* slot = 0;
+    for(int word = 0; word < DEV_MAX / 64 && !slot; word++){
+        uint64_t bits = freeslots[word];
+        while(bits){
+            int index = word * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+            if(!pthread_mutex_trylock(&slots[index]->devmutex)){
+                slot = slots[index];
+                freeslots[word] &= ~(1ULL << (index % 64));
+                break;
+            }
+        }
+    }
+    if(!slot){
+        // Allocate a new one
+        if(slotcount == DEV_MAX){
+            pthread_mutex_unlock(&devlistmutex);
+            errno = ENOSPC;
+            return 0;
+        }
+        slot = calloc(1, sizeof(devslot));
+        slot->index = slotcount;
+        pthread_mutex_init(&slot->devmutex, 0);
+        pthread_mutex_init(&slot->inputmutex, 0);
+        pthread_mutex_lock(&slot->devmutex);
+        __atomic_store_n(slots + slotcount, slot, __ATOMIC_RELEASE);
+        __atomic_store_n(&slotcount, slotcount + 1, __ATOMIC_RELEASE);
+    }
+    slot->used = 1;
+    slot->generation++;
+    if(key){
+        slot->key = strdup(key);
+        unsigned bucket = keybucket(key);
+        slot->hashnext = keyhash[bucket];
+        keyhash[bucket] = slot;
+    }
+    pthread_mutex_unlock(&devlistmutex);
+    return &slot->kb;
+}
+
+usbdevice* device_find(const char* key){
+    pthread_mutex_lock(&devlistmutex);
+    devslot* slot = keylookup(key);
+    pthread_mutex_unlock(&devlistmutex);
+    return slot ? &slot->kb : 0;
+}
+
+const char* device_key(usbdevice* kb){
+    return DEV_SLOT(kb)->key;
+}
+
+void device_release(usbdevice* kb){
+    devslot* slot = DEV_SLOT(kb);
+    if(slot == &rootslot)
+        return;
+    pthread_mutex_lock(&devlistmutex);
+    if(!slot->used){
+        pthread_mutex_unlock(&devlistmutex);
+        return;
+    }
+    if(slot->key){
+        devslot** entry = keyhash + keybucket(slot->key);
+        while(*entry != slot)
+            entry = &(*entry)->hashnext;
+        *entry = slot->hashnext;
+        free(slot->key);
+        slot->key = 0;
+        slot->hashnext = 0;
+    }
+    slot->used = 0;
+    freeslots[slot->index / 64] |= 1ULL << (slot->index % 64);
+    pthread_mutex_unlock(&devlistmutex);
+}
 
 int _start_dev(usbdevice* kb, int makeactive){
     // Get the firmware version from the device
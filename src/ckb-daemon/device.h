@@ -4,9 +4,49 @@
 #include "includes.h"
 #include "keymap.h"
 
-// Connected devices
-#define DEV_MAX     9
-extern usbdevice keyboard[DEV_MAX];
+// Connected devices. Slot 0 is the root controller; devices take the lowest free slot from 1 up, which is the N in
+// <devpath>N, and keep it until they're disconnected. Slots are allocated the first time they're needed and never freed,
+// so a device pointer stays valid for as long as the daemon runs and the table costs one pointer per unused slot.
+#define DEV_MAX     256
+typedef struct _devslot {
+    // Must be first, so that a usbdevice* can be converted back to its slot
+    usbdevice kb;
+    int index;
+    // Whether the slot is reserved by a device
+    char used;
+    // Key used to find the device again (the sysfs path on Linux, the serial number on the simulator). Null if none.
+    // Only changed with the device's dmutex locked.
+    char* key;
+    struct _devslot* hashnext;
+    // See dmutex/imutex below
+    pthread_mutex_t devmutex, inputmutex;
+    // Incremented each time the slot is reserved, so that work queued for an earlier device can tell that it's gone.
+    // Only changed with the device's dmutex locked.
+    unsigned long generation;
+    // State owned by the OS backend (usb_*.c and input_*.c). Allocated by the backend and kept with the slot.
+    void* usbdata, *inputdata;
+#ifdef OS_LINUX
+    // Command FIFO buffer for devices handled by the event loop
+    struct _readlines_ctx* fifoctx;
+#endif
+} devslot;
+#define DEV_SLOT(kb) ((devslot*)(kb))
+#define DEV_INDEX(kb) (DEV_SLOT(kb)->index)
+
+// Returns the device in a slot, or null if the slot hasn't been allocated. Slot 0 always exists.
+usbdevice* device_get(int index);
+// Number of slots allocated so far. Every slot below this number exists.
+int device_count();
+// Reserves the lowest free slot for a new device, with an optional key. The device's dmutex is locked on return.
+// Returns null if there are no slots left (errno = ENOSPC) or a device with the same key exists already (errno = EEXIST).
+usbdevice* device_add(const char* key);
+// Finds a device by key, or returns null. The device isn't locked, so lock dmutex and check the key again before using it.
+usbdevice* device_find(const char* key);
+// Returns a device's key, or null. Lock dmutex first.
+const char* device_key(usbdevice* kb);
+// Frees a device's slot once it's been closed. Lock dmutex first. Does nothing if the slot isn't in use.
+void device_release(usbdevice* kb);
+
 // Is a device active?
 #ifdef OS_LINUX
 #define IS_CONNECTED(kb) ((kb) && (kb)->handle && (kb)->uinput_kb && (kb)->uinput_mouse)
@@ -14,12 +54,13 @@ extern usbdevice keyboard[DEV_MAX];
 #define IS_CONNECTED(kb) ((kb) && (kb)->handle && (kb)->event)
 #endif
 // A mutex used for USB controls. Needs to be locked before reading or writing the device handle or accessing its profile
-extern pthread_mutex_t devmutex[DEV_MAX];
-#define dmutex(kb) (devmutex + INDEX_OF(kb, keyboard))
+#define dmutex(kb) (&DEV_SLOT(kb)->devmutex)
 // Similar, but for key input. Also needs to be locked before accessing output FIFOs.
 // When adding or removing a device you must lock BOTH mutexes, dmutex first.
-extern pthread_mutex_t inputmutex[DEV_MAX];
-#define imutex(kb) (inputmutex + INDEX_OF(kb, keyboard))
+#define imutex(kb) (&DEV_SLOT(kb)->inputmutex)
+
+// Hardware profile loading (--hwload): 0 = never, 1 = try (default), 2 = always. With 2, the profile cache is bypassed.
+extern int hwload_mode;
 
 // Sets up device hardware, after software initialization is finished. Also used during resets
 // Should be called only from setupusb/resetusb
@@ -1,13 +1,19 @@
 #include "device.h"
 #include "devnode.h"
+#include "eventloop.h"
 #include "firmware.h"
+#include "frame.h"
 #include "input.h"
 #include "led.h"
 #include "notify.h"
 #include "profile.h"
+#include <sys/mman.h>
 
 // OSX doesn't like putting FIFOs in /dev for some reason
-#ifndef OS_MAC
+// Simulated devices don't need root access, so they're kept out of /dev as well
+#ifdef OS_SIM
+const char *const devpath = "/tmp/ckb";
+#elif !defined(OS_MAC)
 const char *const devpath = "/dev/input/ckb";
 #else
 const char *const devpath = "/var/run/ckb";
@@ -36,20 +42,23 @@ int rm_recursive(const char* path){
 }
 
 void _updateconnected(){
-    pthread_mutex_lock(devmutex);
+    usbdevice* root = device_get(0);
+    pthread_mutex_lock(dmutex(root));
     char cpath[strlen(devpath) + 12];
     snprintf(cpath, sizeof(cpath), "%s0/connected", devpath);
     FILE* cfile = fopen(cpath, "w");
     if(!cfile){
         ckb_warn("Unable to update %s: %s\n", cpath, strerror(errno));
-        pthread_mutex_unlock(devmutex);
+        pthread_mutex_unlock(dmutex(root));
         return;
     }
     int written = 0;
-    for(int i = 1; i < DEV_MAX; i++){
-        if(IS_CONNECTED(keyboard + i)){
+    int count = device_count();
+    for(int i = 1; i < count; i++){
+        usbdevice* kb = device_get(i);
+        if(IS_CONNECTED(kb)){
             written = 1;
-            fprintf(cfile, "%s%d %s %s\n", devpath, i, keyboard[i].serial, keyboard[i].name);
+            fprintf(cfile, "%s%d %s %s\n", devpath, i, kb->serial, kb->name);
         }
     }
     if(!written)
@@ -58,7 +67,7 @@ void _updateconnected(){
     chmod(cpath, S_GID_READ);
     if(gid >= 0)
         chown(cpath, 0, gid);
-    pthread_mutex_unlock(devmutex);
+    pthread_mutex_unlock(dmutex(root));
 }
 
 void updateconnected(){
@@ -73,7 +82,7 @@ int _mknotifynode(usbdevice* kb, int notify){
     if(kb->outfifo[notify] != 0)
         return 0;
     // Create the notification node
-    int index = INDEX_OF(kb, keyboard);
+    int index = DEV_INDEX(kb);
     char outpath[strlen(devpath) + 10];
     snprintf(outpath, sizeof(outpath), "%s%d/notify%d", devpath, index, notify);
     if(mkfifo(outpath, S_GID_READ) != 0 || (kb->outfifo[notify] = open(outpath, O_RDWR | O_NONBLOCK) + 1) == 0){
@@ -98,7 +107,7 @@ int mknotifynode(usbdevice* kb, int notify){
 int _rmnotifynode(usbdevice* kb, int notify){
     if(notify < 0 || notify >= OUTFIFO_MAX || !kb->outfifo[notify])
         return -1;
-    int index = INDEX_OF(kb, keyboard);
+    int index = DEV_INDEX(kb);
     char outpath[strlen(devpath) + 10];
     snprintf(outpath, sizeof(outpath), "%s%d/notify%d", devpath, index, notify);
     // Close FIFO
@@ -117,7 +126,7 @@ int rmnotifynode(usbdevice* kb, int notify){
 }
 
 static int _mkdevpath(usbdevice* kb){
-    int index = INDEX_OF(kb, keyboard);
+    int index = DEV_INDEX(kb);
     // Create the control path
     char path[strlen(devpath) + 2];
     snprintf(path, sizeof(path), "%s%d", devpath, index);
@@ -133,7 +142,7 @@ static int _mkdevpath(usbdevice* kb){
     if(gid >= 0)
         chown(path, 0, gid);
 
-    if(kb == keyboard + 0){
+    if(DEV_INDEX(kb) == 0){
         // Root keyboard: write a list of devices
         _updateconnected();
         // Write version number
@@ -257,16 +266,24 @@ int mkdevpath(usbdevice* kb){
 
 int rmdevpath(usbdevice* kb){
     euid_guard_start;
-    int index = INDEX_OF(kb, keyboard);
+    int index = DEV_INDEX(kb);
     if(kb->infifo != 0){
 #ifdef OS_LINUX
-        write(kb->infifo - 1, "\n", 1); // hack to prevent the FIFO thread from perma-blocking
+        if(eventloop_enabled)
+            eventloop_del(kb->infifo - 1);
+        else
+            write(kb->infifo - 1, "\n", 1); // hack to prevent the FIFO thread from perma-blocking
 #endif
         close(kb->infifo - 1);
         kb->infifo = 0;
     }
     for(int i = 0; i < OUTFIFO_MAX; i++)
         _rmnotifynode(kb, i);
+    if(kb->framefd){
+        // The node itself is deleted along with the rest of the path
+        close(kb->framefd - 1);
+        kb->framefd = 0;
+    }
     char path[strlen(devpath) + 2];
     snprintf(path, sizeof(path), "%s%d", devpath, index);
     if(rm_recursive(path) != 0 && errno != ENOENT){
@@ -280,7 +297,7 @@ int rmdevpath(usbdevice* kb){
 }
 
 int mkfwnode(usbdevice* kb){
-    int index = INDEX_OF(kb, keyboard);
+    int index = DEV_INDEX(kb);
     char fwpath[strlen(devpath) + 12];
     snprintf(fwpath, sizeof(fwpath), "%s%d/fwversion", devpath, index);
     FILE* fwfile = fopen(fwpath, "w");
@@ -333,7 +350,7 @@ void readlines_ctx_free(readlines_ctx ctx){
     free(ctx);
 }
 
-unsigned readlines(int fd, readlines_ctx ctx, const char** input){
+unsigned readlines(int fd, readlines_ctx ctx, char** input){
     // Move any data left over from a previous read to the start of the buffer
     char* buffer = ctx->buffer;
     int buffersize = ctx->buffersize;
@@ -36,6 +36,6 @@ int mkfwnode(usbdevice* kb);
 typedef struct _readlines_ctx* readlines_ctx;
 void readlines_ctx_init(readlines_ctx* ctx);
 void readlines_ctx_free(readlines_ctx ctx);
-unsigned readlines(int fd, readlines_ctx ctx, const char** input);
+unsigned readlines(int fd, readlines_ctx ctx, char** input);
 
 #endif  // DEVNODE_H
@@ -158,14 +158,8 @@ int loaddpi(usbdevice* kb, dpiset* dpi, lighting* light){
         { 0x0e, 0x13, 0x04, 1, }
     };
     uchar in_pkt[4][MSG_SIZE];
-    for(int i = 0; i < 4; i++){
-        if(!usbrecv(kb, data_pkt[i], in_pkt[i]))
-            return -2;
-        if(memcmp(in_pkt[i], data_pkt[i], 4)){
-            ckb_err("Bad input header\n");
-            return -3;
-        }
-    }
+    if(!usbrecvbatch(kb, data_pkt[0], in_pkt[0], 4, 4))
+        return -2;
     // Copy data from device
     dpi->enabled = in_pkt[0][4];
     dpi->enabled &= (1 << DPI_COUNT) - 1;
@@ -178,17 +172,19 @@ int loaddpi(usbdevice* kb, dpiset* dpi, lighting* light){
     dpi->snap = !!in_pkt[3][4];
 
     // Get X/Y DPIs
+    uchar dpi_pkt[DPI_COUNT][MSG_SIZE] = { { 0 } };
+    uchar dpi_in[DPI_COUNT][MSG_SIZE];
+    for(int i = 0; i < DPI_COUNT; i++){
+        dpi_pkt[i][0] = 0x0e;
+        dpi_pkt[i][1] = 0x13;
+        dpi_pkt[i][2] = 0xd0 | i;
+        dpi_pkt[i][3] = 1;
+    }
+    if(!usbrecvbatch(kb, dpi_pkt[0], dpi_in[0], DPI_COUNT, 4))
+        return -2;
     for(int i = 0; i < DPI_COUNT; i++){
-        uchar data_pkt[MSG_SIZE] = { 0x0e, 0x13, 0xd0, 1 };
-        uchar in_pkt[MSG_SIZE];
-        data_pkt[2] |= i;
-        if(!usbrecv(kb, data_pkt, in_pkt))
-            return -2;
-        if(memcmp(in_pkt, data_pkt, 4)){
-            ckb_err("Bad input header\n");
-            return -3;
-        }
         // Copy to profile
+        uchar* in_pkt = dpi_in[i];
         dpi->x[i] = *(ushort*)(in_pkt + 5);
         dpi->y[i] = *(ushort*)(in_pkt + 7);
         light->r[LED_MOUSE + N_MOUSE_ZONES + i] = in_pkt[9];
@@ -0,0 +1,469 @@
+#include "command.h"
+#include "device.h"
+#include "effect.h"
+#include "keymap.h"
+#include "latency.h"
+#include "profile.h"
+
+// Only the types are needed from the animation header
+#define CKB_NO_MAIN
+#include "../ckb/ckb-anim.h"
+
+#include <dlfcn.h>
+
+// Keypress modes (see CKB_KPMODE in ckb-anim.h)
+#define KP_NONE     0
+#define KP_NAME     1
+#define KP_POSITION 2
+
+const char* effectdir = EFFECT_DIR;
+
+typedef struct {
+    char* name;
+    char* value;
+} effectparam;
+
+typedef struct _effect {
+    // Settings. These are kept so that the effect can be loaded again if its keys change.
+    char* path;
+    int modeindex;
+    // Position of each key, by key index, or -1 if the key isn't given to the effect
+    short x[N_KEYS_EXTENDED], y[N_KEYS_EXTENDED];
+    effectparam* params;
+    int paramcount;
+    char kpmode;
+    // Length of one duration in seconds, or 0 if the effect uses absolute time. Repeat interval in seconds, or 0 for none.
+    double duration, repeat;
+    int fps;
+
+    // Loaded instance, or null if it hasn't been loaded yet
+    void* handle;
+    void (*init)(ckb_runctx*);
+    void (*parameter)(ckb_runctx*, const char*, const char*);
+    void (*keypress)(ckb_runctx*, ckb_key*, int, int, int);
+    void (*start)(ckb_runctx*, int);
+    void (*time)(ckb_runctx*, double);
+    int (*frame)(ckb_runctx*);
+    ckb_runctx ctx;
+    // Key index of each entry in ctx.keys
+    short* keyindex;
+    // Set when the effect has asked to stop. Its last frame stays on the keyboard.
+    char ended;
+    // Set if the effect couldn't be loaded, so that it isn't tried again every frame
+    char failed;
+    // Time of the last frame and of the next repeat (ns)
+    uint64_t last, nextrepeat;
+    // The current mode's lighting with the effect drawn over it
+    lighting out;
+
+    // Key events for the next frame, as (key index << 1 | down). Protected by imutex, as is the wakeup below.
+    short events[EFFECT_EVENTS];
+    int eventcount;
+    pthread_cond_t cond;
+    pthread_t thread;
+} effect;
+
+// Whether the effect should be drawn right now. Lock dmutex first.
+static int playing(usbdevice* kb, effect* fx){
+    return fx->path && !fx->failed && kb->active && kb->profile
+            && kb->profile->currentmode == kb->profile->mode + fx->modeindex;
+}
+
+static void unload(effect* fx){
+    if(!fx->handle)
+        return;
+    dlclose(fx->handle);
+    fx->handle = 0;
+    free(fx->ctx.keys);
+    free(fx->keyindex);
+    memset(&fx->ctx, 0, sizeof(fx->ctx));
+    fx->keyindex = 0;
+}
+
+// Checks that a file or directory is owned by root (or the daemon's own user) and nobody else can write to it
+static int trusted(const char* path, mode_t type){
+    struct stat st;
+    if(stat(path, &st)){
+        ckb_err("Couldn't load effect %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+    if((st.st_mode & S_IFMT) != type || (st.st_uid != 0 && st.st_uid != geteuid()) || (st.st_mode & (S_IWGRP | S_IWOTH))){
+        ckb_err("Refusing to load effect from %s: it must be owned by root and not writable by anyone else\n", path);
+        return 0;
+    }
+    return 1;
+}
+
+// Loads the effect and gives it its keys and parameters. Returns 0 on success.
+static int load(effect* fx, uint64_t now){
+    // Positions are made relative to the top left key, the same as the GUI does
+    unsigned count = 0;
+    int minx = INT16_MAX, miny = INT16_MAX, maxx = 0, maxy = 0;
+    for(int i = 0; i < N_KEYS_EXTENDED; i++){
+        if(fx->x[i] < 0)
+            continue;
+        count++;
+        if(fx->x[i] < minx)
+            minx = fx->x[i];
+        if(fx->y[i] < miny)
+            miny = fx->y[i];
+        if(fx->x[i] > maxx)
+            maxx = fx->x[i];
+        if(fx->y[i] > maxy)
+            maxy = fx->y[i];
+    }
+    // Nothing to draw until the keys have been set
+    if(!count)
+        return -1;
+    if(!trusted(effectdir, S_IFDIR) || !trusted(fx->path, S_IFREG)){
+        fx->failed = 1;
+        return -1;
+    }
+#ifdef LM_ID_NEWLM
+    // Each effect gets a namespace of its own, so that the same effect can run on several devices without sharing globals
+    void* handle = dlmopen(LM_ID_NEWLM, fx->path, RTLD_NOW | RTLD_LOCAL);
+#else
+    // Loading the same file again would share the first instance's globals, so only one device may use it
+    void* handle = dlopen(fx->path, RTLD_NOW | RTLD_LOCAL | RTLD_NOLOAD);
+    if(handle){
+        dlclose(handle);
+        ckb_err("Effect %s is already running on another device\n", fx->path);
+        fx->failed = 1;
+        return -1;
+    }
+    handle = dlopen(fx->path, RTLD_NOW | RTLD_LOCAL);
+#endif
+    if(!handle){
+        ckb_err("Couldn't load effect: %s\n", dlerror());
+        fx->failed = 1;
+        return -1;
+    }
+    fx->init = dlsym(handle, "ckb_init");
+    fx->parameter = dlsym(handle, "ckb_parameter");
+    fx->keypress = dlsym(handle, "ckb_keypress");
+    fx->start = dlsym(handle, "ckb_start");
+    fx->time = dlsym(handle, "ckb_time");
+    fx->frame = dlsym(handle, "ckb_frame");
+    if(!fx->init || !fx->parameter || !fx->keypress || !fx->start || !fx->time || !fx->frame){
+        ckb_err("%s is not a ckb effect\n", fx->path);
+        dlclose(handle);
+        fx->failed = 1;
+        return -1;
+    }
+    fx->handle = handle;
+    fx->ctx.keys = calloc(count, sizeof(ckb_key));
+    fx->ctx.keycount = count;
+    fx->ctx.width = maxx - minx + 1;
+    fx->ctx.height = maxy - miny + 1;
+    fx->keyindex = malloc(count * sizeof(short));
+    ckb_key* key = fx->ctx.keys;
+    for(int i = 0; i < N_KEYS_EXTENDED; i++){
+        if(fx->x[i] < 0)
+            continue;
+        strncpy(key->name, keymap[i].name, CKB_KEYNAME_MAX - 1);
+        key->x = fx->x[i] - minx;
+        key->y = fx->y[i] - miny;
+        fx->keyindex[key - fx->ctx.keys] = i;
+        key++;
+    }
+    // Same start-up sequence as an animation process
+    fx->init(&fx->ctx);
+    for(int i = 0; i < fx->paramcount; i++)
+        fx->parameter(&fx->ctx, fx->params[i].name, fx->params[i].value);
+    fx->start(&fx->ctx, 1);
+    fx->ended = 0;
+    fx->last = now;
+    fx->nextrepeat = now + (uint64_t)(fx->repeat * 1e9);
+    return 0;
+}
+
+// Advances the effect to the given time
+static void advance(effect* fx, uint64_t now){
+    if(now <= fx->last)
+        return;
+    double delta = (now - fx->last) / 1e9;
+    fx->last = now;
+    if(fx->duration > 0.){
+        delta /= fx->duration;
+        // Skip any complete durations
+        while(delta > 1.){
+            fx->time(&fx->ctx, 1.);
+            delta -= 1.;
+        }
+    }
+    fx->time(&fx->ctx, delta);
+}
+
+// Draws a frame and sends it to the device. Lock dmutex first.
+static void drawframe(usbdevice* kb, effect* fx, const short* events, int eventcount){
+    uint64_t now = latency_now();
+    if(!playing(kb, fx)){
+        // Don't let the time jump ahead when the effect comes back
+        fx->last = now;
+        return;
+    }
+    if(!fx->handle && load(fx, now))
+        return;
+    if(fx->ended)
+        return;
+    advance(fx, now);
+    if(fx->repeat > 0. && now >= fx->nextrepeat){
+        fx->start(&fx->ctx, 1);
+        fx->nextrepeat = now + (uint64_t)(fx->repeat * 1e9);
+    }
+    for(int i = 0; i < eventcount; i++){
+        int keyindex = events[i] >> 1, down = events[i] & 1;
+        ckb_key* key = 0;
+        for(unsigned k = 0; k < fx->ctx.keycount && !key; k++){
+            if(fx->keyindex[k] == keyindex)
+                key = fx->ctx.keys + k;
+        }
+        if(!key)
+            continue;
+        if(fx->kpmode == KP_NONE){
+            // Effects without keypress support restart instead
+            if(down)
+                fx->start(&fx->ctx, 1);
+        } else
+            fx->keypress(&fx->ctx, key, key->x, key->y, down);
+    }
+    if(fx->frame(&fx->ctx))
+        fx->ended = 1;
+    // A failed transfer is picked up by the device thread the next time it sends something
+    kb->vtable->updatergb(kb, 0);
+}
+
+static void* effect_main(void* context){
+    usbdevice* kb = context;
+    pthread_mutex_lock(imutex(kb));
+    effect* fx = kb->effect;
+    uint64_t next = latency_now();
+    // Clearing kb->effect tells the thread to stop
+    while(fx && kb->effect == fx){
+        uint64_t now = latency_now();
+        if(!fx->eventcount && now < next){
+#ifdef OS_LINUX
+            struct timespec due = { next / 1000000000ULL, next % 1000000000ULL };
+            pthread_cond_timedwait(&fx->cond, imutex(kb), &due);
+#else
+            uint64_t wait = next - now;
+            struct timespec timeout = { wait / 1000000000ULL, wait % 1000000000ULL };
+            pthread_cond_timedwait_relative_np(&fx->cond, imutex(kb), &timeout);
+#endif
+            continue;
+        }
+        // Take the waiting key events, then draw without holding imutex so that input isn't held up
+        short events[EFFECT_EVENTS];
+        int eventcount = fx->eventcount;
+        memcpy(events, fx->events, eventcount * sizeof(short));
+        fx->eventcount = 0;
+        pthread_mutex_unlock(imutex(kb));
+        pthread_mutex_lock(dmutex(kb));
+        uint64_t period = 1000000000ULL / fx->fps;
+        if(kb->effect == fx)
+            drawframe(kb, fx, events, eventcount);
+        pthread_mutex_unlock(dmutex(kb));
+        // Key events draw a frame right away, but don't change the schedule for the rest
+        if(next <= now){
+            next += period;
+            if(next <= now)
+                next = now + period;
+        }
+        pthread_mutex_lock(imutex(kb));
+    }
+    pthread_mutex_unlock(imutex(kb));
+    return 0;
+}
+
+// Creates the effect and its thread. Lock dmutex first. Returns null on failure.
+static effect* create(usbdevice* kb){
+    effect* fx = calloc(1, sizeof(effect));
+    memset(fx->x, -1, sizeof(fx->x));
+    memset(fx->y, -1, sizeof(fx->y));
+    fx->duration = 1.;
+    fx->fps = EFFECT_FPS;
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+#ifdef OS_LINUX
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+#endif
+    pthread_cond_init(&fx->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_lock(imutex(kb));
+    kb->effect = fx;
+    pthread_mutex_unlock(imutex(kb));
+    if(!pthread_create(&fx->thread, 0, effect_main, kb))
+        return fx;
+    ckb_err("Failed to start effect thread\n");
+    pthread_mutex_lock(imutex(kb));
+    kb->effect = 0;
+    pthread_mutex_unlock(imutex(kb));
+    pthread_cond_destroy(&fx->cond);
+    free(fx);
+    return 0;
+}
+
+static void clearparams(effect* fx){
+    for(int i = 0; i < fx->paramcount; i++){
+        free(fx->params[i].name);
+        free(fx->params[i].value);
+    }
+    free(fx->params);
+    fx->params = 0;
+    fx->paramcount = 0;
+}
+
+void effect_stop(usbdevice* kb){
+    effect* fx = kb->effect;
+    if(!fx)
+        return;
+    pthread_mutex_lock(imutex(kb));
+    kb->effect = 0;
+    pthread_cond_signal(&fx->cond);
+    pthread_mutex_unlock(imutex(kb));
+    // The thread may be waiting for dmutex
+    pthread_mutex_unlock(dmutex(kb));
+    pthread_join(fx->thread, 0);
+    pthread_mutex_lock(dmutex(kb));
+    unload(fx);
+    clearparams(fx);
+    free(fx->path);
+    pthread_cond_destroy(&fx->cond);
+    free(fx);
+}
+
+void effect_keypress(usbdevice* kb, int keyindex, int down){
+    effect* fx = kb->effect;
+    if(!fx || fx->eventcount == EFFECT_EVENTS)
+        return;
+    fx->events[fx->eventcount++] = keyindex << 1 | !!down;
+    pthread_cond_signal(&fx->cond);
+}
+
+lighting* effect_light(usbdevice* kb){
+    lighting* base = &kb->profile->currentmode->light;
+    effect* fx = kb->effect;
+    if(!fx || !fx->handle || !playing(kb, fx))
+        return base;
+    // Draw the effect over the mode's lighting. The mode's forced update (if any) is passed on with it.
+    lighting* out = &fx->out;
+    memcpy(out, base, sizeof(lighting));
+    base->forceupdate = 0;
+    for(unsigned i = 0; i < fx->ctx.keycount; i++){
+        const ckb_key* key = fx->ctx.keys + i;
+        int led = keymap[fx->keyindex[i]].led;
+        if(led < 0 || !key->a)
+            continue;
+        int a = key->a, na = 255 - a;
+        out->r[led] = (key->r * a + out->r[led] * na + 127) / 255;
+        out->g[led] = (key->g * a + out->g[led] * na + 127) / 255;
+        out->b[led] = (key->b * a + out->b[led] * na + 127) / 255;
+    }
+    return out;
+}
+
+void cmd_effect(usbdevice* kb, usbmode* mode, const char* word){
+    effect* fx = kb->effect;
+    if(!strncmp(word, "load:", 5)){
+        // Only a file name is accepted. It's looked up in the effect directory, never anywhere else.
+        char name[strlen(word + 5) + 1];
+        urldecode2(name, word + 5);
+        if(!*name || strchr(name, '/') || strstr(name, "..")){
+            ckb_err("Invalid effect name: %s\n", name);
+            return;
+        }
+        // A new effect starts from the default settings
+        if(!fx && !(fx = create(kb)))
+            return;
+        unload(fx);
+        clearparams(fx);
+        free(fx->path);
+        fx->path = malloc(strlen(effectdir) + strlen(name) + 2);
+        sprintf(fx->path, "%s/%s", effectdir, name);
+        fx->modeindex = INDEX_OF(mode, kb->profile->mode);
+        memset(fx->x, -1, sizeof(fx->x));
+        memset(fx->y, -1, sizeof(fx->y));
+        fx->kpmode = KP_NONE;
+        fx->duration = 1.;
+        fx->repeat = 0.;
+        fx->fps = EFFECT_FPS;
+        fx->failed = 0;
+        return;
+    }
+    // Everything else needs an effect
+    if(!fx || !fx->path)
+        return;
+    if(!strcmp(word, "unload")){
+        unload(fx);
+        free(fx->path);
+        fx->path = 0;
+    } else if(!strcmp(word, "start") || !strcmp(word, "stop")){
+        if(fx->handle && playing(kb, fx)){
+            advance(fx, latency_now());
+            fx->start(&fx->ctx, !strcmp(word, "start"));
+            fx->ended = 0;
+        }
+    } else if(!strncmp(word, "kp:", 3)){
+        if(!strcmp(word + 3, "name"))
+            fx->kpmode = KP_NAME;
+        else if(!strcmp(word + 3, "position"))
+            fx->kpmode = KP_POSITION;
+        else if(!strcmp(word + 3, "none"))
+            fx->kpmode = KP_NONE;
+    } else if(!strncmp(word, "duration:", 9)){
+        double duration;
+        if(sscanf(word + 9, "%lf", &duration) == 1 && duration >= 0.)
+            fx->duration = duration;
+    } else if(!strncmp(word, "repeat:", 7)){
+        double repeat;
+        if(sscanf(word + 7, "%lf", &repeat) == 1 && repeat >= 0.){
+            fx->repeat = repeat;
+            fx->nextrepeat = latency_now() + (uint64_t)(repeat * 1e9);
+        }
+    } else if(!strncmp(word, "fps:", 4)){
+        uint fps;
+        if(parse_uint(word + 4, &fps) && fps > 0)
+            fx->fps = fps < EFFECT_FPS_MAX ? fps : EFFECT_FPS_MAX;
+    } else if(strchr(word, '=')){
+        // Parameter (name=value). The value is URL-encoded, the same as for an animation process.
+        const char* equals = strchr(word, '=');
+        char* name = strndup(word, equals - word);
+        char* value = strdup(equals + 1);
+        urldecode2(value, value);
+        int i = 0;
+        for(; i < fx->paramcount; i++){
+            if(!strcmp(fx->params[i].name, name))
+                break;
+        }
+        if(i == fx->paramcount){
+            fx->params = realloc(fx->params, (fx->paramcount + 1) * sizeof(effectparam));
+            fx->params[fx->paramcount++].name = name;
+        } else {
+            free(name);
+            free(fx->params[i].value);
+        }
+        fx->params[i].value = value;
+        // Running effects get the new value right away
+        if(fx->handle)
+            fx->parameter(&fx->ctx, fx->params[i].name, value);
+    } else {
+        // Key position (key:x,y)
+        const char* colon = strchr(word, ':');
+        if(!colon || colon - word >= CKB_KEYNAME_MAX)
+            return;
+        char name[CKB_KEYNAME_MAX];
+        memcpy(name, word, colon - word);
+        name[colon - word] = 0;
+        int keyindex = keymap_find(name);
+        uint x, y;
+        int digits = parse_uint(colon + 1, &x);
+        if(keyindex < 0 || !digits || colon[1 + digits] != ',' || !parse_uint(colon + 2 + digits, &y) || x > INT16_MAX || y > INT16_MAX)
+            return;
+        if(fx->x[keyindex] != (short)x || fx->y[keyindex] != (short)y){
+            fx->x[keyindex] = x;
+            fx->y[keyindex] = y;
+            // The keys are only given to an effect when it starts, so it has to be loaded again
+            unload(fx);
+        }
+    }
+}
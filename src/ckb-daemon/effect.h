@@ -0,0 +1,43 @@
+#ifndef EFFECT_H
+#define EFFECT_H
+
+#include "includes.h"
+
+// Native lighting effects. An effect is an animation built as a shared object (see CKB_PLUGIN in ckb-anim.h) which the
+// daemon runs itself, instead of going through the GUI. Key events are handed to it straight from the input thread and its
+// frames are drawn over the mode's lighting whenever the lighting is sent, so a keypress shows up on the next USB frame.
+// Each device can run one effect, which belongs to one of its modes and only plays while that mode is selected.
+// The effect runs on a thread of its own, which locks dmutex to draw a frame. This is true even with --eventloop, because
+// the event loop must not wait on dmutex.
+
+// Default and maximum effect frame rates
+#define EFFECT_FPS          60
+#define EFFECT_FPS_MAX      1000
+// Maximum key events waiting for the next frame. Any more are dropped.
+#define EFFECT_EVENTS       64
+
+// Directory that effects are loaded from (set with --effectdir). Only files owned by root that nobody else can write
+// are loaded, since the command nodes are open to every user unless --gid is given.
+#ifndef EFFECT_DIR
+#ifdef OS_MAC
+#define EFFECT_DIR          "/Applications/ckb.app/Contents/Resources/ckb-effects"
+#else
+#define EFFECT_DIR          "/usr/bin/ckb-effects"
+#endif
+#endif
+extern const char* effectdir;
+
+// Stops the effect and unloads it. Called from closeusb with dmutex locked.
+void effect_stop(usbdevice* kb);
+
+// Queues a key event for the effect, if there is one. Lock imutex first.
+void effect_keypress(usbdevice* kb, int keyindex, int down);
+
+// Returns the lighting to send to the device: the current mode's lighting with the effect drawn over it, or just the
+// mode's lighting if no effect is playing. Lock dmutex first.
+lighting* effect_light(usbdevice* kb);
+
+// Command: Load, configure, or unload an effect (see DAEMON.md)
+void cmd_effect(usbdevice* kb, usbmode* mode, const char* word);
+
+#endif  // EFFECT_H
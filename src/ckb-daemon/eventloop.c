@@ -0,0 +1,179 @@
+#include "eventloop.h"
+
+#ifdef OS_LINUX
+
+#include <sys/eventfd.h>
+
+int eventloop_enabled = 0;
+
+#define EVENTS_MAX  16
+// Workers are started when a job comes in and none are free, so that one device's slow command doesn't hold up another's
+#define WORKER_MAX  32
+
+// Handler info for a file descriptor. Descriptors are small integers, so they're stored in a table indexed by fd.
+typedef struct {
+    eventhandler handler;
+    void* context;
+} eventsource;
+#define SOURCE_MAX  1024
+static eventsource sources[SOURCE_MAX];
+static pthread_mutex_t sourcemutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int epollfd = -1;
+// Written to by eventloop_stop() to wake the loop up, in case it's called from another thread or a signal handler
+static int wakefd = -1;
+static volatile int running = 0;
+static pthread_t loopthread;
+
+// Worker pool job queue
+typedef struct _job {
+    void (*run)(void*);
+    void* context;
+    struct _job* next;
+} job;
+static job* jobs = 0, *lastjob = 0;
+// Jobs waiting in the queue, worker threads started, and workers waiting for a job
+static int queued = 0, workers = 0, idle = 0;
+static pthread_mutex_t jobmutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobcond = PTHREAD_COND_INITIALIZER;
+
+static void* worker(void* context){
+    pthread_mutex_lock(&jobmutex);
+    while(1){
+        idle++;
+        while(!jobs)
+            pthread_cond_wait(&jobcond, &jobmutex);
+        idle--;
+        job* next = jobs;
+        jobs = next->next;
+        if(!jobs)
+            lastjob = 0;
+        queued--;
+        pthread_mutex_unlock(&jobmutex);
+        next->run(next->context);
+        free(next);
+        pthread_mutex_lock(&jobmutex);
+    }
+    return 0;
+}
+
+static void wake_ready(void* context, uint32_t events){
+    uint64_t count;
+    read(wakefd, &count, sizeof(count));
+}
+
+int eventloop_init(){
+    epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if(epollfd < 0){
+        ckb_err("Failed to create epoll instance: %s\n", strerror(errno));
+        return -1;
+    }
+    wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if(wakefd < 0 || eventloop_add(wakefd, EPOLLIN, wake_ready, 0)){
+        ckb_err("Failed to create wakeup event: %s\n", strerror(errno));
+        close(epollfd);
+        epollfd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+void eventloop_run(){
+    loopthread = pthread_self();
+    running = 1;
+    struct epoll_event events[EVENTS_MAX];
+    while(running){
+        int count = epoll_wait(epollfd, events, EVENTS_MAX, -1);
+        if(count < 0){
+            if(errno == EINTR)
+                continue;
+            ckb_err("epoll_wait failed: %s\n", strerror(errno));
+            break;
+        }
+        for(int i = 0; i < count; i++){
+            int fd = events[i].data.fd;
+            // Look up the handler now rather than storing it in the event, in case an earlier event in this batch removed it
+            pthread_mutex_lock(&sourcemutex);
+            eventsource source = sources[fd];
+            pthread_mutex_unlock(&sourcemutex);
+            if(source.handler)
+                source.handler(source.context, events[i].events);
+        }
+    }
+    running = 0;
+}
+
+void eventloop_stop(){
+    running = 0;
+    if(wakefd >= 0){
+        uint64_t count = 1;
+        write(wakefd, &count, sizeof(count));
+    }
+}
+
+int eventloop_isthread(){
+    return running && pthread_equal(pthread_self(), loopthread);
+}
+
+int eventloop_add(int fd, uint32_t events, eventhandler handler, void* context){
+    if(fd < 0 || fd >= SOURCE_MAX){
+        ckb_err("File descriptor %d out of range\n", fd);
+        return -1;
+    }
+    pthread_mutex_lock(&sourcemutex);
+    int existing = sources[fd].handler != 0;
+    sources[fd].handler = handler;
+    sources[fd].context = context;
+    pthread_mutex_unlock(&sourcemutex);
+    struct epoll_event event = { .events = events, .data.fd = fd };
+    if(epoll_ctl(epollfd, existing ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &event)){
+        ckb_err("Failed to add fd %d to event loop: %s\n", fd, strerror(errno));
+        pthread_mutex_lock(&sourcemutex);
+        sources[fd].handler = 0;
+        pthread_mutex_unlock(&sourcemutex);
+        return -1;
+    }
+    return 0;
+}
+
+int eventloop_rearm(int fd, uint32_t events){
+    struct epoll_event event = { .events = events, .data.fd = fd };
+    return epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event);
+}
+
+void eventloop_del(int fd){
+    if(fd < 0 || fd >= SOURCE_MAX)
+        return;
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, 0);
+    pthread_mutex_lock(&sourcemutex);
+    sources[fd].handler = 0;
+    sources[fd].context = 0;
+    pthread_mutex_unlock(&sourcemutex);
+}
+
+void eventloop_work(void (*run)(void*), void* context){
+    job* newjob = malloc(sizeof(job));
+    newjob->run = run;
+    newjob->context = context;
+    newjob->next = 0;
+    pthread_mutex_lock(&jobmutex);
+    if(lastjob)
+        lastjob->next = newjob;
+    else
+        jobs = newjob;
+    lastjob = newjob;
+    queued++;
+    if(queued > idle && workers < WORKER_MAX){
+        pthread_t thread;
+        if(pthread_create(&thread, 0, worker, 0))
+            ckb_err("Failed to create worker thread\n");
+        else {
+            pthread_detach(thread);
+            workers++;
+        }
+    }
+    pthread_cond_signal(&jobcond);
+    pthread_mutex_unlock(&jobmutex);
+}
+
+#endif  // OS_LINUX
@@ -0,0 +1,43 @@
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include "includes.h"
+
+// Optional single-threaded event loop (Linux only, enabled with --eventloop).
+// Instead of three threads per device, one epoll loop handles the command FIFOs, USB handles, uinput LED events, and the udev monitor.
+// Device commands and indicator updates, which wait on USB transfers, are handed off to a pool of worker threads so that the
+// loop itself never blocks. The pool grows as needed, so one device's slow command doesn't stall the others.
+
+#ifdef OS_LINUX
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+// Whether the event loop is in use. Set before calling usbmain.
+extern int eventloop_enabled;
+
+// Called when a registered file descriptor is ready. events is a set of EPOLL flags.
+typedef void (*eventhandler)(void* context, uint32_t events);
+
+// Creates the epoll instance. Returns 0 on success.
+int eventloop_init();
+// Runs the loop on the calling thread until eventloop_stop() is called.
+void eventloop_run();
+void eventloop_stop();
+// Returns nonzero if called from the event loop thread.
+int eventloop_isthread();
+
+// Adds a file descriptor to the loop, or changes its settings if it's already there. Returns 0 on success.
+// The handler is called on the event loop thread. Use EPOLLONESHOT to keep it from being called again until the descriptor is re-armed.
+int eventloop_add(int fd, uint32_t events, eventhandler handler, void* context);
+// Re-arms a descriptor added with EPOLLONESHOT. Returns 0 on success.
+int eventloop_rearm(int fd, uint32_t events);
+// Removes a file descriptor. Must be called before it's closed.
+void eventloop_del(int fd);
+
+// Runs a job on the worker pool, starting a new worker if they're all busy.
+void eventloop_work(void (*job)(void*), void* context);
+
+#endif  // OS_LINUX
+
+#endif  // EVENTLOOP_H
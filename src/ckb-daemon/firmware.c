@@ -12,12 +12,8 @@ int getfwversion(usbdevice* kb){
     // Ask board for firmware info
     uchar data_pkt[MSG_SIZE] = { 0x0e, 0x01, 0 };
     uchar in_pkt[MSG_SIZE];
-    if(!usbrecv(kb, data_pkt, in_pkt))
+    if(!usbrecvbatch(kb, data_pkt, in_pkt, 1, 2))
         return -1;
-    if(in_pkt[0] != 0x0e || in_pkt[1] != 0x01){
-        ckb_err("Bad input header\n");
-        return -1;
-    }
     short vendor, product, version, bootloader;
     // Copy the vendor ID, product ID, version, and poll rate from the firmware data
     memcpy(&version, in_pkt + 8, 2);
@@ -0,0 +1,115 @@
+#include "devnode.h"
+#include "frame.h"
+#include "keymap.h"
+#include <sched.h>
+#include <stddef.h>
+
+// Same access as the cmd node, since anyone who can write one can write the other
+#define S_GID_READWRITE (gid >= 0 ? S_CUSTOM : S_READWRITE)
+
+// The daemon doesn't map the file itself. A client may truncate it at any time, and touching a mapping past the end of
+// the file raises SIGBUS; pread just comes up short instead.
+
+static int _mkframenode(usbdevice* kb){
+    if(kb->framefd)
+        return 0;
+    int index = DEV_INDEX(kb);
+    char path[strlen(devpath) + 10];
+    snprintf(path, sizeof(path), "%s%d/frame", devpath, index);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, S_GID_READWRITE);
+    if(fd < 0){
+        ckb_warn("Unable to create %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    fchmod(fd, S_GID_READWRITE);
+    if(gid >= 0)
+        fchown(fd, 0, gid);
+
+    // Fill in the LED name table. The first key name for each LED is used.
+    ckbframe* frame = calloc(1, sizeof(ckbframe));
+    for(int i = 0; i < N_KEYS_EXTENDED; i++){
+        int led = keymap[i].led;
+        if(led < 0 || led >= FRAME_LEDS || !keymap[i].name || frame->names[led][0])
+            continue;
+        strncpy(frame->names[led], keymap[i].name, FRAME_NAME_LEN - 1);
+    }
+    // Start with the current lighting
+    lighting* light = &kb->profile->currentmode->light;
+    memcpy(frame->r, light->r, FRAME_LEDS);
+    memcpy(frame->g, light->g, FRAME_LEDS);
+    memcpy(frame->b, light->b, FRAME_LEDS);
+    frame->ledcount = FRAME_LEDS;
+    frame->namelen = FRAME_NAME_LEN;
+    frame->version = FRAME_VERSION;
+    // Write the magic number last, so that a client mapping the file early doesn't see a half-initialized header
+    uint32_t magic = FRAME_MAGIC;
+    int ok = pwrite(fd, frame, sizeof(ckbframe), 0) == sizeof(ckbframe)
+            && pwrite(fd, &magic, sizeof(magic), offsetof(ckbframe, magic)) == sizeof(magic);
+    free(frame);
+    if(!ok){
+        ckb_warn("Unable to write %s: %s\n", path, strerror(errno));
+        close(fd);
+        remove(path);
+        return -1;
+    }
+    kb->framefd = fd + 1;
+    return 0;
+}
+
+int mkframenode(usbdevice* kb){
+    euid_guard_start;
+    int res = _mkframenode(kb);
+    euid_guard_stop;
+    return res;
+}
+
+int rmframenode(usbdevice* kb){
+    if(!kb->framefd)
+        return -1;
+    euid_guard_start;
+    close(kb->framefd - 1);
+    kb->framefd = 0;
+    int index = DEV_INDEX(kb);
+    char path[strlen(devpath) + 10];
+    snprintf(path, sizeof(path), "%s%d/frame", devpath, index);
+    int res = remove(path);
+    euid_guard_stop;
+    return res;
+}
+
+int loadframe(usbdevice* kb, usbmode* mode){
+    if(!kb->framefd)
+        return -1;
+    int fd = kb->framefd - 1;
+    // The three planes are next to each other, so they can be read in one go
+    uchar planes[3][FRAME_LEDS];
+    uint32_t seq, seq2;
+    // The client normally finishes writing before sending the command, so this rarely needs more than one try
+    for(int tries = 0; tries < 3; tries++){
+        if(pread(fd, &seq, sizeof(seq), offsetof(ckbframe, seq)) != sizeof(seq))
+            return -1;
+        if(seq & 1){
+            sched_yield();
+            continue;
+        }
+        if(pread(fd, planes, sizeof(planes), offsetof(ckbframe, r)) != sizeof(planes)
+                || pread(fd, &seq2, sizeof(seq2), offsetof(ckbframe, seq)) != sizeof(seq2))
+            return -1;
+        if(seq2 != seq)
+            continue;
+        memcpy(mode->light.r, planes[0], FRAME_LEDS);
+        memcpy(mode->light.g, planes[1], FRAME_LEDS);
+        memcpy(mode->light.b, planes[2], FRAME_LEDS);
+        return 0;
+    }
+    return -1;
+}
+
+void cmd_frame(usbdevice* kb, usbmode* mode, const char* action){
+    if(!strcmp(action, "load"))
+        loadframe(kb, mode);
+    else if(!strcmp(action, "open"))
+        mkframenode(kb);
+    else if(!strcmp(action, "close"))
+        rmframenode(kb);
+}
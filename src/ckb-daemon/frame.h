@@ -0,0 +1,45 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stdint.h>
+#include "includes.h"
+#include "device.h"
+
+// Shared-memory lighting frames.
+// Instead of sending "rgb name:rrggbb ..." for every key, a client may write raw color planes to <devpath>N/frame and send "frame load".
+// The file has the layout below. The client must increment seq before writing the planes (making it odd) and again afterward (making it even).
+
+#define FRAME_MAGIC     0x666b6263  // "ckbf"
+#define FRAME_VERSION   1
+#define FRAME_LEDS      (N_KEYS_HW + N_MOUSE_ZONES_EXTENDED)
+#define FRAME_NAME_LEN  12
+
+typedef struct ckbframe {
+    uint32_t magic;
+    uint32_t version;
+    // Number of LEDs in each color plane
+    uint32_t ledcount;
+    // Length of each name in the table below (including null terminator)
+    uint32_t namelen;
+    // Sequence counter. Odd while the planes are being written.
+    uint32_t seq;
+    uint32_t reserved[3];
+    // Key name for each LED, or empty if unused
+    char names[FRAME_LEDS][FRAME_NAME_LEN];
+    // Color planes, indexed by LED
+    uchar r[FRAME_LEDS];
+    uchar g[FRAME_LEDS];
+    uchar b[FRAME_LEDS];
+} ckbframe;
+
+// Creates the frame node for a device. Does nothing if it already exists. Returns 0 on success.
+int mkframenode(usbdevice* kb);
+// Unmaps and removes the frame node. Returns 0 on success.
+int rmframenode(usbdevice* kb);
+// Copies the current frame into a mode's lighting. Returns 0 on success, or -1 if no consistent frame could be read.
+int loadframe(usbdevice* kb, usbmode* mode);
+
+// Handles the "frame" command (open, close, load)
+void cmd_frame(usbdevice* kb, usbmode* mode, const char* action);
+
+#endif  // FRAME_H
@@ -0,0 +1,101 @@
+#include "hwcache.h"
+
+#ifdef OS_SIM
+const char* const hwcache_path = "/tmp/ckb-cache";
+#elif !defined(OS_MAC)
+const char* const hwcache_path = "/var/cache/ckb";
+#else
+const char* const hwcache_path = "/Library/Caches/ckb";
+#endif
+
+// Bump this if the file layout changes. Changes to hwprofile itself are caught by the size field.
+#define HWCACHE_VERSION 1
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t size;
+    short vendor, product;
+    ushort fwversion;
+    ushort modes;
+    char serial[SERIAL_LEN];
+} hwcacheheader;
+
+// Cache file name for a device. Serial numbers are normally hex digits, but anything else is replaced to keep the path sane.
+static void cachefile(usbdevice* kb, char* path, size_t len){
+    char serial[SERIAL_LEN];
+    int i;
+    for(i = 0; i < SERIAL_LEN - 1 && kb->serial[i]; i++){
+        char c = kb->serial[i];
+        serial[i] = (isalnum(c) || c == '-') ? c : '_';
+    }
+    serial[i] = 0;
+    snprintf(path, len, "%s/%04x-%04x-%s", hwcache_path, (ushort)kb->vendor, (ushort)kb->product, serial);
+}
+
+static void fillheader(usbdevice* kb, hwcacheheader* header, int modes){
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, "ckbh", 4);
+    header->version = HWCACHE_VERSION;
+    header->size = sizeof(hwprofile);
+    header->vendor = kb->vendor;
+    header->product = kb->product;
+    header->fwversion = kb->fwversion;
+    header->modes = modes;
+    memcpy(header->serial, kb->serial, SERIAL_LEN - 1);
+}
+
+int hwcache_load(usbdevice* kb, hwprofile* hw, int modes){
+    // Without a serial number there's nothing to tell two devices of the same model apart
+    if(!kb->serial[0])
+        return -1;
+    char path[strlen(hwcache_path) + SERIAL_LEN + 16];
+    cachefile(kb, path, sizeof(path));
+    FILE* file = fopen(path, "rb");
+    if(!file)
+        return -1;
+    hwcacheheader expected, header;
+    fillheader(kb, &expected, modes);
+    hwprofile* cached = malloc(sizeof(hwprofile));
+    int res = -1;
+    if(fread(&header, sizeof(header), 1, file) == 1
+            && !memcmp(&header, &expected, sizeof(header))
+            && fread(cached, sizeof(hwprofile), 1, file) == 1
+            && !memcmp(cached->id, hw->id, sizeof(usbid) * (modes + 1))){
+        memcpy(hw, cached, sizeof(hwprofile));
+        res = 0;
+    }
+    free(cached);
+    fclose(file);
+    return res;
+}
+
+void hwcache_save(usbdevice* kb, const hwprofile* hw, int modes){
+    if(!kb->serial[0])
+        return;
+    if(mkdir(hwcache_path, S_IRWXU) && errno != EEXIST){
+        ckb_warn("Unable to create %s: %s\n", hwcache_path, strerror(errno));
+        return;
+    }
+    char path[strlen(hwcache_path) + SERIAL_LEN + 16];
+    cachefile(kb, path, sizeof(path));
+    // Write to a temporary file first so that a crash can't leave a half-written cache behind
+    char tmppath[sizeof(path) + 4];
+    snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+    int fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    FILE* file = fd >= 0 ? fdopen(fd, "wb") : 0;
+    if(!file){
+        if(fd >= 0)
+            close(fd);
+        ckb_warn("Unable to write %s: %s\n", tmppath, strerror(errno));
+        return;
+    }
+    hwcacheheader header;
+    fillheader(kb, &header, modes);
+    int ok = fwrite(&header, sizeof(header), 1, file) == 1
+            && fwrite(hw, sizeof(hwprofile), 1, file) == 1;
+    if(fclose(file) || !ok || rename(tmppath, path)){
+        ckb_warn("Unable to write %s: %s\n", path, strerror(errno));
+        remove(tmppath);
+    }
+}
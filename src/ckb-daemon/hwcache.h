@@ -0,0 +1,20 @@
+#ifndef HWCACHE_H
+#define HWCACHE_H
+
+#include "includes.h"
+
+// On-disk cache of hardware profiles, so a device that's plugged back in (or found again after a restart) doesn't have to
+// send its whole profile over USB. Each device gets one file, named after its serial number. An entry is only used if the
+// firmware version and every profile/mode ID (including the modification stamp) still match what the device reports,
+// so a profile saved from another computer is always loaded from the hardware again.
+
+// Where the cache files are kept
+extern const char* const hwcache_path;
+
+// Looks for a cached profile matching the IDs in hw->id[0...modes]. If there is one, its names, lighting, and DPI are
+// copied into hw and 0 is returned. Returns -1 if the profile has to be loaded from the device.
+int hwcache_load(usbdevice* kb, hwprofile* hw, int modes);
+// Saves a profile after it's been loaded from or written to the device. Failures are logged and otherwise ignored.
+void hwcache_save(usbdevice* kb, const hwprofile* hw, int modes);
+
+#endif  // HWCACHE_H
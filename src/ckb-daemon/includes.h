@@ -8,6 +8,8 @@
 #include <fcntl.h>
 #include <iconv.h>
 #include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -54,6 +56,14 @@ typedef unsigned short ushort;
 #define ckb_info_fn(fmt, file, line, args...)   fprintf(ckb_s_out, "[I] " fmt, ## args)
 #define ckb_info(fmt, args...)                  fprintf(ckb_s_out, "[I] " fmt, ## args)
 
+// FNV-1a string hash, used for name lookup tables
+static inline unsigned strhash(const char* str){
+    unsigned hash = 2166136261u;
+    while(*str)
+        hash = (hash ^ (uchar)*str++) * 16777619u;
+    return hash;
+}
+
 // Timespec utilities
 void timespec_add(struct timespec* timespec, long nanoseconds);
 #define timespec_gt(left, right)    ((left).tv_sec > (right).tv_sec || ((left).tv_sec == (right).tv_sec && (left).tv_nsec > (right).tv_nsec))
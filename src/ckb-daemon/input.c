@@ -1,116 +1,208 @@
 #include "device.h"
+#include "effect.h"
 #include "input.h"
+#include "latency.h"
+#include "macro.h"
 #include "notify.h"
 
 int macromask(const uchar* key1, const uchar* key2){
     // Scan a macro against key input. Return 0 if any of them don't match
-    for(int i = 0; i < N_KEYBYTES_INPUT; i++){
-        if((key1[i] & key2[i]) != key2[i])
+    for(int i = 0; i < N_KEYWORDS_INPUT; i++){
+        uint64_t combo = keyword(key2, i);
+        if((keyword(key1, i) & combo) != combo)
             return 0;
     }
     return 1;
 }
 
-static void inputupdate_keys(usbdevice* kb){
-    usbmode* mode = kb->profile->currentmode;
-    binding* bind = &mode->bind;
+// Source of snapshot generation numbers. Shared by all devices, so a generation is never reused.
+static unsigned long bindgeneration = 0;
+
+// Builds a snapshot of a mode's bindings. The snapshot, its macros, their actions, and the key index share one allocation.
+static bindsnapshot* makesnapshot(const usbmode* mode){
+    const binding* bind = &mode->bind;
+    // Count the actions and the macros using each key
+    int keystart[N_KEYS_INPUT + 1];
+    memset(keystart, 0, sizeof(keystart));
+    int actioncount = 0;
+    for(int i = 0; i < bind->macrocount; i++){
+        const uchar* combo = bind->macros[i].combo;
+        for(int key = 0; key < N_KEYS_INPUT; key++){
+            if(combo[key / 8] & (1 << (key % 8)))
+                keystart[key + 1]++;
+        }
+        actioncount += bind->macros[i].actioncount;
+    }
+    for(int key = 0; key < N_KEYS_INPUT; key++)
+        keystart[key + 1] += keystart[key];
+    bindsnapshot* snap = malloc(sizeof(bindsnapshot)
+                                + bind->macrocount * sizeof(keymacro)
+                                + actioncount * sizeof(macroaction)
+                                + keystart[N_KEYS_INPUT] * sizeof(ushort));
+    keymacro* macros = (keymacro*)(snap + 1);
+    macroaction* actions = (macroaction*)(macros + bind->macrocount);
+    ushort* macroindex = (ushort*)(actions + actioncount);
+    memcpy(snap->base, bind->base, sizeof(snap->base));
+    memcpy(snap->notify, mode->notify, sizeof(snap->notify));
+    memcpy(snap->keystart, keystart, sizeof(keystart));
+    // Copy the macros. Each key's list is in macro order.
+    int next[N_KEYS_INPUT];
+    memcpy(next, keystart, sizeof(next));
+    for(int i = 0; i < bind->macrocount; i++){
+        const keymacro* macro = bind->macros + i;
+        memcpy(macros + i, macro, sizeof(keymacro));
+        macros[i].actions = actions;
+        memcpy(actions, macro->actions, macro->actioncount * sizeof(macroaction));
+        actions += macro->actioncount;
+        for(int key = 0; key < N_KEYS_INPUT; key++){
+            if(macro->combo[key / 8] & (1 << (key % 8)))
+                macroindex[next[key]++] = i;
+        }
+    }
+    snap->macros = macros;
+    snap->macrocount = bind->macrocount;
+    snap->macroindex = macroindex;
+    snap->generation = __atomic_add_fetch(&bindgeneration, 1, __ATOMIC_RELAXED);
+    return snap;
+}
+
+// Queues any macros triggered by the current input (see macro.h). Returns nonzero if at least one was triggered.
+static int inputupdate_macros(usbdevice* kb, const bindsnapshot* bind){
     usbinput* input = &kb->input;
-    // Don't do anything if the state hasn't changed
-    if(!memcmp(input->prevkeys, input->keys, N_KEYBYTES_INPUT))
-        return;
-    // Look for macros matching the current state
-    int macrotrigger = 0;
-    if(kb->active){
+    if(input->macrogen != bind->generation){
+        // New bindings. Any macro that already matched the previous input counts as triggered, so that it doesn't go off again.
+        // Macros from the old bindings can't be matched up with their keys any more, so stop the ones that only play while held.
+        macro_releaseall(kb);
+        memset(input->triggered, 0, sizeof(input->triggered));
         for(int i = 0; i < bind->macrocount; i++){
-            keymacro* macro = &bind->macros[i];
+            if(macromask(input->prevkeys, bind->macros[i].combo))
+                input->triggered[i / 64] |= 1ULL << (i % 64);
+        }
+        input->macrogen = bind->generation;
+    }
+    // A macro can only start or stop matching when one of its keys changes, so only those (plus any that are already triggered) need to be checked.
+    int words = (bind->macrocount + 63) / 64;
+    uint64_t candidates[MACRO_MAX / 64];
+    memcpy(candidates, input->triggered, sizeof(candidates));
+    for(int w = 0; w < N_KEYWORDS_INPUT; w++){
+        uint64_t changed = keyword(input->keys, w) ^ keyword(input->prevkeys, w);
+        while(changed){
+            int key = w * 64 + __builtin_ctzll(changed);
+            changed &= changed - 1;
+            for(int j = bind->keystart[key]; j < bind->keystart[key + 1]; j++){
+                int i = bind->macroindex[j];
+                candidates[i / 64] |= 1ULL << (i % 64);
+            }
+        }
+    }
+    // Check the candidates in order
+    int macrotrigger = 0;
+    for(int w = 0; w < words; w++){
+        uint64_t bits = candidates[w];
+        while(bits){
+            int i = w * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+            if(i >= bind->macrocount)
+                break;
+            const keymacro* macro = &bind->macros[i];
+            uint64_t bit = 1ULL << (i % 64);
             if(macromask(input->keys, macro->combo)){
-                if(!macro->triggered){
+                if(!(input->triggered[w] & bit)){
                     macrotrigger = 1;
-                    macro->triggered = 1;
-                    // Send events for each keypress in the macro
-                    for(int a = 0; a < macro->actioncount; a++){
-                        macroaction* action = macro->actions + a;
-                        if(action->rel_x != 0 || action->rel_y != 0)
-                            os_mousemove(kb, action->rel_x, action->rel_y);
-                        else
-                            os_keypress(kb, action->scan, action->down);
-                    }
+                    input->triggered[w] |= bit;
+                    macro_play(kb, macro, bind->generation, i);
                 }
-            } else {
-                macro->triggered = 0;
+            } else if(input->triggered[w] & bit){
+                input->triggered[w] &= ~bit;
+                macro_release(kb, bind->generation, i);
             }
         }
     }
-    // Make a list of keycodes to send. Rearrange them so that modifier keydowns always come first
-    // and modifier keyups always come last. This ensures that shortcut keys will register properly
-    // even if both keydown events happen at once.
-    // N_KEYS + 4 is used because the volume wheel generates keydowns and keyups at the same time
-    // (it's currently impossible to press all four at once, but safety first)
-    int events[N_KEYS_INPUT + 4];
-    int modcount = 0, keycount = 0, rmodcount = 0;
-    for(int byte = 0; byte < N_KEYBYTES_INPUT; byte++){
-        char oldb = input->prevkeys[byte], newb = input->keys[byte];
-        if(oldb == newb)
-            continue;
-        for(int bit = 0; bit < 8; bit++){
-            int keyindex = byte * 8 + bit;
+    return macrotrigger;
+}
+
+// Returns nonzero if any keys changed
+static int inputupdate_keys(usbdevice* kb){
+    usbinput* input = &kb->input;
+    // Don't do anything if the state hasn't changed
+    if(!memcmp(input->prevkeys, input->keys, N_KEYBYTES_INPUT))
+        return 0;
+    // Bindings and notifications only apply to active devices. Without a snapshot, the mode uses the defaults.
+    const bindsnapshot* bind = kb->active ? __atomic_load_n(&kb->profile->currentmode->snapshot, __ATOMIC_ACQUIRE) : 0;
+    // Look for macros matching the current state
+    int macrotrigger = 0;
+    if(bind)
+        macrotrigger = inputupdate_macros(kb, bind);
+    else if(input->macrogen){
+        macro_releaseall(kb);
+        input->macrogen = 0;
+    }
+    // Make lists of keycodes to send. Modifier keydowns are sent first and modifier keyups are sent last. This ensures that
+    // shortcut keys will register properly even if both keydown events happen at once.
+    // Regular keys are stored as positive for keydown, negative for keyup. Add 1 to the scancode because A is zero on OSX.
+    // They get twice the space because the volume wheel and the mouse wheel generate a keydown and keyup at the same time.
+    int moddown[N_KEYS_INPUT], keys[N_KEYS_INPUT * 2], modup[N_KEYS_INPUT];
+    int moddowncount = 0, keycount = 0, modupcount = 0;
+    for(int word = 0; word < N_KEYWORDS_INPUT; word++){
+        uint64_t now = keyword(input->keys, word);
+        uint64_t changed = now ^ keyword(input->prevkeys, word);
+        while(changed){
+            int bit = __builtin_ctzll(changed);
+            changed &= changed - 1;
+            int keyindex = word * 64 + bit;
             if(keyindex >= N_KEYS_INPUT)
                 break;
             const key* map = keymap + keyindex;
-            int scancode = (kb->active) ? bind->base[keyindex] : map->scan;
-            char mask = 1 << bit;
-            char old = oldb & mask, new = newb & mask;
-            // If the key state changed, send it to the input device
-            if(old != new){
-                // Don't echo a key press if a macro was triggered or if there's no scancode associated
-                if(!macrotrigger && !(scancode & SCAN_SILENT)){
-                    if(IS_MOD(scancode)){
-                        if(new){
-                            // Modifier down: Add to the end of modifier keys
-                            for(int i = keycount + rmodcount; i > 0; i--)
-                                events[modcount + i] = events[modcount + i - 1];
-                            // Add 1 to the scancode because A is zero on OSX
-                            // Positive code = keydown, negative code = keyup
-                            events[modcount++] = scancode + 1;
-                        } else {
-                            // Modifier up: Add to the end of everything
-                            events[modcount + keycount + rmodcount++] = -(scancode + 1);
-                        }
-                    } else {
-                        // Regular keypress: add to the end of regular keys
-                        for(int i = rmodcount; i > 0; i--)
-                            events[modcount + keycount + i] = events[modcount + keycount + i - 1];
-                        events[modcount + keycount++] = new ? (scancode + 1) : -(scancode + 1);
-                        // The volume wheel and the mouse wheel don't generate keyups, so create them automatically
+            int scancode = bind ? bind->base[keyindex] : map->scan;
+            int new = (now >> bit) & 1;
+            // Don't echo a key press if a macro was triggered or if there's no scancode associated
+            if(!macrotrigger && !(scancode & SCAN_SILENT)){
+                if(IS_MOD(scancode)){
+                    if(new)
+                        moddown[moddowncount++] = scancode;
+                    else
+                        modup[modupcount++] = scancode;
+                } else {
+                    keys[keycount++] = new ? (scancode + 1) : -(scancode + 1);
+                    // The volume wheel and the mouse wheel don't generate keyups, so create them automatically
 #define IS_WHEEL(scan, kb)  (((scan) == KEY_VOLUMEUP || (scan) == KEY_VOLUMEDOWN || (scan) == BTN_WHEELUP || (scan) == BTN_WHEELDOWN) && !IS_K65(kb))
-                        if(new && IS_WHEEL(map->scan, kb)){
-                            for(int i = rmodcount; i > 0; i--)
-                                events[modcount + keycount + i] = events[modcount + keycount + i - 1];
-                            events[modcount + keycount++] = -(scancode + 1);
-                            input->keys[byte] &= ~mask;
-                        }
+                    if(new && IS_WHEEL(map->scan, kb)){
+                        keys[keycount++] = -(scancode + 1);
+                        CLEAR_KEYBIT(input->keys, keyindex);
                     }
                 }
-                // Print notifications if desired
-                if(kb->active){
-                    for(int notify = 0; notify < OUTFIFO_MAX; notify++){
-                        if(mode->notify[notify][byte] & mask){
-                            nprintkey(kb, notify, keyindex, new);
-                            // Wheels doesn't generate keyups
-                            if(new && IS_WHEEL(map->scan, kb))
-                                nprintkey(kb, notify, keyindex, 0);
-                        }
+            }
+            // Native effects see the physical key, regardless of bindings
+            if(kb->effect){
+                effect_keypress(kb, keyindex, new);
+                if(new && IS_WHEEL(map->scan, kb))
+                    effect_keypress(kb, keyindex, 0);
+            }
+            // Print notifications if desired
+            if(bind){
+                int byte = keyindex / 8;
+                uchar mask = 1 << (keyindex % 8);
+                for(int notify = 0; notify < OUTFIFO_MAX; notify++){
+                    if(bind->notify[notify][byte] & mask){
+                        nprintkey(kb, notify, keyindex, new);
+                        // Wheels doesn't generate keyups
+                        if(new && IS_WHEEL(map->scan, kb))
+                            nprintkey(kb, notify, keyindex, 0);
                     }
                 }
             }
         }
     }
     // Process all queued keypresses
-    int totalkeys = modcount + keycount + rmodcount;
-    for(int i = 0; i < totalkeys; i++){
-        int scancode = events[i];
+    for(int i = 0; i < moddowncount; i++)
+        os_keypress(kb, moddown[i], 1);
+    for(int i = 0; i < keycount; i++){
+        int scancode = keys[i];
         os_keypress(kb, (scancode < 0 ? -scancode : scancode) - 1, scancode > 0);
     }
+    for(int i = 0; i < modupcount; i++)
+        os_keypress(kb, modup[i], 0);
+    return 1;
 }
 
 void inputupdate(usbdevice* kb){
@@ -122,16 +214,25 @@ void inputupdate(usbdevice* kb){
             || !kb->profile)
         return;
     // Process key/button input
-    inputupdate_keys(kb);
+    int changed = inputupdate_keys(kb);
+    if(latency_enabled)
+        kb->latency.macro = latency_now();
     // Process mouse movement
     usbinput* input = &kb->input;
     if(input->rel_x != 0 || input->rel_y != 0){
         os_mousemove(kb, input->rel_x, input->rel_y);
         input->rel_x = input->rel_y = 0;
+        changed = 1;
     }
     // Finish up
     os_isync(kb);
     memcpy(input->prevkeys, input->keys, N_KEYBYTES_INPUT);
+    if(latency_enabled){
+        // Only reports that generated events count towards latency
+        if(changed)
+            latency_record(kb, latency_now());
+        kb->latency.reap = 0;
+    }
 }
 
 void updateindicators_kb(usbdevice* kb, int force){
@@ -180,42 +281,65 @@ void freebind(binding* bind){
     memset(bind, 0, sizeof(*bind));
 }
 
+void publishbind(usbdevice* kb){
+    usbprofile* profile = kb->profile;
+    if(!profile)
+        return;
+    bindsnapshot* old[MODE_COUNT];
+    int oldcount = 0;
+    for(int i = 0; i < MODE_COUNT; i++){
+        usbmode* mode = profile->mode + i;
+        if(!mode->binddirty)
+            continue;
+        mode->binddirty = 0;
+        bindsnapshot* prev = __atomic_exchange_n(&mode->snapshot, makesnapshot(mode), __ATOMIC_ACQ_REL);
+        if(prev)
+            old[oldcount++] = prev;
+    }
+    if(!oldcount)
+        return;
+    // The input thread holds imutex while handling a report, so once it's been unlocked nothing can be using the old snapshots
+    pthread_mutex_lock(imutex(kb));
+    pthread_mutex_unlock(imutex(kb));
+    for(int i = 0; i < oldcount; i++)
+        free(old[i]);
+}
+
+void freesnapshot(usbmode* mode){
+    free(mode->snapshot);
+    mode->snapshot = 0;
+}
+
 void cmd_bind(usbdevice* kb, usbmode* mode, int dummy, int keyindex, const char* to){
     if(keyindex >= N_KEYS_INPUT)
         return;
     // Find the key to bind to
     int tocode = 0;
     if(sscanf(to, "#x%ux", &tocode) != 1 && sscanf(to, "#%u", &tocode) == 1 && tocode < N_KEYS_INPUT){
-        pthread_mutex_lock(imutex(kb));
         mode->bind.base[keyindex] = tocode;
-        pthread_mutex_unlock(imutex(kb));
+        mode->binddirty = 1;
         return;
     }
     // If not numeric, look it up
-    for(int i = 0; i < N_KEYS_INPUT; i++){
-        if(keymap[i].name && !strcmp(to, keymap[i].name)){
-            pthread_mutex_lock(imutex(kb));
-            mode->bind.base[keyindex] = keymap[i].scan;
-            pthread_mutex_unlock(imutex(kb));
-            return;
-        }
+    int i = keymap_find(to);
+    if(i >= 0 && i < N_KEYS_INPUT){
+        mode->bind.base[keyindex] = keymap[i].scan;
+        mode->binddirty = 1;
     }
 }
 
 void cmd_unbind(usbdevice* kb, usbmode* mode, int dummy, int keyindex, const char* to){
     if(keyindex >= N_KEYS_INPUT)
         return;
-    pthread_mutex_lock(imutex(kb));
     mode->bind.base[keyindex] = KEY_UNBOUND;
-    pthread_mutex_unlock(imutex(kb));
+    mode->binddirty = 1;
 }
 
 void cmd_rebind(usbdevice* kb, usbmode* mode, int dummy, int keyindex, const char* to){
     if(keyindex >= N_KEYS_INPUT)
         return;
-    pthread_mutex_lock(imutex(kb));
     mode->bind.base[keyindex] = keymap[keyindex].scan;
-    pthread_mutex_unlock(imutex(kb));
+    mode->binddirty = 1;
 }
 
 static void _cmd_macro(usbmode* mode, const char* keys, const char* assignment){
@@ -246,12 +370,10 @@ static void _cmd_macro(usbmode* mode, const char* keys, const char* assignment){
             empty = 0;
         } else {
             // Find this key in the keymap
-            for(unsigned i = 0; i < N_KEYS_INPUT; i++){
-                if(keymap[i].name && !strcmp(keyname, keymap[i].name)){
-                    macro.combo[i / 8] |= 1 << (i % 8);
-                    empty = 0;
-                    break;
-                }
+            int i = keymap_find(keyname);
+            if(i >= 0 && i < N_KEYS_INPUT){
+                macro.combo[i / 8] |= 1 << (i % 8);
+                empty = 0;
             }
         }
         if(keys[position += field] == '+')
@@ -268,30 +390,42 @@ static void _cmd_macro(usbmode* mode, const char* keys, const char* assignment){
     // Allocate a buffer for them
     macro.actions = calloc(count, sizeof(macroaction));
     macro.actioncount = 0;
-    // Scan the actions
+    // Scan the actions. Each one may be followed by =<ms> to wait before the next.
     position = 0;
     field = 0;
-    while(position < right && sscanf(assignment + position, "%11[^,]%n", keyname, &field) == 1){
-        if(!strcmp(keyname, "clear"))
+    char action[24];
+    while(position < right && sscanf(assignment + position, "%23[^,]%n", action, &field) == 1){
+        if(!strcmp(action, "clear"))
             break;
-        int down = (keyname[0] == '+');
-        if(down || keyname[0] == '-'){
+        if(!strcmp(action, "repeat"))
+            macro.repeat = 1;
+        int delay = 0;
+        char* equals = strchr(action, '=');
+        if(equals){
+            *equals = 0;
+            if(sscanf(equals + 1, "%d", &delay) != 1 || delay < 0)
+                delay = 0;
+            else if(delay > 65535)
+                delay = 65535;
+        }
+        int down = (action[0] == '+');
+        if(down || action[0] == '-'){
             int keycode;
-            if((sscanf(keyname + 1, "#%d", &keycode) && keycode >= 0 && keycode < N_KEYS_INPUT)
-                      || (sscanf(keyname + 1, "#x%x", &keycode) && keycode >= 0 && keycode < N_KEYS_INPUT)){
+            if((sscanf(action + 1, "#%d", &keycode) && keycode >= 0 && keycode < N_KEYS_INPUT)
+                      || (sscanf(action + 1, "#x%x", &keycode) && keycode >= 0 && keycode < N_KEYS_INPUT)){
                 // Set a key numerically
                 macro.actions[macro.actioncount].scan = keymap[keycode].scan;
                 macro.actions[macro.actioncount].down = down;
+                macro.actions[macro.actioncount].delay = delay;
                 macro.actioncount++;
             } else {
                 // Find this key in the keymap
-                for(unsigned i = 0; i < N_KEYS_INPUT; i++){
-                    if(keymap[i].name && !strcmp(keyname + 1, keymap[i].name)){
-                        macro.actions[macro.actioncount].scan = keymap[i].scan;
-                        macro.actions[macro.actioncount].down = down;
-                        macro.actioncount++;
-                        break;
-                    }
+                int i = keymap_find(action + 1);
+                if(i >= 0 && i < N_KEYS_INPUT){
+                    macro.actions[macro.actioncount].scan = keymap[i].scan;
+                    macro.actions[macro.actioncount].down = down;
+                    macro.actions[macro.actioncount].delay = delay;
+                    macro.actioncount++;
                 }
             }
         }
@@ -325,7 +459,6 @@ static void _cmd_macro(usbmode* mode, const char* keys, const char* assignment){
 }
 
 void cmd_macro(usbdevice* kb, usbmode* mode, const int notifynumber, const char* keys, const char* assignment){
-    pthread_mutex_lock(imutex(kb));
     _cmd_macro(mode, keys, assignment);
-    pthread_mutex_unlock(imutex(kb));
+    mode->binddirty = 1;
 }
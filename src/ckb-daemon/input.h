@@ -14,12 +14,18 @@ void inputupdate(usbdevice* kb);
 // Read indicator LED state and send it back to the keyboard if needed. Lock dmutex first.
 void updateindicators_kb(usbdevice* kb, int force);
 
-// Initializes key bindings for a device. Lock imutex first.
+// Initializes key bindings for a mode.
 void initbind(binding* bind);
-// Frees key binding data for a device. Lock imutex first.
+// Frees key binding data for a mode.
 void freebind(binding* bind);
-
-// Note: unlike most commands, bind commands will lock/unlock the device's imutex
+// Publishes new snapshots for any modes whose bindings or key notifications have changed (see usbmode.binddirty),
+// then frees the old ones once the input thread is done with them. Lock dmutex first, but not imutex.
+void publishbind(usbdevice* kb);
+// Frees a mode's published snapshot. Lock imutex first.
+void freesnapshot(usbmode* mode);
+
+// Note: bind, macro, and notify commands only change the command thread's copy of the bindings. They take effect on the
+// input thread after publishbind is called.
 // Binds a key
 void cmd_bind(usbdevice* kb, usbmode* mode, int dummy, int keyindex, const char* to);
 // Unbinds a key
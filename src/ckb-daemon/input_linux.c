@@ -1,8 +1,11 @@
 #include "command.h"
 #include "device.h"
+#include "eventloop.h"
 #include "input.h"
 
-#ifdef OS_LINUX
+#if defined(OS_LINUX) && !defined(OS_SIM)
+
+#include <sys/uio.h>
 
 // Xorg has buggy handling of combined keyboard + mouse devices, so instead we should create two separate devices:
 // One for keyboard events, one for mouse.
@@ -46,9 +49,59 @@ int uinputopen(struct uinput_user_dev* indev, int mouse){
     return fd + 1;
 }
 
+// Events are collected here as they're generated and written all at once by os_isync
+#define UEVENT_MAX  64
+typedef struct {
+    struct input_event events[UEVENT_MAX];
+    int count;
+    // Whether any events were written since the last SYN_REPORT
+    char dirty;
+} ueventbuf;
+// One for each uinput device, allocated by os_inputopen the first time a slot is used and kept in devslot.inputdata
+typedef struct {
+    ueventbuf kb, mouse;
+} ueventslot;
+#define UEVENT_SLOT(kb) ((ueventslot*)DEV_SLOT(kb)->inputdata)
+
+// Writes buffered events to a uinput device, optionally followed by SYN_REPORT
+static void uevent_flush(int fd, ueventbuf* buf, int sync){
+    static const struct input_event syn = { .type = EV_SYN, .code = SYN_REPORT };
+    struct iovec iov[2] = {
+        { buf->events, buf->count * sizeof(struct input_event) },
+        { (void*)&syn, sizeof(syn) }
+    };
+    if(buf->count == 0 && !sync)
+        return;
+    if(buf->count == 0)
+        // Only the SYN needs to be written
+        iov[0] = iov[1];
+    if(writev(fd, iov, (sync && buf->count) ? 2 : 1) <= 0)
+        ckb_warn("uinput write failed: %s\n", strerror(errno));
+    buf->count = 0;
+    buf->dirty = !sync;
+}
+
+static void uevent_add(int fd, ueventbuf* buf, int type, int code, int value){
+    if(buf->count == UEVENT_MAX)
+        // Buffer is full; write what's there now and sync later
+        uevent_flush(fd, buf, 0);
+    struct input_event* event = buf->events + buf->count++;
+    memset(event, 0, sizeof(*event));
+    event->type = type;
+    event->code = code;
+    event->value = value;
+    buf->dirty = 1;
+}
+
 int os_inputopen(usbdevice* kb){
     // Create the new input device
-    int index = INDEX_OF(kb, keyboard);
+    int index = DEV_INDEX(kb);
+    devslot* slot = DEV_SLOT(kb);
+    if(!slot->inputdata)
+        slot->inputdata = malloc(sizeof(ueventslot));
+    ueventslot* events = slot->inputdata;
+    events->kb.count = events->mouse.count = 0;
+    events->kb.dirty = events->mouse.dirty = 0;
     struct uinput_user_dev indev;
     memset(&indev, 0, sizeof(indev));
     snprintf(indev.name, UINPUT_MAX_NAME_SIZE, "ckb%d: %s", index, kb->name);
@@ -71,82 +124,55 @@ void os_inputclose(usbdevice* kb){
     if(kb->uinput_kb <= 0 || kb->uinput_mouse <= 0)
         return;
     // Set all keys released
-    struct input_event event;
-    memset(&event, 0, sizeof(event));
-    event.type = EV_KEY;
+    ueventslot* events = UEVENT_SLOT(kb);
+    int kbfd = kb->uinput_kb - 1, mousefd = kb->uinput_mouse - 1;
     for(int key = 0; key < KEY_CNT; key++){
-        event.code = key;
-        if(write(kb->uinput_kb - 1, &event, sizeof(event)) <= 0)
-            ckb_warn("uinput write failed: %s\n", strerror(errno));
-        if(write(kb->uinput_mouse - 1, &event, sizeof(event)) <= 0)
-            ckb_warn("uinput write failed: %s\n", strerror(errno));
+        uevent_add(kbfd, &events->kb, EV_KEY, key, 0);
+        uevent_add(mousefd, &events->mouse, EV_KEY, key, 0);
     }
-    event.type = EV_SYN;
-    event.code = SYN_REPORT;
-    if(write(kb->uinput_kb - 1, &event, sizeof(event)) <= 0)
-        ckb_warn("uinput write failed: %s\n", strerror(errno));
-    if(write(kb->uinput_mouse - 1, &event, sizeof(event)) <= 0)
-        ckb_warn("uinput write failed: %s\n", strerror(errno));
+    uevent_flush(kbfd, &events->kb, 1);
+    uevent_flush(mousefd, &events->mouse, 1);
     // Close the keyboard
-    ioctl(kb->uinput_kb - 1, UI_DEV_DESTROY);
-    close(kb->uinput_kb - 1);
+    if(eventloop_enabled)
+        eventloop_del(kbfd);
+    ioctl(kbfd, UI_DEV_DESTROY);
+    close(kbfd);
     kb->uinput_kb = 0;
     // Close the mouse
-    ioctl(kb->uinput_mouse - 1, UI_DEV_DESTROY);
-    close(kb->uinput_mouse - 1);
+    ioctl(mousefd, UI_DEV_DESTROY);
+    close(mousefd);
     kb->uinput_mouse = 0;
 }
 
 void os_keypress(usbdevice* kb, int scancode, int down){
-    struct input_event event;
-    memset(&event, 0, sizeof(event));
-    int is_mouse = 0;
+    ueventslot* events = UEVENT_SLOT(kb);
     if(scancode == BTN_WHEELUP || scancode == BTN_WHEELDOWN){
         // The mouse wheel is a relative axis
         if(!down)
             return;
-        event.type = EV_REL;
-        event.code = REL_WHEEL;
-        event.value = (scancode == BTN_WHEELUP ? 1 : -1);
-        is_mouse = 1;
-    } else {
+        uevent_add(kb->uinput_mouse - 1, &events->mouse, EV_REL, REL_WHEEL, (scancode == BTN_WHEELUP ? 1 : -1));
+    } else if(scancode & SCAN_MOUSE)
         // Mouse buttons and key events are both EV_KEY. The scancodes are already correct, just remove the ckb bit
-        event.type = EV_KEY;
-        event.code = scancode & ~SCAN_MOUSE;
-        event.value = down;
-        is_mouse = !!(scancode & SCAN_MOUSE);
-    }
-    if(write((is_mouse ? kb->uinput_mouse : kb->uinput_kb) - 1, &event, sizeof(event)) <= 0)
-        ckb_warn("uinput write failed: %s\n", strerror(errno));
+        uevent_add(kb->uinput_mouse - 1, &events->mouse, EV_KEY, scancode & ~SCAN_MOUSE, down);
+    else
+        uevent_add(kb->uinput_kb - 1, &events->kb, EV_KEY, scancode, down);
 }
 
 void os_mousemove(usbdevice* kb, int x, int y){
-    struct input_event event;
-    memset(&event, 0, sizeof(event));
-    event.type = EV_REL;
-    if(x != 0){
-        event.code = REL_X;
-        event.value = x;
-        if(write(kb->uinput_mouse - 1, &event, sizeof(event)) <= 0)
-            ckb_warn("uinput write failed: %s\n", strerror(errno));
-    }
-    if(y != 0){
-        event.code = REL_Y;
-        event.value = y;
-        if(write(kb->uinput_mouse - 1, &event, sizeof(event)) <= 0)
-            ckb_warn("uinput write failed: %s\n", strerror(errno));
-    }
+    ueventslot* events = UEVENT_SLOT(kb);
+    if(x != 0)
+        uevent_add(kb->uinput_mouse - 1, &events->mouse, EV_REL, REL_X, x);
+    if(y != 0)
+        uevent_add(kb->uinput_mouse - 1, &events->mouse, EV_REL, REL_Y, y);
 }
 
 void os_isync(usbdevice* kb){
-    struct input_event event;
-    memset(&event, 0, sizeof(event));
-    event.type = EV_SYN;
-    event.code = SYN_REPORT;
-    if(write(kb->uinput_kb - 1, &event, sizeof(event)) <= 0)
-        ckb_warn("uinput write failed: %s\n", strerror(errno));
-    if(write(kb->uinput_mouse - 1, &event, sizeof(event)) <= 0)
-        ckb_warn("uinput write failed: %s\n", strerror(errno));
+    // Write everything generated since the last sync, one call per device. Devices that didn't get any events don't need a SYN.
+    ueventslot* events = UEVENT_SLOT(kb);
+    if(events->kb.dirty)
+        uevent_flush(kb->uinput_kb - 1, &events->kb, 1);
+    if(events->mouse.dirty)
+        uevent_flush(kb->uinput_mouse - 1, &events->mouse, 1);
 }
 
 void* _ledthread(void* ctx){
@@ -173,9 +199,59 @@ void* _ledthread(void* ctx){
     return 0;
 }
 
+typedef struct {
+    usbdevice* kb;
+    // Slot generation when the job was queued (see devjob in usb.c)
+    unsigned long generation;
+} ledjob;
+
+static void ledwork(void* context){
+    ledjob* job = context;
+    usbdevice* kb = job->kb;
+    pthread_mutex_lock(dmutex(kb));
+    if(DEV_SLOT(kb)->generation == job->generation && IS_CONNECTED(kb))
+        kb->vtable->updateindicators(kb, 0);
+    pthread_mutex_unlock(dmutex(kb));
+    free(job);
+}
+
+// Event loop counterpart of _ledthread
+static void led_ready(void* context, uint32_t events){
+    usbdevice* kb = context;
+    int fd = kb->uinput_kb - 1;
+    uchar ileds = kb->hw_ileds;
+    struct input_event event;
+    while(read(fd, &event, sizeof(event)) > 0){
+        if(event.type == EV_LED && event.code < 8){
+            char which = 1 << event.code;
+            if(event.value)
+                ileds |= which;
+            else
+                ileds &= ~which;
+        }
+    }
+    if(events & (EPOLLERR | EPOLLHUP)){
+        eventloop_del(fd);
+        return;
+    }
+    if(kb->hw_ileds == ileds)
+        return;
+    kb->hw_ileds = ileds;
+    // Sending the new state to the device waits on a USB transfer, so leave it to a worker
+    ledjob* job = malloc(sizeof(ledjob));
+    job->kb = kb;
+    job->generation = DEV_SLOT(kb)->generation;
+    eventloop_work(ledwork, job);
+}
+
 int os_setupindicators(usbdevice* kb){
     // Initialize LEDs to all off
     kb->hw_ileds = kb->hw_ileds_old = kb->ileds = 0;
+    if(eventloop_enabled){
+        int fd = kb->uinput_kb - 1;
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        return eventloop_add(fd, EPOLLIN, led_ready, kb);
+    }
     // Create and detach thread to read LED events
     pthread_t thread;
     int err = pthread_create(&thread, 0, _ledthread, kb);
@@ -0,0 +1,70 @@
+#include "device.h"
+#include "input.h"
+#include "sim.h"
+
+#ifdef OS_SIM
+
+// Simulated devices don't send events anywhere. They're counted so that tests can check what the daemon generated.
+// Kept in devslot.inputdata.
+typedef struct {
+    unsigned long events, syncs;
+    char dirty;
+} simcounts;
+#define SIM_COUNTS(kb) ((simcounts*)DEV_SLOT(kb)->inputdata)
+
+int os_inputopen(usbdevice* kb){
+    // The handles aren't written to, but they need to be valid for IS_CONNECTED
+    devslot* slot = DEV_SLOT(kb);
+    if(!slot->inputdata)
+        slot->inputdata = malloc(sizeof(simcounts));
+    memset(slot->inputdata, 0, sizeof(simcounts));
+    kb->uinput_kb = open("/dev/null", O_WRONLY) + 1;
+    if(kb->uinput_kb <= 0)
+        return 1;
+    kb->uinput_mouse = open("/dev/null", O_WRONLY) + 1;
+    return kb->uinput_mouse <= 0;
+}
+
+void os_inputclose(usbdevice* kb){
+    if(kb->uinput_kb > 0)
+        close(kb->uinput_kb - 1);
+    if(kb->uinput_mouse > 0)
+        close(kb->uinput_mouse - 1);
+    kb->uinput_kb = kb->uinput_mouse = 0;
+}
+
+void os_keypress(usbdevice* kb, int scancode, int down){
+    // The mouse wheel only generates events on the way down
+    if((scancode == BTN_WHEELUP || scancode == BTN_WHEELDOWN) && !down)
+        return;
+    simcounts* counts = SIM_COUNTS(kb);
+    counts->events++;
+    counts->dirty = 1;
+}
+
+void os_mousemove(usbdevice* kb, int x, int y){
+    simcounts* counts = SIM_COUNTS(kb);
+    counts->events += (x != 0) + (y != 0);
+    counts->dirty = 1;
+}
+
+void os_isync(usbdevice* kb){
+    simcounts* counts = SIM_COUNTS(kb);
+    if(counts->dirty)
+        counts->syncs++;
+    counts->dirty = 0;
+}
+
+int os_setupindicators(usbdevice* kb){
+    // Indicators are set from the control socket instead
+    kb->hw_ileds = kb->hw_ileds_old = kb->ileds = 0;
+    return 0;
+}
+
+void sim_inputstats(usbdevice* kb, unsigned long* events, unsigned long* syncs){
+    simcounts* counts = SIM_COUNTS(kb);
+    *events = counts ? counts->events : 0;
+    *syncs = counts ? counts->syncs : 0;
+}
+
+#endif  // OS_SIM
@@ -220,52 +220,143 @@ const key keymap[N_KEYS_EXTENDED] = {
     { "dpi5",       LED_MOUSE + 10, KEY_NONE },
 };
 
+// Hash table of key names (open addressing). Entries are keymap indices + 1; 0 = empty.
+#define KEYHASH_SIZE    1024
+static short keyhash[KEYHASH_SIZE];
+static pthread_once_t keyhash_once = PTHREAD_ONCE_INIT;
+
+static void keyhash_init(){
+    for(int i = 0; i < N_KEYS_EXTENDED; i++){
+        if(!keymap[i].name)
+            continue;
+        unsigned slot = strhash(keymap[i].name) & (KEYHASH_SIZE - 1);
+        while(keyhash[slot]){
+            // Keep only the first key with a given name
+            if(!strcmp(keymap[keyhash[slot] - 1].name, keymap[i].name))
+                break;
+            slot = (slot + 1) & (KEYHASH_SIZE - 1);
+        }
+        if(!keyhash[slot])
+            keyhash[slot] = i + 1;
+    }
+}
+
+int keymap_find(const char* name){
+    pthread_once(&keyhash_once, keyhash_init);
+    unsigned slot = strhash(name) & (KEYHASH_SIZE - 1);
+    int index;
+    while((index = keyhash[slot])){
+        if(!strcmp(keymap[index - 1].name, name))
+            return index - 1;
+        slot = (slot + 1) & (KEYHASH_SIZE - 1);
+    }
+    return -1;
+}
+
+// LUT for HID -> Corsair scancodes (-1 for no scan code, -2 for currently unsupported)
+// Modified from Linux drivers/hid/usbhid/usbkbd.c, key codes replaced with array indices and K95 keys added
+static const short hid_codes[256] = {
+    -1,  -1,  -1,  -1,  37,  54,  52,  39,  27,  40,  41,  42,  32,  43,  44,  45,
+    56,  55,  33,  34,  25,  28,  38,  29,  31,  53,  26,  51,  30,  50,  13,  14,
+    15,  16,  17,  18,  19,  20,  21,  22,  82,   0,  86,  24,  64,  23,  84,  35,
+    79,  80,  81,  46,  47,  12,  57,  58,  59,  36,   1,   2,   3,   4,   5,   6,
+     7,   8,   9,  10,  11,  72,  73,  74,  75,  76,  77,  78,  87,  88,  89,  95,
+    93,  94,  92, 102, 103, 104, 105, 106, 107, 115, 116, 117, 112, 113, 114, 108,
+   109, 110, 118, 119,  49,  69,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,
+    -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  98,  -2,  -2,  -2,  -2,  -2,  -2,  97,
+   130, 131,  -1,  -1,  -1,  -2,  -1,  -2,  -2,  -2,  -2,  -2,  -2,  -1,  -1,  -1,
+    -2,  -2,  -2,  -2,  -2,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
+    -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
+    -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
+    -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -3,  -1,  -1,  -1,  // <- -3 = non-RGB program key
+   120, 121, 122, 123, 124, 125, 126, 127, 128, 129, 136, 137, 138, 139, 140, 141,
+    60,  48,  62,  61,  91,  90,  67,  68, 142, 143,  99, 101,  -2, 130, 131,  97,
+    -2, 133, 134, 135,  -2,  96,  -2, 132,  -2,  -2,  71,  71,  71,  71,  -1,  -1,
+};
+
+// Scatter table for HID bitmaps, which have one bit per HID code. hidscatter[n][v] is the ckb key bitfield for value v of
+// nibble n (HID codes 4n ... 4n + 3), so a whole bitmap byte translates with two lookups instead of eight bit tests.
+#define HID_NIBBLES 64
+static uint64_t hidscatter[HID_NIBBLES][16][N_KEYWORDS_INPUT];
+// Bits of each bitmap byte that don't have a key
+static uchar hidunknown[HID_NIBBLES / 2];
+// Every key that has a HID code
+static uint64_t hidall[N_KEYWORDS_INPUT];
+static pthread_once_t hid_once = PTHREAD_ONCE_INIT;
+
+static void hid_init(){
+    for(int code = 0; code < 256; code++){
+        int scan = hid_codes[code];
+        if(scan < 0){
+            hidunknown[code / 8] |= 1 << (code % 8);
+            continue;
+        }
+        uint64_t bit = 1ULL << (scan % 64);
+        hidall[scan / 64] |= bit;
+        for(int value = 0; value < 16; value++){
+            if(value & (1 << (code % 4)))
+                hidscatter[code / 4][value][scan / 64] |= bit;
+        }
+    }
+}
+
+// Keys collected from a report. Only the covered keys are changed when it's applied.
+typedef struct {
+    uint64_t set[N_KEYWORDS_INPUT];
+    uint64_t covered[N_KEYWORDS_INPUT];
+} hidkeys;
+
+// Adds count bytes of a HID bitmap, starting at HID code first * 8
+static void hid_scatter(hidkeys* keys, const uchar* bitmap, int first, int count, int endpoint){
+    for(int byte = 0; byte < count; byte++){
+        uchar value = bitmap[byte];
+        int nibble = (first + byte) * 2;
+        const uint64_t* lo = hidscatter[nibble][value & 15], * hi = hidscatter[nibble + 1][value >> 4];
+        const uint64_t* lo_all = hidscatter[nibble][15], * hi_all = hidscatter[nibble + 1][15];
+        for(int w = 0; w < N_KEYWORDS_INPUT; w++){
+            keys->set[w] |= lo[w] | hi[w];
+            keys->covered[w] |= lo_all[w] | hi_all[w];
+        }
+        uchar unknown = value & hidunknown[first + byte];
+        while(unknown){
+            int bit = __builtin_ctz(unknown);
+            unknown &= unknown - 1;
+            ckb_warn("Got unknown key press %d on EP %d\n", (first + byte) * 8 + bit, endpoint < 0 ? -endpoint : endpoint);
+        }
+    }
+}
+
+static void hid_apply(uchar* kbinput, const hidkeys* keys){
+    for(int w = 0; w < N_KEYWORDS_INPUT; w++)
+        setkeyword(kbinput, w, (keyword(kbinput, w) & ~keys->covered[w]) | keys->set[w]);
+}
+
+// Modifier keys (HID codes 224 - 231) are sent as a separate bitmap byte
+#define HID_MODBYTE (224 / 8)
+
 void hid_kb_translate(unsigned char* kbinput, int endpoint, int length, const unsigned char* urbinput){
     if(length < 1)
         return;
-    // LUT for HID -> Corsair scancodes (-1 for no scan code, -2 for currently unsupported)
-    // Modified from Linux drivers/hid/usbhid/usbkbd.c, key codes replaced with array indices and K95 keys added
-    static const short hid_codes[256] = {
-        -1,  -1,  -1,  -1,  37,  54,  52,  39,  27,  40,  41,  42,  32,  43,  44,  45,
-        56,  55,  33,  34,  25,  28,  38,  29,  31,  53,  26,  51,  30,  50,  13,  14,
-        15,  16,  17,  18,  19,  20,  21,  22,  82,   0,  86,  24,  64,  23,  84,  35,
-        79,  80,  81,  46,  47,  12,  57,  58,  59,  36,   1,   2,   3,   4,   5,   6,
-         7,   8,   9,  10,  11,  72,  73,  74,  75,  76,  77,  78,  87,  88,  89,  95,
-        93,  94,  92, 102, 103, 104, 105, 106, 107, 115, 116, 117, 112, 113, 114, 108,
-       109, 110, 118, 119,  49,  69,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,
-        -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  98,  -2,  -2,  -2,  -2,  -2,  -2,  97,
-       130, 131,  -1,  -1,  -1,  -2,  -1,  -2,  -2,  -2,  -2,  -2,  -2,  -1,  -1,  -1,
-        -2,  -2,  -2,  -2,  -2,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
-        -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
-        -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
-        -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -3,  -1,  -1,  -1,  // <- -3 = non-RGB program key
-       120, 121, 122, 123, 124, 125, 126, 127, 128, 129, 136, 137, 138, 139, 140, 141,
-        60,  48,  62,  61,  91,  90,  67,  68, 142, 143,  99, 101,  -2, 130, 131,  97,
-        -2, 133, 134, 135,  -2,  96,  -2, 132,  -2,  -2,  71,  71,  71,  71,  -1,  -1,
-    };
+    pthread_once(&hid_once, hid_init);
+    hidkeys keys;
+    memset(&keys, 0, sizeof(keys));
     switch(endpoint){
     case 1:
     case -1:
         // EP 1: 6KRO input (RGB and non-RGB)
-        // Clear previous input
-        for(int i = 0; i < 256; i++){
-            if(hid_codes[i] >= 0)
-                CLEAR_KEYBIT(kbinput, hid_codes[i]);
-        }
-        // Set new input
-        for(int i = 0; i < 8; i++){
-            if((urbinput[0] >> i) & 1)
-                SET_KEYBIT(kbinput, hid_codes[i + 224]);
-        }
+        // Replaces all previous input
+        memcpy(keys.covered, hidall, sizeof(hidall));
+        hid_scatter(&keys, urbinput, HID_MODBYTE, 1, endpoint);
         for(int i = 2; i < length; i++){
             if(urbinput[i] > 3){
                 int scan = hid_codes[urbinput[i]];
                 if(scan >= 0)
-                    SET_KEYBIT(kbinput, scan);
+                    keys.set[scan / 64] |= 1ULL << (scan % 64);
                 else
                     ckb_warn("Got unknown key press %d on EP 1\n", urbinput[i]);
             }
         }
+        hid_apply(kbinput, &keys);
         break;
     case -2:
         // EP 2 RGB: NKRO input
@@ -273,26 +364,9 @@ void hid_kb_translate(unsigned char* kbinput, int endpoint, int length, const un
             // Type 1: standard key
             if(length != 21)
                 return;
-            for(int bit = 0; bit < 8; bit++){
-                if((urbinput[1] >> bit) & 1)
-                    SET_KEYBIT(kbinput, hid_codes[bit + 224]);
-                else
-                    CLEAR_KEYBIT(kbinput, hid_codes[bit + 224]);
-            }
-            for(int byte = 0; byte < 19; byte++){
-                char input = urbinput[byte + 2];
-                for(int bit = 0; bit < 8; bit++){
-                    int keybit = byte * 8 + bit;
-                    int scan = hid_codes[keybit];
-                    if((input >> bit) & 1){
-                        if(scan >= 0)
-                            SET_KEYBIT(kbinput, hid_codes[keybit]);
-                        else
-                            ckb_warn("Got unknown key press %d on EP 2\n", keybit);
-                    } else if(scan >= 0)
-                        CLEAR_KEYBIT(kbinput, hid_codes[keybit]);
-                }
-            }
+            hid_scatter(&keys, urbinput + 1, HID_MODBYTE, 1, endpoint);
+            hid_scatter(&keys, urbinput + 2, 0, 19, endpoint);
+            hid_apply(kbinput, &keys);
             break;
         } else if(urbinput[0] == 2)
             ;       // Type 2: media key (fall through)
@@ -337,26 +411,9 @@ void hid_kb_translate(unsigned char* kbinput, int endpoint, int length, const un
         // EP 3 non-RGB: NKRO input
         if(length != 15)
             return;
-        for(int bit = 0; bit < 8; bit++){
-            if((urbinput[0] >> bit) & 1)
-                SET_KEYBIT(kbinput, hid_codes[bit + 224]);
-            else
-                CLEAR_KEYBIT(kbinput, hid_codes[bit + 224]);
-        }
-        for(int byte = 0; byte < 14; byte++){
-            char input = urbinput[byte + 1];
-            for(int bit = 0; bit < 8; bit++){
-                int keybit = byte * 8 + bit;
-                int scan = hid_codes[keybit];
-                if((input >> bit) & 1){
-                    if(scan >= 0)
-                        SET_KEYBIT(kbinput, hid_codes[keybit]);
-                    else
-                        ckb_warn("Got unknown key press %d on EP 3\n", keybit);
-                } else if(scan >= 0)
-                    CLEAR_KEYBIT(kbinput, hid_codes[keybit]);
-            }
-        }
+        hid_scatter(&keys, urbinput, HID_MODBYTE, 1, endpoint);
+        hid_scatter(&keys, urbinput + 1, 0, 14, endpoint);
+        hid_apply(kbinput, &keys);
         break;
     }
 }
@@ -35,6 +35,7 @@
 // Number of keys that generate input
 #define N_KEYS_INPUT            (MOUSE_BUTTON_FIRST + N_BUTTONS_EXTENDED)
 #define N_KEYBYTES_INPUT        ((N_KEYS_INPUT + 7) / 8)
+#define N_KEYWORDS_INPUT        ((N_KEYBYTES_INPUT + 7) / 8)
 // Mouse zones
 #define LED_MOUSE               N_KEYS_HW
 #define N_MOUSE_ZONES           5
@@ -61,11 +62,33 @@ typedef struct {
 // Begins with keyboard keys, followed by extra keys, then mouse buttons, and finally LED zones
 extern const key keymap[N_KEYS_EXTENDED];
 
+// Finds a key by name. Returns its index in keymap, or -1 if there is no such key.
+// If more than one key has the same name, the first one is returned.
+int keymap_find(const char* name);
+
 // Translates input from HID to a ckb input bitfield.
 // Use positive endpoint for non-RGB keyboards, negative endpoint for RGB
 void hid_kb_translate(unsigned char* kbinput, int endpoint, int length, const unsigned char* urbinput);
 void hid_mouse_translate(unsigned char* kbinput, short* xaxis, short* yaxis, int endpoint, int length, const unsigned char* urbinput);
 
+// Key bitfields handled 64 bits at a time. Bit n of word w is key 64 * w + n, regardless of byte order.
+static inline uint64_t keyword(const unsigned char* keys, int word){
+    uint64_t res = 0;
+    int start = word * 8, end = start + 8;
+    if(end > N_KEYBYTES_INPUT)
+        end = N_KEYBYTES_INPUT;
+    for(int i = start; i < end; i++)
+        res |= (uint64_t)keys[i] << ((i - start) * 8);
+    return res;
+}
+static inline void setkeyword(unsigned char* keys, int word, uint64_t value){
+    int start = word * 8, end = start + 8;
+    if(end > N_KEYBYTES_INPUT)
+        end = N_KEYBYTES_INPUT;
+    for(int i = start; i < end; i++)
+        keys[i] = value >> ((i - start) * 8);
+}
+
 // Copies input from Corsair reports
 void corsair_kbcopy(unsigned char* kbinput, int endpoint, const unsigned char* urbinput);
 void corsair_mousecopy(unsigned char* kbinput, int endpoint, const unsigned char* urbinput);
@@ -0,0 +1,81 @@
+#include "device.h"
+#include "latency.h"
+#include "notify.h"
+
+int latency_enabled = 0;
+
+static const char* const stagenames[LAT_STAGES] = { "translate", "macro", "write", "total" };
+
+// Log-linear bucket: 4 per power of two, so each one covers at most 25% of its value
+static int bucket(uint64_t ns){
+    if(ns < 4)
+        return (int)ns;
+    int octave = 63 - __builtin_clzll(ns);
+    int index = octave * 4 + (int)((ns >> (octave - 2)) & 3);
+    return index < LAT_BUCKETS ? index : LAT_BUCKETS - 1;
+}
+
+// Upper bound of a bucket, in nanoseconds
+static uint64_t bucketmax(int index){
+    if(index < 4)
+        return index;
+    int octave = index / 4;
+    return ((uint64_t)(4 + index % 4 + 1) << (octave - 2)) - 1;
+}
+
+static void addsample(latencystats* stats, int stage, uint64_t start, uint64_t end){
+    uint64_t ns = end > start ? end - start : 0;
+    __atomic_fetch_add(&stats->hist[stage][bucket(ns)], 1, __ATOMIC_RELAXED);
+    // Only the input path writes these, so a plain compare is enough
+    if(ns > __atomic_load_n(&stats->max[stage], __ATOMIC_RELAXED))
+        __atomic_store_n(&stats->max[stage], ns, __ATOMIC_RELAXED);
+}
+
+void latency_record(usbdevice* kb, uint64_t written){
+    latencystats* stats = &kb->latency;
+    // Reports that don't come from the device (e.g. clearing input when switching modes) have no reap stamp
+    if(!stats->reap)
+        return;
+    addsample(stats, 0, stats->reap, stats->translate);
+    addsample(stats, 1, stats->translate, stats->macro);
+    addsample(stats, 2, stats->macro, written);
+    addsample(stats, 3, stats->reap, written);
+    stats->reap = 0;
+}
+
+void latency_print(usbdevice* kb, int nnumber){
+    if(!latency_enabled){
+        nprintf(kb, nnumber, 0, "latency off\n");
+        return;
+    }
+    latencystats* stats = &kb->latency;
+    for(int stage = 0; stage < LAT_STAGES; stage++){
+        // Take a snapshot of the histogram so the percentiles are consistent with each other
+        unsigned long hist[LAT_BUCKETS];
+        unsigned long count = 0;
+        for(int i = 0; i < LAT_BUCKETS; i++)
+            count += hist[i] = __atomic_load_n(&stats->hist[stage][i], __ATOMIC_RELAXED);
+        uint64_t max = __atomic_load_n(&stats->max[stage], __ATOMIC_RELAXED);
+        uint64_t p50 = 0, p99 = 0;
+        unsigned long seen = 0;
+        int median = 0;
+        for(int i = 0; i < LAT_BUCKETS && count; i++){
+            if(!hist[i])
+                continue;
+            seen += hist[i];
+            if(!median && seen * 2 >= count){
+                p50 = bucketmax(i);
+                median = 1;
+            }
+            if(seen * 100 >= count * 99){
+                p99 = bucketmax(i);
+                break;
+            }
+        }
+        // Bucket bounds can overshoot the actual maximum
+        if(p50 > max) p50 = max;
+        if(p99 > max) p99 = max;
+        // Values are in microseconds
+        nprintf(kb, nnumber, 0, "latency %s %lu %.1f %.1f %.1f\n", stagenames[stage], count, p50 / 1000., p99 / 1000., max / 1000.);
+    }
+}
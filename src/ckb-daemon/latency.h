@@ -0,0 +1,26 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include "includes.h"
+
+// Input latency instrumentation. When enabled (--latency), each input report is stamped when it's reaped from the device,
+// after it's translated, after macros are matched, and after the resulting events are written. The time spent in each
+// stage goes into a per-device histogram, which can be read with "get :latency".
+
+// Whether latency tracking is enabled. Set at startup.
+extern int latency_enabled;
+
+// Current time in nanoseconds
+static inline uint64_t latency_now(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// Records the end of a report that produced output, using the stamps saved in kb->latency.
+// MUTEXES: Lock imutex before calling
+void latency_record(usbdevice* kb, uint64_t written);
+// Prints p50/p99/max for each stage to a notification node
+void latency_print(usbdevice* kb, int nnumber);
+
+#endif  // LATENCY_H
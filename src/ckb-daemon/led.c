@@ -8,13 +8,13 @@ void cmd_rgb(usbdevice* kb, usbmode* mode, int dummy, int keyindex, const char*
     if(index < 0) {
         if (index == -2){     // Process strafe sidelights
             uchar sideshine;
-            if (sscanf(code, "%2hhx",&sideshine)) // monochromatic
+            if (parse_hexbyte(code, &sideshine)) // monochromatic
                 mode->light.sidelight = sideshine;
         }
         return;
     }
     uchar r, g, b;
-    if(sscanf(code, "%2hhx%2hhx%2hhx", &r, &g, &b) == 3){
+    if(parse_rgb(code, &r, &g, &b)){
         mode->light.r[index] = r;
         mode->light.g[index] = g;
         mode->light.b[index] = b;
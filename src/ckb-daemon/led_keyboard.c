@@ -1,5 +1,6 @@
 #include <stdint.h>
 
+#include "effect.h"
 #include "led.h"
 #include "notify.h"
 #include "profile.h"
@@ -74,16 +75,40 @@ static int rgbcmp(const lighting* lhs, const lighting* rhs){
     return memcmp(lhs->r, rhs->r, N_KEYS_HW) || memcmp(lhs->g, rhs->g, N_KEYS_HW) || memcmp(lhs->b, rhs->b, N_KEYS_HW);
 }
 
+// Appends the color buffer packets in data_pkt[0 ... count - 2] to out, followed by the commit packet data_pkt[count - 1].
+// If delta is set, buffer packets are skipped when the device already holds the same data in that slot.
+// Returns the new number of packets in out.
+static int addpackets(usbdevice* kb, uchar out[][MSG_SIZE], int n, uchar data_pkt[][MSG_SIZE], int count, int delta){
+    for(int i = 0; i < count - 1; i++){
+        // Byte 1 is the buffer slot (1 - 4)
+        uchar* slot = kb->lightbuf[data_pkt[i][1] - 1];
+        if(delta && !memcmp(slot, data_pkt[i], MSG_SIZE))
+            continue;
+        memcpy(slot, data_pkt[i], MSG_SIZE);
+        memcpy(out[n++], data_pkt[i], MSG_SIZE);
+    }
+    memcpy(out[n++], data_pkt[count - 1], MSG_SIZE);
+    return n;
+}
+
 int updatergb_kb(usbdevice* kb, int force){
     if(!kb->active)
         return 0;
     lighting* lastlight = &kb->profile->lastlight;
-    lighting* newlight = &kb->profile->currentmode->light;
+    // Includes the native effect, if one is playing
+    lighting* newlight = effect_light(kb);
     // Don't do anything if the lighting hasn't changed
     if(!force && !lastlight->forceupdate && !newlight->forceupdate
             && !rgbcmp(lastlight, newlight) && lastlight->sidelight == newlight->sidelight)   // strafe sidelights
         return 0;
+    // Send only the changed packets if possible. The color buffer on older firmware can't be trusted to keep its contents, so send full frames there.
+    int delta = kb->delta && kb->lightbuf_ok && kb->fwversion >= 0x0120
+            && !force && !lastlight->forceupdate && !newlight->forceupdate;
     lastlight->forceupdate = newlight->forceupdate = 0;
+    // If the transfer fails, the buffer contents are unknown
+    kb->lightbuf_ok = 0;
+    uchar out_pkt[12][MSG_SIZE];
+    int out_count = 0;
 
     if(IS_STRAFE(kb)){
         // Update strafe sidelights if necessary
@@ -94,7 +119,7 @@ int updatergb_kb(usbdevice* kb, int force){
              };
              if (newlight->sidelight)
                  data_pkt[0][4]=1;    // turn on
-             if(!usbsend(kb, data_pkt[0], 2))
+             if(!usbqueue(kb, data_pkt[0], 2))
                  return -1;
         }
         // 16.8M color lighting works fine on strafe and is the only way it actually works
@@ -116,7 +141,13 @@ int updatergb_kb(usbdevice* kb, int force){
             { 0x07, 0x28, 0x03, 0x03, 0x02, 0}
         };
         makergb_full(newlight, data_pkt);
-        if(!usbsend(kb, data_pkt[0], 12))
+        // Each color is loaded into the buffer and then committed. Unchanged colors can be skipped, except for blue, whose commit applies the frame.
+        if(!delta || memcmp(lastlight->r, newlight->r, N_KEYS_HW))
+            out_count = addpackets(kb, out_pkt, out_count, data_pkt, 4, delta);
+        if(!delta || memcmp(lastlight->g, newlight->g, N_KEYS_HW))
+            out_count = addpackets(kb, out_pkt, out_count, data_pkt + 4, 4, delta);
+        out_count = addpackets(kb, out_pkt, out_count, data_pkt + 8, 4, delta);
+        if(!usbqueue(kb, out_pkt[0], out_count))
             return -1;
     } else {
         // On older keyboards it looks flickery and causes lighting glitches, so we don't use it.
@@ -128,15 +159,19 @@ int updatergb_kb(usbdevice* kb, int force){
             { 0x07, 0x27, 0x00, 0x00, 0xD8 }
         };
         makergb_512(newlight, data_pkt, kb->dither ? ordered8to3 : quantize8to3);
-        if(!usbsend(kb, data_pkt[0], 5))
+        out_count = addpackets(kb, out_pkt, out_count, data_pkt, 5, delta);
+        if(!usbqueue(kb, out_pkt[0], out_count))
             return -1;
     }
 
+    kb->lightbuf_ok = 1;
     memcpy(lastlight, newlight, sizeof(lighting));
     return 0;
 }
 
 int savergb_kb(usbdevice* kb, lighting* light, int mode){
+    // Saving goes through the same color buffer, so the next update has to be sent in full
+    kb->lightbuf_ok = 0;
     if(kb->fwversion >= 0x0120){
         uchar data_pkt[12][MSG_SIZE] = {
             // Red
@@ -179,6 +214,7 @@ int savergb_kb(usbdevice* kb, lighting* light, int mode){
 }
 
 int loadrgb_kb(usbdevice* kb, lighting* light, int mode){
+    kb->lightbuf_ok = 0;
     if(kb->fwversion >= 0x0120){
         uchar data_pkt[12][MSG_SIZE] = {
             { 0x0e, 0x14, 0x03, 0x01, 0x01, mode + 1, 0x01 },
@@ -203,15 +239,9 @@ int loadrgb_kb(usbdevice* kb, lighting* light, int mode){
         // Read colors
         uchar* colors[3] = { light->r, light->g, light->b };
         for(int clr = 0; clr < 3; clr++){
-            for(int i = 0; i < 4; i++){
-                if(!usbrecv(kb, data_pkt[i + clr * 4], in_pkt[i]))
-                    return -1;
-                // Make sure the first four bytes match
-                if(memcmp(in_pkt[i], data_pkt[i + clr * 4], 4)){
-                    ckb_err("Bad input header\n");
-                    return -1;
-                }
-            }
+            // Each response starts with the same four bytes as its request
+            if(!usbrecvbatch(kb, data_pkt[clr * 4], in_pkt[0], 4, 4))
+                return -1;
             // Copy colors to lighting. in_pkt[0] is irrelevant.
             memcpy(colors[clr], in_pkt[1] + 4, 60);
             memcpy(colors[clr] + 60, in_pkt[2] + 4, 60);
@@ -235,14 +265,8 @@ int loadrgb_kb(usbdevice* kb, lighting* light, int mode){
         if(!usbsend(kb, data_pkt[0], 1))
             return -1;
         // Read colors
-        for(int i = 1; i < 5; i++){
-            if(!usbrecv(kb, data_pkt[i],in_pkt[i - 1]))
-                return -1;
-            if(memcmp(in_pkt[i - 1], data_pkt[i], 4)){
-                ckb_err("Bad input header\n");
-                return -1;
-            }
-        }
+        if(!usbrecvbatch(kb, data_pkt[1], in_pkt[0], 4, 4))
+            return -1;
         // Copy the data back to the mode
         uint8_t mr[N_KEYS_HW / 2], mg[N_KEYS_HW / 2], mb[N_KEYS_HW / 2];
         memcpy(mr,      in_pkt[0] +  4, 60);
@@ -1,3 +1,4 @@
+#include "effect.h"
 #include "led.h"
 #include "notify.h"
 #include "profile.h"
@@ -21,7 +22,8 @@ int updatergb_mouse(usbdevice* kb, int force){
     if(!kb->active)
         return 0;
     lighting* lastlight = &kb->profile->lastlight;
-    lighting* newlight = &kb->profile->currentmode->light;
+    // Includes the native effect, if one is playing
+    lighting* newlight = effect_light(kb);
     // Don't do anything if the lighting hasn't changed
     if(!force && !lastlight->forceupdate && !newlight->forceupdate
             && !rgbcmp(lastlight, newlight))
@@ -84,12 +86,8 @@ int loadrgb_mouse(usbdevice* kb, lighting* light, int mode){
     // Load each RGB zone
     int zonecount = IS_SCIMITAR(kb) ? 4 : IS_SABRE(kb) ? 3 : 2;
     for(int i = 0; i < zonecount; i++){
-        if(!usbrecv(kb, data_pkt, in_pkt))
+        if(!usbrecvbatch(kb, data_pkt, in_pkt, 1, 4))
             return -1;
-        if(memcmp(in_pkt, data_pkt, 4)){
-            ckb_err("Bad input header\n");
-            return -2;
-        }
         // Copy data
         int led = LED_MOUSE + i;
         if(led >= LED_DPI)
@@ -0,0 +1,286 @@
+#include "device.h"
+#include "eventloop.h"
+#include "input.h"
+#include "latency.h"
+#include "macro.h"
+
+#ifdef OS_LINUX
+#include <sys/timerfd.h>
+#endif
+
+// Schedules the next call to macro_step, or cancels it if due is zero. A time that's already passed fires right away.
+static void arm(macroplayer* player, uint64_t due){
+#ifdef OS_LINUX
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = due / 1000000000ULL;
+    spec.it_value.tv_nsec = due % 1000000000ULL;
+    timerfd_settime(player->timer - 1, TFD_TIMER_ABSTIME, &spec, 0);
+#else
+    player->due = due;
+    pthread_cond_signal(&player->cond);
+#endif
+}
+
+static void playaction(usbdevice* kb, const macroaction* action){
+    if(action->rel_x != 0 || action->rel_y != 0)
+        os_mousemove(kb, action->rel_x, action->rel_y);
+    else
+        os_keypress(kb, action->scan, action->down);
+}
+
+// Releases any keys that a macro has pressed but not released yet. Returns nonzero if anything was sent.
+static int releasekeys(usbdevice* kb, const macrorun* run){
+    int sent = 0;
+    for(int i = 0; i < run->position; i++){
+        const macroaction* action = run->actions + i;
+        if(!action->down || action->rel_x != 0 || action->rel_y != 0)
+            continue;
+        // Only the last action for each key matters
+        int last = 1;
+        for(int j = i + 1; j < run->position && last; j++){
+            const macroaction* later = run->actions + j;
+            if(later->scan == action->scan && later->rel_x == 0 && later->rel_y == 0)
+                last = 0;
+        }
+        if(last){
+            os_keypress(kb, action->scan, 0);
+            sent = 1;
+        }
+    }
+    return sent;
+}
+
+static void removerun(macroplayer* player, int i){
+    free(player->runs[i].actions);
+    memmove(player->runs + i, player->runs + i + 1, (player->runcount - i - 1) * sizeof(macrorun));
+    player->runcount--;
+}
+
+// Plays every action that's due, up to MACRO_BURST of them, and sets the timer for the next one. Lock imutex first.
+static void macro_step(usbdevice* kb){
+    macroplayer* player = &kb->macro;
+    uint64_t now = latency_now(), next = 0;
+    int played = 0;
+    for(int i = 0; i < player->runcount;){
+        macrorun* run = player->runs + i;
+        // A macro that's triggered again waits for the earlier run to finish
+        int blocked = 0;
+        for(int j = 0; j < i && !blocked; j++)
+            blocked = (player->runs[j].generation == run->generation && player->runs[j].index == run->index);
+        if(blocked){
+            i++;
+            continue;
+        }
+        while(run->due <= now && run->position < run->actioncount && played < MACRO_BURST){
+            const macroaction* action = run->actions + run->position++;
+            playaction(kb, action);
+            played++;
+            if(action->delay)
+                run->due = now + action->delay * 1000000ULL;
+        }
+        if(run->position == run->actioncount){
+            if(!run->repeat){
+                removerun(player, i);
+                continue;
+            }
+            run->position = 0;
+            if(!run->actions[run->actioncount - 1].delay)
+                run->due = now + MACRO_REPEAT_MIN * 1000000ULL;
+        }
+        if(!next || run->due < next)
+            next = run->due;
+        i++;
+    }
+    if(played)
+        os_isync(kb);
+    arm(player, next);
+}
+
+#ifdef OS_LINUX
+
+static void* macro_main(void* context){
+    usbdevice* kb = context;
+    int fd = kb->macro.timer - 1;
+    while(1){
+        uint64_t expirations;
+        if(read(fd, &expirations, sizeof(expirations)) < 0 && errno != EINTR)
+            break;
+        pthread_mutex_lock(imutex(kb));
+        if(!kb->macro.timer){
+            pthread_mutex_unlock(imutex(kb));
+            break;
+        }
+        macro_step(kb);
+        pthread_mutex_unlock(imutex(kb));
+    }
+    return 0;
+}
+
+// Event loop counterpart of macro_main
+static void macro_ready(void* context, uint32_t events){
+    usbdevice* kb = context;
+    pthread_mutex_lock(imutex(kb));
+    // The device may have been closed after the event was reported
+    if(kb->macro.timer){
+        uint64_t expirations;
+        read(kb->macro.timer - 1, &expirations, sizeof(expirations));
+        macro_step(kb);
+    }
+    pthread_mutex_unlock(imutex(kb));
+}
+
+#else
+
+static void* macro_main(void* context){
+    usbdevice* kb = context;
+    macroplayer* player = &kb->macro;
+    pthread_mutex_lock(imutex(kb));
+    while(player->timer){
+        uint64_t now = latency_now();
+        if(player->due && player->due <= now){
+            player->due = 0;
+            macro_step(kb);
+        } else if(!player->due)
+            pthread_cond_wait(&player->cond, imutex(kb));
+        else {
+            uint64_t wait = player->due - now;
+            struct timespec timeout = { wait / 1000000000ULL, wait % 1000000000ULL };
+            pthread_cond_timedwait_relative_np(&player->cond, imutex(kb), &timeout);
+        }
+    }
+    pthread_mutex_unlock(imutex(kb));
+    return 0;
+}
+
+#endif
+
+int macro_start(usbdevice* kb){
+    macroplayer* player = &kb->macro;
+    player->runcount = 0;
+#ifdef OS_LINUX
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | (eventloop_enabled ? TFD_NONBLOCK : 0));
+    if(fd < 0){
+        ckb_err("Failed to create macro timer: %s\n", strerror(errno));
+        return -1;
+    }
+    player->timer = fd + 1;
+    if(eventloop_enabled){
+        if(!eventloop_add(fd, EPOLLIN, macro_ready, kb))
+            return 0;
+    } else if(!pthread_create(&player->thread, 0, macro_main, kb))
+        return 0;
+    close(fd);
+#else
+    pthread_cond_init(&player->cond, 0);
+    player->due = 0;
+    player->timer = 1;
+    if(!pthread_create(&player->thread, 0, macro_main, kb))
+        return 0;
+    pthread_cond_destroy(&player->cond);
+#endif
+    ckb_err("Failed to start macro player\n");
+    player->timer = 0;
+    return -1;
+}
+
+void macro_stop(usbdevice* kb){
+    macroplayer* player = &kb->macro;
+    pthread_mutex_lock(imutex(kb));
+    int timer = player->timer;
+    if(!timer){
+        pthread_mutex_unlock(imutex(kb));
+        return;
+    }
+    // Clearing the timer tells the thread to stop
+    player->timer = 0;
+#ifdef OS_LINUX
+    int threaded = !eventloop_enabled;
+    if(threaded){
+        // Wake it up
+        struct itimerspec spec = { { 0, 0 }, { 0, 1 } };
+        timerfd_settime(timer - 1, TFD_TIMER_ABSTIME, &spec, 0);
+    } else
+        eventloop_del(timer - 1);
+#else
+    int threaded = 1;
+    pthread_cond_signal(&player->cond);
+#endif
+    pthread_mutex_unlock(imutex(kb));
+    if(threaded)
+        pthread_join(player->thread, 0);
+
+    // Let go of anything that was held down and drop the rest
+    pthread_mutex_lock(imutex(kb));
+    int sent = 0;
+    for(int i = 0; i < player->runcount; i++){
+        sent |= releasekeys(kb, player->runs + i);
+        free(player->runs[i].actions);
+    }
+    player->runcount = 0;
+    if(sent)
+        os_isync(kb);
+#ifdef OS_LINUX
+    close(timer - 1);
+#else
+    pthread_cond_destroy(&player->cond);
+#endif
+    pthread_mutex_unlock(imutex(kb));
+}
+
+void macro_play(usbdevice* kb, const keymacro* macro, unsigned long generation, int index){
+    macroplayer* player = &kb->macro;
+    if(!player->timer){
+        // No player, so play the whole thing now (without delays)
+        for(int a = 0; a < macro->actioncount; a++)
+            playaction(kb, macro->actions + a);
+        return;
+    }
+    if(player->runcount == MACRO_RUNS){
+        ckb_warn("Too many macros playing at once, skipping one\n");
+        return;
+    }
+    macrorun* run = player->runs + player->runcount++;
+    run->actions = malloc(macro->actioncount * sizeof(macroaction));
+    memcpy(run->actions, macro->actions, macro->actioncount * sizeof(macroaction));
+    run->actioncount = macro->actioncount;
+    run->position = 0;
+    run->due = latency_now();
+    run->generation = generation;
+    run->index = index;
+    run->repeat = macro->repeat;
+    run->held = macro->repeat;
+    for(int a = 0; a < macro->actioncount && !run->held; a++)
+        run->held = (macro->actions[a].delay != 0);
+    arm(player, run->due);
+}
+
+// Stops every run of a macro (or of every macro) that only plays while held, and lets go of any keys they were holding.
+// Runs without delays or repeat are left to finish.
+static void cancel(usbdevice* kb, int all, unsigned long generation, int index){
+    macroplayer* player = &kb->macro;
+    int sent = 0, removed = 0;
+    for(int i = 0; i < player->runcount;){
+        macrorun* run = player->runs + i;
+        if(!run->held || (!all && (run->generation != generation || run->index != index))){
+            i++;
+            continue;
+        }
+        sent |= releasekeys(kb, run);
+        removerun(player, i);
+        removed = 1;
+    }
+    if(sent)
+        os_isync(kb);
+    // Let the player work out when the remaining runs are due
+    if(removed)
+        arm(player, latency_now());
+}
+
+void macro_release(usbdevice* kb, unsigned long generation, int index){
+    cancel(kb, 0, generation, index);
+}
+
+void macro_releaseall(usbdevice* kb){
+    cancel(kb, 1, 0, 0);
+}
@@ -0,0 +1,29 @@
+#ifndef MACRO_H
+#define MACRO_H
+
+#include "includes.h"
+
+// Macro player. The input thread only queues macros; their actions are played by a separate thread (or the event loop),
+// driven by a timerfd on Linux. Other keys keep working while a macro waits out its delays. A macro with delays or repeat
+// only plays while its keys are held: releasing them stops it. Any other macro plays to the end once it's triggered.
+// All functions except macro_stop must be called with imutex locked.
+
+// Maximum actions played in one go. A macro with more actions than this (and no delays) lets other input through partway.
+#define MACRO_BURST         32
+// Minimum time between the repeats of a repeating macro whose last action has no delay (ms)
+#define MACRO_REPEAT_MIN    20
+
+// Starts the player for a device. Called from setupusb. Returns 0 on success.
+int macro_start(usbdevice* kb);
+// Stops the player and releases any keys a macro was holding. Called from closeusb; don't lock imutex first.
+void macro_stop(usbdevice* kb);
+
+// Queues a macro. If the same macro is already playing, it starts when that one finishes.
+void macro_play(usbdevice* kb, const keymacro* macro, unsigned long generation, int index);
+// Tells the player that a macro's keys were released. If the macro has delays or repeats, every run of it stops right away
+// and releases any keys it's holding.
+void macro_release(usbdevice* kb, unsigned long generation, int index);
+// Same, for every macro. Used when the bindings change.
+void macro_releaseall(usbdevice* kb);
+
+#endif  // MACRO_H
@@ -1,14 +1,15 @@
 #include "device.h"
 #include "devnode.h"
+#include "effect.h"
+#include "eventloop.h"
 #include "input.h"
+#include "latency.h"
 #include "led.h"
 #include "notify.h"
 
 // usb.c
 extern volatile int reset_stop;
 extern int features_mask;
-// device.c
-extern int hwload_mode;
 
 // Timespec utility function
 void timespec_add(struct timespec* timespec, long nanoseconds){
@@ -20,17 +21,19 @@ void timespec_add(struct timespec* timespec, long nanoseconds){
 void quit(){
     // Abort any USB resets in progress
     reset_stop = 1;
-    for(int i = 1; i < DEV_MAX; i++){
+    int count = device_count();
+    for(int i = 1; i < count; i++){
         // Before closing, set all keyboards back to HID input mode so that the stock driver can still talk to them
-        pthread_mutex_lock(devmutex + i);
-        if(IS_CONNECTED(keyboard + i)){
-            revertusb(keyboard + i);
-            closeusb(keyboard + i);
+        usbdevice* kb = device_get(i);
+        pthread_mutex_lock(dmutex(kb));
+        if(IS_CONNECTED(kb)){
+            revertusb(kb);
+            closeusb(kb);
         }
-        pthread_mutex_unlock(devmutex + i);
+        pthread_mutex_unlock(dmutex(kb));
     }
     ckb_info("Closing root controller\n");
-    rmdevpath(keyboard);
+    rmdevpath(device_get(0));
     usbkill();
 }
 
@@ -44,6 +47,14 @@ void sighandler(int type){
     signal(SIGINT, sighandler2);
     signal(SIGQUIT, sighandler2);
     printf("\n[I] Caught signal %d\n", type);
+#ifdef OS_LINUX
+    if(eventloop_enabled){
+        // The event loop may be holding a device lock, so let it return from usbmain and shut down from there
+        reset_stop = 1;
+        eventloop_stop();
+        return;
+    }
+#endif
     quit();
     exit(0);
 }
@@ -76,9 +87,9 @@ int main(int argc, char** argv){
         if(!strcmp(argv[i], "--help")){
             printf(
 #ifdef OS_MAC
-                        "Usage: ckb-daemon [--gid=<gid>] [--hwload=<always|try|never>] [--nonotify] [--nobind] [--nomouseaccel] [--nonroot]\n"
+                        "Usage: ckb-daemon [--gid=<gid>] [--hwload=<always|try|never>] [--nonotify] [--nobind] [--nomouseaccel] [--latency] [--effectdir=<dir>] [--nonroot]\n"
 #else
-                        "Usage: ckb-daemon [--gid=<gid>] [--hwload=<always|try|never>] [--nonotify] [--nobind] [--nonroot]\n"
+                        "Usage: ckb-daemon [--gid=<gid>] [--hwload=<always|try|never>] [--nonotify] [--nobind] [--eventloop] [--latency] [--effectdir=<dir>] [--nonroot]\n"
 #endif
                         "\n"
                         "See https://github.com/ccMSC/ckb/blob/master/DAEMON.md for full instructions.\n"
@@ -88,7 +99,7 @@ int main(int argc, char** argv){
                         "        Restrict access to %s* nodes to users in group <gid>.\n"
                         "        (Ordinarily they are accessible to anyone)\n"
                         "    --hwload=<always|try|never>\n"
-                        "        --hwload=always will force loading of stored hardware profiles on compatible devices. May result in long start up times.\n"
+                        "        --hwload=always will force loading of stored hardware profiles on compatible devices, ignoring any cached copy. May result in long start up times.\n"
                         "        --hwload=try will try to load the profiles, but give up if not immediately successful (default).\n"
                         "        --hwload=never will ignore hardware profiles completely.\n"
                         "    --nonotify\n"
@@ -99,7 +110,15 @@ int main(int argc, char** argv){
 #ifdef OS_MAC
                         "    --nomouseaccel\n"
                         "        Disables mouse acceleration, even if the system preferences enable it.\n"
+#else
+                        "    --eventloop\n"
+                        "        Handles all devices from a single event loop instead of using several threads per device.\n"
 #endif
+                        "    --latency\n"
+                        "        Tracks how long key presses take to pass through the daemon. Use \"get :latency\" to see the results.\n"
+                        "    --effectdir=<dir>\n"
+                        "        Loads native effects from <dir> (default " EFFECT_DIR ").\n"
+                        "        The directory and the effects in it must be owned by root and not writable by anyone else.\n"
                         "    --nonroot\n"
                         "        Allows running ckb-daemon as a non root user.\n"
                         "        This will almost certainly not work. Use only if you know what you're doing.\n"
@@ -127,7 +146,12 @@ int main(int argc, char** argv){
     }
 
     // Read parameters
+#ifdef OS_SIM
+    // Simulated devices don't touch any hardware
+    int forceroot = 0;
+#else
     int forceroot = 1;
+#endif
     for(int i = 1; i < argc; i++){
         char* argument = argv[i];
         unsigned newgid;
@@ -155,6 +179,14 @@ int main(int argc, char** argv){
                 hwload_mode = 0;
                 ckb_info_nofile("Setting hardware load: never\n");
             }
+        } else if(!strcmp(argument, "--latency")){
+            // Enable input latency tracking
+            latency_enabled = 1;
+            ckb_info_nofile("Input latency tracking enabled\n");
+        } else if(!strncmp(argument, "--effectdir=", 12)){
+            // Set native effect directory
+            effectdir = argument + 12;
+            ckb_info_nofile("Loading effects from %s\n", effectdir);
         } else if(!strcmp(argument, "--nonroot")){
             // Allow running as a non-root user
             forceroot = 0;
@@ -165,6 +197,12 @@ int main(int argc, char** argv){
             features_mask &= ~FEAT_MOUSEACCEL;
             ckb_info_nofile("Mouse acceleration disabled\n");
         }
+#else
+        else if(!strcmp(argument, "--eventloop")){
+            // Use a single epoll loop for all devices
+            eventloop_enabled = 1;
+            ckb_info_nofile("Using event loop\n");
+        }
 #endif
     }
 
@@ -179,8 +217,7 @@ int main(int argc, char** argv){
 
     // Make root keyboard
     umask(0);
-    memset(keyboard, 0, sizeof(keyboard));
-    if(!mkdevpath(keyboard))
+    if(!mkdevpath(device_get(0)))
         ckb_info("Root controller ready at %s0\n", devpath);
 
     // Set signals
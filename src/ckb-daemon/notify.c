@@ -1,6 +1,7 @@
 #include "device.h"
 #include "devnode.h"
 #include "dpi.h"
+#include "latency.h"
 #include "led.h"
 #include "notify.h"
 #include "profile.h"
@@ -61,12 +62,11 @@ void nprintind(usbdevice* kb, int nnumber, int led, int on){
 void cmd_notify(usbdevice* kb, usbmode* mode, int nnumber, int keyindex, const char* toggle){
     if(keyindex >= N_KEYS_INPUT)
         return;
-    pthread_mutex_lock(imutex(kb));
     if(!strcmp(toggle, "on") || *toggle == 0)
         SET_KEYBIT(mode->notify[nnumber], keyindex);
     else if(!strcmp(toggle, "off"))
         CLEAR_KEYBIT(mode->notify[nnumber], keyindex);
-    pthread_mutex_unlock(imutex(kb));
+    mode->binddirty = 1;
 }
 
 // Check hardware mode, bail out if it doesn't exist
@@ -209,6 +209,12 @@ static void _cmd_get(usbdevice* kb, usbmode* mode, int nnumber, const char* sett
         // Get the hardware angle snap status
         HW_STANDARD;
         nprintf(kb, nnumber, mode, "hwsnap %s\n", kb->hw->dpi[index].snap ? "on" : "off");
+    } else if(!strcmp(setting, ":latency")){
+        // Get input latency statistics
+        latency_print(kb, nnumber);
+    } else if(!strcmp(setting, ":frames")){
+        // Get the number of lighting frames received and dropped
+        nprintf(kb, nnumber, 0, "frames %lu %lu\n", kb->frames_received, kb->frames_dropped);
     }
 }
 
@@ -14,6 +14,14 @@
 #error Your OS is not supported. Edit os.h if you want to compile anyway.
 #endif
 
+// Simulated devices (see usb_sim.c). This is a Linux build with the USB and uinput code replaced, so OS_LINUX stays defined.
+#ifdef CKB_SIM
+#ifndef OS_LINUX
+#error The simulated device backend requires Linux.
+#endif
+#define OS_SIM
+#endif
+
 // OS-specific includes
 
 #ifdef OS_LINUX
@@ -27,7 +35,9 @@
 #endif
 
 #include <features.h>
+#ifndef OS_SIM
 #include <libudev.h>
+#endif
 #include <linux/uinput.h>
 #include <linux/usbdevice_fs.h>
 
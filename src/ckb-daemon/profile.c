@@ -197,6 +197,7 @@ int loadprofile(usbdevice* kb){
 
 static void freemode(usbmode* mode){
     freebind(&mode->bind);
+    freesnapshot(mode);
     memset(mode, 0, sizeof(*mode));
 }
 
@@ -27,6 +27,8 @@ void cmd_profilename(usbdevice* kb, usbmode* dummy1, int dummy2, int dummy3, con
 char* getmodename(usbmode* mode);
 // Get a profile's name. See above.
 char* getprofilename(usbprofile* profile);
+// Decodes a URL-encoded string. dst may be the same as src.
+void urldecode2(char* dst, const char* src);
 // Get hardware names.
 char* gethwmodename(hwprofile* profile, int index);
 char* gethwprofilename(hwprofile* profile);
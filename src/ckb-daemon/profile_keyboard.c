@@ -1,3 +1,5 @@
+#include "device.h"
+#include "hwcache.h"
 #include "profile.h"
 #include "usb.h"
 #include "led.h"
@@ -31,18 +33,22 @@ int cmd_hwload_kb(usbdevice* kb, usbmode* dummy1, int dummy2, int apply, const c
         }
         memcpy(hw->id + i, in_pkt + 4, sizeof(usbid));
     }
-    // Ask for profile name
-    if(!usbrecv(kb, data_pkt[1], in_pkt)){
-        free(hw);
-        return -1;
-    }
-    memcpy(hw->name[0], in_pkt + 4, PR_NAME_LEN * 2);
-    // Load modes
-    for(int i = 0; i < modes; i++){
-        if(hwloadmode(kb, hw, i)){
+    // If the IDs haven't changed since the profile was last seen, the rest can come from the cache
+    if(hwload_mode == 2 || hwcache_load(kb, hw, modes)){
+        // Ask for profile name
+        if(!usbrecv(kb, data_pkt[1], in_pkt)){
             free(hw);
             return -1;
         }
+        memcpy(hw->name[0], in_pkt + 4, PR_NAME_LEN * 2);
+        // Load modes
+        for(int i = 0; i < modes; i++){
+            if(hwloadmode(kb, hw, i)){
+                free(hw);
+                return -1;
+            }
+        }
+        hwcache_save(kb, hw, modes);
     }
     // Make the profile active (if requested)
     if(apply)
@@ -85,6 +91,7 @@ int cmd_hwsave_kb(usbdevice* kb, usbmode* dummy1, int dummy2, int dummy3, const
         if(savergb_kb(kb, hw->light + i, i))
             return -1;
     }
+    hwcache_save(kb, hw, modes);
     DELAY_LONG(kb);
     return 0;
 }
@@ -1,4 +1,6 @@
+#include "device.h"
 #include "dpi.h"
+#include "hwcache.h"
 #include "profile.h"
 #include "usb.h"
 #include "led.h"
@@ -20,21 +22,25 @@ int cmd_hwload_mouse(usbdevice* kb, usbmode* dummy1, int dummy2, int apply, cons
         }
         memcpy(hw->id + i, in_pkt + 4, sizeof(usbid));
     }
-    // Ask for profile and mode names
-    for(int i = 0; i <= 1; i++){
-        data_pkt[1][3] = i;
-        if(!usbrecv(kb, data_pkt[1],in_pkt)){
+    // If the IDs haven't changed since the profile was last seen, the rest can come from the cache
+    if(hwload_mode == 2 || hwcache_load(kb, hw, 1)){
+        // Ask for profile and mode names
+        for(int i = 0; i <= 1; i++){
+            data_pkt[1][3] = i;
+            if(!usbrecv(kb, data_pkt[1],in_pkt)){
+                free(hw);
+                return -1;
+            }
+            memcpy(hw->name[i], in_pkt + 4, PR_NAME_LEN * 2);
+        }
+
+        // Load the RGB and DPI settings
+        if(loadrgb_mouse(kb, hw->light, 0)
+                || loaddpi(kb, hw->dpi, hw->light)){
             free(hw);
             return -1;
         }
-        memcpy(hw->name[i], in_pkt + 4, PR_NAME_LEN * 2);
-    }
-
-    // Load the RGB and DPI settings
-    if(loadrgb_mouse(kb, hw->light, 0)
-            || loaddpi(kb, hw->dpi, hw->light)){
-        free(hw);
-        return -1;
+        hwcache_save(kb, hw, 1);
     }
 
     // Make the profile active (if requested)
@@ -77,6 +83,7 @@ int cmd_hwsave_mouse(usbdevice* kb, usbmode* dummy1, int dummy2, int dummy3, con
     // Save the DPI data (also saves RGB for those states)
     if(savedpi(kb, hw->dpi, hw->light))
         return -1;
+    hwcache_save(kb, hw, 1);
     DELAY_LONG(kb);
     return 0;
 }
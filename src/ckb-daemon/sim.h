@@ -0,0 +1,18 @@
+#ifndef SIM_H
+#define SIM_H
+
+#include "includes.h"
+
+// Simulated device backend (build with `qmake CKB_SIM=1`). Devices are plugged in, removed, and given input through a
+// control socket at <devpath>0/sim instead of being found over USB. See usb_sim.c for the list of commands.
+
+#ifdef OS_SIM
+
+// Number of USB packets and complete lighting frames a device has received since it was connected (usb_sim.c)
+void sim_usbstats(usbdevice* kb, unsigned long* packets, unsigned long* frames);
+// Number of input events and syncs generated for a device since it was connected (input_sim.c)
+void sim_inputstats(usbdevice* kb, unsigned long* events, unsigned long* syncs);
+
+#endif  // OS_SIM
+
+#endif  // SIM_H
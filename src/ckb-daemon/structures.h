@@ -28,17 +28,21 @@ typedef struct {
     short scan;         // Key scancode, OR
     short rel_x, rel_y; // Mouse movement
     char down;          // 0 for keyup, 1 for keydown (ignored if rel_x != 0 || rel_y != 0)
+    ushort delay;       // Time to wait before the next action (ms)
 } macroaction;
 
+#define MACRO_MAX   1024
+
 // Key macro
 typedef struct {
     macroaction* actions;
     int actioncount;
     uchar combo[N_KEYBYTES_INPUT];
-    char triggered;
+    // Play the actions again for as long as the keys are held
+    char repeat;
 } keymacro;
 
-// Key bindings for a mode (keyboard + mouse)
+// Key bindings for a mode (keyboard + mouse). Only used by the command thread; the input thread reads a bindsnapshot instead.
 typedef struct {
     // Base bindings
     int base[N_KEYS_INPUT];
@@ -47,7 +51,22 @@ typedef struct {
     int macrocount;
     int macrocap;
 } binding;
-#define MACRO_MAX   1024
+
+// Read-only copy of a mode's bindings and key notifications, used by the input thread without locking.
+// Snapshots are never modified. When commands change a mode, a new one is built and swapped in (see publishbind).
+typedef struct {
+    int base[N_KEYS_INPUT];
+    // Macros, with their actions stored in the same allocation
+    const keymacro* macros;
+    int macrocount;
+    // Index of macros by key: macroindex[keystart[k] ... keystart[k + 1] - 1] are the macros that include key k.
+    const ushort* macroindex;
+    int keystart[N_KEYS_INPUT + 1];
+    // Key notification settings (see usbmode)
+    uchar notify[OUTFIFO_MAX][N_KEYBYTES_INPUT];
+    // Different for every snapshot, so the input thread can tell when the bindings have changed
+    unsigned long generation;
+} bindsnapshot;
 
 // DPI settings for mice
 #define DPI_COUNT   6
@@ -82,6 +101,10 @@ typedef struct {
 typedef struct {
     lighting light;
     binding bind;
+    // Published copy of bind and notify, or null for the defaults (no notifications, no macros, keys bound to themselves).
+    // Set binddirty after changing either of them.
+    bindsnapshot* snapshot;
+    char binddirty;
     dpiset dpi;
     // Name and UUID
     usbid id;
@@ -129,8 +152,72 @@ typedef struct {
     uchar keys[N_KEYBYTES_INPUT];
     uchar prevkeys[N_KEYBYTES_INPUT];
     short rel_x, rel_y;
+    // Generation of the snapshot whose macros were checked on the last report, or 0 if none were
+    unsigned long macrogen;
+    // Bitset of the macros in that snapshot which are currently triggered
+    uint64_t triggered[MACRO_MAX / 64];
 } usbinput;
 
+// A macro being played (see macro.h)
+typedef struct {
+    // Copy of the macro's actions, so that they outlive the snapshot they came from
+    macroaction* actions;
+    int actioncount;
+    // Next action to play and when to play it (CLOCK_MONOTONIC ns)
+    int position;
+    uint64_t due;
+    // Snapshot generation and macro index, used to match up key releases
+    unsigned long generation;
+    int index;
+    char repeat;
+    // Nonzero if the macro repeats or has delays. Only these stop when their keys are released; the rest play to the end.
+    char held;
+} macrorun;
+
+// Macro player. Everything here is protected by imutex.
+#define MACRO_RUNS  16
+typedef struct {
+    // Macros being played, in the order they were triggered
+    macrorun runs[MACRO_RUNS];
+    int runcount;
+    // Timer file descriptor (+1) on Linux, 1 on OSX. Zero if the player isn't running.
+    int timer;
+    pthread_t thread;
+#ifndef OS_LINUX
+    pthread_cond_t cond;
+    uint64_t due;
+#endif
+} macroplayer;
+
+// Adaptive USB pacing (see usb.c)
+typedef struct {
+    // Current gap between transfers (us)
+    int gap;
+    // Time available per lighting frame at the requested frame rate (us), or 0 if none was requested
+    int frametime;
+    // Number of packets per lighting frame, as last sent
+    int perframe;
+    // Smoothed transfer completion time (us), short and long term
+    int latency, latency_avg;
+    // Consecutive transfers without failure
+    int clean;
+    // Transfer totals
+    unsigned transfers, failures;
+    // When the last transfer finished
+    struct timespec last;
+} usbpacing;
+
+// Input latency tracking (see latency.h). Stamps are in nanoseconds from CLOCK_MONOTONIC.
+#define LAT_STAGES  4       // reap -> translate, translate -> macros, macros -> write, and reap -> write in total
+#define LAT_BUCKETS 128     // 4 buckets per power of two, up to 2^32 ns
+typedef struct {
+    // Stamps for the report currently being processed. Protected by imutex.
+    uint64_t reap, translate, macro;
+    // Histograms and maximums for each stage. Updated atomically so they can be read without locking.
+    unsigned long hist[LAT_STAGES][LAT_BUCKETS];
+    uint64_t max[LAT_STAGES];
+} latencystats;
+
 // Device features
 #define FEAT_RGB        0x001   // RGB backlighting?
 #define FEAT_MONOCHROME 0x002   // RGB protocol but single-color only?
@@ -238,14 +325,31 @@ typedef struct {
     ushort fwversion;
     // Poll rate (ms), or -1 if unsupported
     char pollrate;
-    // USB protocol delay (ms)
+    // USB protocol delay (ms). Used as the starting point for the adaptive pacing below, and as a minimum when raised above the default.
     char usbdelay;
+    // Adaptive gap between USB transfers
+    usbpacing pacing;
     // Current input state
     usbinput input;
+    // Macros being played
+    macroplayer macro;
+    // Input latency histograms (only used with --latency)
+    latencystats latency;
+    // Lighting frames received, and how many of them were replaced by a newer frame before they were sent (see readcmd)
+    unsigned long frames_received, frames_dropped;
     // Indicator LED state
     uchar hw_ileds, hw_ileds_old, ileds;
     // Color dithering in use
     char dither;
+    // Delta lighting updates enabled (only changed packets are sent)
+    char delta;
+    // Last data written to each slot of the device's color buffer, used for delta updates. Only valid if lightbuf_ok is set.
+    uchar lightbuf[4][MSG_SIZE];
+    char lightbuf_ok;
+    // Shared-memory lighting frame (see frame.h). File descriptor + 1, or 0 if not open.
+    int framefd;
+    // Native lighting effect (see effect.h), or null if none has been loaded
+    struct _effect* effect;
 } usbdevice;
 
 #endif  // STRUCTURES_H
@@ -1,9 +1,12 @@
 #include "command.h"
 #include "device.h"
 #include "devnode.h"
+#include "effect.h"
+#include "eventloop.h"
 #include "firmware.h"
 #include "input.h"
 #include "led.h"
+#include "macro.h"
 #include "notify.h"
 #include "profile.h"
 #include "usb.h"
@@ -55,7 +58,7 @@ static void* devmain(usbdevice* kb){
     while(1){
         pthread_mutex_unlock(dmutex(kb));
         // Read from FIFO
-        const char* line;
+        char* line;
         int lines = readlines(kbfifo, linectx, &line);
         pthread_mutex_lock(dmutex(kb));
         // End thread when the handle is removed
@@ -74,6 +77,64 @@ static void* devmain(usbdevice* kb){
     return 0;
 }
 
+#ifdef OS_LINUX
+// Commands read by the event loop. Nearly all of them wait on USB transfers, so they're run on a worker thread.
+typedef struct {
+    usbdevice* kb;
+    // Slot generation when the commands were read. The device may be disconnected, and its slot reused, before the job runs.
+    unsigned long generation;
+    char* line;
+} devjob;
+
+static void devwork(void* context){
+    devjob* job = context;
+    usbdevice* kb = job->kb;
+    pthread_mutex_lock(dmutex(kb));
+    if(DEV_SLOT(kb)->generation == job->generation && IS_CONNECTED(kb) && kb->infifo){
+        if(readcmd(kb, job->line))
+            // USB transfer failed; destroy device
+            closeusb(kb);
+        else
+            eventloop_rearm(kb->infifo - 1, EPOLLIN | EPOLLONESHOT);
+    }
+    pthread_mutex_unlock(dmutex(kb));
+    free(job->line);
+    free(job);
+}
+
+// Event loop counterpart of devmain. Called when the command FIFO is readable.
+static void devready(void* context, uint32_t events){
+    usbdevice* kb = context;
+    pthread_mutex_lock(dmutex(kb));
+    if(!IS_CONNECTED(kb) || !kb->infifo){
+        pthread_mutex_unlock(dmutex(kb));
+        return;
+    }
+    int fd = kb->infifo - 1;
+    char* line;
+    if(!readlines(fd, DEV_SLOT(kb)->fifoctx, &line)){
+        eventloop_rearm(fd, EPOLLIN | EPOLLONESHOT);
+        pthread_mutex_unlock(dmutex(kb));
+        return;
+    }
+    // The FIFO isn't re-armed until the worker is finished, so commands stay in order
+    devjob* job = malloc(sizeof(devjob));
+    job->kb = kb;
+    job->generation = DEV_SLOT(kb)->generation;
+    job->line = strdup(line);
+    pthread_mutex_unlock(dmutex(kb));
+    eventloop_work(devwork, job);
+}
+
+// Adds the device's command FIFO to the event loop
+static int devwatch(usbdevice* kb){
+    int fd = kb->infifo - 1;
+    readlines_ctx_init(&DEV_SLOT(kb)->fifoctx);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return eventloop_add(fd, EPOLLIN | EPOLLONESHOT, devready, kb);
+}
+#endif
+
 static void* _setupusb(void* context){
     usbdevice* kb = context;
     // Set standard fields
@@ -83,6 +144,9 @@ static void* _setupusb(void* context){
     if(IS_MOUSE(vendor, product)) kb->features |= FEAT_ADJRATE;
     if(IS_MONOCHROME(vendor, product)) kb->features |= FEAT_MONOCHROME;
     kb->usbdelay = USB_DELAY_DEFAULT;
+    usb_pace_init(kb);
+    kb->delta = 1;
+    kb->lightbuf_ok = 0;
 
     // Perform OS-specific setup
     DELAY_LONG(kb);
@@ -94,12 +158,20 @@ static void* _setupusb(void* context){
     if(!kb->name[0])
         snprintf(kb->name, KB_NAME_LEN, "%s %s", vendor_str(kb->vendor), product_str(kb->product));
 
-    // Set up an input device for key events
-    if(os_inputopen(kb))
-        goto fail;
-    if(pthread_create(&kb->inputthread, 0, os_inputmain, kb))
+    // Set up an input device for key events, and the macro player that writes to it
+    if(os_inputopen(kb) || macro_start(kb))
         goto fail;
-    pthread_detach(kb->inputthread);
+#ifdef OS_LINUX
+    if(eventloop_enabled){
+        if(os_inputwatch(kb))
+            goto fail;
+    } else
+#endif
+    {
+        if(pthread_create(&kb->inputthread, 0, os_inputmain, kb))
+            goto fail;
+        pthread_detach(kb->inputthread);
+    }
     if(os_setupindicators(kb))
         goto fail;
 
@@ -115,9 +187,18 @@ static void* _setupusb(void* context){
         goto fail_noinput;
 
     // Finished. Enter main loop
-    int index = INDEX_OF(kb, keyboard);
+    int index = DEV_INDEX(kb);
     ckb_info("Setup finished for %s%d\n", devpath, index);
     updateconnected();
+#ifdef OS_LINUX
+    if(eventloop_enabled){
+        // The event loop takes over from here, so this thread can exit
+        if(devwatch(kb))
+            goto fail_noinput;
+        pthread_mutex_unlock(dmutex(kb));
+        return 0;
+    }
+#endif
     return devmain(kb);
 
     fail:
@@ -178,16 +259,91 @@ int usb_tryreset(usbdevice* kb){
     return -1;
 }
 
-// device.c
-extern int hwload_mode;
+// Microseconds from start to end
+static long us_between(const struct timespec* start, const struct timespec* end){
+    return (end->tv_sec - start->tv_sec) * 1000000L + (end->tv_nsec - start->tv_nsec) / 1000L;
+}
+
+void usb_pace_init(usbdevice* kb){
+    usbpacing* pace = &kb->pacing;
+    memset(pace, 0, sizeof(*pace));
+    pace->gap = kb->usbdelay * 1000;
+}
+
+void usb_pace(usbdevice* kb){
+    // A usbdelay of zero turns pacing off (ckb-bench)
+    if(!kb->usbdelay)
+        return;
+    usbpacing* pace = &kb->pacing;
+    int gap = pace->gap;
+    // Setup and hardware load/save raise usbdelay when the device needs extra time; honor it as a minimum
+    if(kb->usbdelay > USB_DELAY_DEFAULT && gap < kb->usbdelay * 1000)
+        gap = kb->usbdelay * 1000;
+    // Only wait for whatever part of the gap hasn't already passed since the last transfer
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long elapsed = us_between(&pace->last, &now);
+    if(elapsed >= 0 && elapsed < gap)
+        usleep(gap - elapsed);
+}
+
+void usb_pace_update(usbdevice* kb, int res, int count, const struct timespec* start){
+    usbpacing* pace = &kb->pacing;
+    clock_gettime(CLOCK_MONOTONIC, &pace->last);
+    pace->transfers += count;
+    int gap = pace->gap;
+    if(res <= 0){
+        // Timeouts and stalls mean the firmware is being overwhelmed. Back off quickly.
+        pace->failures++;
+        pace->clean = 0;
+        gap = (gap < USB_GAP_MIN ? USB_GAP_MIN : gap) * 2;
+    } else {
+        // Track how long each packet takes to complete
+        long latency = us_between(start, &pace->last) / (count > 0 ? count : 1);
+        if(pace->latency_avg == 0)
+            pace->latency = pace->latency_avg = latency;
+        else {
+            pace->latency += (latency - pace->latency) / 4;
+            pace->latency_avg += (latency - pace->latency_avg) / 64;
+        }
+        if(pace->latency > pace->latency_avg * 2 && pace->latency > USB_GAP_MIN){
+            // Transfers are taking much longer than usual, so the device is busy. Slow down a little.
+            pace->clean = 0;
+            gap += gap / 4;
+        } else if(++pace->clean % USB_PACE_WINDOW == 0){
+            // No trouble in a while, so try a shorter gap
+            gap -= gap / 8;
+            // Once things have been stable for some time, also make sure the frame rate can be met
+            if(pace->clean >= USB_PACE_WINDOW * 4 && pace->frametime && pace->perframe > 0){
+                int framegap = pace->frametime / pace->perframe;
+                if(gap > framegap)
+                    gap = framegap;
+            }
+        }
+    }
+    if(gap < USB_GAP_MIN)
+        gap = USB_GAP_MIN;
+    else if(gap > USB_GAP_MAX)
+        gap = USB_GAP_MAX;
+    pace->gap = gap;
+}
+
+void usb_pace_setfps(usbdevice* kb, int fps){
+    kb->pacing.frametime = fps > 0 ? 1000000 / fps : 0;
+}
 
 int _usbsend(usbdevice* kb, const uchar* messages, int count, const char* file, int line){
     int total_sent = 0;
+    if(count > 1)
+        kb->pacing.perframe = count;
     for(int i = 0; i < count; i++){
         // Send each message via the OS function
         while(1){
             DELAY_SHORT(kb);
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
             int res = os_usbsend(kb, messages + i * MSG_SIZE, 0, file, line);
+            usb_pace_update(kb, res, 1, &start);
             if(res == 0)
                 return 0;
             else if(res != -1){
@@ -204,12 +360,37 @@ int _usbsend(usbdevice* kb, const uchar* messages, int count, const char* file,
     return total_sent;
 }
 
+int _usbqueue(usbdevice* kb, const uchar* messages, int count, const char* file, int line){
+    while(1){
+        // Pace the batch as a whole rather than each message in it
+        DELAY_SHORT(kb);
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int res = os_usbqueue(kb, messages, count, file, line);
+        if(res == -2)
+            // Device can't queue transfers; send the messages one at a time instead
+            return _usbsend(kb, messages, count, file, line);
+        kb->pacing.perframe = count;
+        usb_pace_update(kb, res, count, &start);
+        if(res != -1)
+            return res;
+        // Stop immediately if the program is shutting down or hardware load is set to tryonce
+        if(reset_stop || hwload_mode != 2)
+            return 0;
+        // Retry the whole batch on temporary failure
+        DELAY_LONG(kb);
+    }
+}
+
 int _usbrecv(usbdevice* kb, const uchar* out_msg, uchar* in_msg, const char* file, int line){
     // Try a maximum of 3 times
     for(int try = 0; try < 5; try++){
         // Send the output message
         DELAY_SHORT(kb);
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
         int res = os_usbsend(kb, out_msg, 1, file, line);
+        usb_pace_update(kb, res, 1, &start);
         if(res == 0)
             return 0;
         else if(res == -1){
@@ -222,6 +403,9 @@ int _usbrecv(usbdevice* kb, const uchar* out_msg, uchar* in_msg, const char* fil
         // Wait for the response
         DELAY_MEDIUM(kb);
         res = os_usbrecv(kb, in_msg, file, line);
+        if(res <= 0)
+            // Only failures count towards pacing here; the fixed wait above would skew the latency
+            usb_pace_update(kb, res, 1, &start);
         if(res == 0)
             return 0;
         else if(res != -1)
@@ -235,10 +419,68 @@ int _usbrecv(usbdevice* kb, const uchar* out_msg, uchar* in_msg, const char* fil
     return 0;
 }
 
+// Sends one request and polls for its response, which is recognized by the echoed header
+static int recvmatch(usbdevice* kb, const uchar* out_msg, uchar* in_msg, int hdrlen, const char* file, int line){
+    for(int try = 0; try < 5; try++){
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int res = os_usbsend(kb, out_msg, 1, file, line);
+        usb_pace_update(kb, res, 1, &start);
+        if(res == 0)
+            return 0;
+        else if(res == -1){
+            // Retry on temporary failure
+            if(reset_stop)
+                return 0;
+            DELAY_LONG(kb);
+            continue;
+        }
+        // Until the device has processed the request, it keeps returning the previous response (or nothing at all)
+        int interval = USB_POLL_MIN, waited = 0;
+        while(waited < USB_POLL_TIMEOUT){
+            usleep(interval);
+            waited += interval;
+            res = os_usbrecv(kb, in_msg, file, line);
+            if(res == 0)
+                return 0;
+            if(res > 0 && !memcmp(in_msg, out_msg, hdrlen))
+                return res;
+            if(reset_stop)
+                return 0;
+            if(interval < USB_POLL_MAX)
+                interval *= 2;
+        }
+        ckb_err_fn("Bad input header\n", file, line);
+        // Only resend the request if hwload is set to always, same as usbrecv
+        if(hwload_mode != 2)
+            return 0;
+        DELAY_LONG(kb);
+    }
+    // Give up
+    ckb_err_fn("Too many send/recv failures. Dropping.\n", file, line);
+    return 0;
+}
+
+int _usbrecvbatch(usbdevice* kb, const uchar* out_msgs, uchar* in_msgs, int count, int hdrlen, const char* file, int line){
+    // Pace the batch as a whole. Each response shows that the device is ready for the next request.
+    DELAY_SHORT(kb);
+    int total = 0;
+    for(int i = 0; i < count; i++){
+        int res = recvmatch(kb, out_msgs + i * MSG_SIZE, in_msgs + i * MSG_SIZE, hdrlen, file, line);
+        if(res == 0)
+            return 0;
+        total += res;
+    }
+    return total;
+}
+
 int closeusb(usbdevice* kb){
+    // Stop any macros and effects first. The macro player needs imutex to finish up, and the effect needs dmutex.
+    effect_stop(kb);
+    macro_stop(kb);
     pthread_mutex_lock(imutex(kb));
     if(kb->handle){
-        int index = INDEX_OF(kb, keyboard);
+        int index = DEV_INDEX(kb);
         ckb_info("Disconnecting %s%d\n", devpath, index);
         os_inputclose(kb);
         updateconnected();
@@ -247,6 +489,13 @@ int closeusb(usbdevice* kb){
     } else
         updateconnected();
     rmdevpath(kb);
+#ifdef OS_LINUX
+    devslot* slot = DEV_SLOT(kb);
+    if(slot->fifoctx){
+        readlines_ctx_free(slot->fifoctx);
+        slot->fifoctx = 0;
+    }
+#endif
 
     // Wait for thread to close
     pthread_mutex_unlock(imutex(kb));
@@ -254,10 +503,11 @@ int closeusb(usbdevice* kb){
     pthread_join(kb->thread, 0);
     pthread_mutex_lock(dmutex(kb));
 
-    // Delete the profile and the control path
-    if(!kb->vtable)
-        return 0;
-    kb->vtable->freeprofile(kb);
-    memset(kb, 0, sizeof(usbdevice));
+    // Delete the profile and the control path, then give up the slot
+    if(kb->vtable){
+        kb->vtable->freeprofile(kb);
+        memset(kb, 0, sizeof(usbdevice));
+    }
+    device_release(kb);
     return 0;
 }
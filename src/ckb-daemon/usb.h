@@ -65,11 +65,32 @@ const char* product_str(short product);
 #define IS_MOUSE_DEV(kb)                IS_MOUSE((kb)->vendor, (kb)->product)
 
 // USB delays for when the keyboards get picky about timing
-#define DELAY_SHORT(kb)     usleep((int)(kb)->usbdelay * 1000)  // base (default: 5ms)
+#define DELAY_SHORT(kb)     usb_pace(kb)                        // adaptive, between transfers (starts at usbdelay)
 #define DELAY_MEDIUM(kb)    usleep((int)(kb)->usbdelay * 10000) // x10 (default: 50ms)
 #define DELAY_LONG(kb)      usleep(100000)                      // long, fixed 100ms
 #define USB_DELAY_DEFAULT   5
 
+// Bounds for the adaptive transfer gap (us)
+#define USB_GAP_MIN         1000
+#define USB_GAP_MAX         20000
+// Number of consecutive clean transfers before the gap is shortened
+#define USB_PACE_WINDOW     32
+
+// Polling interval for usbrecvbatch responses (us). Starts at the minimum and doubles after each miss.
+#define USB_POLL_MIN        1000
+#define USB_POLL_MAX        8000
+// How long to poll before giving up on a response (us)
+#define USB_POLL_TIMEOUT    500000
+
+// Resets a device's pacing to its usbdelay.
+void usb_pace_init(usbdevice* kb);
+// Waits until it's safe to start the next transfer. Returns immediately if the gap has already passed, or if usbdelay is zero.
+void usb_pace(usbdevice* kb);
+// Records the result of a transfer of count packets which began at start. res is the same as the os_usbsend return value.
+void usb_pace_update(usbdevice* kb, int res, int count, const struct timespec* start);
+// Sets the lighting frame rate the device should keep up with.
+void usb_pace_setfps(usbdevice* kb, int fps);
+
 // Start the USB main loop. Returns program exit code when finished
 int usbmain();
 // Stop the USB system.
@@ -84,6 +105,10 @@ void setupusb(usbdevice* kb);
 int os_setupusb(usbdevice* kb);
 // Per keyboard input thread (OS specific). Will be detached from the main thread, so it needs to clean up its own resources.
 void* os_inputmain(void* kb);
+#ifdef OS_LINUX
+// Event loop alternative to os_inputmain. Submits the input URBs and adds the device handle to the event loop. Returns 0 on success.
+int os_inputwatch(usbdevice* kb);
+#endif
 
 // Puts a USB device back into hardware mode. Returns 0 on success.
 int revertusb(usbdevice* kb);
@@ -98,12 +123,24 @@ int os_resetusb(usbdevice* kb, const char* file, int line);
 // Write data to a USB device. Returns number of bytes written or zero on failure.
 int _usbsend(usbdevice* kb, const uchar* messages, int count, const char* file, int line);
 #define usbsend(kb, messages, count) _usbsend(kb, messages, count, __FILE_NOPATH__, __LINE__)
+// Queues several messages to a USB device at once and waits until all of them have been written.
+// Unlike usbsend, there is no delay between the individual packets. Falls back to usbsend if the device can't queue transfers.
+// Returns number of bytes written or zero on failure.
+int _usbqueue(usbdevice* kb, const uchar* messages, int count, const char* file, int line);
+#define usbqueue(kb, messages, count) _usbqueue(kb, messages, count, __FILE_NOPATH__, __LINE__)
 // Requests data from a USB device by first sending an output packet and the reading the response. Returns number of bytes read or zero on failure.
 int _usbrecv(usbdevice* kb, const uchar* out_msg, uchar* in_msg, const char* file, int line);
 #define usbrecv(kb, out_msg, in_msg) _usbrecv(kb, out_msg, in_msg, __FILE_NOPATH__, __LINE__)
+// Sends a series of requests and reads the response to each. The device echoes the first hdrlen bytes of the request in its
+// response, so instead of waiting a fixed time like usbrecv, the device is polled until the matching response arrives and the
+// next request is sent right away. Returns number of bytes read or zero on failure (including a response that never arrived).
+int _usbrecvbatch(usbdevice* kb, const uchar* out_msgs, uchar* in_msgs, int count, int hdrlen, const char* file, int line);
+#define usbrecvbatch(kb, out_msgs, in_msgs, count, hdrlen) _usbrecvbatch(kb, out_msgs, in_msgs, count, hdrlen, __FILE_NOPATH__, __LINE__)
 
 // OS: Send a USB message to the device. Return number of bytes written, zero for permanent failure, -1 for try again
 int os_usbsend(usbdevice* kb, const uchar* out_msg, int is_recv, const char* file, int line);
+// OS: Submit several USB messages asynchronously and wait for them to complete. Return same as above, or -2 if the device can't queue transfers.
+int os_usbqueue(usbdevice* kb, const uchar* messages, int count, const char* file, int line);
 // OS: Gets input from a USB device. Return same as above.
 int os_usbrecv(usbdevice* kb, uchar* in_msg, const char* file, int line);
 // OS: Update HID indicator LEDs (Num Lock, Caps, etc). Read from kb->ileds.
@@ -1,12 +1,12 @@
 #include "device.h"
 #include "devnode.h"
+#include "eventloop.h"
 #include "input.h"
+#include "latency.h"
 #include "notify.h"
 #include "usb.h"
 
-#ifdef OS_LINUX
-
-static char kbsyspath[DEV_MAX][FILENAME_MAX];
+#if defined(OS_LINUX) && !defined(OS_SIM)
 
 int os_usbsend(usbdevice* kb, const uchar* out_msg, int is_recv, const char* file, int line){
     int res;
@@ -39,6 +39,140 @@ int os_usbsend(usbdevice* kb, const uchar* out_msg, int is_recv, const char* fil
     return res;
 }
 
+// Output URBs submitted by os_usbqueue. These complete on the same handle as the input URBs, so they're reaped by the input thread
+// (or the event loop) and handed back here through the queue's condition variable.
+#define OUTURB_MAX  16
+typedef struct {
+    struct usbdevfs_urb urbs[OUTURB_MAX];
+    uchar buffers[OUTURB_MAX][MSG_SIZE];
+    // Number of URBs still owned by the kernel, bytes written, and the last error status (negative errno)
+    int pending, written, status;
+    // Whether an input thread is running to reap completions
+    int reaping;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} outqueue;
+
+#define INURB_MAX   4
+// Per-device state, allocated by usbadd the first time a slot is used and kept in devslot.usbdata
+typedef struct {
+    outqueue queue;
+    // Input URBs for devices handled by the event loop. The input thread keeps its own.
+    struct usbdevfs_urb inurbs[INURB_MAX];
+    int inurbcount;
+} usbslot;
+#define USB_SLOT(kb) ((usbslot*)DEV_SLOT(kb)->usbdata)
+
+// Called by the input thread when an output URB is reaped
+static void outurb_complete(outqueue* queue, struct usbdevfs_urb* urb){
+    pthread_mutex_lock(&queue->mutex);
+    if(urb->status != 0)
+        queue->status = urb->status;
+    else
+        queue->written += urb->actual_length;
+    queue->pending--;
+    pthread_cond_broadcast(&queue->cond);
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+// Sets whether or not the input thread is available to reap output URBs
+static void outqueue_setreaping(outqueue* queue, int reaping){
+    pthread_mutex_lock(&queue->mutex);
+    queue->reaping = reaping;
+    if(reaping)
+        // New handle; anything left over from a previous one is gone
+        queue->pending = 0;
+    pthread_cond_broadcast(&queue->cond);
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+int os_usbqueue(usbdevice* kb, const uchar* messages, int count, const char* file, int line){
+    // Older firmware takes output over control transfers, which need to be paced one by one
+    if(kb->fwversion < 0x120)
+        return -2;
+    outqueue* queue = &USB_SLOT(kb)->queue;
+    pthread_mutex_lock(&queue->mutex);
+    // Nothing will reap the URBs if the input thread isn't running, or if this is the event loop (which does the reaping
+    // itself, and only hands device commands to workers). Also don't touch the buffers if a previous batch never finished.
+    if(!queue->reaping || queue->pending > 0 || eventloop_isthread()){
+        pthread_mutex_unlock(&queue->mutex);
+        return -2;
+    }
+    int fd = kb->handle - 1;
+    uchar ep = (kb->fwversion >= 0x130 && kb->fwversion < 0x200) ? 4 : 3;
+    int total = 0;
+    for(int first = 0; first < count; first += OUTURB_MAX){
+        int batch = count - first;
+        if(batch > OUTURB_MAX)
+            batch = OUTURB_MAX;
+        queue->written = queue->status = 0;
+        // Submit the whole batch at once. The kernel keeps URBs on the same endpoint in order.
+        for(int i = 0; i < batch; i++){
+            struct usbdevfs_urb* urb = queue->urbs + i;
+            memset(urb, 0, sizeof(*urb));
+            memcpy(queue->buffers[i], messages + (first + i) * MSG_SIZE, MSG_SIZE);
+            urb->type = USBDEVFS_URB_TYPE_BULK;
+            urb->endpoint = ep;
+            urb->buffer = queue->buffers[i];
+            urb->buffer_length = MSG_SIZE;
+            urb->usercontext = queue;
+            if(ioctl(fd, USBDEVFS_SUBMITURB, urb)){
+                queue->status = -errno;
+                break;
+            }
+            queue->pending++;
+#ifdef DEBUG_USB
+            char converted[MSG_SIZE*3 + 1];
+            for(int j=0;j<MSG_SIZE;j++)
+                sprintf(&converted[j*3], "%02x ", queue->buffers[i][j]);
+            ckb_warn_fn("Queued %s\n", file, line, converted);
+#endif
+        }
+        // Wait for the submitted URBs to come back. Give up after the same timeout as a synchronous transfer.
+        struct timespec timeout;
+        clock_gettime(CLOCK_REALTIME, &timeout);
+        timeout.tv_sec += 5;
+        int discarded = 0;
+        while(queue->pending > 0 && queue->reaping){
+            int waited = pthread_cond_timedwait(&queue->cond, &queue->mutex, &timeout);
+            if(waited != ETIMEDOUT)
+                continue;
+            if(discarded)
+                break;
+            // Cancel anything that's still in flight. The discarded URBs are still reaped by the input thread.
+            for(int i = 0; i < batch; i++)
+                ioctl(fd, USBDEVFS_DISCARDURB, queue->urbs + i);
+            discarded = 1;
+            clock_gettime(CLOCK_REALTIME, &timeout);
+            timeout.tv_sec += 1;
+        }
+        int status = queue->status;
+        if(discarded)
+            status = -ETIMEDOUT;
+        if(queue->pending > 0)
+            // URBs were lost (input thread stopped or the kernel never returned them)
+            status = -ENODEV;
+        if(status != 0){
+            pthread_mutex_unlock(&queue->mutex);
+            ckb_err_fn("%s\n", file, line, strerror(-status));
+            if(status == -EPIPE){
+                // Clear the stall and try again
+                unsigned int endpoint = ep;
+                ioctl(fd, USBDEVFS_CLEAR_HALT, &endpoint);
+                return -1;
+            }
+            if(status == -ETIMEDOUT)
+                return -1;
+            return 0;
+        }
+        if(queue->written != batch * MSG_SIZE)
+            ckb_warn_fn("Wrote %d bytes (expected %d)\n", file, line, queue->written, batch * MSG_SIZE);
+        total += queue->written;
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return total;
+}
+
 int os_usbrecv(usbdevice* kb, uchar* in_msg, const char* file, int line){
     int res;
     // This is what CUE does, but it doesn't seem to work on linux.
@@ -84,18 +218,16 @@ void os_sendindicators(usbdevice* kb){
         ckb_err("%s\n", res ? strerror(errno) : "No data written");
 }
 
-void* os_inputmain(void* context){
-    usbdevice* kb = context;
+// Allocates and submits the input URBs for a device. Returns the number of URBs used.
+static int inurbs_submit(usbdevice* kb, struct usbdevfs_urb* urbs){
     int fd = kb->handle - 1;
     short vendor = kb->vendor, product = kb->product;
-    int index = INDEX_OF(kb, keyboard);
-    ckb_info("Starting input thread for %s%d\n", devpath, index);
-
     // Monitor input transfers on all endpoints for non-RGB devices
     // For RGB, monitor all but the last, as it's used for input/output
     int urbcount = IS_RGB(vendor, product) ? (kb->epcount - 1) : kb->epcount;
-    struct usbdevfs_urb urbs[urbcount];
-    memset(urbs, 0, sizeof(urbs));
+    if(urbcount > INURB_MAX)
+        urbcount = INURB_MAX;
+    memset(urbs, 0, sizeof(*urbs) * INURB_MAX);
     urbs[0].buffer_length = 8;
     if(IS_RGB(vendor, product)){
         if(IS_MOUSE(vendor, product))
@@ -116,70 +248,154 @@ void* os_inputmain(void* context){
         urbs[i].buffer = malloc(urbs[i].buffer_length);
         ioctl(fd, USBDEVFS_SUBMITURB, urbs + i);
     }
+    return urbcount;
+}
+
+// Cancels and frees input URBs
+static void inurbs_discard(int fd, struct usbdevfs_urb* urbs, int urbcount){
+    for(int i = 0; i < urbcount; i++){
+        ioctl(fd, USBDEVFS_DISCARDURB, urbs + i);
+        free(urbs[i].buffer);
+        urbs[i].buffer = 0;
+    }
+}
+
+// Translates a completed input URB
+static void inurb_complete(usbdevice* kb, struct usbdevfs_urb* urb){
+    short vendor = kb->vendor, product = kb->product;
+    uint64_t reaped = latency_enabled ? latency_now() : 0;
+    pthread_mutex_lock(imutex(kb));
+    if(IS_MOUSE(vendor, product)){
+        switch(urb->actual_length){
+        case 8:
+        case 10:
+        case 11:
+            // HID mouse input
+            hid_mouse_translate(kb->input.keys, &kb->input.rel_x, &kb->input.rel_y, -(urb->endpoint & 0xF), urb->actual_length, urb->buffer);
+            break;
+        case MSG_SIZE:
+            // Corsair mouse input
+            corsair_mousecopy(kb->input.keys, -(urb->endpoint & 0xF), urb->buffer);
+            break;
+        }
+    } else if(IS_RGB(vendor, product)){
+        switch(urb->actual_length){
+        case 8:
+            // RGB EP 1: 6KRO (BIOS mode) input
+            hid_kb_translate(kb->input.keys, -1, urb->actual_length, urb->buffer);
+            break;
+        case 21:
+        case 5:
+            // RGB EP 2: NKRO (non-BIOS) input. Accept only if keyboard is inactive
+            if(!kb->active)
+                hid_kb_translate(kb->input.keys, -2, urb->actual_length, urb->buffer);
+            break;
+        case MSG_SIZE:
+            // RGB EP 3: Corsair input
+            corsair_kbcopy(kb->input.keys, -(urb->endpoint & 0xF), urb->buffer);
+            break;
+        }
+    } else
+        // Non-RGB input
+        hid_kb_translate(kb->input.keys, urb->endpoint & 0xF, urb->actual_length, urb->buffer);
+    if(reaped){
+        kb->latency.reap = reaped;
+        kb->latency.translate = latency_now();
+    }
+    inputupdate(kb);
+    pthread_mutex_unlock(imutex(kb));
+}
+
+// Handles the result of a REAPURB ioctl (res and errno) along with the URB it returned, if any.
+// Returns nonzero if the handle has been closed.
+static int urb_reaped(usbdevice* kb, int fd, outqueue* queue, int res, struct usbdevfs_urb* urb){
+    if(res){
+        if(errno == ENODEV || errno == ENOENT || errno == ESHUTDOWN)
+            return 1;
+        if(errno != EPIPE || !urb)
+            return 0;
+        if(urb->usercontext == queue){
+            // Output URB. The sender clears the halt itself.
+            outurb_complete(queue, urb);
+            return 0;
+        }
+        // On EPIPE, clear halt on the endpoint and re-submit the URB
+        ioctl(fd, USBDEVFS_CLEAR_HALT, &urb->endpoint);
+        ioctl(fd, USBDEVFS_SUBMITURB, urb);
+        return 0;
+    }
+    if(!urb)
+        return 0;
+    if(urb->usercontext == queue){
+        // Output URB completed; notify the sender and don't resubmit
+        outurb_complete(queue, urb);
+        return 0;
+    }
+    // Process input (if any) and re-submit the URB
+    inurb_complete(kb, urb);
+    ioctl(fd, USBDEVFS_SUBMITURB, urb);
+    return 0;
+}
+
+void* os_inputmain(void* context){
+    usbdevice* kb = context;
+    int fd = kb->handle - 1;
+    int index = DEV_INDEX(kb);
+    outqueue* queue = &USB_SLOT(kb)->queue;
+    ckb_info("Starting input thread for %s%d\n", devpath, index);
+
+    struct usbdevfs_urb urbs[INURB_MAX];
+    int urbcount = inurbs_submit(kb, urbs);
+    // Output URBs queued from the device thread will be reaped here as well
+    outqueue_setreaping(queue, 1);
     // Start monitoring input
     while(1){
         struct usbdevfs_urb* urb = 0;
-        if(ioctl(fd, USBDEVFS_REAPURB, &urb)){
-            if(errno == ENODEV || errno == ENOENT || errno == ESHUTDOWN)
-                // Stop the thread if the handle closes
-                break;
-            else if(errno == EPIPE && urb){
-                // On EPIPE, clear halt on the endpoint
-                ioctl(fd, USBDEVFS_CLEAR_HALT, &urb->endpoint);
-                // Re-submit the URB
-                if(urb)
-                    ioctl(fd, USBDEVFS_SUBMITURB, urb);
-                urb = 0;
-            }
-        }
-        if(urb){
-            // Process input (if any)
-            pthread_mutex_lock(imutex(kb));
-            if(IS_MOUSE(vendor, product)){
-                switch(urb->actual_length){
-                case 8:
-                case 10:
-                case 11:
-                    // HID mouse input
-                    hid_mouse_translate(kb->input.keys, &kb->input.rel_x, &kb->input.rel_y, -(urb->endpoint & 0xF), urb->actual_length, urb->buffer);
-                    break;
-                case MSG_SIZE:
-                    // Corsair mouse input
-                    corsair_mousecopy(kb->input.keys, -(urb->endpoint & 0xF), urb->buffer);
-                    break;
-                }
-            } else if(IS_RGB(vendor, product)){
-                switch(urb->actual_length){
-                case 8:
-                    // RGB EP 1: 6KRO (BIOS mode) input
-                    hid_kb_translate(kb->input.keys, -1, urb->actual_length, urb->buffer);
-                    break;
-                case 21:
-                case 5:
-                    // RGB EP 2: NKRO (non-BIOS) input. Accept only if keyboard is inactive
-                    if(!kb->active)
-                        hid_kb_translate(kb->input.keys, -2, urb->actual_length, urb->buffer);
-                    break;
-                case MSG_SIZE:
-                    // RGB EP 3: Corsair input
-                    corsair_kbcopy(kb->input.keys, -(urb->endpoint & 0xF), urb->buffer);
-                    break;
-                }
-            } else
-                // Non-RGB input
-                hid_kb_translate(kb->input.keys, urb->endpoint & 0xF, urb->actual_length, urb->buffer);
-            inputupdate(kb);
-            pthread_mutex_unlock(imutex(kb));
-            // Re-submit the URB
-            ioctl(fd, USBDEVFS_SUBMITURB, urb);
-            urb = 0;
-        }
+        int res = ioctl(fd, USBDEVFS_REAPURB, &urb);
+        // Stop the thread if the handle closes
+        if(urb_reaped(kb, fd, queue, res, urb))
+            break;
     }
     // Clean up
     ckb_info("Stopping input thread for %s%d\n", devpath, index);
-    for(int i = 0; i < urbcount; i++){
-        ioctl(fd, USBDEVFS_DISCARDURB, urbs + i);
-        free(urbs[i].buffer);
+    outqueue_setreaping(queue, 0);
+    inurbs_discard(fd, urbs, urbcount);
+    return 0;
+}
+
+// Reaps every URB that has completed so far. Returns nonzero if the handle has been closed.
+static int reapall(usbdevice* kb, outqueue* queue){
+    int fd = kb->handle - 1;
+    while(1){
+        struct usbdevfs_urb* urb = 0;
+        int res = ioctl(fd, USBDEVFS_REAPURBNDELAY, &urb);
+        if(res && errno == EAGAIN)
+            return 0;
+        if(urb_reaped(kb, fd, queue, res, urb))
+            return 1;
+    }
+}
+
+// Event loop handler for a USB device handle. usbfs reports completed URBs as writable.
+static void usb_ready(void* context, uint32_t events){
+    usbdevice* kb = context;
+    outqueue* queue = &USB_SLOT(kb)->queue;
+    if(reapall(kb, queue) || (events & (EPOLLERR | EPOLLHUP))){
+        // Device is gone. It will be cleaned up by the udev remove event.
+        eventloop_del(kb->handle - 1);
+        outqueue_setreaping(queue, 0);
+    }
+}
+
+int os_inputwatch(usbdevice* kb){
+    usbslot* slot = USB_SLOT(kb);
+    slot->inurbcount = inurbs_submit(kb, slot->inurbs);
+    outqueue_setreaping(&slot->queue, 1);
+    if(eventloop_add(kb->handle - 1, EPOLLOUT, usb_ready, kb)){
+        outqueue_setreaping(&slot->queue, 0);
+        inurbs_discard(kb->handle - 1, slot->inurbs, slot->inurbcount);
+        slot->inurbcount = 0;
+        return -1;
     }
     return 0;
 }
@@ -206,6 +422,14 @@ int usbunclaim(usbdevice* kb, int resetting){
 }
 
 void os_closeusb(usbdevice* kb){
+    if(kb->handle && eventloop_enabled){
+        // There's no input thread to clean up after itself
+        usbslot* slot = USB_SLOT(kb);
+        eventloop_del(kb->handle - 1);
+        outqueue_setreaping(&slot->queue, 0);
+        inurbs_discard(kb->handle - 1, slot->inurbs, slot->inurbcount);
+        slot->inurbcount = 0;
+    }
     if(kb->handle){
         usbunclaim(kb, 0);
         close(kb->handle - 1);
@@ -214,7 +438,6 @@ void os_closeusb(usbdevice* kb){
         udev_device_unref(kb->udev);
     kb->handle = 0;
     kb->udev = 0;
-    kbsyspath[INDEX_OF(kb, keyboard)][0] = 0;
 }
 
 int usbclaim(usbdevice* kb){
@@ -279,7 +502,7 @@ int os_setupusb(usbdevice* kb){
         sscanf(firmware, "%hx", &kb->fwversion);
     else
         kb->fwversion = 0;
-    int index = INDEX_OF(kb, keyboard);
+    int index = DEV_INDEX(kb);
     ckb_info("Connecting %s at %s%d\n", kb->name, devpath, index);
 
     // Claim the USB interfaces
@@ -306,40 +529,37 @@ int usbadd(struct udev_device* dev, short vendor, short product){
         ckb_err("Failed to get device path\n");
         return -1;
     }
-    // Find a free USB slot
-    for(int index = 1; index < DEV_MAX; index++){
-        usbdevice* kb = keyboard + index;
-        if(pthread_mutex_trylock(dmutex(kb))){
-            // If the mutex is locked then the device is obviously in use, so keep going
-            if(!strcmp(syspath, kbsyspath[index])){
-                // Make sure this existing keyboard doesn't have the same syspath (this shouldn't happen)
-                return 0;
-            }
-            continue;
-        }
-        if(!IS_CONNECTED(kb)){
-            // Open the sysfs device
-            kb->handle = open(path, O_RDWR) + 1;
-            if(kb->handle <= 0){
-                ckb_err("Failed to open USB device: %s\n", strerror(errno));
-                kb->handle = 0;
-                pthread_mutex_unlock(dmutex(kb));
-                return -1;
-            } else {
-                // Set up device
-                kb->udev = dev;
-                kb->vendor = vendor;
-                kb->product = product;
-                strncpy(kbsyspath[index], syspath, FILENAME_MAX);
-                // Mutex remains locked
-                setupusb(kb);
-                return 0;
-            }
-        }
+    // Find a free USB slot. The syspath is used to find the device again when it's removed.
+    usbdevice* kb = device_add(syspath);
+    if(!kb){
+        if(errno == EEXIST)
+            // Already connected (this shouldn't happen)
+            return 0;
+        ckb_err("No free devices\n");
+        return -1;
+    }
+    devslot* slot = DEV_SLOT(kb);
+    if(!slot->usbdata){
+        usbslot* data = slot->usbdata = calloc(1, sizeof(usbslot));
+        pthread_mutex_init(&data->queue.mutex, 0);
+        pthread_cond_init(&data->queue.cond, 0);
+    }
+    // Open the sysfs device
+    kb->handle = open(path, O_RDWR) + 1;
+    if(kb->handle <= 0){
+        ckb_err("Failed to open USB device: %s\n", strerror(errno));
+        kb->handle = 0;
+        device_release(kb);
         pthread_mutex_unlock(dmutex(kb));
+        return -1;
     }
-    ckb_err("No free devices\n");
-    return -1;
+    // Set up device
+    kb->udev = dev;
+    kb->vendor = vendor;
+    kb->product = product;
+    // Mutex remains locked
+    setupusb(kb);
+    return 0;
 }
 
 static struct udev* udev;
@@ -385,16 +605,19 @@ static int usb_add_device(struct udev_device* dev){
 
 // Remove a udev device.
 static void usb_rm_device(struct udev_device* dev){
-    // Device removed. Look for it in our list of keyboards
+    // Device removed. Look it up by syspath
     const char* syspath = udev_device_get_syspath(dev);
     if(!syspath || syspath[0] == 0)
         return;
-    for(int i = 1; i < DEV_MAX; i++){
-        pthread_mutex_lock(devmutex + i);
-        if(!strcmp(syspath, kbsyspath[i]))
-            closeusb(keyboard + i);
-        pthread_mutex_unlock(devmutex + i);
-    }
+    usbdevice* kb = device_find(syspath);
+    if(!kb)
+        return;
+    pthread_mutex_lock(dmutex(kb));
+    // Make sure the slot wasn't given to a different device before it was locked
+    const char* key = device_key(kb);
+    if(key && !strcmp(syspath, key))
+        closeusb(kb);
+    pthread_mutex_unlock(dmutex(kb));
 }
 
 static void udev_enum(){
@@ -420,6 +643,30 @@ static void udev_enum(){
     udev_enumerate_unref(enumerator);
 }
 
+// Reads a device event from the udev monitor
+static void udev_ready(void* context, uint32_t events){
+    struct udev_monitor* monitor = context;
+    struct udev_device* dev = udev_monitor_receive_device(monitor);
+    if(!dev)
+        return;
+    const char* action = udev_device_get_action(dev);
+    if(!action){
+        udev_device_unref(dev);
+        return;
+    }
+    // Add/remove device
+    if(!strcmp(action, "add")){
+        int res = usb_add_device(dev);
+        if(res == 0)
+            return;
+        // If the device matched but the handle wasn't opened correctly, re-enumerate (this sometimes solves the problem)
+        if(res == -1)
+            udev_enum();
+    } else if(!strcmp(action, "remove"))
+        usb_rm_device(dev);
+    udev_device_unref(dev);
+}
+
 int usbmain(){
     // Load the uinput module (if it's not loaded already)
     if(system("modprobe uinput") != 0)
@@ -431,6 +678,12 @@ int usbmain(){
         return -1;
     }
 
+    // Set up the event loop before any devices are added, so they can register with it
+    if(eventloop_enabled && eventloop_init()){
+        ckb_warn("Falling back to threads\n");
+        eventloop_enabled = 0;
+    }
+
     // Enumerate all currently connected devices
     udev_enum();
 
@@ -440,38 +693,29 @@ int usbmain(){
     udev_monitor_enable_receiving(monitor);
     // Get an fd for the monitor
     int fd = udev_monitor_get_fd(monitor);
+    if(eventloop_enabled){
+        // Let the event loop watch the monitor along with everything else
+        int res = eventloop_add(fd, EPOLLIN, udev_ready, monitor);
+        if(!res)
+            eventloop_run();
+        udev_monitor_unref(monitor);
+        return res;
+    }
     fd_set fds;
     while(udev){
         FD_ZERO(&fds);
         FD_SET(fd, &fds);
         // Block until an event is read
-        if(select(fd + 1, &fds, 0, 0, 0) > 0 && FD_ISSET(fd, &fds)){
-            struct udev_device* dev = udev_monitor_receive_device(monitor);
-            if(!dev)
-                continue;
-            const char* action = udev_device_get_action(dev);
-            if(!action){
-                udev_device_unref(dev);
-                continue;
-            }
-            // Add/remove device
-            if(!strcmp(action, "add")){
-                int res = usb_add_device(dev);
-                if(res == 0)
-                    continue;
-                // If the device matched but the handle wasn't opened correctly, re-enumerate (this sometimes solves the problem)
-                if(res == -1)
-                    udev_enum();
-            } else if(!strcmp(action, "remove"))
-                usb_rm_device(dev);
-            udev_device_unref(dev);
-        }
+        if(select(fd + 1, &fds, 0, 0, 0) > 0 && FD_ISSET(fd, &fds))
+            udev_ready(monitor, EPOLLIN);
     }
     udev_monitor_unref(monitor);
     return 0;
 }
 
 void usbkill(){
+    if(eventloop_enabled)
+        eventloop_stop();
     udev_unref(udev);
     udev = 0;
 }
@@ -1,6 +1,7 @@
 #include "device.h"
 #include "devnode.h"
 #include "input.h"
+#include "latency.h"
 #include "notify.h"
 #include "usb.h"
 
@@ -115,6 +116,11 @@ int os_usbsend(usbdevice* kb, const uchar* out_msg, int is_recv, const char* fil
     return MSG_SIZE;
 }
 
+int os_usbqueue(usbdevice* kb, const uchar* messages, int count, const char* file, int line){
+    // Not implemented; usbqueue falls back to sending the messages one at a time
+    return -2;
+}
+
 int os_usbrecv(usbdevice* kb, uchar* in_msg, const char* file, int line){
     int ep = kb->epcount;
     IOUSBDevRequestTO rq = { 0xa1, 0x01, 0x0200, ep - 1, MSG_SIZE, in_msg, 0, 5000, 5000 };
@@ -199,6 +205,7 @@ int os_resetusb(usbdevice* kb, const char* file, int line){
 
 static void intreport(void* context, IOReturn result, void* sender, IOHIDReportType reporttype, uint32_t reportid, uint8_t* data, CFIndex length){
     usbdevice* kb = context;
+    uint64_t reaped = latency_enabled ? latency_now() : 0;
     pthread_mutex_lock(imutex(kb));
     if(IS_MOUSE(kb->vendor, kb->product)){
         switch(length){
@@ -245,6 +252,10 @@ static void intreport(void* context, IOReturn result, void* sender, IOHIDReportT
             break;
         }
     }
+    if(reaped){
+        kb->latency.reap = reaped;
+        kb->latency.translate = latency_now();
+    }
     inputupdate(kb);
     pthread_mutex_unlock(imutex(kb));
 }
@@ -276,7 +287,7 @@ extern void keyretrigger(CFRunLoopTimerRef timer, void* info);
 
 void* os_inputmain(void* context){
     usbdevice* kb = context;
-    int index = INDEX_OF(kb, keyboard);
+    int index = DEV_INDEX(kb);
     // Monitor input transfers on all endpoints for non-RGB devices
     // For RGB, monitor all but the last, as it's used for input/output
     int count = IS_RGB_DEV(kb) ? (kb->epcount - 1) : kb->epcount;
@@ -416,41 +427,38 @@ static void remove_device(void* context, io_service_t device, uint32_t message_t
 }
 
 // Finds a USB device by location ID. Returns a new device if none was found or -1 if no devices available.
-// If successful, devmutex[index] will be locked when the function returns. Unlock it when finished.
+// If successful, the device's dmutex will be locked when the function returns. Unlock it when finished.
 static int find_device(uint16_t idvendor, uint16_t idproduct, uint32_t location, int handle_idx){
     // Look for any partially-set up boards matching this device
-    for(int i = 1; i < DEV_MAX; i++){
-        if(pthread_mutex_trylock(devmutex + i))
+    int count = device_count();
+    for(int i = 1; i < count; i++){
+        usbdevice* kb = device_get(i);
+        if(pthread_mutex_trylock(dmutex(kb)))
             // If the mutex is locked then the device is obviously set up already, keep going
             continue;
-        if(keyboard[i].vendor == idvendor && keyboard[i].product == idproduct){
+        if(kb->handle && kb->vendor == idvendor && kb->product == idproduct){
             for(int iface = 0; iface <= IFACE_MAX; iface++){
-                if(keyboard[i].location_id[iface] == location){
+                if(kb->location_id[iface] == location){
                     // Matched; continue setting up this device
-                    keyboard[i].location_id[handle_idx] = location;
+                    kb->location_id[handle_idx] = location;
                     // Device mutex remains locked
                     return i;
                 }
             }
         }
-        pthread_mutex_unlock(devmutex + i);
+        pthread_mutex_unlock(dmutex(kb));
     }
     // If none was found, grab the first free device
-    for(int i = 1; i < DEV_MAX; i++){
-        if(pthread_mutex_trylock(devmutex + i))
-            continue;
-        if(!keyboard[i].handle){
-            // Mark the device as in use and print out a message
-            keyboard[i].handle = INCOMPLETE;
-            keyboard[i].location_id[handle_idx] = location;
-            keyboard[i].vendor = idvendor;
-            keyboard[i].product = idproduct;
-            // Device mutex remains locked
-            return i;
-        }
-        pthread_mutex_unlock(devmutex + i);
-    }
-    return -1;
+    usbdevice* kb = device_add(0);
+    if(!kb)
+        return -1;
+    // Mark the device as in use and print out a message
+    kb->handle = INCOMPLETE;
+    kb->location_id[handle_idx] = location;
+    kb->vendor = idvendor;
+    kb->product = idproduct;
+    // Device mutex remains locked
+    return DEV_INDEX(kb);
 }
 
 static int seize_wait(long location){
@@ -508,7 +516,7 @@ static usbdevice* add_usb(usb_dev_t handle, io_object_t** rm_notify){
         ckb_err("No free devices\n");
         return 0;
     }
-    usbdevice* kb = keyboard + index;
+    usbdevice* kb = device_get(index);
 
     // Set the handle for the keyboard
     if(kb->handle && kb->handle != INCOMPLETE){
@@ -525,7 +533,7 @@ static usbdevice* add_usb(usb_dev_t handle, io_object_t** rm_notify){
             usbgetstr(handle, serial_idx, kb->serial, SERIAL_LEN);
         if((*handle)->USBGetProductStringIndex(handle, &product_idx) == kIOReturnSuccess)
             usbgetstr(handle, product_idx, kb->name, KB_NAME_LEN);
-        ckb_info("Connecting %s at %s%d\n", keyboard[index].name, devpath, index);
+        ckb_info("Connecting %s at %s%d\n", kb->name, devpath, index);
     }
 
     // Iterate through the USB interfaces. Most of these will fail to open because they're already grabbed by the HID system.
@@ -592,12 +600,12 @@ release:
     if(HAS_ALL_HANDLES(kb))
         setupusb(kb);
     else
-        pthread_mutex_unlock(devmutex + index);
+        pthread_mutex_unlock(dmutex(kb));
     *rm_notify = kb->rm_notify;
     return kb;
 
 error:
-    pthread_mutex_unlock(devmutex + index);
+    pthread_mutex_unlock(dmutex(kb));
     return 0;
 }
 
@@ -689,13 +697,13 @@ static usbdevice* add_hid(hid_dev_t handle, io_object_t** rm_notify){
         ckb_err("No free devices\n");
         return 0;
     }
-    usbdevice* kb = keyboard + index;
+    usbdevice* kb = device_get(index);
 
     // Read the serial number and name (if not done yet)
-    if(!keyboard[index].serial[0] && !keyboard[index].name[0]){
-        hidgetstr(handle, CFSTR(kIOHIDSerialNumberKey), keyboard[index].serial, SERIAL_LEN);
-        hidgetstr(handle, CFSTR(kIOHIDProductKey), keyboard[index].name, KB_NAME_LEN);
-        ckb_info("Connecting %s at %s%d\n", keyboard[index].name, devpath, index);
+    if(!kb->serial[0] && !kb->name[0]){
+        hidgetstr(handle, CFSTR(kIOHIDSerialNumberKey), kb->serial, SERIAL_LEN);
+        hidgetstr(handle, CFSTR(kIOHIDProductKey), kb->name, KB_NAME_LEN);
+        ckb_info("Connecting %s at %s%d\n", kb->name, devpath, index);
     }
 
 
@@ -712,12 +720,12 @@ static usbdevice* add_hid(hid_dev_t handle, io_object_t** rm_notify){
         setupusb(kb);
     else
         // Otherwise, return and keep going
-        pthread_mutex_unlock(devmutex + index);
+        pthread_mutex_unlock(dmutex(kb));
     *rm_notify = kb->rm_notify + IFACE_MAX + 1 + handle_idx;
     return kb;
 
 error:
-    pthread_mutex_unlock(devmutex + index);
+    pthread_mutex_unlock(dmutex(kb));
     return 0;
 }
 
@@ -0,0 +1,557 @@
+#include "command.h"
+#include "device.h"
+#include "devnode.h"
+#include "eventloop.h"
+#include "input.h"
+#include "latency.h"
+#include "sim.h"
+#include "usb.h"
+
+#ifdef OS_SIM
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Simulated devices are controlled through a socket at <devpath>0/sim. Commands are one per line:
+//  add <model> [serial=<serial>] [fw=<hex>] [latency=<us>]
+//      Plugs in a device. Models are k65, k70, k95, strafe, m65, sabre, and scimitar. Replies "ok <n>" with the device number.
+//  remove <device>
+//      Unplugs a device. <device> is either the device number or its serial.
+//  key <device> [+|-]<key> ...
+//      Presses (+) or releases (-) keys or mouse buttons, sending one input report for each.
+//  move <device> <x> <y>
+//      Moves the mouse.
+//  report <device> <endpoint> <hex data>
+//      Sends a raw input report.
+//  led <device> [+|-]<num|caps|scroll> ...
+//      Changes the indicator LEDs as if the system had done it.
+//  latency <device> <us>
+//      Sets how long each USB packet takes.
+//  stats <device>
+//      Replies with the number of packets the device received and the input events the daemon generated for it.
+//  list
+//      Lists the connected devices, followed by "ok".
+// Anything that doesn't have another reply answers "ok" on success or "error <reason>".
+
+#define SIM_DEFAULT_FW  0x0205
+
+// Input report, passed from the control socket to the device's input thread through a pipe
+typedef struct {
+    int endpoint;
+    int length;
+    uchar data[MSG_SIZE];
+} simreport;
+
+typedef struct {
+    // Setup info, copied to the device by os_setupusb
+    char serial[SERIAL_LEN];
+    ushort fwversion;
+    // Time taken by each packet (us)
+    int latency;
+    // Write end of the input report pipe. The read end is the device handle.
+    int inputfd;
+    // Current key/button state
+    uchar keys[N_KEYBYTES_INPUT];
+    // Reply to the last request sent with is_recv set. It's only returned once the device has had time to process the
+    // request (one latency period after it arrives); until then, reads get the previous reply.
+    uchar reply[MSG_SIZE], pending[MSG_SIZE];
+    uint64_t replyready;
+    // Packet counters
+    unsigned long packets, recvs, lighting, frames;
+} simdevice;
+// Kept in devslot.usbdata, or null if the slot has never had a simulated device
+#define SIM_SLOT(kb) ((simdevice*)DEV_SLOT(kb)->usbdata)
+
+// Returns a device's simulated state, allocating it if needed. Devices set up by something other than simadd
+// (such as ckb-bench) get a blank one.
+static simdevice* simdata(usbdevice* kb){
+    devslot* slot = DEV_SLOT(kb);
+    if(!slot->usbdata)
+        slot->usbdata = calloc(1, sizeof(simdevice));
+    return slot->usbdata;
+}
+
+// Simulated models
+typedef struct {
+    const char* name;
+    short product;
+    const char* description;
+} simmodel;
+static const simmodel models[] = {
+    { "k65", P_K65, "Corsair K65 RGB (simulated)" },
+    { "k70", P_K70, "Corsair K70 RGB (simulated)" },
+    { "k95", P_K95, "Corsair K95 RGB (simulated)" },
+    { "strafe", P_STRAFE, "Corsair STRAFE RGB (simulated)" },
+    { "m65", P_M65, "Corsair M65 RGB (simulated)" },
+    { "sabre", P_SABRE_O, "Corsair Sabre RGB (simulated)" },
+    { "scimitar", P_SCIMITAR, "Corsair Scimitar RGB (simulated)" },
+};
+#define N_MODELS (sizeof(models) / sizeof(simmodel))
+
+static int sleeping(simdevice* sim, int packets){
+    if(sim->latency > 0)
+        usleep(sim->latency * packets);
+    return 0;
+}
+
+// Counts an incoming packet and prepares the reply, if any
+static void simpacket(simdevice* sim, usbdevice* kb, const uchar* msg, int is_recv){
+    sim->packets++;
+    if(msg[0] == 0x7f)
+        // Color data
+        sim->lighting++;
+    else if(msg[0] == 0x07 && (msg[1] == 0x27 || msg[1] == 0x22 || (msg[1] == 0x28 && msg[2] == 0x03)))
+        // Final packet of a lighting update
+        sim->frames++;
+    if(!is_recv)
+        return;
+    sim->recvs++;
+    // Replies echo the request header. Everything else is zero (empty names, black lights, default DPI) except for firmware info.
+    memset(sim->pending, 0, MSG_SIZE);
+    memcpy(sim->pending, msg, 4);
+    if(msg[0] == 0x0e && msg[1] == 0x01){
+        short vendor = kb->vendor, product = kb->product, bootloader = 1;
+        memcpy(sim->pending + 8, &sim->fwversion, 2);
+        memcpy(sim->pending + 10, &bootloader, 2);
+        memcpy(sim->pending + 12, &vendor, 2);
+        memcpy(sim->pending + 14, &product, 2);
+        sim->pending[16] = 1;
+    }
+    sim->replyready = latency_now() + (uint64_t)(sim->latency > 0 ? sim->latency : 0) * 1000;
+}
+
+int os_usbsend(usbdevice* kb, const uchar* out_msg, int is_recv, const char* file, int line){
+    simdevice* sim = simdata(kb);
+    sleeping(sim, 1);
+    simpacket(sim, kb, out_msg, is_recv);
+    return MSG_SIZE;
+}
+
+int os_usbqueue(usbdevice* kb, const uchar* messages, int count, const char* file, int line){
+    if(kb->fwversion < 0x120)
+        return -2;
+    // The whole batch completes at once, after the same total time as sending the packets one by one
+    simdevice* sim = simdata(kb);
+    sleeping(sim, count);
+    for(int i = 0; i < count; i++)
+        simpacket(sim, kb, messages + i * MSG_SIZE, 0);
+    return count * MSG_SIZE;
+}
+
+int os_usbrecv(usbdevice* kb, uchar* in_msg, const char* file, int line){
+    simdevice* sim = simdata(kb);
+    if(sim->replyready && latency_now() >= sim->replyready){
+        memcpy(sim->reply, sim->pending, MSG_SIZE);
+        sim->replyready = 0;
+    }
+    memcpy(in_msg, sim->reply, MSG_SIZE);
+    return MSG_SIZE;
+}
+
+int _nk95cmd(usbdevice* kb, uchar bRequest, ushort wValue, const char* file, int line){
+    return 0;
+}
+
+void os_sendindicators(usbdevice* kb){
+    simdata(kb)->packets++;
+}
+
+void* os_inputmain(void* context){
+    usbdevice* kb = context;
+    int fd = kb->handle - 1;
+    short vendor = kb->vendor, product = kb->product;
+    int index = DEV_INDEX(kb);
+    ckb_info("Starting input thread for %s%d\n", devpath, index);
+    simreport report;
+    while(read(fd, &report, sizeof(report)) == sizeof(report)){
+        uint64_t reaped = latency_enabled ? latency_now() : 0;
+        pthread_mutex_lock(imutex(kb));
+        if(IS_MOUSE(vendor, product)){
+            if(report.length == 10)
+                hid_mouse_translate(kb->input.keys, &kb->input.rel_x, &kb->input.rel_y, -report.endpoint, report.length, report.data);
+            else if(report.length == MSG_SIZE)
+                corsair_mousecopy(kb->input.keys, -report.endpoint, report.data);
+        } else {
+            if(report.length == MSG_SIZE)
+                corsair_kbcopy(kb->input.keys, -report.endpoint, report.data);
+            else if(report.length == 8 || (report.length == 21 && !kb->active))
+                hid_kb_translate(kb->input.keys, -report.endpoint, report.length, report.data);
+        }
+        if(reaped){
+            kb->latency.reap = reaped;
+            kb->latency.translate = latency_now();
+        }
+        inputupdate(kb);
+        pthread_mutex_unlock(imutex(kb));
+    }
+    ckb_info("Stopping input thread for %s%d\n", devpath, index);
+    close(fd);
+    return 0;
+}
+
+int os_inputwatch(usbdevice* kb){
+    // Not supported; usbmain turns the event loop off
+    return -1;
+}
+
+void os_closeusb(usbdevice* kb){
+    simdevice* sim = simdata(kb);
+    // Closing the write end stops the input thread, which closes the read end
+    if(sim->inputfd > 0)
+        close(sim->inputfd - 1);
+    sim->inputfd = 0;
+    kb->handle = 0;
+}
+
+int os_resetusb(usbdevice* kb, const char* file, int line){
+    return 0;
+}
+
+int os_setupusb(usbdevice* kb){
+    simdevice* sim = simdata(kb);
+    for(unsigned i = 0; i < N_MODELS; i++){
+        if(models[i].product == kb->product){
+            strncpy(kb->name, models[i].description, KB_NAME_LEN);
+            break;
+        }
+    }
+    memcpy(kb->serial, sim->serial, SERIAL_LEN);
+    kb->fwversion = sim->fwversion;
+    kb->epcount = 4;
+    ckb_info("Connecting %s at %s%d\n", kb->name, devpath, DEV_INDEX(kb));
+    return 0;
+}
+
+void sim_usbstats(usbdevice* kb, unsigned long* packets, unsigned long* frames){
+    simdevice* sim = simdata(kb);
+    *packets = sim->packets;
+    *frames = sim->frames;
+}
+
+// Returns a slot's simulated device if one is plugged in there, otherwise null
+static simdevice* simget(int index){
+    usbdevice* kb = device_get(index);
+    if(index <= 0 || !kb || !SIM_SLOT(kb) || !SIM_SLOT(kb)->inputfd)
+        return 0;
+    return SIM_SLOT(kb);
+}
+
+// Finds a device by number or serial. Returns its index, or 0 if it isn't connected.
+static int simfind(const char* name){
+    int index = 0;
+    char end;
+    if(sscanf(name, "%d%c", &index, &end) == 1)
+        return simget(index) ? index : 0;
+    int count = device_count();
+    for(index = 1; index < count; index++){
+        simdevice* sim = simget(index);
+        if(sim && !strcmp(sim->serial, name))
+            return index;
+    }
+    return 0;
+}
+
+static int simadd(const char* model, char* options, char* reply, int replylen){
+    short product = 0;
+    for(unsigned i = 0; i < N_MODELS; i++){
+        if(!strcmp(model, models[i].name))
+            product = models[i].product;
+    }
+    if(!product)
+        return snprintf(reply, replylen, "error unknown model\n");
+    // Find a free slot
+    usbdevice* kb = device_add(0);
+    if(!kb)
+        return snprintf(reply, replylen, "error no free devices\n");
+    int index = DEV_INDEX(kb);
+    simdevice* sim = simdata(kb);
+    memset(sim, 0, sizeof(*sim));
+    snprintf(sim->serial, SERIAL_LEN, "SIM%04X%04X", product, index);
+    sim->fwversion = SIM_DEFAULT_FW;
+    // Read options
+    char* option = strtok(options, " \t");
+    while(option){
+        unsigned fw;
+        if(!strncmp(option, "serial=", 7))
+            strncpy(sim->serial, option + 7, SERIAL_LEN - 1);
+        else if(sscanf(option, "fw=%x", &fw) == 1)
+            sim->fwversion = fw;
+        else
+            sscanf(option, "latency=%d", &sim->latency);
+        option = strtok(0, " \t");
+    }
+    int fds[2];
+    if(pipe(fds)){
+        int error = errno;
+        device_release(kb);
+        pthread_mutex_unlock(dmutex(kb));
+        return snprintf(reply, replylen, "error %s\n", strerror(error));
+    }
+    sim->inputfd = fds[1] + 1;
+    kb->handle = fds[0] + 1;
+    kb->udev = 0;
+    kb->vendor = V_CORSAIR;
+    kb->product = product;
+    // Mutex remains locked
+    setupusb(kb);
+    return snprintf(reply, replylen, "ok %d\n", index);
+}
+
+// Sends reports for the current key state
+static void simkeys(usbdevice* kb, simdevice* sim, int wheel){
+    simreport report;
+    memset(&report, 0, sizeof(report));
+    if(IS_MOUSE(kb->vendor, kb->product)){
+        // HID buttons and wheel on EP 2
+        report.endpoint = 2;
+        report.length = 10;
+        report.data[0] = 1;
+        for(int bit = 0; bit < 8; bit++){
+            if(sim->keys[(MOUSE_BUTTON_FIRST + bit) / 8] & (1 << ((MOUSE_BUTTON_FIRST + bit) % 8)))
+                report.data[1] |= 1 << bit;
+        }
+        report.data[9] = wheel;
+        write(sim->inputfd - 1, &report, sizeof(report));
+        // Corsair buttons on EP 3
+        memset(report.data, 0, MSG_SIZE);
+        report.endpoint = 3;
+        report.length = MSG_SIZE;
+        for(int bit = 0; bit < N_BUTTONS_HW; bit++){
+            if(sim->keys[(MOUSE_BUTTON_FIRST + bit) / 8] & (1 << ((MOUSE_BUTTON_FIRST + bit) % 8)))
+                report.data[bit / 8] |= 1 << (bit % 8);
+        }
+    } else {
+        report.endpoint = 3;
+        report.length = MSG_SIZE;
+        memcpy(report.data, sim->keys, N_KEYBYTES_HW);
+    }
+    write(sim->inputfd - 1, &report, sizeof(report));
+}
+
+static int simkey(int index, char* args, char* reply, int replylen){
+    usbdevice* kb = device_get(index);
+    simdevice* sim = SIM_SLOT(kb);
+    char* word = strtok(args, " \t");
+    while(word){
+        int down = (word[0] == '+');
+        if(!down && word[0] != '-')
+            return snprintf(reply, replylen, "error expected +key or -key\n");
+        int key = keymap_find(word + 1);
+        if(key < 0 || key >= N_KEYS_INPUT)
+            return snprintf(reply, replylen, "error unknown key %s\n", word + 1);
+        int wheel = 0;
+        if(IS_MOUSE(kb->vendor, kb->product) && (key == MOUSE_EXTRA_FIRST || key == MOUSE_EXTRA_FIRST + 1)){
+            // The wheel doesn't have a state, so only presses count
+            if(down)
+                wheel = (key == MOUSE_EXTRA_FIRST) ? 1 : -1;
+        } else if(down)
+            SET_KEYBIT(sim->keys, key);
+        else
+            CLEAR_KEYBIT(sim->keys, key);
+        simkeys(kb, sim, wheel);
+        word = strtok(0, " \t");
+    }
+    return 0;
+}
+
+static int simled(int index, char* args, char* reply, int replylen){
+    usbdevice* kb = device_get(index);
+    pthread_mutex_lock(dmutex(kb));
+    uchar ileds = kb->hw_ileds;
+    char* word = strtok(args, " \t");
+    while(word){
+        uchar which = !strcmp(word + 1, "num") ? I_NUM : !strcmp(word + 1, "caps") ? I_CAPS : !strcmp(word + 1, "scroll") ? I_SCROLL : 0;
+        if(word[0] == '+')
+            ileds |= which;
+        else
+            ileds &= ~which;
+        word = strtok(0, " \t");
+    }
+    if(IS_CONNECTED(kb) && kb->hw_ileds != ileds){
+        kb->hw_ileds = ileds;
+        kb->vtable->updateindicators(kb, 0);
+    }
+    pthread_mutex_unlock(dmutex(kb));
+    return 0;
+}
+
+// Runs one line from the control socket and writes the reply
+static void simcmd(int client, char* line){
+    char reply[256];
+    int replylen = 0;
+    char command[16], device[SERIAL_LEN];
+    int field = 0;
+    if(sscanf(line, "%15s %n", command, &field) != 1)
+        return;
+    char* args = line + field;
+    if(!strcmp(command, "list")){
+        int count = device_count();
+        for(int i = 1; i < count; i++){
+            simdevice* sim = simget(i);
+            if(!sim)
+                continue;
+            replylen = snprintf(reply, sizeof(reply), "%d %s %s\n", i, sim->serial, device_get(i)->name);
+            write(client, reply, replylen);
+        }
+        write(client, "ok\n", 3);
+        return;
+    }
+    if(!strcmp(command, "add")){
+        char model[16];
+        if(sscanf(args, "%15s %n", model, &field) != 1)
+            replylen = snprintf(reply, sizeof(reply), "error no model\n");
+        else
+            replylen = simadd(model, args + field, reply, sizeof(reply));
+        write(client, reply, replylen);
+        return;
+    }
+    // Everything else needs a device
+    int index = 0;
+    if(sscanf(args, "%33s %n", device, &field) == 1)
+        index = simfind(device);
+    args += field;
+    if(!index){
+        replylen = snprintf(reply, sizeof(reply), "error no such device\n");
+        write(client, reply, replylen);
+        return;
+    }
+    usbdevice* kb = device_get(index);
+    simdevice* sim = SIM_SLOT(kb);
+    if(!strcmp(command, "remove")){
+        pthread_mutex_lock(dmutex(kb));
+        closeusb(kb);
+        pthread_mutex_unlock(dmutex(kb));
+    } else if(!strcmp(command, "key"))
+        replylen = simkey(index, args, reply, sizeof(reply));
+    else if(!strcmp(command, "move")){
+        short x = 0, y = 0;
+        sscanf(args, "%hd %hd", &x, &y);
+        simreport report;
+        memset(&report, 0, sizeof(report));
+        report.endpoint = 2;
+        report.length = 10;
+        report.data[0] = 1;
+        for(int bit = 0; bit < 8; bit++){
+            if(sim->keys[(MOUSE_BUTTON_FIRST + bit) / 8] & (1 << ((MOUSE_BUTTON_FIRST + bit) % 8)))
+                report.data[1] |= 1 << bit;
+        }
+        memcpy(report.data + 5, &x, 2);
+        memcpy(report.data + 7, &y, 2);
+        write(sim->inputfd - 1, &report, sizeof(report));
+    } else if(!strcmp(command, "report")){
+        simreport report;
+        memset(&report, 0, sizeof(report));
+        int position = 0;
+        if(sscanf(args, "%d %n", &report.endpoint, &position) == 1){
+            unsigned byte;
+            while(report.length < MSG_SIZE && sscanf(args + position, "%2x%n", &byte, &field) == 1){
+                report.data[report.length++] = byte;
+                position += field;
+            }
+        }
+        if(report.length)
+            write(sim->inputfd - 1, &report, sizeof(report));
+        else
+            replylen = snprintf(reply, sizeof(reply), "error no data\n");
+    } else if(!strcmp(command, "led"))
+        replylen = simled(index, args, reply, sizeof(reply));
+    else if(!strcmp(command, "latency"))
+        sscanf(args, "%d", &sim->latency);
+    else if(!strcmp(command, "stats")){
+        unsigned long events = 0, syncs = 0;
+        sim_inputstats(kb, &events, &syncs);
+        replylen = snprintf(reply, sizeof(reply), "stats packets %lu recv %lu lighting %lu frames %lu events %lu syncs %lu\n",
+                            sim->packets, sim->recvs, sim->lighting, sim->frames, events, syncs);
+    } else
+        replylen = snprintf(reply, sizeof(reply), "error unknown command\n");
+    if(replylen)
+        write(client, reply, replylen);
+    else
+        write(client, "ok\n", 3);
+}
+
+#define SIM_CLIENTS 8
+static volatile int simrunning = 0;
+
+int usbmain(){
+    if(eventloop_enabled){
+        ckb_warn("The event loop isn't supported with simulated devices\n");
+        eventloop_enabled = 0;
+    }
+    // Open the control socket
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s0/sim", devpath);
+    unlink(addr.sun_path);
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listener < 0 || bind(listener, (struct sockaddr*)&addr, sizeof(addr)) || listen(listener, SIM_CLIENTS)){
+        ckb_fatal("Failed to open control socket %s: %s\n", addr.sun_path, strerror(errno));
+        return -1;
+    }
+    chmod(addr.sun_path, S_READWRITE);
+    ckb_info("Simulated devices are controlled through %s\n", addr.sun_path);
+
+    int clients[SIM_CLIENTS];
+    readlines_ctx linectx[SIM_CLIENTS];
+    for(int i = 0; i < SIM_CLIENTS; i++)
+        clients[i] = -1;
+    simrunning = 1;
+    while(simrunning){
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(listener, &fds);
+        int maxfd = listener;
+        for(int i = 0; i < SIM_CLIENTS; i++){
+            if(clients[i] < 0)
+                continue;
+            FD_SET(clients[i], &fds);
+            if(clients[i] > maxfd)
+                maxfd = clients[i];
+        }
+        if(select(maxfd + 1, &fds, 0, 0, 0) <= 0)
+            continue;
+        if(FD_ISSET(listener, &fds)){
+            int client = accept(listener, 0, 0);
+            for(int i = 0; i < SIM_CLIENTS && client >= 0; i++){
+                if(clients[i] < 0){
+                    clients[i] = client;
+                    readlines_ctx_init(linectx + i);
+                    client = -1;
+                }
+            }
+            if(client >= 0){
+                ckb_warn("Too many control connections\n");
+                close(client);
+            }
+        }
+        for(int i = 0; i < SIM_CLIENTS; i++){
+            if(clients[i] < 0 || !FD_ISSET(clients[i], &fds))
+                continue;
+            char* lines;
+            int length = readlines(clients[i], linectx[i], &lines);
+            if(!length){
+                // Disconnected (or an incomplete line; check again next time)
+                char test;
+                if(recv(clients[i], &test, 1, MSG_PEEK | MSG_DONTWAIT) == 0){
+                    close(clients[i]);
+                    clients[i] = -1;
+                    readlines_ctx_free(linectx[i]);
+                }
+                continue;
+            }
+            char* next;
+            for(char* line = strtok_r(lines, "\n", &next); line; line = strtok_r(0, "\n", &next))
+                simcmd(clients[i], line);
+        }
+    }
+    close(listener);
+    unlink(addr.sun_path);
+    return 0;
+}
+
+void usbkill(){
+    simrunning = 0;
+}
+
+#endif  // OS_SIM
@@ -0,0 +1,11 @@
+TEMPLATE = subdirs
+
+# The bundled animations, built as shared objects for ckb-daemon's effect engine (see DAEMON.md).
+# Each one uses the same source as the animation program; CKB_PLUGIN leaves out the main function.
+SUBDIRS = \
+    ripple \
+    wave \
+    gradient \
+    pinwheel \
+    random \
+    rain
@@ -0,0 +1,14 @@
+TEMPLATE = lib
+CONFIG   = plugin no_plugin_name_prefix
+QT       =
+LIBS     = -lm
+
+DEFINES += CKB_PLUGIN
+QMAKE_CFLAGS += -std=c99 -fvisibility=hidden
+QMAKE_MACOSX_DEPLOYMENT_TARGET = 10.9
+
+macx {
+    DESTDIR = $$PWD/../../ckb.app/Contents/Resources/ckb-effects
+} else {
+    DESTDIR = $$PWD/../../bin/ckb-effects
+}
@@ -0,0 +1,5 @@
+TARGET = ckb-gradient
+include(../effect.pri)
+
+SOURCES += \
+    ../../ckb-gradient/main.c
@@ -0,0 +1,5 @@
+TARGET = ckb-pinwheel
+include(../effect.pri)
+
+SOURCES += \
+    ../../ckb-pinwheel/main.c
@@ -0,0 +1,5 @@
+TARGET = ckb-rain
+include(../effect.pri)
+
+SOURCES += \
+    ../../ckb-rain/main.c
@@ -0,0 +1,5 @@
+TARGET = ckb-random
+include(../effect.pri)
+
+SOURCES += \
+    ../../ckb-random/main.c
@@ -0,0 +1,5 @@
+TARGET = ckb-ripple
+include(../effect.pri)
+
+SOURCES += \
+    ../../ckb-ripple/main.c
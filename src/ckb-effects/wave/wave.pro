@@ -0,0 +1,5 @@
+TARGET = ckb-wave
+include(../effect.pri)
+
+SOURCES += \
+    ../../ckb-wave/main.c
@@ -0,0 +1,209 @@
+#include <QCoreApplication>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QMutexLocker>
+#include <QTemporaryFile>
+#include <QThread>
+#include "animplugin.h"
+
+// Worker thread shared by all plugins
+static QThread* workerThread = 0;
+
+QHash<QString, int> AnimPlugin::openPaths;
+QMutex AnimPlugin::openMutex;
+
+AnimPlugin::AnimPlugin(const QString& path) :
+    _path(path), ckbInit(0), ckbParameter(0), ckbKeypress(0), ckbStart(0), ckbTime(0), ckbFrame(0),
+    initialized(false), ended(false), newFrame(false), frameEnded(false)
+{
+    memset(&ctx, 0, sizeof(ctx));
+}
+
+AnimPlugin::~AnimPlugin(){
+    free(ctx.keys);
+    library.unload();
+    QMutexLocker locker(&openMutex);
+    if(--openPaths[_path] <= 0)
+        openPaths.remove(_path);
+}
+
+AnimPlugin* AnimPlugin::open(const QString& path, const QStringList& keys, const QList<QPoint>& positions){
+    if(keys.isEmpty() || keys.count() != positions.count())
+        return 0;
+    AnimPlugin* plugin = new AnimPlugin(path);
+    {
+        QMutexLocker locker(&openMutex);
+        openPaths[path]++;
+        if(openPaths[path] == 1)
+            plugin->library.setFileName(path);
+        else {
+            // Animations keep their state in globals, and loading the same file again would share them with the instance
+            // that's already running. Load a private copy instead. It can be removed as soon as it's loaded.
+            QFile source(path);
+            QTemporaryFile copy(QDir::temp().absoluteFilePath("ckb-XXXXXX-" + QFileInfo(path).fileName()));
+            if(source.open(QIODevice::ReadOnly) && copy.open() && copy.write(source.readAll()) == source.size() && copy.flush())
+                plugin->library.setFileName(copy.fileName());
+            plugin->library.load();
+        }
+    }
+    if(!plugin->library.isLoaded() && !plugin->library.load()){
+        qDebug() << "Couldn't load" << path << ":" << plugin->library.errorString();
+        delete plugin;
+        return 0;
+    }
+    plugin->ckbInit = (void(*)(ckb_runctx*))plugin->library.resolve("ckb_init");
+    plugin->ckbParameter = (void(*)(ckb_runctx*, const char*, const char*))plugin->library.resolve("ckb_parameter");
+    plugin->ckbKeypress = (void(*)(ckb_runctx*, ckb_key*, int, int, int))plugin->library.resolve("ckb_keypress");
+    plugin->ckbStart = (void(*)(ckb_runctx*, int))plugin->library.resolve("ckb_start");
+    plugin->ckbTime = (void(*)(ckb_runctx*, double))plugin->library.resolve("ckb_time");
+    plugin->ckbFrame = (int(*)(ckb_runctx*))plugin->library.resolve("ckb_frame");
+    if(!plugin->ckbInit || !plugin->ckbParameter || !plugin->ckbKeypress || !plugin->ckbStart || !plugin->ckbTime || !plugin->ckbFrame){
+        qDebug() << path << "is not a ckb animation plugin";
+        delete plugin;
+        return 0;
+    }
+    // Same key layout as the one sent to an animation process
+    ckb_runctx& ctx = plugin->ctx;
+    ctx.keycount = keys.count();
+    ctx.keys = (ckb_key*)calloc(ctx.keycount, sizeof(ckb_key));
+    int maxX = 0, maxY = 0;
+    for(int i = 0; i < keys.count(); i++){
+        ckb_key* key = ctx.keys + i;
+        strncpy(key->name, keys[i].toLatin1().constData(), CKB_KEYNAME_MAX - 1);
+        key->x = positions[i].x();
+        key->y = positions[i].y();
+        if(key->x > maxX)
+            maxX = key->x;
+        if(key->y > maxY)
+            maxY = key->y;
+    }
+    ctx.width = maxX + 1;
+    ctx.height = maxY + 1;
+    plugin->_frame.fill(0, keys.count());
+    if(!workerThread){
+        workerThread = new QThread;
+        workerThread->start();
+    }
+    plugin->moveToThread(workerThread);
+    return plugin;
+}
+
+void AnimPlugin::close(){
+    disconnect(this, SIGNAL(frameReady()), 0, 0);
+    // Commands already in the queue are dropped along with the object
+    deleteLater();
+}
+
+void AnimPlugin::cleanUp(){
+    if(!workerThread)
+        return;
+    // Plugins waiting to be deleted are deleted as the thread finishes
+    workerThread->quit();
+    workerThread->wait();
+    delete workerThread;
+    workerThread = 0;
+}
+
+void AnimPlugin::queue(const Command& command){
+    QMutexLocker locker(&commandMutex);
+    commands.append(command);
+    // Wake the worker up if it doesn't already have a run() waiting
+    if(commands.count() == 1)
+        metaObject()->invokeMethod(this, "run", Qt::QueuedConnection);
+}
+
+void AnimPlugin::parameter(const QString& name, const QString& value){
+    Command command = { Command::PARAMETER, 0, 0, 0, 0, 0., name.toLatin1(), value.toUtf8() };
+    queue(command);
+}
+
+void AnimPlugin::start(bool state){
+    Command command = { Command::START, 0, 0, 0, state, 0., QByteArray(), QByteArray() };
+    queue(command);
+}
+
+void AnimPlugin::keypress(int index, int x, int y, bool pressed){
+    Command command = { Command::KEYPRESS, index, x, y, pressed, 0., QByteArray(), QByteArray() };
+    queue(command);
+}
+
+void AnimPlugin::time(double delta){
+    Command command = { Command::TIME, 0, 0, 0, 0, delta, QByteArray(), QByteArray() };
+    queue(command);
+}
+
+void AnimPlugin::frame(){
+    Command command = { Command::FRAME, 0, 0, 0, 0, 0., QByteArray(), QByteArray() };
+    queue(command);
+}
+
+bool AnimPlugin::read(QVector<QRgb>& colors){
+    QMutexLocker locker(&frameMutex);
+    if(!newFrame)
+        return false;
+    // Copied rather than shared, so that the worker doesn't have to allocate a new buffer for the next frame
+    colors.resize(_frame.count());
+    memcpy(colors.data(), _frame.constData(), sizeof(QRgb) * _frame.count());
+    newFrame = false;
+    return true;
+}
+
+bool AnimPlugin::hasEnded(){
+    QMutexLocker locker(&frameMutex);
+    return frameEnded;
+}
+
+void AnimPlugin::run(){
+    QList<Command> pending;
+    {
+        QMutexLocker locker(&commandMutex);
+        pending.swap(commands);
+    }
+    if(!initialized){
+        ckbInit(&ctx);
+        initialized = true;
+    }
+    foreach(const Command& command, pending){
+        // Like an animation process, do nothing more once the animation has exited
+        if(ended)
+            break;
+        execute(command);
+    }
+}
+
+void AnimPlugin::execute(const Command& command){
+    switch(command.type){
+    case Command::PARAMETER:
+        ckbParameter(&ctx, command.name.constData(), command.value.constData());
+        break;
+    case Command::START:
+        ckbStart(&ctx, command.state);
+        break;
+    case Command::KEYPRESS:
+        if(command.index >= 0 && (uint)command.index < ctx.keycount){
+            ckb_key* key = ctx.keys + command.index;
+            ckbKeypress(&ctx, key, key->x, key->y, command.state);
+        } else
+            ckbKeypress(&ctx, 0, command.x, command.y, command.state);
+        break;
+    case Command::TIME:
+        ckbTime(&ctx, command.delta);
+        break;
+    case Command::FRAME:{
+        ended = ckbFrame(&ctx) != 0;
+        QMutexLocker locker(&frameMutex);
+        QRgb* colors = _frame.data();
+        for(uint i = 0; i < ctx.keycount; i++){
+            const ckb_key* key = ctx.keys + i;
+            colors[i] = qRgba(key->r, key->g, key->b, key->a);
+        }
+        newFrame = true;
+        frameEnded = ended;
+        locker.unlock();
+        emit frameReady();
+        break;
+    }
+    }
+}
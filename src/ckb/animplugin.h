@@ -0,0 +1,104 @@
+#ifndef ANIMPLUGIN_H
+#define ANIMPLUGIN_H
+
+#include <QHash>
+#include <QLibrary>
+#include <QList>
+#include <QMutex>
+#include <QObject>
+#include <QPoint>
+#include <QRgb>
+#include <QStringList>
+#include <QVector>
+#define CKB_NO_MAIN
+#include "ckb-anim.h"
+
+// In-process form of an animation. The animation is built as a shared object (see CKB_PLUGIN in ckb-anim.h) and its
+// functions are called directly instead of talking to a separate process over pipes.
+// All plugins run on one worker thread. Calls made from the GUI thread are queued and return immediately; when a frame is
+// ready, frameReady() is emitted and the colors can be picked up with read().
+// See also: AnimScript
+
+class AnimPlugin : public QObject
+{
+    Q_OBJECT
+public:
+    // Loads a plugin and initializes it with the given keys (positions relative to the upper left key). Returns null if the
+    // library couldn't be loaded or doesn't export the animation functions.
+    static AnimPlugin* open(const QString& path, const QStringList& keys, const QList<QPoint>& positions);
+    // Unloads the plugin once it's finished whatever it's doing. The object must not be used afterward.
+    void close();
+
+    // Queues a parameter value. Values are not URL-encoded.
+    void parameter(const QString& name, const QString& value);
+    // Queues a start (state = true) or stop (state = false)
+    void start(bool state);
+    // Queues a keypress. index is the key's position in the list given to open(), or -1 for a position not on the list.
+    void keypress(int index, int x, int y, bool pressed);
+    // Queues a time advance
+    void time(double delta);
+    // Requests a frame
+    void frame();
+
+    // Copies the newest frame into colors (one ARGB value per key, in the order they were given to open()).
+    // Returns false if there hasn't been a new frame since the last call.
+    bool read(QVector<QRgb>& colors);
+    // Whether or not the animation has asked to exit
+    bool hasEnded();
+
+    // Stops the worker thread. Call before quitting.
+    static void cleanUp();
+
+signals:
+    void frameReady();
+
+private slots:
+    void run();
+
+private:
+    AnimPlugin(const QString& path);
+    ~AnimPlugin();
+
+    struct Command {
+        enum Type {
+            PARAMETER,
+            START,
+            KEYPRESS,
+            TIME,
+            FRAME
+        } type;
+        int index, x, y, state;
+        double delta;
+        QByteArray name, value;
+    };
+    void queue(const Command& command);
+    void execute(const Command& command);
+
+    // Library file (may be a private copy, see open()) and the original path
+    QLibrary    library;
+    QString     _path;
+    // Animation functions
+    void        (*ckbInit)(ckb_runctx*);
+    void        (*ckbParameter)(ckb_runctx*, const char*, const char*);
+    void        (*ckbKeypress)(ckb_runctx*, ckb_key*, int, int, int);
+    void        (*ckbStart)(ckb_runctx*, int);
+    void        (*ckbTime)(ckb_runctx*, double);
+    int         (*ckbFrame)(ckb_runctx*);
+    // Run context. Only used from the worker thread.
+    ckb_runctx  ctx;
+    bool        initialized, ended;
+
+    // Commands waiting for the worker thread
+    QMutex          commandMutex;
+    QList<Command>  commands;
+    // Last frame, written by the worker thread
+    QMutex          frameMutex;
+    QVector<QRgb>   _frame;
+    bool            newFrame, frameEnded;
+
+    // Open paths, and how many plugins are using each of them
+    static QHash<QString, int> openPaths;
+    static QMutex openMutex;
+};
+
+#endif // ANIMPLUGIN_H
@@ -1,20 +1,49 @@
 #include <cmath>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <QApplication>
 #include <QDateTime>
 #include <QDebug>
 #include <QDir>
+#include <QFileInfo>
+#include <QLibrary>
+#include <QThread>
 #include <QUrl>
+#include "animplugin.h"
 #include "animscript.h"
+#include "renderlock.h"
 
 QHash<QUuid, AnimScript*> AnimScript::scripts;
 
+// Process for an animation that uses a shared frame buffer. The buffer's file descriptor stays close-on-exec in ckb, so
+// that nothing else it starts can inherit it; only the animation's own child process clears the flag, after forking.
+class AnimProcess : public QProcess {
+public:
+    AnimProcess(QObject* parent, int fd) : QProcess(parent), shmFd(fd) {
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+        setChildProcessModifier([this](){ setupChildProcess(); });
+#endif
+    }
+
+protected:
+    // Called in the child process, between fork and exec
+    void setupChildProcess(){
+        if(shmFd >= 0)
+            fcntl(shmFd, F_SETFD, 0);
+    }
+
+private:
+    int shmFd;
+};
+
 AnimScript::AnimScript(QObject* parent, const QString& path) :
-    QObject(parent), _path(path), initialized(false), process(0)
+    QObject(parent), _path(path), initialized(false), startPending(false), process(0), plugin(0), shm(0), shmSize(0)
 {
 }
 
 AnimScript::AnimScript(QObject* parent, const AnimScript& base) :
-    QObject(parent), _info(base._info), _path(base._path), initialized(false), process(0)
+    QObject(parent), _info(base._info), _path(base._path), _plugin(base._plugin), initialized(false), startPending(false), process(0), plugin(0), shm(0), shmSize(0)
 {
 }
 
@@ -24,6 +53,9 @@ AnimScript::~AnimScript(){
         process->waitForFinished(1000);
         delete process;
     }
+    if(plugin)
+        plugin->close();
+    closeShm();
 }
 
 QString AnimScript::path(){
@@ -34,13 +66,29 @@ QString AnimScript::path(){
 #endif
 }
 
+QString AnimScript::pluginPath(){
+#ifdef __APPLE__
+    return QDir(QApplication::applicationDirPath() + "/../Resources").absoluteFilePath("ckb-effects");
+#else
+    return QDir(QApplication::applicationDirPath()).absoluteFilePath("ckb-effects");
+#endif
+}
+
 void AnimScript::scan(){
     QDir dir(path());
     foreach(AnimScript* script, scripts)
         delete script;
     scripts.clear();
+    // Plugins are matched to scripts by name (e.g. ckb-wave.so for ckb-wave). Info is still read from the script.
+    QDir pluginDir(pluginPath());
+    QHash<QString, QString> plugins;
+    foreach(QString file, pluginDir.entryList(QDir::Files)){
+        if(QLibrary::isLibrary(file))
+            plugins[QFileInfo(file).baseName()] = pluginDir.absoluteFilePath(file);
+    }
     foreach(QString file, dir.entryList(QDir::Files | QDir::Executable)){
         AnimScript* script = new AnimScript(qApp, dir.absoluteFilePath(file));
+        script->_plugin = plugins.value(QFileInfo(file).baseName());
         if(script->load() && !scripts.contains(script->_info.guid))
             scripts[script->_info.guid] = script;
         else
@@ -89,6 +137,7 @@ bool AnimScript::load(){
     _info.kpMode = KP_NONE;
     _info.absoluteTime = _info.preempt = _info.liveParams = false;
     _info.repeat = true;
+    _info.protocol = 1;
     // Read output
     QString line;
     while((line = infoProcess.readLine()) != ""){
@@ -122,6 +171,8 @@ bool AnimScript::load(){
             _info.preempt = (components[1] == "on");
         else if(param == "parammode")
             _info.liveParams = (components[1] == "live");
+        else if(param == "protocol")
+            _info.protocol = components[1].toInt();
         else if(param == "param"){
             // Read parameter
             if(count < 3)
@@ -263,7 +314,7 @@ void AnimScript::setDuration(){
 }
 
 void AnimScript::parameters(const QMap<QString, QVariant>& paramValues){
-    if(!initialized || !process || !_info.liveParams)
+    if(!initialized || !running() || !_info.liveParams)
         return;
     _paramValues = paramValues;
     setDuration();
@@ -271,17 +322,30 @@ void AnimScript::parameters(const QMap<QString, QVariant>& paramValues){
 }
 
 void AnimScript::printParams(){
-    process->write("begin params\n");
+    if(plugin){
+        QMapIterator<QString, QVariant> i(_paramValues);
+        while(i.hasNext()){
+            i.next();
+            plugin->parameter(i.key(), i.value().toString());
+        }
+        return;
+    }
+    write(paramText());
+}
+
+QByteArray AnimScript::paramText(){
+    QByteArray text("begin params\n");
     QMapIterator<QString, QVariant> i(_paramValues);
     while(i.hasNext()){
         i.next();
-        process->write("param ");
-        process->write(i.key().toLatin1());
-        process->write(" ");
-        process->write(QUrl::toPercentEncoding(i.value().toString()));
-        process->write("\n");
+        text += "param ";
+        text += i.key().toLatin1();
+        text += " ";
+        text += QUrl::toPercentEncoding(i.value().toString());
+        text += "\n";
     }
-    process->write("end params\n");
+    text += "end params\n";
+    return text;
 }
 
 void AnimScript::begin(quint64 timestamp){
@@ -309,23 +373,92 @@ void AnimScript::begin(quint64 timestamp){
         firstFrame = readFrame = readAnyFrame = true;
         return;
     }
-    process = new QProcess(this);
+    // Look up each key's color once instead of on every frame
+    keyIndex.resize(keysCopy.count());
+    for(int i = 0; i < keysCopy.count(); i++){
+        QRgb* color = _colorBuffer.colorForIndex(_map.index(keysCopy[i]));
+        keyIndex[i] = color ? color - _colorBuffer.colors() : -1;
+    }
+    if(!_plugin.isEmpty()){
+        QList<QPoint> positions;
+        pluginKeys.clear();
+        for(int i = 0; i < keysCopy.count(); i++){
+            const Key& pos = _map.key(keysCopy[i]);
+            positions.append(QPoint(pos.x - minX, pos.y - minY));
+            pluginKeys[keysCopy[i]] = i;
+        }
+        plugin = AnimPlugin::open(_plugin, keysCopy, positions);
+        if(plugin){
+            connect(plugin, SIGNAL(frameReady()), this, SLOT(readPlugin()));
+            qDebug() << "Starting " << _plugin;
+            printParams();
+            lastFrame = timestamp;
+            return;
+        }
+        // Run the script instead if the plugin can't be loaded
+    }
+    runKeys = keysCopy;
+    startPending = true;
+    if(QThread::currentThread() == thread())
+        startProcess();
+    else
+        // Called from the render thread. The process has to be started by the thread that owns this object, and anything
+        // sent to it until then waits in pendingWrite.
+        metaObject()->invokeMethod(this, "startProcess", Qt::QueuedConnection);
+    lastFrame = timestamp;
+}
+
+void AnimScript::startProcess(){
+    RenderLock lock;
+    if(!startPending)
+        // Ended before it got the chance to start
+        return;
+    startPending = false;
+    // The shared frame buffer is passed on to the process as an open file descriptor
+    int shmFd = openShm(runKeys);
+    process = new AnimProcess(this, shmFd);
     connect(process, SIGNAL(readyRead()), this, SLOT(readProcess()));
     process->start(_path, QStringList("--ckb-run"));
+    if(shmFd >= 0)
+        close(shmFd);
     qDebug() << "Starting " << _path;
     // Write the keymap to the process
     process->write("begin keymap\n");
-    process->write(QString("keycount %1\n").arg(keysCopy.count()).toLatin1());
-    foreach(const QString& key, keysCopy){
+    process->write(QString("keycount %1\n").arg(runKeys.count()).toLatin1());
+    foreach(const QString& key, runKeys){
         const Key& pos = _map.key(key);
         process->write(QString("key %1 %2,%3\n").arg(key).arg(pos.x - minX).arg(pos.y - minY).toLatin1());
     }
+    if(shmFd >= 0)
+        process->write(QString("shm %1\n").arg(shmFd).toLatin1());
     process->write("end keymap\n");
     // Write parameters
-    printParams();
-    // Begin animating
+    process->write(paramText());
+    // Begin animating, then send anything that was queued up in the meantime
     process->write("begin run\n");
-    lastFrame = timestamp;
+    flushWrite();
+}
+
+void AnimScript::write(const QByteArray& data){
+    if(!process && !startPending)
+        return;
+    if(process && QThread::currentThread() == thread()){
+        flushWrite();
+        process->write(data);
+        return;
+    }
+    // The process hasn't been started yet, or this is the render thread, which can't use it. Leave it for the GUI thread.
+    if(process && pendingWrite.isEmpty())
+        metaObject()->invokeMethod(this, "flushWrite", Qt::QueuedConnection);
+    pendingWrite += data;
+}
+
+void AnimScript::flushWrite(){
+    RenderLock lock;
+    if(!process || pendingWrite.isEmpty())
+        return;
+    process->write(pendingWrite);
+    pendingWrite.clear();
 }
 
 void AnimScript::retrigger(quint64 timestamp, bool allowPreempt){
@@ -334,27 +467,31 @@ void AnimScript::retrigger(quint64 timestamp, bool allowPreempt){
     if(allowPreempt && _info.preempt && repeatMsec > 0)
         // If preemption is wanted, trigger the animation 1 duration in the past first
         retrigger(timestamp - repeatMsec);
-    if(!process)
+    if(!running())
         begin(timestamp);
     advance(timestamp);
-    if(process)
-        process->write("start\n");
+    if(plugin)
+        plugin->start(true);
+    else
+        write("start\n");
 }
 
 void AnimScript::stop(quint64 timestamp){
     if(!initialized)
         return;
-    if(!process)
+    if(!running())
         begin(timestamp);
     advance(timestamp);
-    if(process)
-        process->write("stop\n");
+    if(plugin)
+        plugin->start(false);
+    else
+        write("stop\n");
 }
 
 void AnimScript::keypress(const QString& key, bool pressed, quint64 timestamp){
     if(!initialized)
         return;
-    if(!process)
+    if(!running())
         begin(timestamp);
     int kpMode = _info.kpMode;
     if(_paramValues.value("kpmode", 0).toInt() != 0)
@@ -371,7 +508,11 @@ void AnimScript::keypress(const QString& key, bool pressed, quint64 timestamp){
     case KP_NAME:
         // Print keypress by name
         advance(timestamp);
-        process->write(("key " + key + (pressed ? " down\n" : " up\n")).toLatin1());
+        if(plugin){
+            if(pluginKeys.contains(key))
+                plugin->keypress(pluginKeys.value(key), 0, 0, pressed);
+        } else
+            write(("key " + key + (pressed ? " down\n" : " up\n")).toLatin1());
         break;
     case KP_POSITION:
         // Print keypress by position
@@ -379,7 +520,10 @@ void AnimScript::keypress(const QString& key, bool pressed, quint64 timestamp){
         if(!kp)
             return;
         advance(timestamp);
-        process->write(("key " + QString("%1,%2").arg(kp.x - minX).arg(kp.y - minY) + (pressed ? " down\n" : " up\n")).toLatin1());
+        if(plugin)
+            plugin->keypress(pluginKeys.value(key, -1), kp.x - minX, kp.y - minY, pressed);
+        else
+            write(("key " + QString("%1,%2").arg(kp.x - minX).arg(kp.y - minY) + (pressed ? " down\n" : " up\n")).toLatin1());
         break;
     }
 }
@@ -387,21 +531,76 @@ void AnimScript::keypress(const QString& key, bool pressed, quint64 timestamp){
 void AnimScript::end(){
     _colors.clear();
     if(process){
-        process->kill();
+        if(QThread::currentThread() == thread())
+            process->kill();
+        else
+            process->metaObject()->invokeMethod(process, "kill", Qt::QueuedConnection);
         connect(process, SIGNAL(finished(int)), process, SLOT(deleteLater()));
         disconnect(process, SIGNAL(readyRead()), this, SLOT(readProcess()));
         process = 0;
     }
+    startPending = false;
+    pendingWrite.clear();
+    if(plugin){
+        plugin->close();
+        plugin = 0;
+    }
+    closeShm();
+}
+
+int AnimScript::openShm(const QStringList& keys){
+    closeShm();
+#ifdef Q_OS_LINUX
+    if(_info.protocol < 2)
+        return -1;
+    // Close-on-exec is cleared just for this animation's process (see AnimProcess)
+    int fd = memfd_create("ckb-anim", MFD_CLOEXEC);
+    if(fd < 0)
+        return -1;
+    size_t size = keys.count() * sizeof(quint32);
+    void* map = MAP_FAILED;
+    if(ftruncate(fd, size) == 0)
+        map = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED){
+        close(fd);
+        return -1;
+    }
+    shm = (quint32*)map;
+    shmSize = size;
+    return fd;
+#else
+    Q_UNUSED(keys);
+    return -1;
+#endif
+}
+
+void AnimScript::closeShm(){
+    if(!shm)
+        return;
+    munmap(shm, shmSize);
+    shm = 0;
+    shmSize = 0;
 }
 
 void AnimScript::readProcess(){
-    while(process->canReadLine()){
+    // The render thread uses the colors and flags set here
+    RenderLock lock;
+    while(process && process->canReadLine()){
         QByteArray line = process->readLine().trimmed();
         if(!inFrame){
             // Ignore anything not between "begin frame" and "end frame", except for "end run", which indicates that the program is done.
             if(line == "begin frame")
                 inFrame = true;
-            else if(line == "end run"){
+            else if(line == "frame" && shm){
+                // Frame is in the shared buffer (protocol 2)
+                QRgb* colors = _colorBuffer.colors();
+                for(int i = 0; i < keyIndex.count(); i++){
+                    if(keyIndex[i] >= 0)
+                        colors[keyIndex[i]] = shm[i];
+                }
+                memcpy(_colors.colors(), colors, sizeof(QRgb) * _colors.count());
+                readFrame = readAnyFrame = true;
+            } else if(line == "end run"){
                 stopped = true;
                 return;
             }
@@ -413,7 +612,7 @@ void AnimScript::readProcess(){
             QRgb keyColor = 0;
             if(sscanf(line, "argb %30s %x", keyName, &keyColor) != 2)
                 continue;
-            QRgb* inMap = _colorBuffer.colorForName(keyName);
+            QRgb* inMap = _colorBuffer.colorForIndex(_map.index(keyName));
             if(!inMap)
                 continue;
             *inMap = keyColor;
@@ -427,33 +626,62 @@ void AnimScript::readProcess(){
     }
 }
 
+void AnimScript::readPlugin(){
+    RenderLock lock;
+    if(!plugin || !plugin->read(pluginFrame))
+        return;
+    QRgb* colors = _colorBuffer.colors();
+    for(int i = 0; i < keyIndex.count() && i < pluginFrame.count(); i++){
+        if(keyIndex[i] >= 0)
+            colors[keyIndex[i]] = pluginFrame[i];
+    }
+    memcpy(_colors.colors(), colors, sizeof(QRgb) * _colors.count());
+    readFrame = readAnyFrame = true;
+    // The plugin has exited, same as "end run" from a process
+    if(plugin->hasEnded())
+        stopped = true;
+}
+
 void AnimScript::frame(quint64 timestamp){
     if(!initialized || stopped)
         return;
     // Start the animation if it's not running yet
-    if(!process)
+    if(!running())
         begin(timestamp);
+    // Plugin frames are also picked up here, since frameReady() needs the GUI thread
+    if(plugin)
+        readPlugin();
 
     advance(timestamp);
-    if((readFrame || !firstFrame) && process)
+    if(readFrame || !firstFrame){
         // Don't ask for a new frame if the animation hasn't delivered the last one yet
-        process->write("frame\n");
+        if(plugin)
+            plugin->frame();
+        else
+            write("frame\n");
+    }
     firstFrame = true;
     readFrame = false;
 }
 
 void AnimScript::advance(quint64 timestamp){
-    if(timestamp <= lastFrame || !process)
+    if(timestamp <= lastFrame || !running())
         // Don't do anything if the time hasn't actually advanced.
         return;
     double delta = (timestamp - lastFrame) / (double)durationMsec;
     if(!_info.absoluteTime){
         // Skip any complete durations
         while(delta > 1.){
-            process->write("time 1\n");
+            if(plugin)
+                plugin->time(1.);
+            else
+                write("time 1\n");
             delta--;
         }
     }
-    process->write(QString("time %1\n").arg(delta).toLatin1());
+    if(plugin)
+        plugin->time(delta);
+    else
+        write(QString("time %1\n").arg(delta).toLatin1());
     lastFrame = timestamp;
 }
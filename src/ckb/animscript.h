@@ -7,10 +7,14 @@
 #include <QProcess>
 #include <QUuid>
 #include <QVariant>
+#include <QVector>
 #include "keymap.h"
 #include "colormap.h"
 
+class AnimPlugin;
+
 // Class for tracking an animation script. Has a global list of all possible scripts, and can also provide instances to launch the process and communicate with it.
+// If the script is also available as a plugin (same name, in the plugin path), instances load that instead of starting a process.
 // See also: KbAnim, KbLight
 
 class AnimScript : public QObject
@@ -48,6 +52,8 @@ public:
 
     // Global animation path
     static QString      path();
+    // Global plugin path
+    static QString      pluginPath();
     // Scan the animation path for scripts
     static void         scan();
     // Loaded script count and alphabetical list
@@ -102,6 +108,9 @@ public:
 
 private slots:
     void readProcess();
+    void readPlugin();
+    void startProcess();
+    void flushWrite();
 
 private:
     bool load();
@@ -120,12 +129,15 @@ private:
         // Playback flags
         int kpMode :3;
         bool absoluteTime :1, repeat :1, preempt :1, liveParams :1;
+        // Frame protocol (see CKB_PROTOCOL in ckb-anim.h)
+        int protocol;
     } _info;
     const static int    KP_NONE = 0, KP_NAME = 1, KP_POSITION = 2;
     QStringList         _presets;
     QList<PresetValue>  _presetValues;
-    // Script path
+    // Script path, and plugin path (empty if there isn't one)
     QString     _path;
+    QString     _plugin;
     // Key map (positions)
     KeyMap      _map;
     int         minX, minY;
@@ -138,15 +150,34 @@ private:
     // Animation state
     quint64     lastFrame;
     int         durationMsec, repeatMsec;
-    bool        initialized :1, firstFrame :1, readFrame :1, readAnyFrame :1, stopped :1, inFrame :1;
+    bool        initialized :1, firstFrame :1, readFrame :1, readAnyFrame :1, stopped :1, inFrame :1, startPending :1;
     QProcess*   process;
+    // Keys sent to the animation
+    QStringList runKeys;
+    // Data waiting to be written to the process (see write())
+    QByteArray  pendingWrite;
+    AnimPlugin* plugin;
     ColorMap    _colorBuffer;
+    // _colorBuffer index for each key, in the order they were sent to the animation
+    QVector<int> keyIndex;
+    // Shared frame buffer (protocol 2), one ARGB value per key, or null if frames are sent as text
+    quint32*    shm;
+    size_t      shmSize;
+    // Last frame from the plugin, and each key's index in it
+    QVector<QRgb> pluginFrame;
+    QHash<QString, int> pluginKeys;
 
     // Helper functions
     void setDuration();
     void printParams();
+    QByteArray paramText();
+    // Writes to the process. May be called from any thread, and before the process has started.
+    void write(const QByteArray& data);
     void begin(quint64 timestamp);
     void advance(quint64 timestamp);
+    inline bool running() const { return process || plugin || startPending; }
+    int openShm(const QStringList& keys);
+    void closeShm();
 
     // Global script list
     static QHash<QUuid, AnimScript*> scripts;
@@ -3,7 +3,12 @@
 
 // Standardized header for C/C++ CKB animations.
 // If your animation contains multiple source files, #define CKB_NO_MAIN in all but one of them so you don't get duplicate symbols.
-// The main function will be defined for you. You must write several specialized functions in order to handle animations:
+// The main function will be defined for you.
+// To build the animation as a shared object instead, #define CKB_PLUGIN in all of its source files (keeping CKB_NO_MAIN as
+// above) and compile with -fvisibility=hidden. The runtime functions below are exported and no main function is defined.
+// ckb loads the plugin in place of the program if it's installed in ckb-effects under the same name (ckb_info still comes
+// from the program), and ckb-daemon can run it as a native effect (see DAEMON.md).
+// You must write several specialized functions in order to handle animations:
 
 //   void ckb_info()
 //     Prints information about the program and any parameters it wishes to receive. See info helpers section.
@@ -34,9 +39,12 @@
 
 #include <ctype.h>
 #include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
@@ -103,6 +111,12 @@
 // Live parameter updates. Default: FALSE
 #define CKB_LIVEPARAMS(enable)                                      CKB_CONTAINER( printf("parammode %s\n", (enable) ? "live" : "static"); )
 
+// Frame protocol supported by this header. This is printed for you after ckb_info.
+// 1: Frames are printed as text ("argb <key> aarrggbb" for every key).
+// 2: If ckb sends "shm <fd>" in the keymap, frames are written to that shared memory instead, as one 32-bit ARGB value per key
+//    in keymap order, and announced with a "frame" line. Otherwise the same as 1.
+#define CKB_PROTOCOL        2
+
 // * Runtime information
 
 // Parameter input parsers. Usage (within ckb_parameter only):
@@ -169,6 +183,18 @@ void ckb_grad_color(float* a, float* r, float* g, float* b, const ckb_gradient*
 // Alpha blend a color into a key
 void ckb_alpha_blend(ckb_key* key, float a, float r, float g, float b);
 
+// * Plugin exports
+
+#ifdef CKB_PLUGIN
+#define CKB_EXPORT __attribute__((visibility("default")))
+CKB_EXPORT void ckb_init(ckb_runctx* context);
+CKB_EXPORT void ckb_parameter(ckb_runctx*, const char*, const char*);
+CKB_EXPORT void ckb_keypress(ckb_runctx*, ckb_key*, int, int, int);
+CKB_EXPORT void ckb_start(ckb_runctx*, int);
+CKB_EXPORT void ckb_time(ckb_runctx*, double);
+CKB_EXPORT int ckb_frame(ckb_runctx*);
+#endif
+
 
 // * Internal functions
 
@@ -204,6 +230,8 @@ void printurl(const char* src){
     printf("%s", out);
 }
 
+#ifndef CKB_PLUGIN
+
 // URL decode
 void urldecode(char *dst, const char *src){
     char a, b;
@@ -250,6 +278,8 @@ void ckb_getline(char word1[CKB_MAX_WORD], char word2[CKB_MAX_WORD], char word3[
     line[strlen(line) - 1] = 0;
 }
 
+#endif  // CKB_PLUGIN
+
 // Gradient interpolation
 void ckb_grad_color(float* a, float* r, float* g, float* b, const ckb_gradient* grad, float pos){
     // Find the points surrounding this position
@@ -337,6 +367,8 @@ int ckb_scan_grad(const char* string, ckb_gradient* gradient, int alpha){
     return 1;
 }
 
+#ifndef CKB_PLUGIN
+
 extern void ckb_info();
 extern void ckb_init(ckb_runctx* context);
 extern void ckb_parameter(ckb_runctx*, const char*, const char*);
@@ -366,6 +398,7 @@ int main(int argc, char *argv[]){
     if(argc == 2){
         if(!strcmp(argv[1], "--ckb-info")){
             ckb_info();
+            printf("protocol %d\n", CKB_PROTOCOL);
             fflush(stdout);
             return 0;
         } else if(!strcmp(argv[1], "--ckb-run")){
@@ -410,13 +443,23 @@ int main(int argc, char *argv[]){
             }
             ctx.width = max_x + 1;
             ctx.height = max_y + 1;
-            // Skip anything else until "end keymap"
+            // Skip anything else until "end keymap", except for a shared frame buffer (protocol 2)
+            uint32_t* shm = 0;
+            size_t shmsize = keycount * sizeof(uint32_t);
             do {
                 ckb_getline(cmd, param, value);
                 if(!*cmd){
                     printf("Error [ckb-main]: Reached EOF looking for \"end keymap\"");
                     return -2;
                 }
+                int fd;
+                if(!strcmp(cmd, "shm") && !shm && sscanf(param, "%d", &fd) == 1){
+                    // If it can't be mapped, fall back to text frames
+                    void* map = mmap(0, shmsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                    if(map != MAP_FAILED)
+                        shm = (uint32_t*)map;
+                    close(fd);
+                }
             } while(strcmp(cmd, "end") || strcmp(param, "keymap"));
             // Run init function
             ckb_init(&ctx);
@@ -482,12 +525,20 @@ int main(int argc, char *argv[]){
                 } else if(!strcmp(cmd, "frame")){
                     int end = ckb_frame(&ctx);
                     // Output the frame
-                    printf("begin frame\n");
-                    for(i = 0; i < ctx.keycount; i++){
-                        ckb_key* key = ctx.keys + i;
-                        printf("argb %s %02hhx%02hhx%02hhx%02hhx\n", key->name, key->a, key->r, key->g, key->b);
+                    if(shm){
+                        for(i = 0; i < ctx.keycount; i++){
+                            ckb_key* key = ctx.keys + i;
+                            shm[i] = (uint32_t)key->a << 24 | (uint32_t)key->r << 16 | (uint32_t)key->g << 8 | key->b;
+                        }
+                        printf("frame\n");
+                    } else {
+                        printf("begin frame\n");
+                        for(i = 0; i < ctx.keycount; i++){
+                            ckb_key* key = ctx.keys + i;
+                            printf("argb %s %02hhx%02hhx%02hhx%02hhx\n", key->name, key->a, key->r, key->g, key->b);
+                        }
+                        printf("end frame\n");
                     }
-                    printf("end frame\n");
                     if(end)
                         break;
                     fflush(stdout);
@@ -499,6 +550,8 @@ int main(int argc, char *argv[]){
             }
             printf("end run\n");
             fflush(stdout);
+            if(shm)
+                munmap(shm, shmsize);
             free(ctx.keys);
             return 0;
         }
@@ -507,6 +560,8 @@ int main(int argc, char *argv[]){
     return -1;
 }
 
+#endif  // CKB_PLUGIN
+
 #endif  // CKB_NO_MAIN
 
 #endif  // CKB_ANIM_H
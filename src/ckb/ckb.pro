@@ -57,9 +57,12 @@ SOURCES += main.cpp\
     keymap.cpp \
     media_linux.cpp \
     kblight.cpp \
+    kbrender.cpp \
+    kbframe.cpp \
     kbprofile.cpp \
     kbanimwidget.cpp \
     animscript.cpp \
+    animplugin.cpp \
     kbanim.cpp \
     animadddialog.cpp \
     animsettingdialog.cpp \
@@ -100,7 +103,8 @@ SOURCES += main.cpp\
     layoutdialog.cpp \
     extrasettingswidget.cpp \
     kbmanager.cpp \
-    colormap.cpp
+    colormap.cpp \
+    colorpipeline.cpp
 
 HEADERS  += mainwindow.h \
     kbwidget.h \
@@ -110,9 +114,14 @@ HEADERS  += mainwindow.h \
     keymap.h \
     media.h \
     kblight.h \
+    kbrender.h \
+    renderlock.h \
+    snapshot.h \
+    kbframe.h \
     kbprofile.h \
     kbanimwidget.h \
     animscript.h \
+    animplugin.h \
     ckb-anim.h \
     kbanim.h \
     animadddialog.h \
@@ -157,7 +166,8 @@ HEADERS  += mainwindow.h \
     layoutdialog.h \
     extrasettingswidget.h \
     kbmanager.h \
-    colormap.h
+    colormap.h \
+    colorpipeline.h
 
 FORMS    += mainwindow.ui \
     kbwidget.ui \
@@ -51,22 +51,11 @@ static int qs_strcmp(const void* lhs, const void* rhs){
 }
 
 void ColorMap::init(const KeyMap& map){
-    QList<Key> newKeys = map.positions();
-    // There's no point including keys that don't have LEDs, so remove them now
-    QMutableListIterator<Key> i(newKeys);
-    while(i.hasNext()){
-        Key key = i.next();
-        if(!key.hasLed)
-            i.remove();
-    }
-    // Now that we know how many keys we'll have, check memory
-    alloc(newKeys.count());
-    // Copy key names
-    int keyPos = 0;
-    foreach(const Key& key, newKeys)
-        _keyNames[keyPos++] = key.name;     // as above, it's safe to copy these since the strings are constants
-    // Sort names for quick access
-    qsort(_keyNames, _count, sizeof(const char*), qs_strcmp);
+    // There's no point including keys that don't have LEDs. The key map puts them last, so the colors can be indexed
+    // the same way as the keys.
+    alloc(map.ledCount());
+    for(int i = 0; i < _count; i++)
+        _keyNames[i] = map.keyName(i);     // it's safe to copy these since the strings are constants
 }
 
 QRgb* ColorMap::colorForName(const char* name){
@@ -10,7 +10,8 @@ typedef QHash<QString, QRgb>                QColorMap;
 typedef QHashIterator<QString, QRgb>        QColorMapIterator;
 typedef QMutableHashIterator<QString, QRgb> QMutableColorMapIterator;
 
-// ColorMap provides a flat, fast-access array for storing color values on a keyboard. Keys are sorted by name.
+// ColorMap provides a flat, fast-access array for storing color values on a keyboard. Keys are sorted by name, and each
+// color's position is the same as the key's index in the KeyMap (see KeyMap::index()).
 
 class ColorMap
 {
@@ -32,6 +33,9 @@ public:
     QRgb*               colors()            { return _colors; }
     const QRgb*         colors() const      { return _colors; }
 
+    // Finds a color by key index. Returns null if the key isn't in the map or doesn't have an LED.
+    inline QRgb*        colorForIndex(int index)        { return (index >= 0 && index < _count) ? _colors + index : 0; }
+    inline const QRgb*  colorForIndex(int index) const  { return (index >= 0 && index < _count) ? _colors + index : 0; }
     // Finds a color by key name. Returns null if the key isn't in the map.
     QRgb*       colorForName(const char* name);
     const QRgb* colorForName(const char* name) const;
@@ -0,0 +1,248 @@
+#include <cmath>
+#include "colorpipeline.h"
+#include "kbanim.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Colorspace conversion: linear <-> sRGB
+// (sRGB: [0, 255], linear: [0, 1])
+
+static float sToL(float srgb){
+    srgb /= 255.f;
+    if(srgb <= 0.04045f)
+        return srgb / 12.92f;
+    return pow((srgb + 0.055f) / 1.055f, 2.4f);
+}
+
+static float lToS(float linear){
+    if(linear <= 0.0031308f)
+        return 12.92f * linear * 255.f;
+    return (1.055f * pow(linear, 1.f / 2.4f) - 0.055f) * 255.f;
+}
+
+// The same conversions as lookup tables. Linear values are rounded to one of LINEAR_STEPS steps, which is fine enough for
+// every sRGB value to survive a round trip.
+static const int LINEAR_STEPS = 4096;
+static float sToLTable[256];
+static quint8 lToSTable[LINEAR_STEPS];
+
+static bool buildTables(){
+    for(int i = 0; i < 256; i++)
+        sToLTable[i] = sToL(i);
+    for(int i = 0; i < LINEAR_STEPS; i++)
+        lToSTable[i] = round(lToS(i / (float)(LINEAR_STEPS - 1)));
+    return true;
+}
+static bool tablesBuilt = buildTables();
+
+static inline int toSrgb(float linear){
+    int index = (int)(linear * (LINEAR_STEPS - 1) + 0.5f);
+    if(index < 0)
+        index = 0;
+    else if(index >= LINEAR_STEPS)
+        index = LINEAR_STEPS - 1;
+    return lToSTable[index];
+}
+
+static inline int monoValue(int r, int g, int b){
+    // It's important to use a linear colorspace for this, otherwise the colors will appear inconsistent
+    // Note that although we could use linear space for alpha blending or the animation blending functions, we don't.
+    // The reason for this is that photo manipulation programs don't do it either, so even though the result would technically be more correct,
+    // it would look wrong to most people.
+    return toSrgb((sToLTable[r] + sToLTable[g] + sToLTable[b]) / 3.f);
+}
+
+QRgb monoRgb(float r, float g, float b){
+    int value = monoValue(qBound(0, (int)r, 255), qBound(0, (int)g, 255), qBound(0, (int)b, 255));
+    return qRgb(value, value, value);
+}
+
+// Blending functions (colors from 0 to 1). The mode is always a constant, so the switch goes away.
+// Results are rounded with (int)(x + 0.5f) in both versions, so that SSE2 and non-SSE2 builds give the same colors.
+
+static inline float blendChannel(int mode, float bg, float fg){
+    float res = fg;
+    switch(mode){
+    case KbAnim::Add:
+        res = bg + fg;
+        if(res > 1.f)
+            res = 1.f;
+        break;
+    case KbAnim::Subtract:
+        res = bg - fg;
+        if(res < 0.f)
+            res = 0.f;
+        break;
+    case KbAnim::Multiply:
+        res = bg * fg;
+        break;
+    case KbAnim::Divide:
+        // 0 / 0 is 0; anything else over 0 is 1
+        if(bg <= 0.f)
+            return 0.f;
+        res = bg / fg;
+        if(res > 1.f)
+            res = 1.f;
+        break;
+    }
+    return res;
+}
+
+// Mixes one color into the background according to blend mode and alpha. opacity is pre-divided by 255.
+template<int mode>
+static inline void blendOne(QRgb& bg, QRgb fg, float opacity){
+    int alpha = qAlpha(fg);
+    if(alpha == 0)
+        return;
+    if(mode == KbAnim::Normal){
+        // Blend: normal
+        // This is the most common use case and it requires much less arithmetic
+        if(alpha == 255){
+            bg = fg;
+        } else {
+            float r = qRed(bg), g = qGreen(bg), b = qBlue(bg);
+            float a = alpha * opacity;
+            r = r * (1.f - a) + qRed(fg) * a;
+            g = g * (1.f - a) + qGreen(fg) * a;
+            b = b * (1.f - a) + qBlue(fg) * a;
+            bg = qRgb((int)(r + 0.5f), (int)(g + 0.5f), (int)(b + 0.5f));
+        }
+    } else {
+        // Use blend function
+        float r = qRed(bg) / 255.f, g = qGreen(bg) / 255.f, b = qBlue(bg) / 255.f;
+        float a = alpha * opacity;
+        r = r * (1.f - a) + blendChannel(mode, r, qRed(fg) / 255.f) * a;
+        g = g * (1.f - a) + blendChannel(mode, g, qGreen(fg) / 255.f) * a;
+        b = b * (1.f - a) + blendChannel(mode, b, qBlue(fg) / 255.f) * a;
+        bg = qRgb((int)(r * 255.f + 0.5f), (int)(g * 255.f + 0.5f), (int)(b * 255.f + 0.5f));
+    }
+}
+
+#ifdef __SSE2__
+
+// SSE2 versions: four colors at a time, with each channel in a vector of its own
+
+static inline __m128i select4(__m128i mask, __m128i ifTrue, __m128i ifFalse){
+    return _mm_or_si128(_mm_and_si128(mask, ifTrue), _mm_andnot_si128(mask, ifFalse));
+}
+
+template<int mode>
+static inline __m128 blendChannel4(__m128 bg, __m128 fg){
+    switch(mode){
+    case KbAnim::Add:
+        return _mm_min_ps(_mm_add_ps(bg, fg), _mm_set1_ps(1.f));
+    case KbAnim::Subtract:
+        return _mm_max_ps(_mm_sub_ps(bg, fg), _mm_setzero_ps());
+    case KbAnim::Multiply:
+        return _mm_mul_ps(bg, fg);
+    case KbAnim::Divide:
+        // min() also turns x / 0 into 1. 0 / 0 is masked to 0 along with everything else where bg is 0.
+        return _mm_and_ps(_mm_min_ps(_mm_div_ps(bg, fg), _mm_set1_ps(1.f)), _mm_cmpgt_ps(bg, _mm_setzero_ps()));
+    }
+    return fg;
+}
+
+// Blends one channel (given by its bit position) and returns it in place
+template<int mode, int shift>
+static inline __m128i blendChannels4(__m128i bg, __m128i fg, __m128 a){
+    const __m128i byteMask = _mm_set1_epi32(0xff);
+    const __m128 scale = _mm_set1_ps(255.f);
+    __m128 b = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(bg, shift), byteMask));
+    __m128 f = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(fg, shift), byteMask));
+    __m128 inv = _mm_sub_ps(_mm_set1_ps(1.f), a);
+    __m128 res;
+    if(mode == KbAnim::Normal)
+        res = _mm_add_ps(_mm_mul_ps(b, inv), _mm_mul_ps(f, a));
+    else {
+        b = _mm_div_ps(b, scale);
+        f = _mm_div_ps(f, scale);
+        res = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(b, inv), _mm_mul_ps(blendChannel4<mode>(b, f), a)), scale);
+    }
+    return _mm_slli_epi32(_mm_cvttps_epi32(_mm_add_ps(res, _mm_set1_ps(0.5f))), shift);
+}
+
+#endif
+
+template<int mode>
+static void blendLoop(QRgb* background, const QRgb* foreground, int count, float opacity){
+    int i = 0;
+#ifdef __SSE2__
+    const __m128 vOpacity = _mm_set1_ps(opacity);
+    for(; i + 4 <= count; i += 4){
+        __m128i fg = _mm_loadu_si128((const __m128i*)(foreground + i));
+        __m128i alpha = _mm_srli_epi32(fg, 24);
+        // Transparent colors leave the background alone. Most animations only draw a few keys at a time, so skip ahead
+        // if none of them are visible.
+        __m128i skip = _mm_cmpeq_epi32(alpha, _mm_setzero_si128());
+        if(_mm_movemask_epi8(skip) == 0xffff)
+            continue;
+        __m128i bg = _mm_loadu_si128((const __m128i*)(background + i));
+        __m128 a = _mm_mul_ps(_mm_cvtepi32_ps(alpha), vOpacity);
+        __m128i res = _mm_set1_epi32(0xff000000);
+        res = _mm_or_si128(res, blendChannels4<mode, 16>(bg, fg, a));
+        res = _mm_or_si128(res, blendChannels4<mode, 8>(bg, fg, a));
+        res = _mm_or_si128(res, blendChannels4<mode, 0>(bg, fg, a));
+        if(mode == KbAnim::Normal)
+            // Opaque colors are copied as they are, as in blendOne()
+            res = select4(_mm_cmpeq_epi32(alpha, _mm_set1_epi32(255)), fg, res);
+        res = select4(skip, bg, res);
+        _mm_storeu_si128((__m128i*)(background + i), res);
+    }
+#endif
+    for(; i < count; i++)
+        blendOne<mode>(background[i], foreground[i], opacity);
+}
+
+void blendColors(QRgb* background, const QRgb* foreground, int count, int mode, float opacity){
+    opacity /= 255.f;  // save some math by pre-dividing the 255 for qAlpha
+    switch(mode){
+    case KbAnim::Normal:
+        blendLoop<KbAnim::Normal>(background, foreground, count, opacity);
+        break;
+    case KbAnim::Add:
+        blendLoop<KbAnim::Add>(background, foreground, count, opacity);
+        break;
+    case KbAnim::Subtract:
+        blendLoop<KbAnim::Subtract>(background, foreground, count, opacity);
+        break;
+    case KbAnim::Multiply:
+        blendLoop<KbAnim::Multiply>(background, foreground, count, opacity);
+        break;
+    case KbAnim::Divide:
+        blendLoop<KbAnim::Divide>(background, foreground, count, opacity);
+        break;
+    }
+}
+
+void finishColors(QRgb* colors, const QRgb* indicators, int count, bool monochrome, float light, QRgb* display){
+    // The conversions here are all table lookups, which don't vectorize well with SSE2, so this stays one color at a time.
+    // What matters more is that it's only one pass over the colors.
+    bool dim = (light != 1.f);
+    for(int i = 0; i < count; i++){
+        QRgb rgb = colors[i];
+        int r = qRed(rgb), g = qGreen(rgb), b = qBlue(rgb);
+        // Apply indicators
+        if(indicators){
+            QRgb rgb2 = indicators[i];
+            if(qAlpha(rgb2) != 0){
+                float a2 = qAlpha(rgb2) / 255.f;
+                r = (int)(qRed(rgb2) * a2 + r * (1.f - a2) + 0.5f);
+                g = (int)(qGreen(rgb2) * a2 + g * (1.f - a2) + 0.5f);
+                b = (int)(qBlue(rgb2) * a2 + b * (1.f - a2) + 0.5f);
+            }
+        }
+        // If monochrome mode is active, average the channels to get a grayscale image
+        if(monochrome)
+            r = g = b = monoValue(r, g, b);
+        if(display)
+            display[i] = qRgb(r, g, b);
+        // Like the monochrome conversion, dimming should be done in a linear colorspace
+        if(dim){
+            r = toSrgb(sToLTable[r] * light);
+            g = toSrgb(sToLTable[g] * light);
+            b = toSrgb(sToLTable[b] * light);
+        }
+        colors[i] = qRgb(r, g, b);
+    }
+}
@@ -0,0 +1,25 @@
+#ifndef COLORPIPELINE_H
+#define COLORPIPELINE_H
+
+#include <QRgb>
+
+// Per-key color math for the lighting pipeline: blending animations into a frame, and the final pass over it before it's
+// sent to the device. SSE2 is used when the compiler supports it, with a portable version for everything else.
+// Conversions between sRGB and linear color are done with lookup tables instead of pow().
+// See also: KbAnim::blend(), KbLight::frameUpdate()
+
+// Blends foreground colors into the background according to a blend mode (KbAnim::Mode). Opacity is from 0 to 1 and is
+// applied on top of each foreground color's alpha.
+void blendColors(QRgb* background, const QRgb* foreground, int count, int mode, float opacity);
+
+// Final pass over a frame, in place:
+// - Indicators are drawn over the colors according to their alpha (skipped if indicators is null)
+// - If monochrome is set, the colors are converted to grayscale
+// - The colors so far are copied to display (skipped if display is null)
+// - The colors are dimmed by light (from 0 to 1)
+void finishColors(QRgb* colors, const QRgb* indicators, int count, bool monochrome, float light, QRgb* display);
+
+// Converts a color to grayscale. Channels are from 0 to 255.
+QRgb monoRgb(float r, float g, float b);
+
+#endif // COLORPIPELINE_H
@@ -1,10 +1,14 @@
+#include <cerrno>
 #include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
 #include <QSet>
 #include <QUrl>
 #include <QMutex>
 #include <QDateTime>
 #include "kb.h"
 #include "kbmanager.h"
+#include "renderlock.h"
 
 // All active devices
 static QSet<Kb*> activeDevices;
@@ -22,7 +26,7 @@ Kb::Kb(QObject *parent, const QString& path) :
     _currentProfile(0), _currentMode(0), _model(KeyMap::NO_MODEL),
     lastAutoSave(QDateTime::currentMSecsSinceEpoch()),
     _hwProfile(0), prevProfile(0), prevMode(0),
-    cmd(cmdpath), notifyNumber(1), _needsSave(false)
+    cmdFd(-1), frame(path), notifyNumber(1), _needsSave(false)
 {
     memset(iState, 0, sizeof(iState));
     memset(hwLoading, 0, sizeof(hwLoading));
@@ -75,9 +79,11 @@ Kb::Kb(QObject *parent, const QString& path) :
     hwModeCount = (_model == KeyMap::K95) ? 3 : 1;
     // Open cmd in non-blocking mode so that it doesn't lock up if nothing is reading
     // (e.g. if the daemon crashed and didn't clean up the node)
-    int fd = open(cmdpath.toLatin1().constData(), O_WRONLY | O_NONBLOCK);
-    if(!cmd.open(fd, QIODevice::WriteOnly, QFileDevice::AutoCloseHandle))
+    cmdFd = open(cmdpath.toLatin1().constData(), O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if(cmdFd < 0)
         return;
+    cmd.open(QIODevice::WriteOnly);
+    renderCmd.open(QIODevice::WriteOnly);
 
     // Find an available notification node (if none is found, take notify1)
     {
@@ -93,7 +99,7 @@ Kb::Kb(QObject *parent, const QString& path) :
         notifyPaths.insert(notifyPath);
     }
     cmd.write(QString("notifyon %1\n").arg(notifyNumber).toLatin1());
-    cmd.flush();
+    sendCmd(cmd);
     // Activate device, apply settings, and ask for hardware profile
     cmd.write(QString("fps %1\n").arg(_frameRate).toLatin1());
     cmd.write(QString("dither %1\n").arg(static_cast<int>(_dither)).toLatin1());
@@ -105,7 +111,7 @@ Kb::Kb(QObject *parent, const QString& path) :
     cmd.write(QString("accel %1\n").arg(QString(_mouseAccel ? "on" : "off")).toLatin1());
     cmd.write(QString("scrollspeed %1\n").arg(_scrollSpeed).toLatin1());
 #endif
-    cmd.write(QString("\nactive\n@%1 get :hwprofileid").arg(notifyNumber).toLatin1());
+    cmd.write(QString("\nactive\nframe open\n@%1 get :hwprofileid").arg(notifyNumber).toLatin1());
     hwLoading[0] = true;
     for(int i = 0; i < hwModeCount; i++){
         cmd.write(QString(" mode %1 get :hwid").arg(i + 1).toLatin1());
@@ -113,7 +119,7 @@ Kb::Kb(QObject *parent, const QString& path) :
     }
     // Ask for current indicator and key state
     cmd.write(" get :i :keys\n");
-    cmd.flush();
+    sendCmd(cmd);
 
     emit infoUpdated();
     activeDevices.insert(this);
@@ -132,12 +138,14 @@ Kb::~Kb(){
         wait(1000);
         return;
     }
+    frame.close();
     if(notifyNumber > 0)
-        cmd.write(QString("idle\nnotifyoff %1\n").arg(notifyNumber).toLatin1());
-    cmd.flush();
+        cmd.write(QString("frame close\nidle\nnotifyoff %1\n").arg(notifyNumber).toLatin1());
+    sendCmd(cmd);
     terminate();
     wait(1000);
-    cmd.close();
+    if(cmdFd >= 0)
+        close(cmdFd);
 }
 
 void Kb::frameRate(int newFrameRate){
@@ -148,7 +156,7 @@ void Kb::frameRate(int newFrameRate){
     _frameRate = newFrameRate;
     foreach(Kb* kb, activeDevices){
         kb->cmd.write(QString("fps %1\n").arg(newFrameRate).toLatin1());
-        kb->cmd.flush();
+        kb->sendCmd(kb->cmd);
     }
 }
 
@@ -167,7 +175,7 @@ void Kb::updateLayout(){
     cmd.write("layout ");
     cmd.write(KeyMap::isISO(_layout) ? "iso" : "ansi");
     cmd.write("\n");
-    cmd.flush();
+    sendCmd(cmd);
 #endif
     foreach(KbProfile* profile, _profiles)
         profile->keyMap(getKeyMap());
@@ -186,7 +194,7 @@ void Kb::dither(bool newDither){
     // Update all devices
     foreach(Kb* kb, activeDevices){
         kb->cmd.write(QString("dither %1\n").arg(static_cast<int>(newDither)).toLatin1());
-        kb->cmd.flush();
+        kb->sendCmd(kb->cmd);
     }
 }
 
@@ -198,7 +206,7 @@ void Kb::mouseAccel(bool newAccel){
     // Update all devices
     foreach(Kb* kb, activeDevices){
         kb->cmd.write(QString("accel %1\n").arg(QString(newAccel ? "on" : "off")).toLatin1());
-        kb->cmd.flush();
+        kb->sendCmd(kb->cmd);
     }
 #endif
 }
@@ -211,7 +219,7 @@ void Kb::scrollSpeed(int newSpeed){
     // Update all devices
     foreach(Kb* kb, activeDevices){
         kb->cmd.write(QString("scrollspeed %1\n").arg(newSpeed).toLatin1());
-        kb->cmd.flush();
+        kb->sendCmd(kb->cmd);
     }
 #endif
 }
@@ -276,19 +284,23 @@ void Kb::hwSave(){
     if(!_currentProfile)
         return;
     // Close active lighting (if any)
-    if(prevMode){
-        prevMode->light()->close();
-        deletePrevious();
+    {
+        RenderLock lock;
+        if(prevMode){
+            prevMode->light()->close();
+            deletePrevious();
+        }
     }
     hwProfile(_currentProfile);
     _hwProfile->id().hwModified = _hwProfile->id().modified;
     _hwProfile->setNeedsSave();
     // Re-send the current profile from scratch to ensure consistency
-    writeProfileHeader();
+    writeProfileHeader(cmd);
     // Make sure there are enough modes
     while(_currentProfile->modeCount() < hwModeCount)
         _currentProfile->append(new KbMode(this, getKeyMap()));
-    // Write only the base colors of each mode, no animations
+    // Write only the base colors of each mode, no animations. The render thread may be updating the same settings.
+    RenderLock lock;
     for(int i = 0; i < hwModeCount; i++){
         KbMode* mode = _currentProfile->modes()[i];
         cmd.write(QString("\nmode %1").arg(i + 1).toLatin1());
@@ -316,7 +328,7 @@ void Kb::hwSave(){
 
     // Save the profile to memory
     cmd.write("hwsave\n");
-    cmd.flush();
+    sendCmd(cmd);
 }
 
 bool Kb::needsSave() const {
@@ -329,15 +341,15 @@ bool Kb::needsSave() const {
     return false;
 }
 
-void Kb::writeProfileHeader(){
-    cmd.write("eraseprofile");
+void Kb::writeProfileHeader(QIODevice& out){
+    out.write("eraseprofile");
     // Write the profile name and ID
-    cmd.write(" profilename ");
-    cmd.write(QUrl::toPercentEncoding(_currentProfile->name()));
-    cmd.write(" profileid ");
-    cmd.write(_currentProfile->id().guidString().toLatin1());
-    cmd.write(" ");
-    cmd.write(_currentProfile->id().modifiedString().toLatin1());
+    out.write(" profilename ");
+    out.write(QUrl::toPercentEncoding(_currentProfile->name()));
+    out.write(" profileid ");
+    out.write(_currentProfile->id().guidString().toLatin1());
+    out.write(" ");
+    out.write(_currentProfile->id().modifiedString().toLatin1());
 }
 
 void Kb::fwUpdate(const QString& path){
@@ -348,6 +360,41 @@ void Kb::fwUpdate(const QString& path){
     cmd.write("fwupdate ");
     cmd.write(path.toLatin1());
     cmd.write("\n");
+    sendCmd(cmd);
+}
+
+void Kb::sendCmd(QBuffer& buffer){
+    // Only whole lines are sent. Anything after the last newline stays in the buffer until the line is finished.
+    QByteArray& data = buffer.buffer();
+    int end = data.lastIndexOf('\n') + 1;
+    if(end <= 0)
+        return;
+    QMutexLocker locker(&cmdMutex);
+    cmdPending.append(data.constData(), end);
+    data.remove(0, end);
+    buffer.seek(data.size());
+    // The node is non-blocking (see the constructor), so the driver may take less than everything at once. Keep writing
+    // until it's all gone, waiting a short time whenever the driver is busy. If it still isn't ready, the rest is sent the
+    // next time.
+    int written = 0;
+    while(written < cmdPending.size()){
+        ssize_t res = write(cmdFd, cmdPending.constData() + written, cmdPending.size() - written);
+        if(res > 0){
+            written += res;
+            continue;
+        }
+        if(res < 0 && errno == EINTR)
+            continue;
+        if(res < 0 && errno == EAGAIN){
+            pollfd pfd = { cmdFd, POLLOUT, 0 };
+            if(poll(&pfd, 1, 100) > 0)
+                continue;
+            break;
+        }
+        // Nothing is reading the node anymore. Throw everything away, the device will be removed soon.
+        written = cmdPending.size();
+    }
+    cmdPending.remove(0, written);
 }
 
 void Kb::frameUpdate(){
@@ -375,33 +422,38 @@ void Kb::frameUpdate(){
         changed = true;
     }
 
-    // If the profile has changed, update it
-    if(prevProfile != _currentProfile){
-        writeProfileHeader();
-        cmd.write(" ");
-        prevProfile = _currentProfile;
-    }
-
     // Update current mode
     int index = _currentProfile->indexOf(_currentMode);
+    if(index < 0)
+        // The profile was just changed and the mode hasn't been yet (see setCurrentMode())
+        return;
     // ckb-daemon only has 6 modes: 3 hardware, 3 non-hardware. Beyond mode six, switch back to four.
     // e.g. 1, 2, 3, 4, 5, 6, 4, 5, 6, 4, 5, 6 ...
     if(index >= 6)
         index = 3 + index % 3;
 
+    // If the profile has changed, update it
+    if(prevProfile != _currentProfile){
+        writeProfileHeader(renderCmd);
+        renderCmd.write(" ");
+        prevProfile = _currentProfile;
+    }
+
     // Send lighting/binding to driver
-    cmd.write(QString("mode %1 switch ").arg(index + 1).toLatin1());
+    renderCmd.write(QString("mode %1 switch ").arg(index + 1).toLatin1());
     perf->applyIndicators(index, iState);
-    light->frameUpdate(cmd, monochrome);
-    cmd.write(QString("\n@%1 ").arg(notifyNumber).toLatin1());
-    bind->update(cmd, changed);
-    cmd.write(" ");
-    perf->update(cmd, changed);
-    cmd.write("\n");
-    cmd.flush();
+    light->frameUpdate(lightFrame, monochrome);
+    KbLight::writeFrame(renderCmd, lightFrame, frame.open() ? &frame : 0);
+    renderCmd.write(QString("\n@%1 ").arg(notifyNumber).toLatin1());
+    bind->update(renderCmd, changed);
+    renderCmd.write(" ");
+    perf->update(renderCmd, changed);
+    renderCmd.write("\n");
+    sendCmd(renderCmd);
 }
 
 void Kb::deletePrevious(){
+    RenderLock lock;
     disconnect(prevMode, SIGNAL(destroyed()), this, SLOT(deletePrevious()));
     prevMode = 0;
 }
@@ -459,6 +511,8 @@ void Kb::readNotify(QString line){
         bool keyPressed = (key[0] == '+');
         KbMode* mode = _currentMode;
         if(mode){
+            // Both of these lock what they need to (see RenderLock). The key's action itself may do anything, including
+            // things that wait for the GUI, so it must not hold the lock.
             mode->light()->animKeypress(keyName, keyPressed);
             mode->bind()->keyEvent(keyName, keyPressed);
         }
@@ -494,7 +548,7 @@ void Kb::readNotify(QString line){
             newProfile = new KbProfile(this, getKeyMap(), guid, modified);
             hwLoading[0] = true;
             cmd.write(QString("@%1 get :hwprofilename\n").arg(notifyNumber).toLatin1());
-            cmd.flush();
+            sendCmd(cmd);
         } else {
             // If it's been updated, fetch its name
             if(newProfile->id().hwModifiedString() != modified){
@@ -503,7 +557,7 @@ void Kb::readNotify(QString line){
                 newProfile->setNeedsSave();
                 if(hwLoading[0]){
                     cmd.write(QString("@%1 get :hwprofilename\n").arg(notifyNumber).toLatin1());
-                    cmd.flush();
+                    sendCmd(cmd);
                 }
             } else {
                 hwLoading[0] = false;
@@ -577,7 +631,7 @@ void Kb::readNotify(QString line){
                 if(isMouse())
                     cmd.write(" :hwdpi :hwdpisel :hwlift :hwsnap");
                 cmd.write("\n");
-                cmd.flush();
+                sendCmd(cmd);
             }
         } else if(components[2] == "hwname"){
             // Mode name - update list
@@ -746,12 +800,18 @@ void Kb::setCurrentProfile(KbProfile *profile, bool spontaneous){
 
 void Kb::setCurrentMode(KbProfile* profile, KbMode* mode, bool spontaneous){
     if(_currentProfile != profile){
-        _currentProfile = profile;
+        {
+            RenderLock lock;
+            _currentProfile = profile;
+        }
         _needsSave = true;
         emit profileChanged();
     }
     if(_currentMode != mode || _currentProfile->currentMode() != mode){
-        _currentProfile->currentMode(_currentMode = mode);
+        {
+            RenderLock lock;
+            _currentProfile->currentMode(_currentMode = mode);
+        }
         _needsSave = true;
         emit modeChanged(spontaneous);
     }
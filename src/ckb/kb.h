@@ -2,9 +2,11 @@
 #define KB_H
 
 #include <QObject>
-#include <QFile>
+#include <QBuffer>
+#include <QMutex>
 #include <QThread>
 #include "kbprofile.h"
+#include "kbframe.h"
 
 // Class for managing devices
 
@@ -83,6 +85,10 @@ public:
 
     void hwSave();
 
+    // Draws a lighting frame and sends it to the driver, along with any changed settings. Called from the render thread (see
+    // KbRender), with a RenderLock held.
+    void frameUpdate();
+
     ~Kb();
 
 signals:
@@ -102,9 +108,6 @@ signals:
     void fwUpdateFinished(bool succeeded);
 
 public slots:
-    // Send lighting and settings to the driver
-    void frameUpdate();
-
     // Auto-save every 15s (if settings have changed, and no other writes are in progress)
     void autoSave();
 
@@ -122,7 +125,7 @@ private:
     // Creates a keyboard object with the given device path
     Kb(QObject *parent, const QString& path);
 
-    inline bool isOpen() const { return cmd.isOpen(); }
+    inline bool isOpen() const { return cmdFd >= 0; }
 
     // File paths
     QString devpath, cmdpath, notifyPath;
@@ -158,10 +161,20 @@ private:
     KbProfile*  prevProfile;
     KbMode*     prevMode;
     // Used to write the profile info when switching
-    void writeProfileHeader();
-
-    // cmd and notify file handles
-    QFile cmd;
+    void writeProfileHeader(QIODevice& out);
+
+    // Commands for the driver are written to a buffer first, one for each thread that sends them: cmd on the GUI thread,
+    // renderCmd on the render thread. sendCmd() passes the complete lines in a buffer on to the cmd node.
+    QBuffer cmd, renderCmd;
+    void sendCmd(QBuffer& buffer);
+    // cmd node. Only written by sendCmd(), under cmdMutex, so lines from the two threads never get mixed together.
+    int cmdFd;
+    QMutex cmdMutex;
+    // Commands the driver wasn't ready for yet. They're sent first the next time.
+    QByteArray cmdPending;
+    // Lighting for the current frame, and the shared-memory frame node. Only used on the render thread.
+    KbLight::Frame lightFrame;
+    KbFrame frame;
     // Notification number
     int notifyNumber;
 
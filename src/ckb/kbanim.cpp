@@ -3,7 +3,9 @@
 #include <QMetaEnum>
 #include <QDebug>
 #include "ckbsettings.h"
+#include "colorpipeline.h"
 #include "kbanim.h"
+#include "renderlock.h"
 
 KbAnim::KbAnim(QObject *parent, const KeyMap& map, const QUuid id, CkbSettings& settings) :
     QObject(parent), _script(0), _map(map),
@@ -21,6 +23,7 @@ KbAnim::KbAnim(QObject *parent, const KeyMap& map, const QUuid id, CkbSettings&
             key = _map.fromStorage(key);
         }
     }
+    updateKeyBits();
     _name = settings.value("Name").toString().trimmed();
     _opacity = settings.value("Opacity").toString().toDouble();
     if(_opacity < 0.)
@@ -87,6 +90,7 @@ KbAnim::KbAnim(QObject* parent, const KeyMap& map, const QString& name, const QS
     repeatTime(0), kpRepeatTime(0), stopTime(0), kpStopTime(0), repeatMsec(0), kpRepeatMsec(0),
     _guid(QUuid::createUuid()), _name(name), _opacity(1.), _mode(Normal), _isActive(false), _isActiveKp(false), _needsSave(true)
 {
+    updateKeyBits();
     if(_script){
         // Set default parameters
         QListIterator<AnimScript::Param> i = _script->paramIterator();
@@ -108,10 +112,12 @@ KbAnim::KbAnim(QObject* parent, const KeyMap& map, const KbAnim& other) :
     repeatTime(0), kpRepeatTime(0), stopTime(0), kpStopTime(0), repeatMsec(0), kpRepeatMsec(0),
     _guid(other._guid), _name(other._name), _opacity(other._opacity), _mode(other._mode), _isActive(false), _isActiveKp(false), _needsSave(true)
 {
+    updateKeyBits();
     reInit();
 }
 
 void KbAnim::parameter(const QString& name, const QVariant& value){
+    RenderLock lock;
     if(!_script->hasParam(name))
         return;
     _tempParameters[name] = value;
@@ -119,12 +125,14 @@ void KbAnim::parameter(const QString& name, const QVariant& value){
 }
 
 void KbAnim::commitParams(){
+    RenderLock lock;
     _needsSave = true;
     _parameters = effectiveParams();
     _tempParameters.clear();
 }
 
 void KbAnim::resetParams(){
+    RenderLock lock;
     _tempParameters.clear();
     updateParams();
 }
@@ -147,6 +155,7 @@ QMap<QString, QVariant> KbAnim::effectiveParams(){
 }
 
 void KbAnim::reInit(){
+    RenderLock lock;
     if(_script)
         _script->init(_map, _keys, effectiveParams());
     repeatKey = "";
@@ -154,15 +163,28 @@ void KbAnim::reInit(){
 }
 
 void KbAnim::map(const KeyMap& newMap){
+    RenderLock lock;
     _map = newMap;
+    updateKeyBits();
     reInit();
 }
 
 void KbAnim::keys(const QStringList& newKeys){
+    RenderLock lock;
     _keys = newKeys;
+    updateKeyBits();
     reInit();
 }
 
+void KbAnim::updateKeyBits(){
+    _keyBits.fill(false, _map.count());
+    foreach(const QString& key, _keys){
+        int index = _map.index(key);
+        if(index >= 0)
+            _keyBits.setBit(index);
+    }
+}
+
 void KbAnim::catchUp(quint64 timestamp){
     QMap<QString, QVariant> parameters = effectiveParams();
     // Stop the animation if its time has run out
@@ -207,6 +229,7 @@ void KbAnim::catchUp(quint64 timestamp){
 }
 
 void KbAnim::trigger(quint64 timestamp, bool ignoreParameter){
+    RenderLock lock;
     if(!_script)
         return;
     QMap<QString, QVariant> parameters = effectiveParams();
@@ -248,6 +271,7 @@ void KbAnim::trigger(quint64 timestamp, bool ignoreParameter){
 }
 
 void KbAnim::keypress(const QString& key, bool pressed, quint64 timestamp){
+    RenderLock lock;
     if(!_script)
         return;
     QMap<QString, QVariant> parameters = effectiveParams();
@@ -310,6 +334,7 @@ void KbAnim::keypress(const QString& key, bool pressed, quint64 timestamp){
 }
 
 void KbAnim::stop(){
+    RenderLock lock;
     if(_script)
         _script->end();
     repeatTime = 0;
@@ -328,40 +353,6 @@ bool KbAnim::isRunning() const {
     return _script->hasFrame();
 }
 
-// Blending functions
-
-static float blendNormal(float bg, float fg){
-    return fg;
-}
-
-static float blendAdd(float bg, float fg){
-    float res = bg + fg;
-    if(res > 1.f)
-        res = 1.f;
-    return res;
-}
-
-static float blendSubtract(float bg, float fg){
-    float res = bg - fg;
-    if(res < 0.f)
-        res = 0.f;
-    return res;
-}
-
-static float blendMultiply(float bg, float fg){
-    return bg * fg;
-}
-
-static float blendDivide(float bg, float fg){
-    float res = bg / fg;
-    if(res > 1.f)
-        res = 1.f;
-    return res;
-}
-
-typedef float (*blendFunc)(float,float);
-static blendFunc functions[5] = { blendNormal, blendAdd, blendSubtract, blendMultiply, blendDivide };
-
 void KbAnim::blend(ColorMap& animMap, quint64 timestamp){
     if(!_script)
         return;
@@ -371,46 +362,11 @@ void KbAnim::blend(ColorMap& animMap, quint64 timestamp){
     _script->frame(timestamp);
 
     // Blend the script's map with the current map
-    int blendMode = (int)_mode;
-    blendFunc blend = functions[blendMode];
-    float fOpacity = _opacity / 255.f;  // save some math by pre-dividing the 255 for qAlpha
-
     const ColorMap& scriptMap = _script->colors();
     int count = animMap.count();
     if(scriptMap.count() != count){
         qDebug() << "Script map didn't match base map (" << count << " vs " << scriptMap.count() << "). This should never happen.";
         return;
     }
-    QRgb* background = animMap.colors();
-    const QRgb* foreground = scriptMap.colors();
-    for(int i = 0; i < count; i++){
-        // Mix the colors in with the color map according to blend mode and alpha
-        QRgb& bg = background[i];
-        QRgb fg = foreground[i];
-        int alpha = qAlpha(fg);
-        if(alpha == 0)
-            continue;
-        if(blendMode == 0){
-            // Blend: normal
-            // This is the most common use case and it requires much less arithmetic
-            if(alpha == 255){
-                bg = fg;
-            } else {
-                float r = qRed(bg), g = qGreen(bg), b = qBlue(bg);
-                float a = alpha * fOpacity;
-                r = r * (1.f - a) + qRed(fg) * a;
-                g = g * (1.f - a) + qGreen(fg) * a;
-                b = b * (1.f - a) + qBlue(fg) * a;
-                bg = qRgb(round(r), round(g), round(b));
-            }
-        } else {
-            // Use blend function
-            float r = qRed(bg) / 255.f, g = qGreen(bg) / 255.f, b = qBlue(bg) / 255.f;
-            float a = alpha * fOpacity;
-            r = r * (1.f - a) + blend(r, qRed(fg) / 255.f) * a;
-            g = g * (1.f - a) + blend(g, qGreen(fg) / 255.f) * a;
-            b = b * (1.f - a) + blend(b, qBlue(fg) / 255.f) * a;
-            bg = qRgb(round(r * 255.f), round(g * 255.f), round(b * 255.f));
-        }
-    }
+    blendColors(animMap.colors(), scriptMap.colors(), count, _mode, _opacity);
 }
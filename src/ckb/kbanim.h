@@ -1,6 +1,7 @@
 #ifndef KBANIM_H
 #define KBANIM_H
 
+#include <QBitArray>
 #include <QObject>
 #include "ckbsettings.h"
 #include "animscript.h"
@@ -39,6 +40,8 @@ public:
     // Keys to animate
     inline const QStringList&   keys()                              { return _keys; }
     void                        keys(const QStringList& newKeys);
+    // Whether or not a key (by index, see KeyMap::index()) is animated
+    inline bool                 hasKey(int index) const             { return index >= 0 && index < _keyBits.size() && _keyBits.testBit(index); }
 
     // Gets a parameter value
     inline bool     hasParameter(const QString& name) const { return _parameters.contains(name); }
@@ -90,6 +93,9 @@ private:
 
     KeyMap _map;
     QStringList _keys;
+    // Animated keys by index
+    QBitArray _keyBits;
+    void updateKeyBits();
     // Committed parameters
     QMap<QString, QVariant> _parameters;
     // Uncommitted parameters
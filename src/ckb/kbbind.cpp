@@ -4,17 +4,18 @@
 #include "kbbind.h"
 #include "kbmode.h"
 #include "kb.h"
+#include "renderlock.h"
 
 QHash<QString, QString> KbBind::_globalRemap;
 quint64 KbBind::globalRemapTime = 0;
 
 KbBind::KbBind(KbMode* modeParent, Kb* parentBoard, const KeyMap& keyMap) :
-    QObject(modeParent), _devParent(parentBoard), lastGlobalRemapTime(globalRemapTime), _map(keyMap),
+    QObject(modeParent), _devParent(parentBoard), lastGlobalRemapTime(globalRemapTime), _map(keyMap), indexRemapTime(0),
     _winLock(false), _needsUpdate(true), _needsSave(true) {
 }
 
 KbBind::KbBind(KbMode* modeParent, Kb* parentBoard, const KeyMap& keyMap, const KbBind& other) :
-    QObject(modeParent), _devParent(parentBoard), lastGlobalRemapTime(globalRemapTime), _bind(other._bind),
+    QObject(modeParent), _devParent(parentBoard), lastGlobalRemapTime(globalRemapTime), _bind(other._bind), indexRemapTime(0),
     _winLock(false), _needsUpdate(true), _needsSave(true) {
     map(keyMap);
 }
@@ -28,6 +29,7 @@ KbLight* KbBind::light(){
 }
 
 void KbBind::load(CkbSettings& settings){
+    RenderLock lock;
     _needsSave = false;
     SGroup group(settings, "Binding");
     KeyMap currentMap = _map;
@@ -35,6 +37,7 @@ void KbBind::load(CkbSettings& settings){
     // Load key settings
     bool useReal = settings.value("UseRealNames").toBool();
     _bind.clear();
+    _indexBind.clear();
     {
         SGroup group(settings, "Keys");
         foreach(QString key, settings.childKeys()){
@@ -74,6 +77,7 @@ QString KbBind::globalRemap(const QString& key){
 }
 
 void KbBind::setGlobalRemap(const QHash<QString, QString> keyToActual){
+    RenderLock lock;
     _globalRemap.clear();
     // Ignore any keys with the standard binding
     QHashIterator<QString, QString> i(keyToActual);
@@ -86,6 +90,7 @@ void KbBind::setGlobalRemap(const QHash<QString, QString> keyToActual){
 }
 
 void KbBind::loadGlobalRemap(){
+    RenderLock lock;
     _globalRemap.clear();
     CkbSettings settings("Program/GlobalRemap");
     foreach(const QString& key, settings.childKeys())
@@ -103,13 +108,16 @@ void KbBind::saveGlobalRemap(){
 }
 
 void KbBind::map(const KeyMap& map){
+    RenderLock lock;
     _map = map;
+    _indexBind.clear();
     _needsUpdate = true;
     _needsSave = true;
     emit layoutChanged();
 }
 
 QString KbBind::action(const QString& key){
+    RenderLock lock;
     QString rKey = globalRemap(key);
     return bindAction(rKey)->value();
 }
@@ -132,16 +140,19 @@ QString KbBind::friendlyActionName(const QString& key){
 }
 
 void KbBind::resetAction(const QString &key){
+    RenderLock lock;
     QString rKey = globalRemap(key);
     // Clean up existing action (if any)
     KeyAction* action = _bind.value(rKey);
     delete action;
     _bind.remove(rKey);
+    _indexBind.clear();
     _needsUpdate = true;
     _needsSave = true;
 }
 
 void KbBind::noAction(const QString& key){
+    RenderLock lock;
     resetAction(key);
     QString rKey = globalRemap(key);
     if(!_map.key(rKey))
@@ -150,6 +161,7 @@ void KbBind::noAction(const QString& key){
 }
 
 void KbBind::setAction(const QString& key, const QString& action){
+    RenderLock lock;
     resetAction(key);
     QString rKey = globalRemap(key);
     if(!_map.key(rKey))
@@ -157,7 +169,7 @@ void KbBind::setAction(const QString& key, const QString& action){
     _bind[rKey] = new KeyAction(action, this);
 }
 
-void KbBind::update(QFile& cmd, bool force){
+void KbBind::update(QIODevice& cmd, bool force){
     if(!force && !_needsUpdate && lastGlobalRemapTime == globalRemapTime)
         return;
     lastGlobalRemapTime = globalRemapTime;
@@ -183,11 +195,16 @@ void KbBind::update(QFile& cmd, bool force){
         i.next();
         QString key = i.key();
         KeyAction* act = i.value();
-        if(_globalRemap.contains(key))
-            act = bindAction(_globalRemap.value(key));
-        if(!act)
+        QString value;
+        if(_globalRemap.contains(key)){
+            // Actions are owned by the GUI thread, so don't create one here if the remapped key doesn't have one yet
+            QString rKey = _globalRemap.value(key);
+            act = _bind.value(rKey);
+            value = act ? act->driverName() : KeyAction(KeyAction::defaultAction(rKey)).driverName();
+        } else if(act)
+            value = act->driverName();
+        else
             continue;
-        QString value = act->driverName();
         if(value.isEmpty()){
             // If the key is unbound or is a special action, unbind it
             cmd.write(" unbind ");
@@ -205,9 +222,27 @@ void KbBind::update(QFile& cmd, bool force){
         cmd.write(" unbind lwin rwin");
 }
 
+KeyAction* KbBind::indexAction(int index){
+    if(_indexBind.isEmpty() || indexRemapTime != globalRemapTime){
+        _indexBind.fill(0, _map.count());
+        indexRemapTime = globalRemapTime;
+    }
+    KeyAction*& act = _indexBind[index];
+    if(!act)
+        act = bindAction(globalRemap(_map.keyName(index)));
+    return act;
+}
+
 void KbBind::keyEvent(const QString& key, bool down){
-    QString rKey = globalRemap(key);
-    KeyAction* act = bindAction(rKey);
+    // Keys in the map are looked up by index, so a keypress doesn't need to hash the name more than once
+    // Only the lookup is locked (it may add the action). The action itself can switch modes or change DPI, which lock on
+    // their own, and only the GUI thread deletes actions, so it's safe to use after unlocking.
+    KeyAction* act;
+    {
+        RenderLock lock;
+        int index = _map.index(key);
+        act = (index >= 0) ? indexAction(index) : bindAction(globalRemap(key));
+    }
     if(act)
         act->keyEvent(this, down);
 }
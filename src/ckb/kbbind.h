@@ -1,8 +1,8 @@
 #ifndef KBBIND_H
 #define KBBIND_H
 
-#include <QFile>
 #include <QHash>
+#include <QIODevice>
 #include <QObject>
 #include <QProcess>
 #include "ckbsettings.h"
@@ -73,9 +73,9 @@ public:
     inline bool winLock()                   { return _winLock; }
     void        winLock(bool newWinLock)    { _winLock = newWinLock; _needsUpdate = true; }
 
-    // Updates bindings to the driver. Write "mode %d" first.
+    // Updates bindings to the driver. Write "mode %d" first. Called from the render thread, with a RenderLock held.
     // By default, nothing will be written unless bindings have changed. Use force = true or call setNeedsUpdate() to override.
-    void        update(QFile& cmd, bool force = false);
+    void        update(QIODevice& cmd, bool force = false);
     inline void setNeedsUpdate()                        { _needsUpdate = true; }
 
 public slots:
@@ -94,6 +94,8 @@ private:
     inline KbMode*  modeParent()    const   { return (KbMode*)parent(); }
 
     inline KeyAction* bindAction(const QString& key)    { if(!_bind.contains(key)) return _bind[key] = new KeyAction(KeyAction::defaultAction(key), this); return _bind[key]; }
+    // Action for a key by index (see KeyMap::index()), with the global remap already applied. Used for key events.
+    KeyAction*        indexAction(int index);
 
     static QHash<QString, QString>  _globalRemap;
     static quint64                  globalRemapTime;
@@ -102,6 +104,9 @@ private:
     KeyMap _map;
     // Key -> action map (no entry = default action)
     QHash<QString, KeyAction*> _bind;
+    // Actions by key index, filled in as keys are pressed. Cleared whenever _bind, the key map or the global remap changes.
+    QVector<KeyAction*> _indexBind;
+    quint64             indexRemapTime;
 
     bool _winLock;
     bool _needsUpdate;
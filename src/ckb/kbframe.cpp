@@ -0,0 +1,118 @@
+#include <cstdio>
+#include <cstring>
+#include "kbframe.h"
+
+KbFrame::KbFrame(const QString& devpath) :
+    file(devpath + "/frame"), frame(0), header(0), names(0), r(0), g(0), b(0), tries(0)
+{
+}
+
+KbFrame::~KbFrame(){
+    close();
+}
+
+bool KbFrame::open(){
+    if(frame)
+        return true;
+    if(tries >= MAX_TRIES)
+        return false;
+    tries++;
+    if(!file.open(QIODevice::ReadWrite))
+        return false;
+    // Check the header before mapping the rest
+    qint64 size = file.size();
+    uchar* mem = 0;
+    if(size >= (qint64)sizeof(Header))
+        mem = file.map(0, size);
+    if(!mem){
+        file.close();
+        return false;
+    }
+    Header* head = (Header*)mem;
+    quint64 ledCount = head->ledCount, nameLength = head->nameLength;
+    if(__atomic_load_n(&head->magic, __ATOMIC_ACQUIRE) != MAGIC || head->version != VERSION
+            || (quint64)size < sizeof(Header) + ledCount * (nameLength + 3)){
+        file.unmap(mem);
+        file.close();
+        return false;
+    }
+    frame = mem;
+    header = head;
+    names = (const char*)(mem + sizeof(Header));
+    r = mem + sizeof(Header) + ledCount * nameLength;
+    g = r + ledCount;
+    b = g + ledCount;
+    mapNames.clear();
+    mapLeds.clear();
+    return true;
+}
+
+void KbFrame::close(){
+    if(!frame)
+        return;
+    file.unmap(frame);
+    file.close();
+    frame = 0;
+    header = 0;
+    mapNames.clear();
+    mapLeds.clear();
+}
+
+void KbFrame::rebuildIndex(const ColorMap& colorMap){
+    int count = colorMap.count();
+    const char* const* keyNames = colorMap.keyNames();
+    mapNames.resize(count);
+    mapLeds.resize(count);
+    int ledCount = header->ledCount, nameLength = header->nameLength;
+    for(int i = 0; i < count; i++){
+        mapNames[i] = keyNames[i];
+        mapLeds[i] = -1;
+        for(int led = 0; led < ledCount; led++){
+            if(!strncmp(keyNames[i], names + led * nameLength, nameLength)){
+                mapLeds[i] = led;
+                break;
+            }
+        }
+    }
+}
+
+void KbFrame::write(QIODevice& cmd, const ColorMap& colorMap){
+    int count = colorMap.count();
+    const char* const* keyNames = colorMap.keyNames();
+    const QRgb* colors = colorMap.colors();
+    // Key names are constants, so the index only needs rebuilding when the pointers change
+    if(mapNames.count() != count || memcmp(mapNames.constData(), keyNames, count * sizeof(const char*)))
+        rebuildIndex(colorMap);
+    const int* leds = mapLeds.constData();
+
+    // Sequence number is odd while writing
+    __atomic_add_fetch(&header->seq, 1, __ATOMIC_ACQ_REL);
+    for(int i = 0; i < count; i++){
+        int led = leds[i];
+        if(led < 0)
+            continue;
+        QRgb color = colors[i];
+        r[led] = qRed(color);
+        g[led] = qGreen(color);
+        b[led] = qBlue(color);
+    }
+    __atomic_add_fetch(&header->seq, 1, __ATOMIC_RELEASE);
+    cmd.write("frame load");
+
+    // Anything not in the frame (e.g. Strafe sidelights) still goes through the rgb command
+    bool rgb = false;
+    for(int i = 0; i < count; i++){
+        if(leds[i] >= 0)
+            continue;
+        if(!rgb){
+            cmd.write(" rgb");
+            rgb = true;
+        }
+        cmd.write(" ");
+        cmd.write(keyNames[i]);
+        char output[8];
+        QRgb color = colors[i];
+        snprintf(output, sizeof(output), ":%02x%02x%02x", qRed(color), qGreen(color), qBlue(color));
+        cmd.write(output);
+    }
+}
@@ -0,0 +1,56 @@
+#ifndef KBFRAME_H
+#define KBFRAME_H
+
+#include <QFile>
+#include <QVector>
+#include "colormap.h"
+
+// Shared-memory frame node (<devpath>/frame). Lets lighting be sent to the daemon as raw color planes instead of text.
+// The layout must match ckbframe in ckb-daemon/frame.h.
+
+class KbFrame
+{
+public:
+    KbFrame(const QString& devpath);
+    ~KbFrame();
+
+    // Tries to map the frame node, if it isn't mapped already. The daemon creates it after receiving "frame open".
+    // Returns true if the node is available.
+    bool open();
+    void close();
+    inline bool isOpen() const { return frame != 0; }
+
+    // Writes the colors in the map to the frame node, then writes "frame load" to cmd.
+    // Keys without an LED in the frame table are written as a normal rgb command.
+    void write(QIODevice& cmd, const ColorMap& colorMap);
+
+private:
+    static const quint32 MAGIC = 0x666b6263;
+    static const quint32 VERSION = 1;
+    // Stop looking for the node after this many failed attempts (e.g. if the daemon is too old to support it)
+    static const int MAX_TRIES = 60;
+
+    struct Header {
+        quint32 magic;
+        quint32 version;
+        quint32 ledCount;
+        quint32 nameLength;
+        quint32 seq;
+        quint32 reserved[3];
+    };
+
+    QFile file;
+    uchar* frame;
+    Header* header;
+    // Name table and color planes
+    const char* names;
+    uchar* r, *g, *b;
+    int tries;
+
+    // LED index for each key in the last color map (-1 if none)
+    QVector<const char*> mapNames;
+    QVector<int> mapLeds;
+    void rebuildIndex(const ColorMap& colorMap);
+};
+
+#endif // KBFRAME_H
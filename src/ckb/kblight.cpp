@@ -1,20 +1,22 @@
 #include <cmath>
 #include <QDateTime>
 #include <QSet>
+#include "colorpipeline.h"
 #include "kblight.h"
 #include "kbmode.h"
+#include "renderlock.h"
 
 static int _shareDimming = -1;
 static QSet<KbLight*> activeLights;
 
 KbLight::KbLight(KbMode* parent, const KeyMap& keyMap) :
-    QObject(parent), _previewAnim(0), lastFrameSignal(0), _dimming(0), _start(false), _needsSave(true), _needsMapRefresh(true)
+    QObject(parent), _previewAnim(0), _hasIndicators(false), lastFrameSignal(0), _dimming(0), _start(false), _needsSave(true), _needsMapRefresh(true)
 {
     map(keyMap);
 }
 
 KbLight::KbLight(KbMode* parent, const KeyMap& keyMap, const KbLight& other) :
-    QObject(parent), _previewAnim(0), _map(other._map), _qColorMap(other._qColorMap), lastFrameSignal(0), _dimming(other._dimming), _start(false), _needsSave(true), _needsMapRefresh(true)
+    QObject(parent), _previewAnim(0), _map(other._map), _qColorMap(other._qColorMap), _hasIndicators(false), lastFrameSignal(0), _dimming(other._dimming), _start(false), _needsSave(true), _needsMapRefresh(true)
 {
     map(keyMap);
     // Duplicate animations
@@ -23,6 +25,7 @@ KbLight::KbLight(KbMode* parent, const KeyMap& keyMap, const KbLight& other) :
 }
 
 void KbLight::map(const KeyMap& map){
+    RenderLock lock;
     // If any of the keys are missing from the color map, set them to white
     QHashIterator<QString, Key> i(map);
     while(i.hasNext()){
@@ -38,28 +41,32 @@ void KbLight::map(const KeyMap& map){
     _colorMap.init(_map);
     _animMap.init(_map);
     _indicatorMap.init(_map);
+    _indicatorKeys.fill(false, _map.ledCount());
+    _hasIndicators = false;
     _needsSave = _needsMapRefresh = true;
     emit updated();
 }
 
 KbLight::~KbLight(){
+    RenderLock lock;
     activeLights.remove(this);
 }
 
 void KbLight::color(const QString& key, const QColor& newColor){
+    RenderLock lock;
     QRgb newRgb = newColor.rgb();
     _qColorMap[key] = newRgb;
     _needsSave = true;
     if(!_needsMapRefresh){
         // Update flat map if we're not scheduled to rebuild it
-        QByteArray rawName = key.toLatin1();
-        QRgb* rawRgb = _colorMap.colorForName(rawName.data());
+        QRgb* rawRgb = _colorMap.colorForIndex(_map.index(key));
         if(rawRgb)
             *rawRgb = newRgb;
     }
 }
 
 void KbLight::color(const QColor& newColor){
+    RenderLock lock;
     QRgb newRgb = newColor.rgb();
     QMutableColorMapIterator i(_qColorMap);
     while(i.hasNext()){
@@ -80,6 +87,7 @@ int KbLight::shareDimming(){
 }
 
 void KbLight::shareDimming(int newShareDimming){
+    RenderLock lock;
     if(_shareDimming == newShareDimming)
         return;
     _shareDimming = newShareDimming;
@@ -90,6 +98,7 @@ void KbLight::shareDimming(int newShareDimming){
 }
 
 void KbLight::dimming(int newDimming){
+    RenderLock lock;
     if(_shareDimming != -1)
         shareDimming(newDimming);
     _needsSave = true;
@@ -98,6 +107,7 @@ void KbLight::dimming(int newDimming){
 }
 
 KbAnim* KbLight::addAnim(const AnimScript *base, const QStringList &keys, const QString& name, const QMap<QString, QVariant>& preset){
+    RenderLock lock;
     // Stop and restart all existing animations
     stopPreview();
     quint64 timestamp = QDateTime::currentMSecsSinceEpoch();
@@ -122,6 +132,7 @@ KbAnim* KbLight::addAnim(const AnimScript *base, const QStringList &keys, const
 }
 
 void KbLight::previewAnim(const AnimScript* base, const QStringList& keys, const QMap<QString, QVariant>& preset){
+    RenderLock lock;
     if(_previewAnim)
         stopPreview();
     quint64 timestamp = QDateTime::currentMSecsSinceEpoch();
@@ -141,11 +152,17 @@ void KbLight::previewAnim(const AnimScript* base, const QStringList& keys, const
 }
 
 void KbLight::stopPreview(){
-    delete _previewAnim;
+    RenderLock lock;
+    if(!_previewAnim)
+        return;
+    // This may be called from the render thread, so the object has to be deleted by the GUI thread
+    _previewAnim->stop();
+    _previewAnim->deleteLater();
     _previewAnim = 0;
 }
 
 KbAnim* KbLight::duplicateAnim(KbAnim* oldAnim){
+    RenderLock lock;
     // Stop and restart all existing animations
     quint64 timestamp = QDateTime::currentMSecsSinceEpoch();
     foreach(KbAnim* anim, _animList){
@@ -166,6 +183,12 @@ KbAnim* KbLight::duplicateAnim(KbAnim* oldAnim){
     return anim;
 }
 
+void KbLight::animList(const AnimList& newAnimList){
+    RenderLock lock;
+    _needsSave = true;
+    _animList = newAnimList;
+}
+
 bool KbLight::isStarted(){
     if(!_start)
         return false;
@@ -177,6 +200,7 @@ bool KbLight::isStarted(){
 }
 
 void KbLight::restartAnimation(){
+    RenderLock lock;
     quint64 timestamp = QDateTime::currentMSecsSinceEpoch();
     foreach(KbAnim* anim, _animList){
         anim->stop();
@@ -187,17 +211,23 @@ void KbLight::restartAnimation(){
 }
 
 void KbLight::animKeypress(const QString& key, bool down){
+    RenderLock lock;
+    // Keys that aren't in the map can't belong to any animation
+    int index = _map.index(key);
+    if(index < 0)
+        return;
     foreach(KbAnim* anim, _animList){
-        if(anim->keys().contains(key))
+        if(anim->hasKey(index))
             anim->keypress(key, down, QDateTime::currentMSecsSinceEpoch());
     }
     if(_previewAnim){
-        if(_previewAnim->keys().contains(key))
+        if(_previewAnim->hasKey(index))
             _previewAnim->keypress(key, down, QDateTime::currentMSecsSinceEpoch());
     }
 }
 
 void KbLight::open(){
+    RenderLock lock;
     // Apply shared dimming if needed
     if(_shareDimming != -1 && _shareDimming != _dimming)
         dimming(_shareDimming);
@@ -213,6 +243,7 @@ void KbLight::open(){
 }
 
 void KbLight::close(){
+    RenderLock lock;
     activeLights.remove(this);
     foreach(KbAnim* anim, _animList)
         anim->stop();
@@ -220,7 +251,7 @@ void KbLight::close(){
     _start = false;
 }
 
-void KbLight::printRGB(QFile& cmd, const ColorMap &animMap){
+void KbLight::printRGB(QIODevice& cmd, const ColorMap &animMap){
     int count = animMap.count();
     const char* const* names = animMap.keyNames();
     const QRgb* colors = animMap.colors();
@@ -243,9 +274,8 @@ void KbLight::rebuildBaseMap(){
     QColorMapIterator i(_qColorMap);
     while(i.hasNext()){
         i.next();
-        QByteArray rawName = i.key().toLatin1();
         QRgb color = i.value();
-        QRgb* rawColor = _colorMap.colorForName(rawName.data());
+        QRgb* rawColor = _colorMap.colorForIndex(_map.index(i.key()));
         if(rawColor)
             *rawColor = color;
     }
@@ -253,47 +283,23 @@ void KbLight::rebuildBaseMap(){
 
 void KbLight::resetIndicators(){
     _indicatorMap.clear();
-    _indicatorList.clear();
+    if(_hasIndicators){
+        _indicatorKeys.fill(false);
+        _hasIndicators = false;
+    }
 }
 
 void KbLight::setIndicator(const char* name, QRgb argb){
-    QRgb* dest = _indicatorMap.colorForName(name);
+    int index = _map.index(name);
+    QRgb* dest = _indicatorMap.colorForIndex(index);
     if(dest){
         *dest = argb;
-        _indicatorList.insert(name);
+        _indicatorKeys.setBit(index);
+        _hasIndicators = true;
     }
 }
 
-// Colorspace conversion: linear <-> sRGB
-// (sRGB: [0, 255], linear: [0, 1])
-
-static float sToL(float srgb){
-    srgb /= 255.f;
-    if(srgb <= 0.04045f)
-        return srgb / 12.92f;
-    return pow((srgb + 0.055f) / 1.055f, 2.4f);
-}
-
-static float lToS(float linear){
-    if(linear <= 0.0031308f)
-        return 12.92f * linear * 255.f;
-    return (1.055f * pow(linear, 1.f / 2.4f) - 0.055f) * 255.f;
-}
-
-// Convert RGB to monochrome
-QRgb monoRgb(float r, float g, float b){
-    // It's important to use a linear colorspace for this, otherwise the colors will appear inconsistent
-    // Note that although we could use linear space for alpha blending or the animation blending functions, we don't.
-    // The reason for this is that photo manipulation programs don't do it either, so even though the result would technically be more correct,
-    // it would look wrong to most people.
-    r = sToL(r);
-    g = sToL(g);
-    b = sToL(b);
-    int value = round(lToS((r + g + b) / 3.f));
-    return qRgb(value, value, value);
-}
-
-void KbLight::frameUpdate(QFile& cmd, bool monochrome){
+void KbLight::frameUpdate(Frame& frame, bool monochrome){
     rebuildBaseMap();
     _animMap = _colorMap;
     // Advance animations
@@ -303,72 +309,51 @@ void KbLight::frameUpdate(QFile& cmd, bool monochrome){
     if(_previewAnim)
         _previewAnim->blend(_animMap, timestamp);
 
-    int count = _animMap.count();
-    QRgb* colors = _animMap.colors();
-    // Apply active indicators and/or perform monochrome conversion
-    if(monochrome || !_indicatorList.isEmpty()){
-        QRgb* indicators = _indicatorMap.colors();
-        for(int i = 0; i < count; i++){
-            QRgb& rgb = colors[i];
-            float r = qRed(rgb);
-            float g = qGreen(rgb);
-            float b = qBlue(rgb);
-            // Apply indicators
-            QRgb rgb2 = indicators[i];
-            if(qAlpha(rgb2) != 0){
-                float r2 = qRed(rgb2);
-                float g2 = qGreen(rgb2);
-                float b2 = qBlue(rgb2);
-                float a2 = qAlpha(rgb2) / 255.f;
-                r = round(r2 * a2 + r * (1.f - a2));
-                g = round(g2 * a2 + g * (1.f - a2));
-                b = round(b2 * a2 + b * (1.f - a2));
-            }
-            // If monochrome mode is active, average the channels to get a grayscale image
-            if(monochrome)
-                rgb = monoRgb(r, g, b);
-            else
-                rgb = qRgb(r, g, b);
-        }
-    }
-
     // Emit signals for the animation (only do this every 50ms - it can cause a lot of CPU usage)
+    DisplayFrame* display = 0;
     if(timestamp >= lastFrameSignal + 50){
-        emit frameDisplayed(_animMap, _indicatorList);
+        display = &displaySnapshot.write();
+        display->colors = _animMap;
+        display->indicators.clear();
+        for(int i = 0; _hasIndicators && i < _indicatorKeys.size(); i++){
+            if(_indicatorKeys.testBit(i))
+                display->indicators.insert(_map.keyName(i));
+        }
         lastFrameSignal = timestamp;
     }
 
+    // Apply active indicators, monochrome conversion and global dimming, all in one pass. The display frame gets
+    // everything but the dimming, which is skipped at 0% brightness since there's no need for it.
+    float light = (_dimming == 3) ? 1.f : (3 - _dimming) / 3.f;
+    if(_hasIndicators || monochrome || light != 1.f)
+        finishColors(_animMap.colors(), _hasIndicators ? _indicatorMap.colors() : 0, _animMap.count(), monochrome, light, display ? display->colors.colors() : 0);
+    if(display){
+        displaySnapshot.publish();
+        emit frameDisplayed();
+    }
+
     // If brightness is at 0%, turn off lighting entirely
-    if(_dimming == 3){
+    frame.off = (_dimming == 3);
+    if(!frame.off)
+        frame.colors = _animMap;
+}
+
+void KbLight::writeFrame(QIODevice& cmd, const Frame& frame, KbFrame* node){
+    if(frame.off){
         cmd.write("rgb 000000");
         return;
     }
-
-    float light = (3 - _dimming) / 3.f;
-    // Apply global dimming
-    if(light != 1.f || monochrome){
-        for(int i = 0; i < count; i++){
-            QRgb& rgb = colors[i];
-            // Like the monochrome conversion, this should be done in a linear colorspace
-            float r = sToL(qRed(rgb));
-            float g = sToL(qGreen(rgb));
-            float b = sToL(qBlue(rgb));
-            r *= light;
-            g *= light;
-            b *= light;
-            r = round(lToS(r));
-            g = round(lToS(g));
-            b = round(lToS(b));
-            rgb = qRgb(r, g, b);
-        }
-    }
-
     // Apply light
+    if(node){
+        node->write(cmd, frame.colors);
+        return;
+    }
     cmd.write("rgb");
-    printRGB(cmd, _animMap);
+    printRGB(cmd, frame.colors);
 }
 
-void KbLight::base(QFile &cmd, bool ignoreDim, bool monochrome){
+void KbLight::base(QIODevice &cmd, bool ignoreDim, bool monochrome){
+    RenderLock lock;
     close();
     if(_dimming == MAX_DIM && !ignoreDim){
         cmd.write(QString().sprintf("rgb 000000").toLatin1());
@@ -387,7 +372,7 @@ void KbLight::base(QFile &cmd, bool ignoreDim, bool monochrome){
         }
     }
     // Set a few indicators to black as the hardware handles them differently
-    QRgb* mr = _animMap.colorForName("mr"), *m1 = _animMap.colorForName("m1"), *m2 = _animMap.colorForName("m2"), *m3 = _animMap.colorForName("m3"), *lock = _animMap.colorForName("lock");
+    QRgb* mr = _animMap.colorForIndex(_map.index("mr")), *m1 = _animMap.colorForIndex(_map.index("m1")), *m2 = _animMap.colorForIndex(_map.index("m2")), *m3 = _animMap.colorForIndex(_map.index("m3")), *lock = _animMap.colorForIndex(_map.index("lock"));
     if(mr) *mr = 0;
     if(m1) *m1 = 0;
     if(m2) *m2 = 0;
@@ -398,7 +383,17 @@ void KbLight::base(QFile &cmd, bool ignoreDim, bool monochrome){
     printRGB(cmd, _animMap);
 }
 
+bool KbLight::displayedFrame(ColorMap& animatedColors, QSet<QString>& indicatorList){
+    if(!displaySnapshot.take())
+        return false;
+    const DisplayFrame& display = displaySnapshot.read();
+    animatedColors = display.colors;
+    indicatorList = display.indicators;
+    return true;
+}
+
 void KbLight::load(CkbSettings& settings){
+    RenderLock lock;
     // Load light settings
     _needsSave = false;
     SGroup group(settings, "Lighting");
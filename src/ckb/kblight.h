@@ -1,6 +1,7 @@
 #ifndef KBLIGHT_H
 #define KBLIGHT_H
 
+#include <QBitArray>
 #include <QFile>
 #include <QObject>
 #include <QSet>
@@ -9,6 +10,8 @@
 #include "kbanim.h"
 #include "keymap.h"
 #include "colormap.h"
+#include "kbframe.h"
+#include "snapshot.h"
 
 class KbMode;
 
@@ -47,7 +50,7 @@ public:
     KbAnim*             addAnim(const AnimScript* base, const QStringList& keys, const QString& name, const QMap<QString, QVariant>& preset);
     KbAnim*             duplicateAnim(KbAnim* oldAnim);
     const AnimList&     animList()                              { return _animList; }
-    void                animList(const AnimList& newAnimList)   { _needsSave = true; _animList = newAnimList; }
+    void                animList(const AnimList& newAnimList);
     KbAnim*             findAnim(const QUuid& guid) const       { foreach(KbAnim* anim, _animList) { if(anim->guid() == guid) return anim; } return 0; }
     int                 findAnimIdx(const QUuid& guid) const    { return _animList.indexOf(findAnim(guid)); }
     // Preview animation - temporary animation displayed at the top of the animation list
@@ -70,10 +73,22 @@ public:
     // Set an indicator to a given ARGB value
     void setIndicator(const char* name, QRgb argb);
 
-    // Write a new frame to the keyboard. Write "mode %d" first. Optionally provide a list of keys to use as indicators and overwrite the lighting
-    void frameUpdate(QFile& cmd, bool monochrome = false);
+    // Lighting for one frame, as sent to the keyboard
+    struct Frame {
+        // Whether the lighting is turned off entirely (0% brightness)
+        bool        off;
+        ColorMap    colors;
+    };
+    // Advance the animations and draw a new frame. Called from the render thread (see KbRender).
+    void frameUpdate(Frame& frame, bool monochrome = false);
+    // Write a frame to the keyboard. Write "mode %d" first. If a frame node is given, the colors are sent through it instead of as text.
+    static void writeFrame(QIODevice& cmd, const Frame& frame, KbFrame* node = 0);
     // Write the mode's base colors without any animation
-    void base(QFile& cmd, bool ignoreDim = false, bool monochrome = false);
+    void base(QIODevice& cmd, bool ignoreDim = false, bool monochrome = false);
+
+    // Takes the newest frame sent to frameDisplayed(). Returns false if there hasn't been a new one since the last call.
+    // Only one object (the lighting widget) may read frames.
+    bool displayedFrame(ColorMap& animatedColors, QSet<QString>& indicatorList);
 
     // Load and save from stored settings
     void load(CkbSettings& settings);
@@ -83,7 +98,8 @@ public:
 signals:
     void didLoad();
     void updated();
-    void frameDisplayed(const ColorMap& animatedColors, const QSet<QString>& indicatorList);
+    // A frame is ready for display (see displayedFrame()). Emitted from the render thread.
+    void frameDisplayed();
 
 private:
     AnimList        _animList;
@@ -91,7 +107,15 @@ private:
     KeyMap          _map;
     QColorMap       _qColorMap;
     ColorMap        _colorMap, _animMap, _indicatorMap;
-    QSet<QString>   _indicatorList;
+    // Keys with indicators set, by index
+    QBitArray       _indicatorKeys;
+    bool            _hasIndicators;
+    // Frames for display, handed off from the render thread
+    struct DisplayFrame {
+        ColorMap        colors;
+        QSet<QString>   indicators;
+    };
+    Snapshot<DisplayFrame> displaySnapshot;
     quint64         lastFrameSignal;
     int             _dimming;
     bool            _start;
@@ -100,7 +124,7 @@ private:
     // Rebuild base ColorMap (if needed)
     void rebuildBaseMap();
     // Print RGB values to cmd node
-    void printRGB(QFile& cmd, const ColorMap& animMap);
+    static void printRGB(QIODevice& cmd, const ColorMap& animMap);
 };
 
 #endif // KBLIGHT_H
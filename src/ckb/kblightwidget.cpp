@@ -54,15 +54,24 @@ void KbLightWidget::on_showAnimBox_clicked(bool checked){
     // Connect/disconnect animation slot
     if(checked){
         if(light)
-            connect(light, SIGNAL(frameDisplayed(const ColorMap&,const QSet<QString>&)), ui->keyWidget, SLOT(displayColorMap(const ColorMap&,const QSet<QString>&)));
+            connect(light, SIGNAL(frameDisplayed()), this, SLOT(showFrame()));
     } else {
         if(light)
-            disconnect(light, SIGNAL(frameDisplayed(const ColorMap&,const QSet<QString>&)), ui->keyWidget, SLOT(displayColorMap(const ColorMap&,const QSet<QString>&)));
+            disconnect(light, SIGNAL(frameDisplayed()), this, SLOT(showFrame()));
         ui->keyWidget->displayColorMap(ColorMap());
     }
     CkbSettings::set("UI/Light/ShowBaseOnly", !checked);
 }
 
+void KbLightWidget::showFrame(){
+    if(!light)
+        return;
+    ColorMap colors;
+    QSet<QString> indicators;
+    if(light->displayedFrame(colors, indicators))
+        ui->keyWidget->displayColorMap(colors, indicators);
+}
+
 void KbLightWidget::updateLight(){
     ui->keyWidget->map(light->map());
     ui->keyWidget->colorMap(light->colorMap());
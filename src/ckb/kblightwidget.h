@@ -36,6 +36,7 @@ private slots:
     void on_bgButton_clicked();
 
     void on_showAnimBox_clicked(bool checked);
+    void showFrame();
 
     void toggleSidelight(); //strafe
 
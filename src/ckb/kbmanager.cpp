@@ -1,4 +1,5 @@
 #include "kbmanager.h"
+#include "kbrender.h"
 
 #ifndef Q_OS_MACX
 QString devpath = "/dev/input/ckb%1";
@@ -19,27 +20,23 @@ void KbManager::init(QString guiVersion){
 void KbManager::stop(){
     if(!_kbManager)
         return;
+    // The devices can't be deleted while frames are being drawn
+    KbRender::stop();
     delete _kbManager;
     _kbManager = 0;
 }
 
 KbManager::KbManager(QObject *parent) : QObject(parent){
     // Set up the timers
-    _eventTimer = new QTimer(this);
-    _eventTimer->setTimerType(Qt::PreciseTimer);
     _scanTimer = new QTimer(this);
     _scanTimer->start(100);
     connect(_scanTimer, SIGNAL(timeout()), this, SLOT(scanKeyboards()));
 }
 
 void KbManager::fps(int framerate){
-    QTimer* timer = eventTimer();
-    if(!timer)
+    if(!_kbManager)
         return;
-    if(timer->isActive())
-        timer->setInterval(1000 / framerate);
-    else
-        timer->start(1000 / framerate);
+    KbRender::fps(framerate);
 }
 
 float KbManager::parseVersionString(QString version){
@@ -62,6 +59,7 @@ void KbManager::scanKeyboards(){
     if(!connected.open(QIODevice::ReadOnly)){
         // No root controller - remove all keyboards
         foreach(Kb* kb, _devices){
+            KbRender::remove(kb);
             emit kbDisconnected(kb);
             kb->save();
             delete kb;
@@ -114,6 +112,7 @@ void KbManager::scanKeyboards(){
             continue;
         // Device not found, remove
         i.remove();
+        KbRender::remove(kb);
         emit kbDisconnected(kb);
         kb->save();
         delete kb;
@@ -140,7 +139,7 @@ void KbManager::scanKeyboards(){
         // Load preferences and send signal
         emit kbConnected(kb);
         kb->load();
-        connect(_eventTimer, SIGNAL(timeout()), kb, SLOT(frameUpdate()));
+        KbRender::add(kb);
         connect(_scanTimer, SIGNAL(timeout()), kb, SLOT(autoSave()));
     }
 }
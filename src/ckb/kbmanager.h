@@ -33,10 +33,7 @@ public:
     // List of all connected devices
     static const QSet<Kb*> devices()        { return _kbManager ? _kbManager->_devices : QSet<Kb*>(); }
 
-    // Event timer for the driver. Created during init(). Starts ticking when fps() is called.
-    // Use this for animations or other events which need to run at a high frame rate.
-    static inline QTimer* eventTimer()      { return _kbManager ? _kbManager->_eventTimer : 0; }
-    // Sets the frame rate for the event timer
+    // Sets the frame rate. Frames are drawn on a separate thread (see KbRender), which starts when this is first called.
     static void fps(int framerate);
 
     // Timer for scanning the driver/device list. May also be useful for periodic GUI events. Created during init(), always runs at 10FPS.
@@ -61,7 +58,7 @@ private:
     explicit KbManager(QObject* parent = 0);
 
     QSet<Kb*> _devices;
-    QTimer* _eventTimer, *_scanTimer;
+    QTimer* _scanTimer;
 };
 
 #endif // KBMANAGER_H
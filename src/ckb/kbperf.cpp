@@ -76,6 +76,7 @@ KbPerf::KbPerf(KbMode* parent, const KbPerf& other) :
 }
 
 const KbPerf& KbPerf::operator= (const KbPerf& other){
+    RenderLock lock;
     dpiCurX = other.dpiCurX; dpiCurY = other.dpiCurY; dpiCurIdx = other.dpiCurIdx; dpiLastIdx = other.dpiLastIdx; runningPushIdx = 1;
     _iOpacity = other._iOpacity; light100Color = other.light100Color; muteNAColor = other.muteNAColor; _dpiIndicator = other._dpiIndicator;
     _liftHeight = other._liftHeight; _angleSnap = other._angleSnap;
@@ -106,6 +107,7 @@ KbLight* KbPerf::light() const {
 }
 
 void KbPerf::load(CkbSettings& settings){
+    RenderLock lock;
     pushedDpis.clear();
     runningPushIdx = 1;
     _needsSave = false;
@@ -247,6 +249,7 @@ void KbPerf::save(CkbSettings& settings){
 }
 
 void KbPerf::dpi(int index, const QPoint& newValue){
+    RenderLock lock;
     if(index < 0 || index >= DPI_COUNT)
         return;
     dpiX[index] = newValue.x();
@@ -276,12 +279,14 @@ void KbPerf::_curDpi(const QPoint& newDpi){
 }
 
 void KbPerf::curDpi(const QPoint& newDpi){
+    RenderLock lock;
     while(pushedDpis.count() > 0)
         popDpi(pushedDpis.keys().last());
     _curDpi(newDpi);
 }
 
 quint64 KbPerf::pushDpi(const QPoint& newDpi){
+    RenderLock lock;
     if(pushedDpis.isEmpty())
         // Push original DPI
         pushedDpis[0] = curDpi();
@@ -294,6 +299,7 @@ quint64 KbPerf::pushDpi(const QPoint& newDpi){
 }
 
 void KbPerf::popDpi(quint64 pushIdx){
+    RenderLock lock;
     if(pushIdx == 0 || !pushedDpis.contains(pushIdx))
         return;
     pushedDpis.remove(pushIdx);
@@ -342,6 +348,7 @@ void KbPerf::getIndicator(indicator index, QColor& color1, QColor& color2, QColo
 }
 
 void KbPerf::setIndicator(indicator index, const QColor& color1, const QColor& color2, const QColor& color3, bool software_enable, i_hw hardware_enable){
+    RenderLock lock;
     if(index < 0 || index >= I_COUNT)
         return;
     iColor[index][0] = color1;
@@ -370,7 +377,7 @@ void KbPerf::angleSnap(bool newAngleSnap){
     _needsUpdate = _needsSave = true;
 }
 
-void KbPerf::update(QFile& cmd, bool force, bool saveCustomDpi){
+void KbPerf::update(QIODevice& cmd, bool force, bool saveCustomDpi){
     if(!force && !_needsUpdate)
         return;
     emit settingsUpdated();
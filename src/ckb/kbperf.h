@@ -1,10 +1,11 @@
 #ifndef KBPERF_H
 #define KBPERF_H
-#include <QFile>
+#include <QIODevice>
 #include <QMap>
 #include <QPoint>
 #include "ckbsettings.h"
 #include "keymap.h"
+#include "renderlock.h"
 
 class KbMode;
 class KbBind;
@@ -80,7 +81,7 @@ public:
     inline void     dpiIndicator(bool newDpiIndicator)          { _dpiIndicator = newDpiIndicator; _needsSave = true; }
     const static int OTHER = DPI_COUNT;     // valid only with dpiColor
     inline QColor   dpiColor(int index) const                   { return dpiClr[index]; }
-    inline void     dpiColor(int index, const QColor& newColor) { dpiClr[index] = newColor; _needsUpdate = _needsSave = true; }
+    inline void     dpiColor(int index, const QColor& newColor) { RenderLock lock; dpiClr[index] = newColor; _needsUpdate = _needsSave = true; }
     // KB indicator colors
     enum indicator {
         // Hardware
@@ -107,9 +108,9 @@ public:
     void getIndicator(indicator index, QColor& color1, QColor& color2, QColor& color3, bool& software_enable, i_hw& hardware_enable);
     void setIndicator(indicator index, const QColor& color1, const QColor& color2, const QColor& color3 = QColor(), bool software_enable = true, i_hw hardware_enable = NORMAL);
 
-    // Updates settings to the driver. Write "mode %d" first. Disable saveCustomDpi when writing a hardware profile or other permanent storage.
+    // Updates settings to the driver. Write "mode %d" first. Called from the render thread, with a RenderLock held. Disable saveCustomDpi when writing a hardware profile or other permanent storage.
     // By default, nothing will be written unless the settings have changed. Use force = true or call setNeedsUpdate() to override.
-    void        update(QFile& cmd, bool force = false, bool saveCustomDpi = true);
+    void        update(QIODevice& cmd, bool force = false, bool saveCustomDpi = true);
     inline void setNeedsUpdate()        { _needsUpdate = true; }
 
     // Get indicator status to send to KbLight
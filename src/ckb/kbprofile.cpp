@@ -76,6 +76,7 @@ bool KbProfile::needsSave() const {
 }
 
 void KbProfile::newId(){
+    RenderLock lock;
     _needsSave = true;
     _id = UsbId();
     foreach(KbMode* mode, _modes)
@@ -7,6 +7,7 @@
 #include <QString>
 #include <QUuid>
 #include "kbmode.h"
+#include "renderlock.h"
 
 class KbProfile : public QObject
 {
@@ -26,9 +27,9 @@ public:
 
     // Profile properties
     inline QString  name() const                    { return _name; }
-    inline void     name(const QString& newName)    { _needsSave = true; _name = newName.trimmed(); if(_name == "") _name = "Unnamed"; }
+    inline void     name(const QString& newName)    { RenderLock lock; _needsSave = true; _name = newName.trimmed(); if(_name == "") _name = "Unnamed"; }
     inline UsbId&   id()                            { return _id; }
-    inline void     id(const UsbId& newId)          { _needsSave = true; _id = newId; }
+    inline void     id(const UsbId& newId)          { RenderLock lock; _needsSave = true; _id = newId; }
 
     // Creates a new ID for the profile and all of its modes
     void newId();
@@ -37,14 +38,14 @@ public:
     inline const KeyMap&    keyMap() const                  { return _keyMap; }
     void                    keyMap(const KeyMap& newKeyMap);
 
-    // Modes in this profile
+    // Modes in this profile. The render thread looks the current mode up in the list, so changes to it are locked.
     typedef QList<KbMode*> ModeList;
     inline const ModeList&  modes() const                           { return _modes; }
-    inline void             modes(const QList<KbMode*>& newModes)   { setNeedsUpdate(); _modes = newModes; }
-    inline void             append(KbMode* newMode)                 { setNeedsUpdate(); _modes.append(newMode); }
-    inline void             insert(int index, KbMode* newMode)      { setNeedsUpdate(); _modes.insert(index, newMode); }
-    inline void             removeAll(KbMode* mode)                 { setNeedsUpdate(); _modes.removeAll(mode); }
-    inline void             move(int from, int to)                  { setNeedsUpdate(); _modes.move(from, to); }
+    inline void             modes(const QList<KbMode*>& newModes)   { RenderLock lock; setNeedsUpdate(); _modes = newModes; }
+    inline void             append(KbMode* newMode)                 { RenderLock lock; setNeedsUpdate(); _modes.append(newMode); }
+    inline void             insert(int index, KbMode* newMode)      { RenderLock lock; setNeedsUpdate(); _modes.insert(index, newMode); }
+    inline void             removeAll(KbMode* mode)                 { RenderLock lock; setNeedsUpdate(); _modes.removeAll(mode); }
+    inline void             move(int from, int to)                  { RenderLock lock; setNeedsUpdate(); _modes.move(from, to); }
 
     inline int              modeCount() const           { return _modes.count(); }
     inline int              indexOf(KbMode* mode) const { return _modes.indexOf(mode); }
@@ -0,0 +1,70 @@
+#include <QElapsedTimer>
+#include <QMutexLocker>
+#include "kb.h"
+#include "kbrender.h"
+#include "renderlock.h"
+
+KbRender* KbRender::_render = 0;
+QSet<Kb*> KbRender::devices;
+QMutex KbRender::devicesMutex;
+
+KbRender::KbRender() :
+    _fps(60), stopping(0)
+{
+}
+
+void KbRender::fps(int framerate){
+    if(framerate <= 0)
+        return;
+    if(_render){
+        _render->_fps.store(framerate);
+        return;
+    }
+    _render = new KbRender;
+    _render->_fps.store(framerate);
+    _render->start(QThread::TimeCriticalPriority);
+}
+
+void KbRender::stop(){
+    if(!_render)
+        return;
+    _render->stopping.store(1);
+    _render->wait();
+    delete _render;
+    _render = 0;
+}
+
+void KbRender::add(Kb* device){
+    QMutexLocker locker(&devicesMutex);
+    devices.insert(device);
+}
+
+void KbRender::remove(Kb* device){
+    QMutexLocker locker(&devicesMutex);
+    devices.remove(device);
+}
+
+void KbRender::run(){
+    // Frames are scheduled on a fixed grid (next += period) instead of sleeping for a period after each one, so the time it
+    // takes to draw them doesn't add up
+    QElapsedTimer clock;
+    clock.start();
+    qint64 next = clock.nsecsElapsed();
+    while(!stopping.load()){
+        qint64 period = 1000000000LL / _fps.load();
+        next += period;
+        qint64 now = clock.nsecsElapsed();
+        if(now > next + period)
+            // More than a frame behind (the system was busy or asleep). Skip the missed frames instead of sending them all
+            // at once.
+            next = now;
+        else if(next > now)
+            usleep((next - now) / 1000);
+        QMutexLocker locker(&devicesMutex);
+        foreach(Kb* device, devices){
+            // Lock each device separately, so the GUI thread never has to wait for more than one
+            RenderLock lock;
+            device->frameUpdate();
+        }
+    }
+}
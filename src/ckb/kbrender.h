@@ -0,0 +1,45 @@
+#ifndef KBRENDER_H
+#define KBRENDER_H
+
+#include <QAtomicInt>
+#include <QMutex>
+#include <QSet>
+#include <QThread>
+
+class Kb;
+
+// Render thread. Calls Kb::frameUpdate() for every device at the frame rate, on a clock of its own, so that frames keep
+// their timing no matter what the GUI thread is doing. Animations are advanced and blended, and lighting, bindings and
+// performance settings are sent to the driver, all on this thread.
+// The settings themselves still belong to the GUI. Each frame is drawn under a RenderLock, which the GUI thread only
+// takes while it changes something the frame is drawn from (see renderlock.h), so a busy GUI doesn't hold frames back.
+// Finished frames are handed back to the GUI for display through a Snapshot (see KbLight::displayedFrame()).
+// See also: KbManager
+
+class KbRender : public QThread
+{
+    Q_OBJECT
+public:
+    // Starts drawing frames at the given rate, or changes the rate if already running. Call from the GUI thread.
+    static void fps(int framerate);
+    // Stops the render thread. Call before deleting any devices on shutdown.
+    static void stop();
+
+    // Adds or removes a device. Call from the GUI thread, without holding a RenderLock. remove() waits for the current
+    // frame to be drawn, so the device may be deleted once it returns.
+    static void add(Kb* device);
+    static void remove(Kb* device);
+
+private:
+    static KbRender* _render;
+    static QSet<Kb*> devices;
+    // Locked by the render thread while drawing frames, and by add() and remove()
+    static QMutex devicesMutex;
+
+    KbRender();
+    void run();
+
+    QAtomicInt  _fps, stopping;
+};
+
+#endif // KBRENDER_H
@@ -574,17 +574,96 @@ int KeyMap::modelHeight(Model model){
     }
 }
 
+// Key index getter. Like the maps, each index is only built once.
+static KeyIndex emptyIndex = { QVector<const char*>(), 0, QVector<short>(1, -1) };
+static KeyIndex standardIndices[N_MODELS][N_LAYOUTS];
+
+// FNV-1a hash of a key name. Names are ASCII, so QString names (as UTF-16) hash the same as char names.
+template<typename Char>
+static inline uint keyHash(const Char* name, int length){
+    uint hash = 2166136261u;
+    for(int i = 0; i < length; i++){
+        hash ^= (uint)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+template<typename Char>
+static inline bool keyEquals(const char* key, const Char* name, int length){
+    for(int i = 0; i < length; i++){
+        if(key[i] != name[i] || !key[i])
+            return false;
+    }
+    return key[length] == 0;
+}
+
+template<typename Char>
+static inline int findKey(const KeyIndex* index, const Char* name, int length){
+    int mask = index->table.count() - 1;
+    for(uint slot = keyHash(name, length) & mask; ; slot = (slot + 1) & mask){
+        int key = index->table[slot];
+        if(key < 0 || keyEquals(index->names[key], name, length))
+            return key;
+    }
+}
+
+static int qs_strcmp(const void* lhs, const void* rhs){
+    return strcmp(*(const char**)lhs, *(const char**)rhs);
+}
+
+static const KeyIndex* getIndex(KeyMap::Model model, KeyMap::Layout layout, const QHash<QString, Key>& map){
+    if(model < 0 || layout < 0 || model >= N_MODELS || layout >= N_LAYOUTS)
+        return &emptyIndex;
+    KeyIndex& index = standardIndices[model][layout];
+    if(!index.table.isEmpty())
+        return &index;
+    // Keys with LEDs first, then the rest, each sorted by name
+    QVector<const char*> leds, others;
+    foreach(const Key& key, map){
+        if(key.hasLed)
+            leds.append(key.name);
+        else
+            others.append(key.name);
+    }
+    qsort(leds.data(), leds.count(), sizeof(const char*), qs_strcmp);
+    qsort(others.data(), others.count(), sizeof(const char*), qs_strcmp);
+    index.names = leds + others;
+    index.ledCount = leds.count();
+    // Build the hash table. It's kept at most 1/4 full so lookups rarely need more than one comparison.
+    int size = 16;
+    while(size < index.names.count() * 4)
+        size *= 2;
+    index.table.fill(-1, size);
+    for(int i = 0; i < index.names.count(); i++){
+        const char* name = index.names[i];
+        uint slot = keyHash(name, strlen(name)) & (size - 1);
+        while(index.table[slot] >= 0)
+            slot = (slot + 1) & (size - 1);
+        index.table[slot] = i;
+    }
+    return &index;
+}
+
 KeyMap::KeyMap(Model _keyModel, Layout _keyLayout) :
-    _keys(getMap(_keyModel, _keyLayout)),
+    _keys(getMap(_keyModel, _keyLayout)), _index(getIndex(_keyModel, _keyLayout, _keys)),
     keyWidth(modelWidth(_keyModel)), keyHeight(modelHeight(_keyModel)),
     keyModel(_keyModel), keyLayout(_keyLayout)
 {}
 
 KeyMap::KeyMap() :
-     keyWidth(0), keyHeight(0),
+     _index(&emptyIndex), keyWidth(0), keyHeight(0),
      keyModel(NO_MODEL), keyLayout(NO_LAYOUT)
 {}
 
+int KeyMap::index(const char* name) const {
+    return findKey(_index, name, strlen(name));
+}
+
+int KeyMap::index(const QString& name) const {
+    return findKey(_index, name.utf16(), name.length());
+}
+
 QStringList KeyMap::byPosition() const {
     // Use QMaps to order the keys
     QMap<int, QMap<int, QString> > ordered;
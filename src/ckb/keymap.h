@@ -3,6 +3,7 @@
 
 #include <QColor>
 #include <QHash>
+#include <QVector>
 
 // Key information
 struct Key {
@@ -45,6 +46,16 @@ struct Key {
     inline bool operator !() const { return !(bool)*this; }
 };
 
+// Dense key numbering for one model and layout (see KeyMap::index())
+struct KeyIndex {
+    // Key names by index
+    QVector<const char*>    names;
+    // Number of keys with LEDs (they come first)
+    int                     ledCount;
+    // Hash table for looking up names. Each entry is an index into names, or -1 if empty.
+    QVector<short>          table;
+};
+
 // Key layout/device info class
 class KeyMap {
 public:
@@ -134,6 +145,15 @@ public:
     inline QString  toStorage(const QString& name)      { const char* storage = key(name).storageName(); if(!storage) return name; return storage; }
     inline QString  fromStorage(const QString& storage) { QHashIterator<QString, Key> i(*this); while(i.hasNext()) { i.next(); const char* s = i.value().storageName(); if(s == storage) return i.value().name; } return storage; }
 
+    // Keys by index. Every key has an index from 0 to count() - 1, which is the same for all maps with the same model and
+    // layout. Keys with LEDs come first, sorted by name (the same order as ColorMap), followed by the rest.
+    // Lookups are done with a hash table and don't allocate anything. Returns -1 if the key isn't in the map.
+    int                 index(const char* name) const;
+    int                 index(const QString& name) const;
+    inline const char*  keyName(int index) const    { return _index->names[index]; }
+    // Number of keys with LEDs (indices 0 to ledCount() - 1)
+    inline int          ledCount() const            { return _index->ledCount; }
+
     // Keys by position (top to bottom, left to right)
     QStringList byPosition() const;
 
@@ -145,6 +165,7 @@ private:
     static int modelHeight(Model model);
 
     QHash<QString, Key> _keys;
+    const KeyIndex* _index;
     short keyWidth, keyHeight;
     Model keyModel :8;
     Layout keyLayout :8;
@@ -3,6 +3,7 @@
 #include <QGraphicsPixmapItem>
 #include <QGraphicsScene>
 #include <QPainter>
+#include "colorpipeline.h"
 #include "keywidget.h"
 #include "keyaction.h"
 #include "kbbind.h"
@@ -11,9 +12,6 @@ static const int KEY_SIZE = 12;
 
 static QImage* m65Overlay = 0, *sabOverlay = 0, *scimOverlay = 0;
 
-// KbLight.cpp
-extern QRgb monoRgb(float r, float g, float b);
-
 KeyWidget::KeyWidget(QWidget *parent, bool rgbMode) :
     QWidget(parent), mouseDownX(-1), mouseDownY(-1), mouseCurrentX(-1), mouseCurrentY(-1), mouseDownMode(NONE), _rgbMode(rgbMode), _monochrome(false)
 {
@@ -265,7 +263,12 @@ void KeyWidget::paintEvent(QPaintEvent*){
             else
                 decPainter.setPen(QPen(QColor(255, 255, 255), 1.5));
             QRgb color;
-            const QRgb* inDisplay = _displayColorMap.colorForName(key.name);
+            // The display map normally comes from the same key map, so the key's index can be used directly. Check the
+            // name anyway in case it was made before a layout change.
+            int index = keyMap.index(key.name);
+            const QRgb* inDisplay = _displayColorMap.colorForIndex(index);
+            if(inDisplay && strcmp(_displayColorMap.keyNames()[index], key.name))
+                inDisplay = _displayColorMap.colorForName(key.name);
             if(inDisplay)
                 // Color in display map? Grab it from there
                 // (monochrome conversion not necessary as this would have been done by the animation)
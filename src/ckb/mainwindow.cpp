@@ -1,3 +1,4 @@
+#include "animplugin.h"
 #include "ckbsettings.h"
 #include "kbmanager.h"
 #include "kbfirmware.h"
@@ -297,6 +298,7 @@ void MainWindow::cleanup(){
         delete w;
     kbWidgets.clear();
     KbManager::stop();
+    AnimPlugin::cleanUp();
     CkbSettings::cleanUp();
 }
 
@@ -4,18 +4,23 @@
 #include <QProcess>
 #include "media.h"
 
-static QProcess muteProcess;
-
 muteState getMuteState(){
     // Get default sink mute state from pulseaudio
     static muteState lastKnown = UNKNOWN;
     static quint64 lastTime = 0;
+    // This is called while drawing frames, on the render thread. The process is created there too, and since that thread
+    // doesn't run an event loop, it's polled with waitForFinished(0) instead of updating on its own.
+    static QProcess* muteProcess = 0;
+    if(!muteProcess)
+        muteProcess = new QProcess;
     // Instead of running a command to check the state and waiting for it to finish, run the command now but wait to check it until the next frame
-    // (locking up the GUI thread is bad)
-    if(lastTime > 0 && muteProcess.state() == QProcess::NotRunning){
-        if(muteProcess.exitCode() != 0)
+    // (locking up the render thread is bad)
+    if(muteProcess->state() != QProcess::NotRunning)
+        muteProcess->waitForFinished(0);
+    if(lastTime > 0 && muteProcess->state() == QProcess::NotRunning){
+        if(muteProcess->exitCode() != 0)
             lastKnown = UNKNOWN;
-        QString output = muteProcess.readLine().trimmed();
+        QString output = muteProcess->readLine().trimmed();
         if(output == "yes")
             lastKnown = MUTED;
         else if(output == "no")
@@ -26,9 +31,9 @@ muteState getMuteState(){
         // Don't run it than 30 times per second
         return lastKnown;
     lastTime = time;
-    if(muteProcess.state() == QProcess::NotRunning)
+    if(muteProcess->state() == QProcess::NotRunning)
         // Shamelessly taken from pulseaudio-ctl
-        muteProcess.start("sh", QStringList() << "-c" << "pacmd list-sinks|grep -A 15 '* index'|awk '/muted:/{ print $2 }'");
+        muteProcess->start("sh", QStringList() << "-c" << "pacmd list-sinks|grep -A 15 '* index'|awk '/muted:/{ print $2 }'");
     return lastKnown;
 }
 
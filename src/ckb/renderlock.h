@@ -0,0 +1,28 @@
+#ifndef RENDERLOCK_H
+#define RENDERLOCK_H
+
+#include <QMutex>
+
+// Lock for the device settings that the render thread draws frames from (see KbRender). The render thread holds it while it
+// draws a frame for a device. The GUI thread only takes it for as long as it takes to change something the render thread
+// uses: the profile's mode list, lighting colors and animations, bindings, DPI and indicator settings. Settings that are
+// only read on the GUI thread, or a single value written at once (e.g. a flag or an opacity), don't need it.
+// It's recursive, so a locked function may call another. Never wait for the render thread while holding it.
+// Usage: RenderLock lock; (unlocked when it goes out of scope)
+
+class RenderLock
+{
+public:
+    inline RenderLock()     { mutex().lock(); }
+    inline ~RenderLock()    { mutex().unlock(); }
+
+private:
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+    static inline QRecursiveMutex& mutex()  { static QRecursiveMutex m; return m; }
+#else
+    static inline QMutex& mutex()           { static QMutex m(QMutex::Recursive); return m; }
+#endif
+    Q_DISABLE_COPY(RenderLock)
+};
+
+#endif // RENDERLOCK_H
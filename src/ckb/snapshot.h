@@ -0,0 +1,35 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <QAtomicInt>
+
+// Lock-free handoff of a value from one thread to another (triple buffering). The writer fills write() and calls publish();
+// the reader calls take(), and if it returns true, reads the new value from read(). Neither side ever waits for the other,
+// and the reader always gets the newest value that's been published. There may only be one writer and one reader.
+// See also: KbRender
+
+template<typename T>
+class Snapshot
+{
+public:
+    Snapshot() : state(1), writeIndex(0), readIndex(2) {}
+
+    // Writer: buffer to fill in. Its previous contents are whatever was published two or three values ago.
+    inline T&       write()         { return buffers[writeIndex]; }
+    // Writer: makes the value in write() available to the reader
+    inline void     publish()       { writeIndex = state.fetchAndStoreOrdered(writeIndex | NEW) & INDEX; }
+
+    // Reader: fetches the newest value. Returns false (and leaves read() alone) if nothing has been published since the last call.
+    inline bool     take()          { if(!(state.load() & NEW)) return false; readIndex = state.fetchAndStoreOrdered(readIndex) & INDEX; return true; }
+    // Reader: the value from the last successful take()
+    inline const T& read() const    { return buffers[readIndex]; }
+
+private:
+    const static int INDEX = 3, NEW = 4;
+    T           buffers[3];
+    // Index of the buffer waiting between the writer and the reader, plus NEW if the reader hasn't seen it yet
+    QAtomicInt  state;
+    int         writeIndex, readIndex;
+};
+
+#endif // SNAPSHOT_H